@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <drm_fourcc.h>
+
+#include "drm.h"
+#include "convert.h"
+#include "copy.h"
+#include "scale.h"
+#include "compose.h"
+#include "trace.h"
+
+static uint64_t compose_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+struct compose_t *compose_open(int fd, struct drm_dev_t *dev, uint32_t plane_id)
+{
+	struct compose_t *c;
+	int i;
+
+	if (!drm_plane_has_format(fd, plane_id, DRM_FORMAT_XRGB8888)) {
+		fprintf(stderr, "compose: plane %d has no XRGB8888\n", plane_id);
+		return NULL;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	c->fd = fd;
+	c->plane_id = plane_id;
+	c->crtc_id = dev->crtc_id;
+	c->width = dev->width;
+	c->height = dev->height;
+
+	/* whatever no layer covers stays black */
+	for (i = 0; i < 2; i++) {
+		drm_setup_mapped_buffer(fd, dev, c->width, c->height, DRM_FORMAT_XRGB8888, &c->target[i]);
+		memset(c->target[i].buf, 0, c->target[i].size);
+	}
+
+	c->copier = copy_pool_create(-1);
+
+	printf("compose: %dx%d on plane %d\n", c->width, c->height, plane_id);
+	return c;
+}
+
+void compose_close(struct compose_t *c)
+{
+	int i;
+
+	for (i = 0; i < c->nlayers; i++) {
+		free(c->layers[i].pixels);
+		if (c->layers[i].scaler)
+			scale_destroy(c->layers[i].scaler);
+		free(c->layers[i].scaled);
+		free(c->layers[i].xmap);
+		free(c->layers[i].line);
+	}
+	for (i = 0; i < 2; i++)
+		drm_free_buffer(c->fd, &c->target[i]);
+	if (c->copier)
+		copy_pool_destroy(c->copier);
+	free(c);
+}
+
+/* Clip a layer to the screen, its pixel buffer only grows */
+static int compose_place(struct compose_t *c, struct compose_layer *l, int32_t x, int32_t y,
+			 uint32_t width, uint32_t height)
+{
+	uint32_t *pixels;
+
+	if (x < 0 || y < 0 || (uint32_t)x >= c->width || (uint32_t)y >= c->height)
+		return -1;
+
+	l->x = x;
+	l->y = y;
+	l->width = width < c->width - x ? width : c->width - x;
+	l->height = height < c->height - y ? height : c->height - y;
+	if (l->width * l->height > l->capacity) {
+		pixels = realloc(l->pixels, l->width * l->height * sizeof(uint32_t));
+		if (!pixels)
+			return -1;
+		l->pixels = pixels;
+		l->capacity = l->width * l->height;
+	}
+	/* the sampling depends on the size */
+	l->src_width = l->src_height = 0;
+	return 0;
+}
+
+int compose_add_layer(struct compose_t *c, int32_t x, int32_t y, uint32_t width, uint32_t height)
+{
+	struct compose_layer *l;
+
+	if (c->nlayers == COMPOSE_MAX_LAYERS)
+		return -1;
+
+	l = &c->layers[c->nlayers];
+	memset(l, 0, sizeof(*l));
+	if (compose_place(c, l, x, y, width, height) < 0) {
+		free(l->pixels);
+		return -1;
+	}
+
+	c->order[c->nlayers] = c->nlayers;
+	return c->nlayers++;
+}
+
+int compose_move_layer(struct compose_t *c, int layer, int32_t x, int32_t y,
+		       uint32_t width, uint32_t height)
+{
+	struct compose_layer *l;
+
+	if (layer < 0 || layer >= c->nlayers)
+		return -1;
+	l = &c->layers[layer];
+	if (l->x == x && l->y == y && l->width == width && l->height == height)
+		return 0;
+
+	if (compose_place(c, l, x, y, width, height) < 0)
+		return -1;
+	/* what it held was sampled for the old size */
+	l->generation = 0;
+	c->stale[0] = c->stale[1] = 1;
+	return 0;
+}
+
+void compose_stack(struct compose_t *c, const int *zorder)
+{
+	int i, changed = 0;
+
+	for (i = 0; i < c->nlayers; i++) {
+		if (zorder[i] < 0 || zorder[i] >= c->nlayers)
+			return;
+	}
+	for (i = 0; i < c->nlayers; i++) {
+		changed |= c->order[zorder[i]] != i;
+		c->order[zorder[i]] = i;
+	}
+	if (changed)
+		c->stale[0] = c->stale[1] = 1;
+}
+
+/*
+ * The scaler where it takes the source (YUV, even sizes), nearest
+ * neighbour sampling otherwise
+ */
+static int compose_sampling(struct compose_t *c, struct compose_layer *l,
+			    const struct convert_frame *src)
+{
+	uint32_t x;
+
+	if (l->src_width == src->width && l->src_height == src->height
+	    && l->src_format == src->format)
+		return 0;
+
+	if (l->scaler)
+		scale_destroy(l->scaler);
+	free(l->scaled);
+	free(l->xmap);
+	free(l->line);
+	l->scaler = NULL;
+	l->scaled = NULL;
+	l->xmap = NULL;
+	l->line = NULL;
+
+	if (src->width != l->width || src->height != l->height)
+		l->scaler = scale_create(src->format, src->width, src->height,
+					 l->width, l->height, c->copier);
+	if (l->scaler) {
+		/* 2 bytes a pixel holds any of the scaler's formats */
+		l->scaled = malloc(l->width * l->height * 2);
+		if (!l->scaled)
+			goto fail;
+	} else {
+		l->xmap = malloc(l->width * sizeof(uint32_t));
+		l->line = malloc(src->width * sizeof(uint32_t));
+		if (!l->xmap || !l->line)
+			goto fail;
+		/* pixel centres */
+		for (x = 0; x < l->width; x++)
+			l->xmap[x] = ((uint64_t)x * 2 + 1) * src->width / (l->width * 2);
+	}
+	l->src_width = src->width;
+	l->src_height = src->height;
+	l->src_format = src->format;
+	return 0;
+
+fail:
+	l->src_width = l->src_height = 0;
+	return -1;
+}
+
+/* Scale a YUV frame to the layer, then convert it whole */
+static void compose_scaled(struct compose_layer *l, const struct convert_frame *src,
+			   enum convert_matrix matrix, enum convert_range range)
+{
+	int packed = src->format == DRM_FORMAT_UYVY || src->format == DRM_FORMAT_YUYV;
+	struct convert_frame mid = {
+		.format = src->format,
+		.width = l->width,
+		.height = l->height,
+		.planes = { l->scaled },
+		.pitches = { packed ? l->width * 2 : l->width },
+	};
+	struct convert_frame dst = {
+		.format = DRM_FORMAT_XRGB8888,
+		.width = l->width,
+		.height = l->height,
+		.planes = { (uint8_t *)l->pixels },
+		.pitches = { l->width * sizeof(uint32_t) },
+	};
+
+	mid.planes[1] = mid.planes[0] + mid.pitches[0] * mid.height;
+	mid.pitches[1] = mid.pitches[0];
+	scale_frame(l->scaler, src, &mid);
+	convert_frame(&mid, &dst, matrix, range);
+}
+
+/* Convert and scale a new frame into the layer, only the rows it samples */
+void compose_update(struct compose_t *c, int layer, const struct convert_frame *src,
+		    enum convert_matrix matrix, enum convert_range range)
+{
+	struct compose_layer *l;
+	uint64_t start = compose_now_us();
+	uint32_t x, y, sy, prev = UINT32_MAX;
+	uint32_t *row;
+
+	if (layer < 0 || layer >= c->nlayers)
+		return;
+	l = &c->layers[layer];
+	if (compose_sampling(c, l, src) < 0)
+		return;
+
+	if (l->scaler) {
+		compose_scaled(l, src, matrix, range);
+		goto done;
+	}
+
+	for (y = 0; y < l->height; y++) {
+		row = l->pixels + y * l->width;
+		sy = ((uint64_t)y * 2 + 1) * src->height / (l->height * 2);
+
+		if (sy == prev) {
+			memcpy(row, row - l->width, l->width * sizeof(uint32_t));
+			continue;
+		}
+		prev = sy;
+
+		if (src->width == l->width) {
+			convert_line(src, sy, row, DRM_FORMAT_XRGB8888, l->width, matrix, range);
+			continue;
+		}
+		convert_line(src, sy, l->line, DRM_FORMAT_XRGB8888, src->width, matrix, range);
+		for (x = 0; x < l->width; x++)
+			row[x] = l->line[l->xmap[x]];
+	}
+
+done:
+	l->generation++;
+	c->update_us += compose_now_us() - start;
+	c->updates++;
+}
+
+static int compose_overlap(const struct compose_layer *a, const struct compose_layer *b)
+{
+	return a->x < b->x + (int32_t)b->width && b->x < a->x + (int32_t)a->width
+		&& a->y < b->y + (int32_t)b->height && b->y < a->y + (int32_t)a->height;
+}
+
+/*
+ * Bring the back buffer up to date and show it. A layer is copied when
+ * the buffer holds an older generation of it, or when a layer below it
+ * was just copied over the same area. Returns the SetPlane result, 0
+ * when nothing changed.
+ */
+int compose_commit(struct compose_t *c)
+{
+	struct drm_buffer_t *t = &c->target[c->back];
+	struct compose_layer *l;
+	uint64_t start = compose_now_us();
+	uint32_t redrawn = 0;
+	int i, j, n, m, redraw, ret;
+
+	/* a layer moved: start from black, everything gets drawn again */
+	if (c->stale[c->back]) {
+		memset(t->buf, 0, t->size);
+		memset(c->drawn[c->back], 0, sizeof(c->drawn[c->back]));
+		c->stale[c->back] = 0;
+	}
+
+	for (n = 0; n < c->nlayers; n++) {
+		i = c->order[n];
+		l = &c->layers[i];
+		if (!l->generation)
+			continue;
+
+		redraw = c->drawn[c->back][i] != l->generation;
+		for (m = 0; m < n && !redraw; m++) {
+			j = c->order[m];
+			if ((redrawn & (1u << j)) && compose_overlap(l, &c->layers[j]))
+				redraw = 1;
+		}
+		if (!redraw)
+			continue;
+
+		copy_frame(c->copier, (uint8_t *)t->buf + l->y * t->pitch + l->x * 4, t->pitch,
+			   l->pixels, l->width * 4, l->width * 4, l->height);
+		c->drawn[c->back][i] = l->generation;
+		redrawn |= 1u << i;
+	}
+
+	if (!redrawn)
+		return 0;
+	/* CPU time only, SetPlane may wait for vblank */
+	c->commit_us += compose_now_us() - start;
+
+	ret = TRACE_CALL(DRM_IOCTL_MODE_SETPLANE,
+			 drmModeSetPlane(c->fd, c->plane_id, c->crtc_id, t->fb_id, 0,
+					 0, 0, c->width, c->height,
+					 0, 0, c->width << 16, c->height << 16));
+	c->back ^= 1;
+
+	if (++c->commits == COMPOSE_REPORT) {
+		printf("compose: %.2f ms per layer update, %.2f ms per commit\n",
+			c->updates ? c->update_us / 1000.0 / c->updates : 0.0,
+			c->commit_us / 1000.0 / c->commits);
+		c->update_us = c->commit_us = 0;
+		c->updates = c->commits = 0;
+	}
+	return ret;
+}
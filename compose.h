@@ -0,0 +1,69 @@
+
+#include <stdint.h>
+
+/*
+ * Software compositor for streams that get no plane of their own.
+ *
+ * Every layer keeps its latest frame converted to XRGB8888 and scaled
+ * to its rectangle, in ordinary cached memory. YUV frames are scaled
+ * first, by scale.c in their own format, then converted. A commit copies into
+ * the back buffer only the layers that changed since that buffer last
+ * had them (and whatever lies on top of those), then puts the buffer
+ * on a single plane.
+ *
+ * Needs drm.h and convert.h included first.
+ */
+
+#define COMPOSE_MAX_LAYERS	4
+/* print the CPU cost every this many commits */
+#define COMPOSE_REPORT		300
+
+struct copy_pool_t;
+struct scale_t;
+
+struct compose_layer {
+	int32_t x, y;
+	uint32_t width, height;
+	uint32_t *pixels;	/* width * height, packed */
+	uint32_t capacity;	/* pixels allocated */
+	unsigned int generation;	/* bumped by every update */
+
+	/* sampling, rebuilt when the source size or format changes */
+	uint32_t src_width, src_height, src_format;
+	struct scale_t *scaler;	/* YUV sources the scaler takes */
+	uint8_t *scaled;	/* the scaler's output, in the source format */
+	uint32_t *xmap;		/* otherwise nearest neighbour: source column for each column */
+	uint32_t *line;		/* one converted source row */
+};
+
+struct compose_t {
+	int fd;
+	uint32_t plane_id, crtc_id;
+	uint32_t width, height;
+	struct drm_buffer_t target[2];
+	/* layer generation each target buffer holds */
+	unsigned int drawn[2][COMPOSE_MAX_LAYERS];
+	int stale[2];	/* layers moved, clear before drawing */
+	int back;
+
+	int nlayers;
+	struct compose_layer layers[COMPOSE_MAX_LAYERS];
+	int order[COMPOSE_MAX_LAYERS];	/* layer indices, bottom first */
+	struct copy_pool_t *copier;
+
+	uint64_t update_us, commit_us;
+	unsigned int updates, commits;
+};
+
+struct compose_t *compose_open(int fd, struct drm_dev_t *dev, uint32_t plane_id);
+void compose_close(struct compose_t *c);
+/* returns the layer index, new layers go on top */
+int compose_add_layer(struct compose_t *c, int32_t x, int32_t y, uint32_t width, uint32_t height);
+/* the layer shows nothing until its next update */
+int compose_move_layer(struct compose_t *c, int layer, int32_t x, int32_t y,
+		       uint32_t width, uint32_t height);
+/* zorder[layer], 0 at the bottom, each value once */
+void compose_stack(struct compose_t *c, const int *zorder);
+void compose_update(struct compose_t *c, int layer, const struct convert_frame *src,
+		    enum convert_matrix matrix, enum convert_range range);
+int compose_commit(struct compose_t *c);
@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <drm_fourcc.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define CONVERT_NEON
+#endif
+
+#include "convert.h"
+
+/*
+ * 6 bit fixed point, the widest that keeps Y and chroma terms within
+ * int16 lanes. Sums may still saturate, but only where the result
+ * clamps to 0 or 255 anyway, so the vector kernels match the scalar
+ * one exactly.
+ */
+#define Q6(x)	((int16_t)((x) * 64 + 0.5))
+
+struct convert_coef {
+	int16_t yoff, ymul;
+	int16_t rv, gu, gv, bu;
+};
+
+typedef void (*row_packed_fn)(const uint8_t *src, uint8_t *dst, int width,
+			      const struct convert_coef *c, int yuyv, int rgb565);
+typedef void (*row_semi_fn)(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width,
+			    const struct convert_coef *c, int rgb565);
+
+static struct convert_coef coefs[2][2];
+static row_packed_fn row_packed;
+static row_semi_fn row_semi;
+static const char *impl;
+static pthread_once_t convert_once = PTHREAD_ONCE_INIT;
+
+static inline int clamp255(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline void put_pixel(uint8_t *dst, int x, int y, int u, int v,
+			     const struct convert_coef *c, int rgb565)
+{
+	int yy = (y - c->yoff) * c->ymul + 32;
+	int r = clamp255((yy + c->rv * v) >> 6);
+	int g = clamp255((yy - c->gu * u - c->gv * v) >> 6);
+	int b = clamp255((yy + c->bu * u) >> 6);
+
+	if (rgb565)
+		((uint16_t *)dst)[x] = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+	else
+		((uint32_t *)dst)[x] = 0xff000000 | r << 16 | g << 8 | b;
+}
+
+/* scalar rows, also the tails of the vector ones, from pixel x on */
+static void row_packed_tail(const uint8_t *src, uint8_t *dst, int x, int width,
+			    const struct convert_coef *c, int yuyv, int rgb565)
+{
+	const int oy = yuyv ? 0 : 1, ou = yuyv ? 1 : 0, ov = yuyv ? 3 : 2;
+
+	for (; x + 1 < width; x += 2) {
+		const uint8_t *p = src + x * 2;
+		int u = p[ou] - 128, v = p[ov] - 128;
+
+		put_pixel(dst, x, p[oy], u, v, c, rgb565);
+		put_pixel(dst, x + 1, p[oy + 2], u, v, c, rgb565);
+	}
+}
+
+static void row_semi_tail(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int x, int width,
+			  const struct convert_coef *c, int rgb565)
+{
+	for (; x + 1 < width; x += 2) {
+		int u = uv[x] - 128, v = uv[x + 1] - 128;
+
+		put_pixel(dst, x, y[x], u, v, c, rgb565);
+		put_pixel(dst, x + 1, y[x + 1], u, v, c, rgb565);
+	}
+}
+
+static void row_packed_c(const uint8_t *src, uint8_t *dst, int width,
+			 const struct convert_coef *c, int yuyv, int rgb565)
+{
+	row_packed_tail(src, dst, 0, width, c, yuyv, rgb565);
+}
+
+static void row_semi_c(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width,
+		       const struct convert_coef *c, int rgb565)
+{
+	row_semi_tail(y, uv, dst, 0, width, c, rgb565);
+}
+
+#ifdef CONVERT_X86
+
+#define SHUF_Z	-128
+
+/* 8 pixels of int16 Y, U, V (chroma duplicated per pair) to RGB */
+static inline __attribute__((target("sse4.1")))
+void store8_sse(__m128i y, __m128i u, __m128i v, const struct convert_coef *c,
+		uint8_t *dst, int rgb565)
+{
+	const __m128i c128 = _mm_set1_epi16(128);
+	__m128i yy, r, g, b;
+
+	yy = _mm_mullo_epi16(_mm_sub_epi16(y, _mm_set1_epi16(c->yoff)), _mm_set1_epi16(c->ymul));
+	yy = _mm_add_epi16(yy, _mm_set1_epi16(32));
+	u = _mm_sub_epi16(u, c128);
+	v = _mm_sub_epi16(v, c128);
+
+	r = _mm_adds_epi16(yy, _mm_mullo_epi16(v, _mm_set1_epi16(c->rv)));
+	g = _mm_subs_epi16(yy, _mm_mullo_epi16(u, _mm_set1_epi16(c->gu)));
+	g = _mm_subs_epi16(g, _mm_mullo_epi16(v, _mm_set1_epi16(c->gv)));
+	b = _mm_adds_epi16(yy, _mm_mullo_epi16(u, _mm_set1_epi16(c->bu)));
+
+	r = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(r, 6), _mm_setzero_si128()), _mm_set1_epi16(255));
+	g = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(g, 6), _mm_setzero_si128()), _mm_set1_epi16(255));
+	b = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(b, 6), _mm_setzero_si128()), _mm_set1_epi16(255));
+
+	if (rgb565) {
+		__m128i p = _mm_slli_epi16(_mm_and_si128(r, _mm_set1_epi16(0xf8)), 8);
+
+		p = _mm_or_si128(p, _mm_slli_epi16(_mm_and_si128(g, _mm_set1_epi16(0xfc)), 3));
+		p = _mm_or_si128(p, _mm_srli_epi16(b, 3));
+		_mm_storeu_si128((__m128i *)dst, p);
+	} else {
+		__m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+		__m128i rx = _mm_or_si128(r, _mm_set1_epi16((short)0xff00));
+
+		_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(bg, rx));
+		_mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(bg, rx));
+	}
+}
+
+static __attribute__((target("sse4.1")))
+void row_packed_sse(const uint8_t *src, uint8_t *dst, int width,
+		    const struct convert_coef *c, int yuyv, int rgb565)
+{
+	const __m128i my = yuyv ?
+		_mm_setr_epi8(0, SHUF_Z, 2, SHUF_Z, 4, SHUF_Z, 6, SHUF_Z, 8, SHUF_Z, 10, SHUF_Z, 12, SHUF_Z, 14, SHUF_Z) :
+		_mm_setr_epi8(1, SHUF_Z, 3, SHUF_Z, 5, SHUF_Z, 7, SHUF_Z, 9, SHUF_Z, 11, SHUF_Z, 13, SHUF_Z, 15, SHUF_Z);
+	const __m128i mu = yuyv ?
+		_mm_setr_epi8(1, SHUF_Z, 1, SHUF_Z, 5, SHUF_Z, 5, SHUF_Z, 9, SHUF_Z, 9, SHUF_Z, 13, SHUF_Z, 13, SHUF_Z) :
+		_mm_setr_epi8(0, SHUF_Z, 0, SHUF_Z, 4, SHUF_Z, 4, SHUF_Z, 8, SHUF_Z, 8, SHUF_Z, 12, SHUF_Z, 12, SHUF_Z);
+	const __m128i mv = yuyv ?
+		_mm_setr_epi8(3, SHUF_Z, 3, SHUF_Z, 7, SHUF_Z, 7, SHUF_Z, 11, SHUF_Z, 11, SHUF_Z, 15, SHUF_Z, 15, SHUF_Z) :
+		_mm_setr_epi8(2, SHUF_Z, 2, SHUF_Z, 6, SHUF_Z, 6, SHUF_Z, 10, SHUF_Z, 10, SHUF_Z, 14, SHUF_Z, 14, SHUF_Z);
+	const int bpp = rgb565 ? 2 : 4;
+	int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + x * 2));
+
+		store8_sse(_mm_shuffle_epi8(p, my), _mm_shuffle_epi8(p, mu), _mm_shuffle_epi8(p, mv),
+			   c, dst + x * bpp, rgb565);
+	}
+	row_packed_tail(src, dst, x, width, c, yuyv, rgb565);
+}
+
+static __attribute__((target("sse4.1")))
+void row_semi_sse(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width,
+		  const struct convert_coef *c, int rgb565)
+{
+	const __m128i mu = _mm_setr_epi8(0, SHUF_Z, 0, SHUF_Z, 2, SHUF_Z, 2, SHUF_Z,
+					 4, SHUF_Z, 4, SHUF_Z, 6, SHUF_Z, 6, SHUF_Z);
+	const __m128i mv = _mm_setr_epi8(1, SHUF_Z, 1, SHUF_Z, 3, SHUF_Z, 3, SHUF_Z,
+					 5, SHUF_Z, 5, SHUF_Z, 7, SHUF_Z, 7, SHUF_Z);
+	const int bpp = rgb565 ? 2 : 4;
+	int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i py = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(y + x)));
+		__m128i puv = _mm_loadl_epi64((const __m128i *)(uv + x));
+
+		store8_sse(py, _mm_shuffle_epi8(puv, mu), _mm_shuffle_epi8(puv, mv),
+			   c, dst + x * bpp, rgb565);
+	}
+	row_semi_tail(y, uv, dst, x, width, c, rgb565);
+}
+
+/* 16 pixels, lane 0 holds pixels 0-7 and lane 1 pixels 8-15 */
+static inline __attribute__((target("avx2")))
+void store16_avx2(__m256i y, __m256i u, __m256i v, const struct convert_coef *c,
+		  uint8_t *dst, int rgb565)
+{
+	const __m256i c128 = _mm256_set1_epi16(128);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i c255 = _mm256_set1_epi16(255);
+	__m256i yy, r, g, b;
+
+	yy = _mm256_mullo_epi16(_mm256_sub_epi16(y, _mm256_set1_epi16(c->yoff)), _mm256_set1_epi16(c->ymul));
+	yy = _mm256_add_epi16(yy, _mm256_set1_epi16(32));
+	u = _mm256_sub_epi16(u, c128);
+	v = _mm256_sub_epi16(v, c128);
+
+	r = _mm256_adds_epi16(yy, _mm256_mullo_epi16(v, _mm256_set1_epi16(c->rv)));
+	g = _mm256_subs_epi16(yy, _mm256_mullo_epi16(u, _mm256_set1_epi16(c->gu)));
+	g = _mm256_subs_epi16(g, _mm256_mullo_epi16(v, _mm256_set1_epi16(c->gv)));
+	b = _mm256_adds_epi16(yy, _mm256_mullo_epi16(u, _mm256_set1_epi16(c->bu)));
+
+	r = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(r, 6), zero), c255);
+	g = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(g, 6), zero), c255);
+	b = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(b, 6), zero), c255);
+
+	if (rgb565) {
+		__m256i p = _mm256_slli_epi16(_mm256_and_si256(r, _mm256_set1_epi16(0xf8)), 8);
+
+		p = _mm256_or_si256(p, _mm256_slli_epi16(_mm256_and_si256(g, _mm256_set1_epi16(0xfc)), 3));
+		p = _mm256_or_si256(p, _mm256_srli_epi16(b, 3));
+		_mm256_storeu_si256((__m256i *)dst, p);
+	} else {
+		__m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+		__m256i rx = _mm256_or_si256(r, _mm256_set1_epi16((short)0xff00));
+		__m256i lo = _mm256_unpacklo_epi16(bg, rx);	/* 0-3, 8-11 */
+		__m256i hi = _mm256_unpackhi_epi16(bg, rx);	/* 4-7, 12-15 */
+
+		_mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+}
+
+static __attribute__((target("avx2")))
+void row_packed_avx2(const uint8_t *src, uint8_t *dst, int width,
+		     const struct convert_coef *c, int yuyv, int rgb565)
+{
+	const __m256i my = _mm256_broadcastsi128_si256(yuyv ?
+		_mm_setr_epi8(0, SHUF_Z, 2, SHUF_Z, 4, SHUF_Z, 6, SHUF_Z, 8, SHUF_Z, 10, SHUF_Z, 12, SHUF_Z, 14, SHUF_Z) :
+		_mm_setr_epi8(1, SHUF_Z, 3, SHUF_Z, 5, SHUF_Z, 7, SHUF_Z, 9, SHUF_Z, 11, SHUF_Z, 13, SHUF_Z, 15, SHUF_Z));
+	const __m256i mu = _mm256_broadcastsi128_si256(yuyv ?
+		_mm_setr_epi8(1, SHUF_Z, 1, SHUF_Z, 5, SHUF_Z, 5, SHUF_Z, 9, SHUF_Z, 9, SHUF_Z, 13, SHUF_Z, 13, SHUF_Z) :
+		_mm_setr_epi8(0, SHUF_Z, 0, SHUF_Z, 4, SHUF_Z, 4, SHUF_Z, 8, SHUF_Z, 8, SHUF_Z, 12, SHUF_Z, 12, SHUF_Z));
+	const __m256i mv = _mm256_broadcastsi128_si256(yuyv ?
+		_mm_setr_epi8(3, SHUF_Z, 3, SHUF_Z, 7, SHUF_Z, 7, SHUF_Z, 11, SHUF_Z, 11, SHUF_Z, 15, SHUF_Z, 15, SHUF_Z) :
+		_mm_setr_epi8(2, SHUF_Z, 2, SHUF_Z, 6, SHUF_Z, 6, SHUF_Z, 10, SHUF_Z, 10, SHUF_Z, 14, SHUF_Z, 14, SHUF_Z));
+	const int bpp = rgb565 ? 2 : 4;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + x * 2));
+
+		store16_avx2(_mm256_shuffle_epi8(p, my), _mm256_shuffle_epi8(p, mu),
+			     _mm256_shuffle_epi8(p, mv), c, dst + x * bpp, rgb565);
+	}
+	row_packed_tail(src, dst, x, width, c, yuyv, rgb565);
+}
+
+static __attribute__((target("avx2")))
+void row_semi_avx2(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width,
+		   const struct convert_coef *c, int rgb565)
+{
+	const __m256i mu = _mm256_setr_epi8(0, SHUF_Z, 0, SHUF_Z, 2, SHUF_Z, 2, SHUF_Z,
+					    4, SHUF_Z, 4, SHUF_Z, 6, SHUF_Z, 6, SHUF_Z,
+					    8, SHUF_Z, 8, SHUF_Z, 10, SHUF_Z, 10, SHUF_Z,
+					    12, SHUF_Z, 12, SHUF_Z, 14, SHUF_Z, 14, SHUF_Z);
+	const __m256i mv = _mm256_setr_epi8(1, SHUF_Z, 1, SHUF_Z, 3, SHUF_Z, 3, SHUF_Z,
+					    5, SHUF_Z, 5, SHUF_Z, 7, SHUF_Z, 7, SHUF_Z,
+					    9, SHUF_Z, 9, SHUF_Z, 11, SHUF_Z, 11, SHUF_Z,
+					    13, SHUF_Z, 13, SHUF_Z, 15, SHUF_Z, 15, SHUF_Z);
+	const int bpp = rgb565 ? 2 : 4;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m256i py = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + x)));
+		/* both lanes see all 8 chroma pairs, each picks its half */
+		__m256i puv = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(uv + x)));
+
+		store16_avx2(py, _mm256_shuffle_epi8(puv, mu), _mm256_shuffle_epi8(puv, mv),
+			     c, dst + x * bpp, rgb565);
+	}
+	row_semi_tail(y, uv, dst, x, width, c, rgb565);
+}
+
+#endif /* CONVERT_X86 */
+
+#ifdef CONVERT_NEON
+
+/* 8 pixels sharing the chroma of their pair, to clamped 8 bit RGB */
+static inline void rgb8_neon(uint8x8_t y8, int16x8_t u, int16x8_t v, const struct convert_coef *c,
+			     uint8x8_t *r8, uint8x8_t *g8, uint8x8_t *b8)
+{
+	int16x8_t y = vreinterpretq_s16_u16(vmovl_u8(y8));
+	int16x8_t yy, r, g, b;
+
+	yy = vmulq_s16(vsubq_s16(y, vdupq_n_s16(c->yoff)), vdupq_n_s16(c->ymul));
+	yy = vaddq_s16(yy, vdupq_n_s16(32));
+
+	r = vqaddq_s16(yy, vmulq_s16(v, vdupq_n_s16(c->rv)));
+	g = vqsubq_s16(yy, vmulq_s16(u, vdupq_n_s16(c->gu)));
+	g = vqsubq_s16(g, vmulq_s16(v, vdupq_n_s16(c->gv)));
+	b = vqaddq_s16(yy, vmulq_s16(u, vdupq_n_s16(c->bu)));
+
+	*r8 = vqmovun_s16(vshrq_n_s16(r, 6));
+	*g8 = vqmovun_s16(vshrq_n_s16(g, 6));
+	*b8 = vqmovun_s16(vshrq_n_s16(b, 6));
+}
+
+/* even and odd pixels back in order, 16 of them */
+static inline void store16_neon(uint8x8_t y_even, uint8x8_t y_odd, uint8x8_t u8, uint8x8_t v8,
+				const struct convert_coef *c, uint8_t *dst, int rgb565)
+{
+	int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)), vdupq_n_s16(128));
+	int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)), vdupq_n_s16(128));
+	uint8x8_t re, ge, be, ro, go, bo;
+	uint8x8x2_t r, g, b;
+	int i;
+
+	rgb8_neon(y_even, u, v, c, &re, &ge, &be);
+	rgb8_neon(y_odd, u, v, c, &ro, &go, &bo);
+	r = vzip_u8(re, ro);
+	g = vzip_u8(ge, go);
+	b = vzip_u8(be, bo);
+
+	for (i = 0; i < 2; i++) {
+		if (rgb565) {
+			uint16x8_t p = vshlq_n_u16(vmovl_u8(vshr_n_u8(r.val[i], 3)), 11);
+
+			p = vorrq_u16(p, vshlq_n_u16(vmovl_u8(vshr_n_u8(g.val[i], 2)), 5));
+			p = vorrq_u16(p, vmovl_u8(vshr_n_u8(b.val[i], 3)));
+			vst1q_u16((uint16_t *)(dst + i * 16), p);
+		} else {
+			uint8x8x4_t p;
+
+			p.val[0] = b.val[i];
+			p.val[1] = g.val[i];
+			p.val[2] = r.val[i];
+			p.val[3] = vdup_n_u8(0xff);
+			vst4_u8(dst + i * 32, p);
+		}
+	}
+}
+
+static void row_packed_neon(const uint8_t *src, uint8_t *dst, int width,
+			    const struct convert_coef *c, int yuyv, int rgb565)
+{
+	const int bpp = rgb565 ? 2 : 4;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x8x4_t p = vld4_u8(src + x * 2);
+
+		if (yuyv)	/* Y0 U Y1 V */
+			store16_neon(p.val[0], p.val[2], p.val[1], p.val[3], c, dst + x * bpp, rgb565);
+		else		/* U Y0 V Y1 */
+			store16_neon(p.val[1], p.val[3], p.val[0], p.val[2], c, dst + x * bpp, rgb565);
+	}
+	row_packed_tail(src, dst, x, width, c, yuyv, rgb565);
+}
+
+static void row_semi_neon(const uint8_t *y, const uint8_t *uv, uint8_t *dst, int width,
+			  const struct convert_coef *c, int rgb565)
+{
+	const int bpp = rgb565 ? 2 : 4;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x8x2_t py = vld2_u8(y + x);
+		uint8x8x2_t puv = vld2_u8(uv + x);
+
+		store16_neon(py.val[0], py.val[1], puv.val[0], puv.val[1], c, dst + x * bpp, rgb565);
+	}
+	row_semi_tail(y, uv, dst, x, width, c, rgb565);
+}
+
+#endif /* CONVERT_NEON */
+
+static void convert_coef_init(struct convert_coef *c, double kr, double kb, int full)
+{
+	double kg = 1.0 - kr - kb;
+	double ys = full ? 1.0 : 255.0 / 219.0;
+	double cs = full ? 1.0 : 255.0 / 224.0;
+
+	c->yoff = full ? 0 : 16;
+	c->ymul = Q6(ys);
+	c->rv = Q6(2 * (1 - kr) * cs);
+	c->gu = Q6(2 * kb * (1 - kb) / kg * cs);
+	c->gv = Q6(2 * kr * (1 - kr) / kg * cs);
+	c->bu = Q6(2 * (1 - kb) * cs);
+}
+
+static void convert_init(void)
+{
+	convert_coef_init(&coefs[CONVERT_BT601][CONVERT_LIMITED], 0.299, 0.114, 0);
+	convert_coef_init(&coefs[CONVERT_BT601][CONVERT_FULL], 0.299, 0.114, 1);
+	convert_coef_init(&coefs[CONVERT_BT709][CONVERT_LIMITED], 0.2126, 0.0722, 0);
+	convert_coef_init(&coefs[CONVERT_BT709][CONVERT_FULL], 0.2126, 0.0722, 1);
+
+	row_packed = row_packed_c;
+	row_semi = row_semi_c;
+	impl = "scalar";
+
+#ifdef CONVERT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		row_packed = row_packed_avx2;
+		row_semi = row_semi_avx2;
+		impl = "avx2";
+	} else if (__builtin_cpu_supports("sse4.1")) {
+		row_packed = row_packed_sse;
+		row_semi = row_semi_sse;
+		impl = "sse4.1";
+	}
+#endif
+#ifdef CONVERT_NEON
+	row_packed = row_packed_neon;
+	row_semi = row_semi_neon;
+	impl = "neon";
+#endif
+
+	/* for benchmarking the fallback */
+	if (getenv("CONVERT_SCALAR")) {
+		row_packed = row_packed_c;
+		row_semi = row_semi_c;
+		impl = "scalar";
+	}
+}
+
+int convert_supported(uint32_t src_format, uint32_t dst_format)
+{
+	switch (src_format) {
+	case DRM_FORMAT_UYVY:
+	case DRM_FORMAT_YUYV:
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_NV16:
+		break;
+	case DRM_FORMAT_XRGB8888:
+		/* already RGB, copied as it is */
+		return dst_format == DRM_FORMAT_XRGB8888;
+	default:
+		return 0;
+	}
+	return dst_format == DRM_FORMAT_XRGB8888 || dst_format == DRM_FORMAT_RGB565;
+}
+
+const char *convert_impl(void)
+{
+	pthread_once(&convert_once, convert_init);
+	return impl;
+}
+
+void convert_line(const struct convert_frame *src, uint32_t y, void *dst, uint32_t dst_format,
+		  uint32_t width, enum convert_matrix matrix, enum convert_range range)
+{
+	const struct convert_coef *c = &coefs[matrix][range];
+	const uint8_t *s = src->planes[0] + y * src->pitches[0];
+	int rgb565 = dst_format == DRM_FORMAT_RGB565;
+
+	pthread_once(&convert_once, convert_init);
+
+	if (width > src->width)
+		width = src->width;
+
+	switch (src->format) {
+	case DRM_FORMAT_UYVY:
+	case DRM_FORMAT_YUYV:
+		row_packed(s, dst, width, c, src->format == DRM_FORMAT_YUYV, rgb565);
+		break;
+	case DRM_FORMAT_NV12:
+		row_semi(s, src->planes[1] + (y / 2) * src->pitches[1], dst, width, c, rgb565);
+		break;
+	case DRM_FORMAT_NV16:
+		row_semi(s, src->planes[1] + y * src->pitches[1], dst, width, c, rgb565);
+		break;
+	case DRM_FORMAT_XRGB8888:
+		memcpy(dst, s, width * 4);
+		break;
+	}
+}
+
+void convert_rows(const struct convert_frame *src, struct convert_frame *dst,
+		  enum convert_matrix matrix, enum convert_range range, uint32_t y0, uint32_t y1)
+{
+	uint32_t y;
+
+	if (y1 > src->height)
+		y1 = src->height;
+	if (y1 > dst->height)
+		y1 = dst->height;
+
+	for (y = y0; y < y1; y++)
+		convert_line(src, y, dst->planes[0] + y * dst->pitches[0], dst->format,
+			     dst->width, matrix, range);
+}
+
+void convert_frame(const struct convert_frame *src, struct convert_frame *dst,
+		   enum convert_matrix matrix, enum convert_range range)
+{
+	convert_rows(src, dst, matrix, range, 0, src->height);
+}
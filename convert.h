@@ -0,0 +1,38 @@
+
+#include <stdint.h>
+
+/*
+ * YUV to RGB conversion for planes that can't scan out the camera's
+ * format. Sources UYVY, YUYV, NV12, NV16; targets XRGB8888, RGB565.
+ * XRGB8888 sources pass through to XRGB8888 unchanged.
+ * Vector kernels (AVX2, SSE4.1, NEON) are picked at runtime, the
+ * scalar kernel gives the same results bit for bit.
+ */
+
+enum convert_matrix {
+	CONVERT_BT601,
+	CONVERT_BT709,
+};
+
+enum convert_range {
+	CONVERT_LIMITED,
+	CONVERT_FULL,
+};
+
+struct convert_frame {
+	uint32_t format;	/* DRM fourcc */
+	uint32_t width, height;
+	uint8_t *planes[2];	/* second one for NV12/NV16 chroma */
+	uint32_t pitches[2];
+};
+
+int convert_supported(uint32_t src_format, uint32_t dst_format);
+const char *convert_impl(void);
+void convert_frame(const struct convert_frame *src, struct convert_frame *dst,
+		   enum convert_matrix matrix, enum convert_range range);
+/* rows [y0, y1) */
+void convert_rows(const struct convert_frame *src, struct convert_frame *dst,
+		  enum convert_matrix matrix, enum convert_range range, uint32_t y0, uint32_t y1);
+/* one source row into a line of width pixels */
+void convert_line(const struct convert_frame *src, uint32_t y, void *dst, uint32_t dst_format,
+		  uint32_t width, enum convert_matrix matrix, enum convert_range range);
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "copy.h"
+
+static void copy_row(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+#if defined(__SSE2__)
+	/* streaming stores need 16 byte aligned destinations */
+	uint32_t head = -(uintptr_t)dst & 15;
+
+	if (head > len)
+		head = len;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	len -= head;
+
+	for (; len >= 64; len -= 64, dst += 64, src += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)(dst + 16), b);
+		_mm_stream_si128((__m128i *)(dst + 32), c);
+		_mm_stream_si128((__m128i *)(dst + 48), d);
+	}
+	for (; len >= 16; len -= 16, dst += 16, src += 16)
+		_mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+#elif defined(__aarch64__)
+	for (; len >= 64; len -= 64, dst += 64, src += 64)
+		__asm__ volatile("ldp q0, q1, [%1]\n\t"
+				 "ldp q2, q3, [%1, #32]\n\t"
+				 "stnp q0, q1, [%0]\n\t"
+				 "stnp q2, q3, [%0, #32]"
+				 : : "r" (dst), "r" (src) : "v0", "v1", "v2", "v3", "memory");
+#endif
+	memcpy(dst, src, len);
+}
+
+struct copy_frame_job {
+	uint8_t *dst;
+	const uint8_t *src;
+	uint32_t dst_pitch, src_pitch;
+	uint32_t width;		/* bytes per row */
+};
+
+static void copy_frame_stripe(void *arg, int stripe, uint32_t y0, uint32_t y1)
+{
+	struct copy_frame_job *job = arg;
+	uint32_t y;
+
+	if (job->dst_pitch == job->width && job->src_pitch == job->width) {
+		/* both tightly packed, the stripe is one run */
+		copy_row(job->dst + y0 * job->width, job->src + y0 * job->width,
+			 (y1 - y0) * job->width);
+	} else {
+		for (y = y0; y < y1; y++)
+			copy_row(job->dst + y * job->dst_pitch, job->src + y * job->src_pitch,
+				 job->width);
+	}
+
+	/* streaming stores are weakly ordered, drain them before the flip */
+#if defined(__SSE2__)
+	_mm_sfence();
+#elif defined(__aarch64__)
+	__asm__ volatile("dmb ishst" : : : "memory");
+#endif
+}
+
+static void copy_stripe(const struct copy_job *job, int stripe, int nstripes)
+{
+	job->fn(job->arg, stripe, (uint64_t)job->rows * stripe / nstripes,
+		(uint64_t)job->rows * (stripe + 1) / nstripes);
+}
+
+static void *copy_worker(void *arg)
+{
+	struct copy_pool_t *pool = arg;
+	unsigned int seen = 0;
+	struct copy_job job;
+	int stripe, nstripes;
+
+	/* for per-thread CPU time in a monitor */
+	prctl(PR_SET_NAME, "copy");
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->generation == seen && !pool->quit)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->quit)
+			break;
+
+		seen = pool->generation;
+		stripe = pool->next_stripe++;
+		nstripes = pool->nstripes;
+		job = pool->job;
+		pthread_mutex_unlock(&pool->lock);
+
+		copy_stripe(&job, stripe, nstripes);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct copy_pool_t *copy_pool_create(int nworkers)
+{
+	struct copy_pool_t *pool;
+	int i;
+
+	if (nworkers < 0)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (nworkers > COPY_MAX_THREADS - 1)
+		nworkers = COPY_MAX_THREADS - 1;
+	if (nworkers < 0)
+		nworkers = 0;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&pool->workers[i], NULL, copy_worker, pool))
+			break;
+		pool->nworkers++;
+	}
+
+	printf("copy: %d stripes per frame\n", pool->nworkers + 1);
+	return pool;
+}
+
+void copy_pool_destroy(struct copy_pool_t *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nworkers; i++)
+		pthread_join(pool->workers[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+void copy_pool_run(struct copy_pool_t *pool, copy_stripe_fn fn, void *arg, uint32_t rows)
+{
+	struct copy_job job = {
+		.fn = fn,
+		.arg = arg,
+		.rows = rows,
+	};
+
+	if (!pool || !pool->nworkers) {
+		copy_stripe(&job, 0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->nstripes = pool->nworkers + 1;
+	pool->next_stripe = 1;
+	pool->pending = pool->nworkers;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	copy_stripe(&job, 0, pool->nstripes);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void copy_frame(struct copy_pool_t *pool, void *dst, uint32_t dst_pitch,
+		const void *src, uint32_t src_pitch, uint32_t width, uint32_t rows)
+{
+	struct copy_frame_job job = {
+		.dst = dst,
+		.src = src,
+		.dst_pitch = dst_pitch,
+		.src_pitch = src_pitch,
+		.width = width,
+	};
+
+	if ((uint64_t)width * rows < COPY_MIN_PARALLEL)
+		pool = NULL;
+	copy_pool_run(pool, copy_frame_stripe, &job, rows);
+}
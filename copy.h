@@ -0,0 +1,45 @@
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Frame copy into write-combined scanout memory. Rows go out as
+ * streaming stores in whole 64 byte lines, so the write-combining
+ * buffers flush full and nothing is cached or read back. Large frames
+ * are cut into horizontal stripes over a few worker threads, the
+ * caller copies the first stripe itself. Other row-wise work (scaling)
+ * can run its stripes on the same pool.
+ */
+
+#define COPY_MAX_THREADS	4
+/* below this many bytes waking the workers costs more than it saves */
+#define COPY_MIN_PARALLEL	(512 * 1024)
+
+/* rows [y0, y1) of a job, stripe numbers are below COPY_MAX_THREADS */
+typedef void (*copy_stripe_fn)(void *arg, int stripe, uint32_t y0, uint32_t y1);
+
+struct copy_job {
+	copy_stripe_fn fn;
+	void *arg;
+	uint32_t rows;
+};
+
+struct copy_pool_t {
+	int nworkers;
+	pthread_t workers[COPY_MAX_THREADS - 1];
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned int generation;
+	int next_stripe, nstripes;
+	int pending;
+	int quit;
+	struct copy_job job;
+};
+
+/* nworkers < 0 picks one per online CPU beyond the caller's */
+struct copy_pool_t *copy_pool_create(int nworkers);
+void copy_pool_destroy(struct copy_pool_t *pool);
+/* pool may be NULL to work on the calling thread only */
+void copy_pool_run(struct copy_pool_t *pool, copy_stripe_fn fn, void *arg, uint32_t rows);
+void copy_frame(struct copy_pool_t *pool, void *dst, uint32_t dst_pitch,
+		const void *src, uint32_t src_pitch, uint32_t width, uint32_t rows);
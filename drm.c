@@ -1,7 +1,9 @@
 #define _GNU_SOURCE
 #define _XOPEN_SOURCE 701
 
+#include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,43 +13,25 @@
 #include <unistd.h>
 #include <libdrm/drm.h>
 #include "drm.h"
+#include "trace.h"
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 
-struct color_rgb32 {
-	uint32_t value;
-};
-
-struct util_color_component {
-        unsigned int length;
-        unsigned int offset;
-};
-
-struct util_rgb_info {
-        struct util_color_component red;
-        struct util_color_component green;
-        struct util_color_component blue;
-        struct util_color_component alpha;
-};
-
-#define MAKE_RGB_INFO(rl, ro, gl, go, bl, bo, al, ao) \
-        { { (rl), (ro) }, { (gl), (go) }, { (bl), (bo) }, { (al), (ao) } }
-
-#define MAKE_RGBA(rgb, r, g, b, a) \
-        ((((r) >> (8 - (rgb)->red.length)) << (rgb)->red.offset) | \
-         (((g) >> (8 - (rgb)->green.length)) << (rgb)->green.offset) | \
-         (((b) >> (8 - (rgb)->blue.length)) << (rgb)->blue.offset) | \
-         (((a) >> (8 - (rgb)->alpha.length)) << (rgb)->alpha.offset))
-
-#define MAKE_RGB24(rgb, r, g, b) \
-        { .value = MAKE_RGBA(rgb, r, g, b, 0) }
-
 enum {
 	DEPTH = 24,
 	BPP = 32,
 };
 
+#ifndef DRM_IOCTL_MODE_CLOSEFB
+/* Linux 6.8+: drop our fb handle without taking it off the screen */
+struct drm_mode_closefb {
+	__u32 fb_id;
+	__u32 pad;
+};
+#define DRM_IOCTL_MODE_CLOSEFB	DRM_IOWR(0xD0, struct drm_mode_closefb)
+#endif
+
 static int eopen(const char *path, int flag)
 {
 	int fd;
@@ -100,7 +84,18 @@ int drm_open(const char *path, int need_dumb, int need_prime)
 
 struct drm_dev_t *drm_find_dev(int fd)
 {
-	int i, m;
+	return drm_find_dev_probe(fd, 1);
+}
+
+/*
+ * probe == 0 takes the connector state the kernel already has instead
+ * of forcing a detect cycle (EDID reads) on every connector. Connectors
+ * whose state the kernel does not know yet still get a full probe; one
+ * that is known to be disconnected, or has no modes, is not re-probed.
+ */
+struct drm_dev_t *drm_find_dev_probe(int fd, int probe)
+{
+	int i, m, failed = 0;
 	struct drm_dev_t *dev = NULL, *dev_head = NULL;
 	drmModeRes *res;
 	drmModeConnector *conn;
@@ -112,11 +107,26 @@ struct drm_dev_t *drm_find_dev(int fd)
 
 	/* find all available connectors */
 	for (i = 0; i < res->count_connectors; i++) {
-		conn = drmModeGetConnector(fd, res->connectors[i]);
+		if (probe)
+			conn = drmModeGetConnector(fd, res->connectors[i]);
+		else {
+			conn = drmModeGetConnectorCurrent(fd, res->connectors[i]);
+			if (conn != NULL && conn->connection == DRM_MODE_UNKNOWNCONNECTION) {
+				drmModeFreeConnector(conn);
+				conn = drmModeGetConnector(fd, res->connectors[i]);
+			}
+		}
 
 		if (conn != NULL && conn->connection == DRM_MODE_CONNECTED && conn->count_modes > 0) {
-			dev = (struct drm_dev_t *) malloc(sizeof(struct drm_dev_t));
-			memset(dev, 0, sizeof(struct drm_dev_t));
+			/* what the previous connector preferred is gone with it */
+			preferred = NULL;
+			dev = (struct drm_dev_t *) calloc(1, sizeof(struct drm_dev_t));
+			if (!dev) {
+				fprintf(stderr, "DRM: out of memory\n");
+				drmModeFreeConnector(conn);
+				failed = 1;
+				break;
+			}
 
 			/* find preferred mode */
 			for (m = 0; m < conn->count_modes; m++) {
@@ -130,7 +140,9 @@ struct drm_dev_t *drm_find_dev(int fd)
 				preferred = &conn->modes[0];
 
 			dev->conn_id = conn->connector_id;
-			dev->enc_id = conn->encoder_id;
+			/* an idle connector has no encoder yet, take its first */
+			dev->enc_id = conn->encoder_id ? conn->encoder_id
+				: conn->count_encoders ? conn->encoders[0] : 0;
 			dev->next = NULL;
 
 			memcpy(&dev->mode, preferred, sizeof(drmModeModeInfo));
@@ -138,10 +150,21 @@ struct drm_dev_t *drm_find_dev(int fd)
 			dev->height = preferred->vdisplay;
 
 			/* FIXME: use default encoder/crtc pair */
-			if ((enc = drmModeGetEncoder(fd, dev->enc_id)) == NULL)
-				fatal("drmModeGetEncoder() faild");
+			if ((enc = drmModeGetEncoder(fd, dev->enc_id)) == NULL) {
+				fprintf(stderr, "DRM: connector %d has no encoder, skipped\n", dev->conn_id);
+				free(dev);
+				drmModeFreeConnector(conn);
+				continue;
+			}
 			dev->crtc_id = enc->crtc_id;
+			/* and an idle encoder the first CRTC it can drive */
+			for (m = 0; !dev->crtc_id && m < res->count_crtcs; m++)
+				if (enc->possible_crtcs & 1u << m)
+					dev->crtc_id = res->crtcs[m];
 			drmModeFreeEncoder(enc);
+			for (m = 0; m < res->count_crtcs; m++)
+				if (res->crtcs[m] == dev->crtc_id)
+					dev->crtc_index = m;
 
 			dev->saved_crtc = NULL;
 
@@ -154,6 +177,16 @@ struct drm_dev_t *drm_find_dev(int fd)
 
 	drmModeFreeResources(res);
 
+	/* half a list is no use to anyone */
+	if (failed) {
+		while (dev_head) {
+			dev = dev_head;
+			dev_head = dev->next;
+			free(dev);
+		}
+		return NULL;
+	}
+
 	printf("selected connector(s)\n");
 	for (dev = dev_head; dev != NULL; dev = dev->next) {
 		printf("connector id:%d\n", dev->conn_id);
@@ -165,7 +198,7 @@ struct drm_dev_t *drm_find_dev(int fd)
 }
 
 static void drm_setup_buffer(int fd, struct drm_dev_t *dev,
-		int width, int height,
+		int width, int height, int bpp,
 		struct drm_buffer_t *buffer, int map, int export)
 {
 	struct drm_mode_create_dumb create_req;
@@ -176,9 +209,9 @@ static void drm_setup_buffer(int fd, struct drm_dev_t *dev,
 	memset(&create_req, 0, sizeof(struct drm_mode_create_dumb));
 	create_req.width = width;
 	create_req.height = height;
-	create_req.bpp = BPP;
+	create_req.bpp = bpp;
 
-	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_req) < 0)
+	if (TRACE_CALL(DRM_IOCTL_MODE_CREATE_DUMB, drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_req)) < 0)
 		fatal("drmIoctl DRM_IOCTL_MODE_CREATE_DUMB failed");
 
 	buffer->pitch = create_req.pitch;
@@ -199,7 +232,7 @@ static void drm_setup_buffer(int fd, struct drm_dev_t *dev,
 		memset(&map_req, 0, sizeof(struct drm_mode_map_dumb));
 		map_req.handle = buffer->bo_handle;
 
-		if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map_req))
+		if (TRACE_CALL(DRM_IOCTL_MODE_MAP_DUMB, drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map_req)))
 			fatal("drmIoctl DRM_IOCTL_MODE_MAP_DUMB failed");
 		buffer->buf = (uint32_t *) emmap(0, buffer->size,
 			PROT_READ | PROT_WRITE, MAP_SHARED,
@@ -207,12 +240,30 @@ static void drm_setup_buffer(int fd, struct drm_dev_t *dev,
 	}
 }
 
+void drm_free_buffer(int fd, struct drm_buffer_t *buffer)
+{
+	struct drm_mode_destroy_dumb dreq = { .handle = buffer->bo_handle };
+
+	if (buffer->buf)
+		munmap(buffer->buf, buffer->size);
+	if (buffer->dmabuf_fd >= 0)
+		close(buffer->dmabuf_fd);
+	TRACE_CALL(DRM_IOCTL_MODE_DESTROY_DUMB, drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq));
+	if (buffer->fb_id)
+		TRACE_CALL(DRM_IOCTL_MODE_RMFB, drmModeRmFB(fd, buffer->fb_id));
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->dmabuf_fd = -1;
+}
+
 void drm_setup_dummy(int fd, struct drm_dev_t *dev, int map, int export)
 {
 	int i;
 
-	for (i = 0; i < BUFCOUNT; i++)
-		drm_setup_buffer(fd, dev, dev->width, dev->height,
+	if (!dev->nbufs[0])
+		dev->nbufs[0] = BUFCOUNT;
+
+	for (i = 0; i < dev->nbufs[0]; i++)
+		drm_setup_buffer(fd, dev, dev->width, dev->height, BPP,
 				 &dev->bufs[i], map, export);
 
 	/* Assume all buffers have the same pitch */
@@ -247,64 +298,691 @@ void get_planes_property(int fd, drmModePlaneRes *pr)
 }
 
 
-void drm_setup_fb(int fd, struct drm_dev_t *dev, int map, int export)
+static void drm_add_stream_fb(int fd, struct drm_dev_t *dev, int stream,
+		struct drm_buffer_t *buffer)
 {
-	int i;
+	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
 	int ret;
 
+	handles[0] = buffer->bo_handle;
+	pitches[0] = dev->fb_pitch[stream];
+	offsets[0] = 0;
+
+	/* semi-planar: chroma follows luma in the same buffer */
+	if (dev->fb_format[stream] == DRM_FORMAT_NV12 || dev->fb_format[stream] == DRM_FORMAT_NV16) {
+		handles[1] = buffer->bo_handle;
+		pitches[1] = dev->fb_pitch[stream];
+		offsets[1] = dev->fb_pitch[stream] * dev->fb_height[stream];
+	}
+	#if 0
+	ret = drmModeAddFB(fd, dev->width, dev->height,
+		DEPTH, BPP, buffer->pitch,
+		buffer->bo_handle, &buffer->fb_id);
+	if (ret)
+		fatal("drmModeAddFB failed");
+	#endif
+
+	ret = TRACE_CALL(DRM_IOCTL_MODE_ADDFB2,
+			 drmModeAddFB2(fd, dev->fb_width[stream], dev->fb_height[stream], dev->fb_format[stream],
+				       handles, pitches, offsets, &buffer->fb_id, 0));
+//	ret = drmModeAddFB2(fd, width, height, DRM_FORMAT_XRGB8888, handles, pitches, offsets, &buffer->fb_id, 0);
+	if(ret) {
+		printf("drmModeAddFB2 return err %d\n",ret);
+		fatal("drmModeAddFB2 failed");
+	}
+}
+
+/* lines of fb_pitch bytes a frame takes, chroma planes included */
+static uint32_t drm_stream_lines(struct drm_dev_t *dev, int stream)
+{
+	switch (dev->fb_format[stream]) {
+	case DRM_FORMAT_NV12:
+		return dev->fb_height[stream] * 3 / 2;
+	case DRM_FORMAT_NV16:
+		return dev->fb_height[stream] * 2;
+	}
+	return dev->fb_height[stream];
+}
+
+static void drm_setup_stream_buffer(int fd, struct drm_dev_t *dev, int stream,
+		struct drm_buffer_t *buffer, int map, int export)
+{
+	/* a 16bpp dumb buffer one pitch wide holds any frame of that layout */
+	drm_setup_buffer(fd, dev, dev->fb_pitch[stream] / 2, drm_stream_lines(dev, stream), 16,
+			 buffer, map, export);
+	drm_add_stream_fb(fd, dev, stream, buffer);
+}
+
+/*
+ * Drop our handle to a framebuffer that may be on screen. Linux 6.8+
+ * leaves it there until the plane gets another; older kernels can only
+ * remove it, which disables the plane, and the CRTC too when that is
+ * the primary plane.
+ */
+static void drm_close_fb(int fd, uint32_t fb_id)
+{
+	struct drm_mode_closefb req = { .fb_id = fb_id };
+
+	if (!fb_id || drmIoctl(fd, DRM_IOCTL_MODE_CLOSEFB, &req) == 0)
+		return;
+	TRACE_CALL(DRM_IOCTL_MODE_RMFB, drmModeRmFB(fd, fb_id));
+}
+
+/*
+ * Bring one buffer to the stream's frame layout, if it was left behind
+ * in an older one: a new framebuffer, a new dumb buffer too where it is
+ * now too small. Returns 1 when reallocated, its dmabuf fd changed.
+ */
+int drm_refit_buffer(int fd, struct drm_dev_t *dev, int stream, int index, int map, int export)
+{
+	struct drm_buffer_t *buf = stream ? &dev->plane1bufs[index] : &dev->bufs[index];
+	struct drm_buffer_t old;
+
+	if (!(dev->stale[stream] & (1u << index)))
+		return 0;
+	dev->stale[stream] &= ~(1u << index);
+
+	/* the new one first, either way: the old fb may be on screen */
+	if (buf->size >= dev->fb_pitch[stream] * drm_stream_lines(dev, stream)) {
+		uint32_t old_fb = buf->fb_id;
+
+		drm_add_stream_fb(fd, dev, stream, buf);
+		drm_close_fb(fd, old_fb);
+		return 0;
+	}
+	old = *buf;
+	memset(buf, 0, sizeof(*buf));
+	drm_setup_stream_buffer(fd, dev, stream, buf, map, export);
+	drm_close_fb(fd, old.fb_id);
+	old.fb_id = 0;
+	drm_free_buffer(fd, &old);
+	return 1;
+}
+
+/*
+ * Switch a stream to a new frame layout. Framebuffers are recreated,
+ * dumb buffers only where they are now too small. Buffers in busy are
+ * still being read from (a write in flight, a subscriber): they keep
+ * the old layout until drm_refit_buffer once they are back. Returns
+ * how many buffers were reallocated, their dmabuf fds changed.
+ */
+int drm_set_stream_format(int fd, struct drm_dev_t *dev, int stream, uint32_t width, uint32_t height,
+			  uint32_t pitch, uint32_t format, int map, int export, uint32_t busy)
+{
+	int i, realloc = 0;
+
+	if (dev->fb_width[stream] == width && dev->fb_height[stream] == height
+		&& dev->fb_pitch[stream] == pitch && dev->fb_format[stream] == format)
+		return 0;
+
+	dev->fb_width[stream] = width;
+	dev->fb_height[stream] = height;
+	dev->fb_pitch[stream] = pitch;
+	dev->fb_format[stream] = format;
+
+	dev->stale[stream] = (1u << dev->nbufs[stream]) - 1;
+	for (i = 0; i < dev->nbufs[stream]; i++)
+		if (!(busy & (1u << i)))
+			realloc += drm_refit_buffer(fd, dev, stream, i, map, export);
+
+	printf("DRM: stream %d now %dx%d pitch %d, %d buffers reallocated, %d busy\n",
+		stream, width, height, pitch, realloc, __builtin_popcount(dev->stale[stream]));
+	return realloc;
+}
+
+/*
+ * Grow a stream by count buffers. Returns the index of the first new
+ * buffer, or -1 when the stream is already at BUFCOUNT_MAX.
+ */
+int drm_add_buffers(int fd, struct drm_dev_t *dev, int stream, int count, int map, int export)
+{
+	struct drm_buffer_t *bufs = stream ? dev->plane1bufs : dev->bufs;
+	int first = dev->nbufs[stream];
+	int i;
+
+	if (first + count > BUFCOUNT_MAX)
+		return -1;
+
+	for (i = first; i < first + count; i++)
+		drm_setup_stream_buffer(fd, dev, stream, &bufs[i], map, export);
+	dev->nbufs[stream] += count;
+
+	return first;
+}
+
+/*
+ * Free the last count buffers of a stream, none of them may be queued.
+ * One may still be on screen, it stays there until the next frame.
+ */
+void drm_remove_buffers(int fd, struct drm_dev_t *dev, int stream, int count)
+{
+	struct drm_buffer_t *bufs = stream ? dev->plane1bufs : dev->bufs;
+
+	struct drm_buffer_t *buf;
+
+	while (count-- > 0 && dev->nbufs[stream] > 0) {
+		buf = &bufs[--dev->nbufs[stream]];
+		drm_close_fb(fd, buf->fb_id);
+		buf->fb_id = 0;
+		drm_free_buffer(fd, buf);
+		dev->stale[stream] &= ~(1u << dev->nbufs[stream]);
+	}
+}
+
+int drm_plane_has_format(int fd, uint32_t plane_id, uint32_t format)
+{
+	drmModePlane *plane;
+	uint32_t i;
+	int found = 0;
+
+	plane = drmModeGetPlane(fd, plane_id);
+	if (!plane)
+		return 0;
+	for (i = 0; i < plane->count_formats; i++)
+		if (plane->formats[i] == format)
+			found = 1;
+	drmModeFreePlane(plane);
+	return found;
+}
+
+/* DRM_PLANE_TYPE_* of a plane, -1 if it doesn't say */
+static int drm_plane_type(int fd, uint32_t plane_id)
+{
+	drmModeObjectProperties *obj;
+	drmModePropertyRes *p;
+	uint32_t i;
+	int type = -1;
+
+	obj = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!obj)
+		return -1;
+	for (i = 0; i < obj->count_props && type < 0; i++) {
+		p = drmModeGetProperty(fd, obj->props[i]);
+		if (!p)
+			continue;
+		if (!strcmp(p->name, "type"))
+			type = obj->prop_values[i];
+		drmModeFreeProperty(p);
+	}
+	drmModeFreeObjectProperties(obj);
+	return type;
+}
+
+/*
+ * A plane the streams don't use that can show a width x height buffer
+ * of format on the CRTC: an overlay, or a cursor plane if the buffer
+ * fits in a cursor. 0 if there is none.
+ */
+uint32_t drm_find_spare_plane(int fd, struct drm_dev_t *dev, uint32_t format, uint32_t width, uint32_t height)
+{
+	drmModePlane *plane;
+	uint64_t cursor_width = 0, cursor_height = 0;
+	uint32_t i, cursor = 0, found = 0;
+	int type;
+
+	drmGetCap(fd, DRM_CAP_CURSOR_WIDTH, &cursor_width);
+	drmGetCap(fd, DRM_CAP_CURSOR_HEIGHT, &cursor_height);
+
+	/* the first two are the streams' */
+	for (i = 2; dev->plane_res && i < dev->plane_res->count_planes && !found; i++) {
+		plane = drmModeGetPlane(fd, dev->plane_res->planes[i]);
+		if (!plane)
+			continue;
+		if ((plane->possible_crtcs & 1u << dev->crtc_index) && drm_plane_has_format(fd, plane->plane_id, format)) {
+			type = drm_plane_type(fd, plane->plane_id);
+			if (type == DRM_PLANE_TYPE_OVERLAY)
+				found = plane->plane_id;
+			else if (type == DRM_PLANE_TYPE_CURSOR && !cursor
+				 && width <= cursor_width && height <= cursor_height)
+				cursor = plane->plane_id;
+		}
+		drmModeFreePlane(plane);
+	}
+	return found ? found : cursor;
+}
+
+static const char *const drm_plane_prop_names[DRM_PLANE_PROPS] = {
+	[DRM_PLANE_FB_ID] = "FB_ID",
+	[DRM_PLANE_CRTC_ID] = "CRTC_ID",
+	[DRM_PLANE_SRC_X] = "SRC_X",
+	[DRM_PLANE_SRC_Y] = "SRC_Y",
+	[DRM_PLANE_SRC_W] = "SRC_W",
+	[DRM_PLANE_SRC_H] = "SRC_H",
+	[DRM_PLANE_CRTC_X] = "CRTC_X",
+	[DRM_PLANE_CRTC_Y] = "CRTC_Y",
+	[DRM_PLANE_CRTC_W] = "CRTC_W",
+	[DRM_PLANE_CRTC_H] = "CRTC_H",
+	[DRM_PLANE_ZPOS] = "zpos",
+	[DRM_PLANE_ROTATION] = "rotation",
+	[DRM_PLANE_COLOR_ENCODING] = "COLOR_ENCODING",
+	[DRM_PLANE_COLOR_RANGE] = "COLOR_RANGE",
+	[DRM_PLANE_ALPHA] = "alpha",
+	[DRM_PLANE_BLEND] = "pixel blend mode",
+};
+
+/* enum names the kernel gives COLOR_ENCODING and COLOR_RANGE values */
+static const char *const drm_ycbcr_encoding_names[DRM_YCBCR_ENCODINGS] = {
+	[DRM_YCBCR_BT601] = "ITU-R BT.601 YCbCr",
+	[DRM_YCBCR_BT709] = "ITU-R BT.709 YCbCr",
+	[DRM_YCBCR_BT2020] = "ITU-R BT.2020 YCbCr",
+};
+
+static const char *const drm_ycbcr_range_names[DRM_YCBCR_RANGES] = {
+	[DRM_YCBCR_LIMITED] = "YCbCr limited range",
+	[DRM_YCBCR_FULL] = "YCbCr full range",
+};
+
+static const char *const drm_blend_names[DRM_BLEND_MODES] = {
+	[DRM_BLEND_NONE] = "None",
+	[DRM_BLEND_PREMULTI] = "Pre-multiplied",
+	[DRM_BLEND_COVERAGE] = "Coverage",
+};
+
+const char *drm_blend_name(enum drm_blend_mode mode)
+{
+	return mode < DRM_BLEND_MODES ? drm_blend_names[mode] : "?";
+}
+
+/* which of names each enum value of p is, in values and a mask */
+static void drm_prop_enums(const drmModePropertyRes *p, const char *const *names, int count,
+			   uint64_t *values, unsigned int *mask)
+{
+	int i, k;
+
+	for (i = 0; i < p->count_enums; i++)
+		for (k = 0; k < count; k++)
+			if (!strcmp(p->enums[i].name, names[k])) {
+				values[k] = p->enums[i].value;
+				*mask |= 1u << k;
+			}
+}
+
+/* Property ids of a plane, where zpos can go, how it rotates, converts and blends. -1 if it has none */
+int drm_get_plane_props(int fd, uint32_t plane_id, struct drm_plane_props *props)
+{
+	drmModeObjectProperties *obj;
+	drmModePropertyRes *p;
+	uint32_t i;
+	int k;
+
+	memset(props, 0, sizeof(*props));
+	props->plane_id = plane_id;
+
+	obj = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!obj)
+		return -1;
+
+	for (i = 0; i < obj->count_props; i++) {
+		p = drmModeGetProperty(fd, obj->props[i]);
+		if (!p)
+			continue;
+		for (k = 0; k < DRM_PLANE_PROPS; k++)
+			if (!strcmp(p->name, drm_plane_prop_names[k]))
+				props->ids[k] = p->prop_id;
+
+		if (!strcmp(p->name, "zpos")) {
+			props->zpos = obj->prop_values[i];
+			props->zpos_min = props->zpos_max = props->zpos;
+			props->zpos_mutable = !(p->flags & DRM_MODE_PROP_IMMUTABLE);
+			if ((p->flags & DRM_MODE_PROP_RANGE) && p->count_values == 2) {
+				props->zpos_min = p->values[0];
+				props->zpos_max = p->values[1];
+			}
+		}
+		/* a bitmask property: each enum value is a bit number */
+		if (!strcmp(p->name, "rotation"))
+			for (k = 0; k < p->count_enums; k++)
+				if (p->enums[k].value < 32)
+					props->rotations |= 1u << p->enums[k].value;
+		if (!strcmp(p->name, "COLOR_ENCODING"))
+			drm_prop_enums(p, drm_ycbcr_encoding_names, DRM_YCBCR_ENCODINGS,
+				       props->encodings, &props->encoding_mask);
+		if (!strcmp(p->name, "COLOR_RANGE"))
+			drm_prop_enums(p, drm_ycbcr_range_names, DRM_YCBCR_RANGES,
+				       props->ranges, &props->range_mask);
+		if (!strcmp(p->name, "alpha") && (p->flags & DRM_MODE_PROP_RANGE) && p->count_values == 2)
+			props->alpha_max = p->values[1];
+		if (!strcmp(p->name, "pixel blend mode"))
+			drm_prop_enums(p, drm_blend_names, DRM_BLEND_MODES,
+				       props->blends, &props->blend_mask);
+		drmModeFreeProperty(p);
+	}
+	drmModeFreeObjectProperties(obj);
+	return 0;
+}
+
+/* Show part of fb_id in a rectangle of the screen */
+int drm_atomic_add_plane(drmModeAtomicReq *req, const struct drm_plane_props *props, uint32_t crtc_id,
+			 uint32_t fb_id, int32_t x, int32_t y, uint32_t width, uint32_t height,
+			 uint32_t src_x, uint32_t src_y, uint32_t src_width, uint32_t src_height)
+{
+	const uint64_t values[DRM_PLANE_ZPOS] = {
+		[DRM_PLANE_FB_ID] = fb_id,
+		[DRM_PLANE_CRTC_ID] = crtc_id,
+		[DRM_PLANE_SRC_X] = src_x,
+		[DRM_PLANE_SRC_Y] = src_y,
+		[DRM_PLANE_SRC_W] = src_width,
+		[DRM_PLANE_SRC_H] = src_height,
+		[DRM_PLANE_CRTC_X] = x,
+		[DRM_PLANE_CRTC_Y] = y,
+		[DRM_PLANE_CRTC_W] = width,
+		[DRM_PLANE_CRTC_H] = height,
+	};
+	int k;
+
+	for (k = 0; k < DRM_PLANE_ZPOS; k++) {
+		if (!props->ids[k])
+			return -1;
+		if (drmModeAtomicAddProperty(req, props->plane_id, props->ids[k], values[k]) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* One vblank event on the device's CRTC, handed to the vblank_handler with data */
+int drm_request_vblank(int fd, struct drm_dev_t *dev, void *data)
+{
+	drmVBlank vbl;
+
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT;
+	if (dev->crtc_index > 1)
+		vbl.request.type |= (dev->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+	else if (dev->crtc_index == 1)
+		vbl.request.type |= DRM_VBLANK_SECONDARY;
+	vbl.request.sequence = 1;
+	vbl.request.signal = (unsigned long)data;
+	return TRACE_CALL(DRM_IOCTL_WAIT_VBLANK, drmWaitVBlank(fd, &vbl));
+}
+
+/*
+ * Tell the plane how to turn the stream's YCbCr into RGB. A plane without
+ * the property does BT.601 limited range, so that much needs none.
+ * Returns -1 if the plane can't do what was asked.
+ */
+int drm_plane_set_ycbcr(int fd, const struct drm_plane_props *props,
+			enum drm_ycbcr_encoding encoding, enum drm_ycbcr_range range)
+{
+	const uint32_t *ids = props->ids;
+
+	if (ids[DRM_PLANE_COLOR_ENCODING] ? !(props->encoding_mask & 1u << encoding)
+					  : encoding != DRM_YCBCR_BT601)
+		return -1;
+	if (ids[DRM_PLANE_COLOR_RANGE] ? !(props->range_mask & 1u << range)
+				       : range != DRM_YCBCR_LIMITED)
+		return -1;
+
+	if (ids[DRM_PLANE_COLOR_ENCODING]
+		&& TRACE_CALL(DRM_IOCTL_MODE_OBJ_SETPROPERTY,
+			      drmModeObjectSetProperty(fd, props->plane_id, DRM_MODE_OBJECT_PLANE,
+						       ids[DRM_PLANE_COLOR_ENCODING], props->encodings[encoding])) < 0)
+		return -1;
+	if (ids[DRM_PLANE_COLOR_RANGE]
+		&& TRACE_CALL(DRM_IOCTL_MODE_OBJ_SETPROPERTY,
+			      drmModeObjectSetProperty(fd, props->plane_id, DRM_MODE_OBJECT_PLANE,
+						       ids[DRM_PLANE_COLOR_RANGE], props->ranges[range])) < 0)
+		return -1;
+	return 0;
+}
+
+/* Where the CRTC takes a colour matrix and gamma table, if it does */
+static void drm_get_crtc_color(int fd, struct drm_dev_t *dev)
+{
+	drmModeObjectProperties *obj;
+	drmModePropertyRes *p;
+	uint32_t i;
+
+	obj = drmModeObjectGetProperties(fd, dev->crtc_id, DRM_MODE_OBJECT_CRTC);
+	if (!obj)
+		return;
+	for (i = 0; i < obj->count_props; i++) {
+		p = drmModeGetProperty(fd, obj->props[i]);
+		if (!p)
+			continue;
+		if (!strcmp(p->name, "CTM"))
+			dev->ctm_prop = p->prop_id;
+		else if (!strcmp(p->name, "GAMMA_LUT"))
+			dev->gamma_lut_prop = p->prop_id;
+		else if (!strcmp(p->name, "GAMMA_LUT_SIZE"))
+			dev->gamma_lut_size = obj->prop_values[i];
+		drmModeFreeProperty(p);
+	}
+	drmModeFreeObjectProperties(obj);
+}
+
+/* Replace one of our blobs on a CRTC property, 0 data removes it */
+static int drm_set_crtc_blob(int fd, struct drm_dev_t *dev, uint32_t prop, uint32_t *blob,
+			     const void *data, size_t size)
+{
+	uint32_t id = 0;
+
+	if (data && drmModeCreatePropertyBlob(fd, data, size, &id) < 0)
+		return -1;
+	if (TRACE_CALL(DRM_IOCTL_MODE_OBJ_SETPROPERTY,
+		       drmModeObjectSetProperty(fd, dev->crtc_id, DRM_MODE_OBJECT_CRTC, prop, id)) < 0) {
+		if (id)
+			drmModeDestroyPropertyBlob(fd, id);
+		return -1;
+	}
+	if (*blob)
+		drmModeDestroyPropertyBlob(fd, *blob);
+	*blob = id;
+	return 0;
+}
+
+/*
+ * Colour correction after the planes are blended: a 3x3 matrix (white
+ * balance, or any other mix of the channels) then a gamma curve, both
+ * done by the display engine. Returns -1 if the CRTC can't do one of them.
+ */
+int drm_set_crtc_color(int fd, struct drm_dev_t *dev, const double *ctm, double gamma)
+{
+	struct drm_color_ctm matrix;
+	struct drm_color_lut *lut;
+	uint32_t i, n = dev->gamma_lut_size;
+	double v;
+	int ret = 0;
+
+	if (ctm) {
+		/* S31.32 sign and magnitude, not two's complement */
+		for (i = 0; i < 9; i++) {
+			matrix.matrix[i] = (uint64_t)(fabs(ctm[i]) * 4294967296.0 + 0.5);
+			if (ctm[i] < 0)
+				matrix.matrix[i] |= 1ull << 63;
+		}
+	}
+	if (ctm || dev->ctm_blob)
+		ret |= dev->ctm_prop ? drm_set_crtc_blob(fd, dev, dev->ctm_prop, &dev->ctm_blob,
+							 ctm ? &matrix : NULL, sizeof(matrix)) : -1;
+
+	if (gamma != 1.0 && gamma > 0 && n >= 2) {
+		lut = calloc(n, sizeof(*lut));
+		if (!lut)
+			return -1;
+		for (i = 0; i < n; i++) {
+			v = pow((double)i / (n - 1), 1.0 / gamma) * 0xffff + 0.5;
+			lut[i].red = lut[i].green = lut[i].blue = v;
+		}
+		ret |= drm_set_crtc_blob(fd, dev, dev->gamma_lut_prop, &dev->gamma_blob, lut, n * sizeof(*lut));
+		free(lut);
+	} else if (gamma != 1.0) {
+		ret = -1;
+	} else if (dev->gamma_blob) {
+		ret |= drm_set_crtc_blob(fd, dev, dev->gamma_lut_prop, &dev->gamma_blob, NULL, 0);
+	}
+	return ret ? -1 : 0;
+}
+
+void drm_free_convert(int fd, struct drm_dev_t *dev, int stream)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (dev->cvtbufs[stream][i].bo_handle)
+			drm_free_buffer(fd, &dev->cvtbufs[stream][i]);
+	dev->cvt_format[stream] = 0;
+}
+
+/*
+ * A mapped framebuffer of its own size: XRGB8888, RGB565, packed 4:2:2
+ * or NV12/NV16 with chroma after luma in the same buffer
+ */
+void drm_setup_mapped_buffer(int fd, struct drm_dev_t *dev, uint32_t width, uint32_t height,
+			     uint32_t format, struct drm_buffer_t *buffer)
+{
 	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+	uint32_t lines = height;
+	int bpp;
+
+	switch (format) {
+	case DRM_FORMAT_RGB565:
+	case DRM_FORMAT_UYVY:
+	case DRM_FORMAT_YUYV:
+		bpp = 16;
+		break;
+	case DRM_FORMAT_NV12:
+		bpp = 8;
+		lines = height * 3 / 2;
+		break;
+	case DRM_FORMAT_NV16:
+		bpp = 8;
+		lines = height * 2;
+		break;
+	default:
+		bpp = 32;
+		break;
+	}
 
-	printf("drm dev crtid=%d, connnecter=%d(%d,%d)\n", dev->crtc_id, dev->conn_id, dev->width, dev->height);
+	memset(buffer, 0, sizeof(*buffer));
+	drm_setup_buffer(fd, dev, width, lines, bpp, buffer, 1, 0);
+	handles[0] = buffer->bo_handle;
+	pitches[0] = buffer->pitch;
+	if (lines != height) {
+		handles[1] = buffer->bo_handle;
+		pitches[1] = buffer->pitch;
+		offsets[1] = buffer->pitch * height;
+	}
+	if (TRACE_CALL(DRM_IOCTL_MODE_ADDFB2,
+		       drmModeAddFB2(fd, width, height, format, handles, pitches, offsets, &buffer->fb_id, 0)))
+		fatal("drmModeAddFB2 failed");
+}
 
-	for (i = 0; i < BUFCOUNT; i++) {
+/*
+ * Two mapped RGB framebuffers in the stream's frame size, for a plane
+ * that can't take the camera format: one on screen, one being written.
+ * XRGB8888 if the plane has it, RGB565 otherwise. Returns the format,
+ * 0 when the plane takes neither.
+ */
+uint32_t drm_setup_convert(int fd, struct drm_dev_t *dev, int stream, uint32_t plane_id)
+{
+	struct drm_buffer_t cvt[2];
+	uint32_t format;
+	int i;
 
-		// drm_setup_buffer(fd, dev, dev->width, dev->height,
-		// 		 &dev->bufs[i], map, export);
-		// 摄像头的分辨率高于显示输出,申请更大缓存		 
-		drm_setup_buffer(fd, dev, 1920, 1080,
-				 &dev->bufs[i], map, export);
+	if (drm_plane_has_format(fd, plane_id, DRM_FORMAT_XRGB8888))
+		format = DRM_FORMAT_XRGB8888;
+	else if (drm_plane_has_format(fd, plane_id, DRM_FORMAT_RGB565))
+		format = DRM_FORMAT_RGB565;
+	else
+		return 0;
+
+	/* new ones first, the old ones may still be on screen */
+	for (i = 0; i < 2; i++)
+		drm_setup_mapped_buffer(fd, dev, dev->fb_width[stream], dev->fb_height[stream],
+					format, &cvt[i]);
+
+	drm_free_convert(fd, dev, stream);
+	memcpy(dev->cvtbufs[stream], cvt, sizeof(cvt));
+	dev->cvt_format[stream] = format;
+	dev->cvt_next[stream] = 0;
+	return format;
+}
 
-		handles[0] = dev->bufs[i].bo_handle;
-		pitches[0] = dev->width*2;	
-		offsets[0] = 0;
-		#if 0
-		ret = drmModeAddFB(fd, dev->width, dev->height,
-			DEPTH, BPP, dev->bufs[i].pitch,
-			dev->bufs[i].bo_handle, &dev->bufs[i].fb_id);
-		if (ret)
-			fatal("drmModeAddFB failed");
-		#endif
-		
-		ret = drmModeAddFB2(fd, dev->width, dev->height, DRM_FORMAT_UYVY, handles, pitches, offsets, &dev->bufs[i].fb_id, 0);
-//		ret = drmModeAddFB2(fd, dev->width, dev->height, DRM_FORMAT_XRGB8888, handles, pitches, offsets, &dev->bufs[i].fb_id, 0);		
-		if(ret) {
-			printf("drmModeAddFB2 return err %d\n",ret);
-			fatal("drmModeAddFB2 failed");			
+void drm_free_scale(int fd, struct drm_dev_t *dev, int stream)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (dev->sclbufs[stream][i].bo_handle)
+			drm_free_buffer(fd, &dev->sclbufs[stream][i]);
+	dev->scl_next[stream] = 0;
+}
+
+void drm_free_rotate(int fd, struct drm_dev_t *dev, int stream)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (dev->rotbufs[stream][i].bo_handle)
+			drm_free_buffer(fd, &dev->rotbufs[stream][i]);
+	dev->rot_next[stream] = 0;
+}
+
+/* Two mapped framebuffers for a stream's frames turned in software */
+void drm_setup_rotate(int fd, struct drm_dev_t *dev, int stream, uint32_t width, uint32_t height,
+		      uint32_t format)
+{
+	struct drm_buffer_t rot[2];
+	int i;
+
+	for (i = 0; i < 2; i++)
+		drm_setup_mapped_buffer(fd, dev, width, height, format, &rot[i]);
+
+	drm_free_rotate(fd, dev, stream);
+	memcpy(dev->rotbufs[stream], rot, sizeof(rot));
+}
+
+/*
+ * Two mapped framebuffers in the stream's format at its on screen size,
+ * for a plane that can't scale: frames are scaled into them instead.
+ */
+void drm_setup_scale(int fd, struct drm_dev_t *dev, int stream, uint32_t width, uint32_t height)
+{
+	struct drm_buffer_t scl[2];
+	int i;
+
+	for (i = 0; i < 2; i++)
+		drm_setup_mapped_buffer(fd, dev, width, height, dev->fb_format[stream], &scl[i]);
+
+	drm_free_scale(fd, dev, stream);
+	memcpy(dev->sclbufs[stream], scl, sizeof(scl));
+	dev->scl_next[stream] = 0;
+}
+
+void drm_setup_fb(int fd, struct drm_dev_t *dev, int map, int export)
+{
+	int ret;
+	int stream, count;
+
+	printf("drm dev crtid=%d, connnecter=%d(%d,%d)\n", dev->crtc_id, dev->conn_id, dev->width, dev->height);
+
+	/* Callers may preset per-stream counts, otherwise BUFCOUNT each */
+	for (stream = 0; stream < 2; stream++) {
+		/* and the frame layout, until the camera tells us otherwise */
+		if (!dev->fb_width[stream]) {
+			dev->fb_width[stream] = stream ? 1920 : dev->width;
+			dev->fb_height[stream] = stream ? 1080 : dev->height;
+			dev->fb_pitch[stream] = dev->fb_width[stream] * 2;
+			dev->fb_format[stream] = DRM_FORMAT_UYVY;
 		}
+
+		count = dev->nbufs[stream] ? dev->nbufs[stream] : BUFCOUNT;
+		if (count > BUFCOUNT_MAX)
+			count = BUFCOUNT_MAX;
+		dev->nbufs[stream] = 0;
+		drm_add_buffers(fd, dev, stream, count, map, export);
+		printf("DRM: stream %d, %d buffers\n", stream, count);
 	}
 
 	/* Assume all buffers have the same pitch */
-	dev->pitch = pitches[0];
+	dev->pitch = dev->width*2;
 	printf("DRM: buffer pitch %d bytes\n", dev->pitch);
 
 	dev->saved_crtc = drmModeGetCrtc(fd, dev->crtc_id); /* must store crtc data */
 
-	// 申请plane的buffer
-	for (i = 0; i < BUFCOUNT; i++) {	 
-		drm_setup_buffer(fd, dev, 1920, 1080,
-				 &dev->plane1bufs[i], map, export);
-		handles[0] = dev->plane1bufs[i].bo_handle;
-		pitches[0] = 1920*2;
-		offsets[0] = 0;
-		ret = drmModeAddFB2(fd, 1920, 1080, DRM_FORMAT_UYVY, handles, pitches, offsets, &dev->plane1bufs[i].fb_id, 0);		
-		if(ret) {
-			printf("plane drmModeAddFB2 return err %d\n",ret);
-			fatal("plane drmModeAddFB2 failed");			
-		}
-	}
-
 	/* Stop before screwing up the monitor */
-	getchar();
+	if (!dev->no_pause)
+		getchar();
 
 	/* First buffer to DRM */
 	// if (ret = drmModeSetCrtc(fd, dev->crtc_id, dev->plane1bufs[0].fb_id, 0, 0, &dev->conn_id, 1, &dev->mode)) {
@@ -319,45 +997,175 @@ void drm_setup_fb(int fd, struct drm_dev_t *dev, int map, int export)
 
 	dev->plane_res = drmModeGetPlaneResources(fd);
 
+	/* layout changes move every plane in one commit where the driver can */
+	dev->atomic = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+	for (stream = 0; dev->plane_res && stream < 2; stream++)
+		if ((uint32_t)stream < dev->plane_res->count_planes)
+			drm_get_plane_props(fd, dev->plane_res->planes[stream], &dev->plane_props[stream]);
+	printf("DRM: %s plane updates\n", dev->atomic ? "atomic" : "legacy");
+	drm_get_crtc_color(fd, dev);
+
 	/* First flip */
 	// drmModePageFlip(fd, dev->crtc_id,
     //                     dev->plane1bufs[0].fb_id, DRM_MODE_PAGE_FLIP_EVENT,
     //                     dev);
 }
 
+static int drm_same_timing(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+	return a->hdisplay == b->hdisplay && a->vdisplay == b->vdisplay
+		&& a->htotal == b->htotal && a->vtotal == b->vtotal
+		&& a->clock == b->clock && a->flags == b->flags;
+}
+
+/*
+ * Takeover: keep the CRTC running if it already shows the mode we want,
+ * planes then go straight onto the live configuration. Only a dark or
+ * mismatched CRTC gets a modeset, onto a black fb. drm_destroy then
+ * leaves the display as it is instead of restoring the saved CRTC.
+ * Returns 1 when no modeset was needed.
+ */
+int drm_takeover(int fd, struct drm_dev_t *dev)
+{
+	drmModeCrtc *crtc;
+	int adopted = 0;
+
+	dev->takeover = 1;
+
+	crtc = drmModeGetCrtc(fd, dev->crtc_id);
+	if (crtc && crtc->mode_valid && drm_same_timing(&crtc->mode, &dev->mode)) {
+		printf("DRM: taking over live mode %s on crtc %d, no modeset\n",
+			crtc->mode.name, dev->crtc_id);
+		memcpy(&dev->mode, &crtc->mode, sizeof(drmModeModeInfo));
+		adopted = 1;
+	} else {
+		printf("DRM: crtc %d is not showing %dx%d, modeset\n",
+			dev->crtc_id, dev->width, dev->height);
+
+		drm_setup_buffer(fd, dev, dev->width, dev->height, BPP, &dev->blank, 1, 0);
+		memset(dev->blank.buf, 0, dev->blank.size);
+		if (drmModeAddFB(fd, dev->width, dev->height, DEPTH, BPP, dev->blank.pitch,
+				 dev->blank.bo_handle, &dev->blank.fb_id))
+			fatal("drmModeAddFB failed");
+
+		if (TRACE_CALL(DRM_IOCTL_MODE_SETCRTC,
+			       drmModeSetCrtc(fd, dev->crtc_id, dev->blank.fb_id, 0, 0, &dev->conn_id, 1, &dev->mode)))
+			fatal("drmModeSetCrtc() failed");
+	}
+
+	if (crtc)
+		drmModeFreeCrtc(crtc);
+	return adopted;
+}
+
+static struct drm_buffer_t *drm_find_fb(struct drm_dev_t *dev, uint32_t fb_id)
+{
+	int i;
+
+	for (i = 0; i < dev->nbufs[0]; i++)
+		if (dev->bufs[i].fb_id == fb_id)
+			return &dev->bufs[i];
+	for (i = 0; i < dev->nbufs[1]; i++)
+		if (dev->plane1bufs[i].fb_id == fb_id)
+			return &dev->plane1bufs[i];
+	for (i = 0; i < 4; i++) {
+		if (dev->cvtbufs[i / 2][i % 2].fb_id == fb_id)
+			return &dev->cvtbufs[i / 2][i % 2];
+		if (dev->sclbufs[i / 2][i % 2].fb_id == fb_id)
+			return &dev->sclbufs[i / 2][i % 2];
+		if (dev->rotbufs[i / 2][i % 2].fb_id == fb_id)
+			return &dev->rotbufs[i / 2][i % 2];
+	}
+	if (dev->blank.fb_id == fb_id)
+		return &dev->blank;
+	return NULL;
+}
+
+/*
+ * Linux 6.8+ has CLOSEFB. It looks the fb up after checking the id, so
+ * fb 0 fails with ENOENT there and EINVAL on kernels without it.
+ */
+static int drm_has_closefb(int fd)
+{
+	struct drm_mode_closefb req = { .fb_id = 0 };
+
+	return drmIoctl(fd, DRM_IOCTL_MODE_CLOSEFB, &req) < 0 && errno == ENOENT;
+}
+
+/*
+ * Leave the last frames up for whoever comes next. RmFB of an fb on
+ * screen disables its plane, and on the primary plane the CRTC with
+ * it, so the fbs on screen are never removed here. With CLOSEFB we
+ * drop our handles and the frames stay up past exit. Without it the
+ * fbs are kept until our DRM fd closes, and then the kernel removes
+ * them, taking the picture down with them.
+ */
+static void drm_keep_scanout(int fd, struct drm_dev_t *dev)
+{
+	struct drm_mode_closefb req;
+	struct drm_buffer_t *buffer;
+	drmModePlane *plane;
+	uint32_t i;
+	int closefb;
+
+	if (!dev->plane_res)
+		return;
+
+	closefb = drm_has_closefb(fd);
+	if (!closefb)
+		printf("DRM: kernel has no CLOSEFB, the picture goes when we exit\n");
+
+	for (i = 0; i < dev->plane_res->count_planes; i++) {
+		plane = drmModeGetPlane(fd, dev->plane_res->planes[i]);
+		if (!plane)
+			continue;
+
+		if (plane->fb_id && (buffer = drm_find_fb(dev, plane->fb_id))) {
+			memset(&req, 0, sizeof(req));
+			req.fb_id = buffer->fb_id;
+			if (closefb && drmIoctl(fd, DRM_IOCTL_MODE_CLOSEFB, &req) < 0)
+				printf("DRM: cannot keep plane %d up after exit\n", plane->plane_id);
+			/* not removed either way, drm_free_buffer must not RmFB it */
+			buffer->fb_id = 0;
+		}
+		drmModeFreePlane(plane);
+	}
+}
+
 void drm_destroy(int fd, struct drm_dev_t *dev_head)
 {
 	struct drm_dev_t *devp, *devp_tmp;
 	int i;
 
 	for (devp = dev_head; devp != NULL;) {
+		/* our colour correction goes, whatever else stays on screen */
+		if (devp->ctm_blob || devp->gamma_blob)
+			drm_set_crtc_color(fd, devp, NULL, 1.0);
+
 		if (devp->saved_crtc) {
-			drmModeSetCrtc(fd, devp->saved_crtc->crtc_id, devp->saved_crtc->buffer_id,
-				devp->saved_crtc->x, devp->saved_crtc->y, &devp->conn_id, 1, &devp->saved_crtc->mode);
+			if (!devp->takeover)
+				drmModeSetCrtc(fd, devp->saved_crtc->crtc_id, devp->saved_crtc->buffer_id,
+					devp->saved_crtc->x, devp->saved_crtc->y, &devp->conn_id, 1, &devp->saved_crtc->mode);
 			drmModeFreeCrtc(devp->saved_crtc);
 		}
 
-		for (i = 0; i < BUFCOUNT; i++) {
-			struct drm_mode_destroy_dumb dreq = { .handle = devp->bufs[i].bo_handle };
+		if (devp->takeover)
+			drm_keep_scanout(fd, devp);
+		if (devp->blank.bo_handle)
+			drm_free_buffer(fd, &devp->blank);
 
-			if (devp->bufs[i].buf)
-				munmap(devp->bufs[i].buf, devp->bufs[i].size);
-			if (devp->bufs[i].dmabuf_fd >= 0)
-				close(devp->bufs[i].dmabuf_fd);
-			drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
-			drmModeRmFB(fd, devp->bufs[i].fb_id);
-		}
+		for (i = 0; i < devp->nbufs[0]; i++)
+			drm_free_buffer(fd, &devp->bufs[i]);
 
-		for (i = 0; i < BUFCOUNT; i++) {
-			struct drm_mode_destroy_dumb dreq = { .handle = devp->plane1bufs[i].bo_handle };
+		for (i = 0; i < devp->nbufs[1]; i++)
+			drm_free_buffer(fd, &devp->plane1bufs[i]);
 
-			if (devp->plane1bufs[i].buf)
-				munmap(devp->plane1bufs[i].buf, devp->plane1bufs[i].size);
-			if (devp->plane1bufs[i].dmabuf_fd >= 0)
-				close(devp->plane1bufs[i].dmabuf_fd);
-			drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
-			drmModeRmFB(fd, devp->plane1bufs[i].fb_id);
-		}
+		drm_free_convert(fd, devp, 0);
+		drm_free_convert(fd, devp, 1);
+		drm_free_scale(fd, devp, 0);
+		drm_free_scale(fd, devp, 1);
+		drm_free_rotate(fd, devp, 0);
+		drm_free_rotate(fd, devp, 1);
 
 		if (devp->plane_res) {
 			drmModeFreePlaneResources(devp->plane_res);
@@ -371,69 +1179,3 @@ void drm_destroy(int fd, struct drm_dev_t *dev_head)
 
 	close(fd);
 }
-
-void fill_smpte_rgb32(void *mem,
-	unsigned int width, unsigned int height)
-{
-	struct util_rgb_info _rgb = MAKE_RGB_INFO(8, 16, 8, 8, 8, 0, 0, 0);
-	struct util_rgb_info *rgb = &_rgb;
-	int stride = width * BPP / 8;
-	
-	const struct color_rgb32 colors_top[] = {
-		MAKE_RGB24(rgb, 192, 192, 192),	/* grey */
-		MAKE_RGB24(rgb, 192, 192, 0),	/* yellow */
-		MAKE_RGB24(rgb, 0, 192, 192),	/* cyan */
-		MAKE_RGB24(rgb, 0, 192, 0),	/* green */
-		MAKE_RGB24(rgb, 192, 0, 192),	/* magenta */
-		MAKE_RGB24(rgb, 192, 0, 0),	/* red */
-		MAKE_RGB24(rgb, 0, 0, 192),	/* blue */
-	};
-	const struct color_rgb32 colors_middle[] = {
-		MAKE_RGB24(rgb, 0, 0, 192),	/* blue */
-		MAKE_RGB24(rgb, 19, 19, 19),	/* black */
-		MAKE_RGB24(rgb, 192, 0, 192),	/* magenta */
-		MAKE_RGB24(rgb, 19, 19, 19),	/* black */
-		MAKE_RGB24(rgb, 0, 192, 192),	/* cyan */
-		MAKE_RGB24(rgb, 19, 19, 19),	/* black */
-		MAKE_RGB24(rgb, 192, 192, 192),	/* grey */
-	};
-	const struct color_rgb32 colors_bottom[] = {
-		MAKE_RGB24(rgb, 0, 33, 76),	/* in-phase */
-		MAKE_RGB24(rgb, 255, 255, 255),	/* super white */
-		MAKE_RGB24(rgb, 50, 0, 106),	/* quadrature */
-		MAKE_RGB24(rgb, 19, 19, 19),	/* black */
-		MAKE_RGB24(rgb, 9, 9, 9),	/* 3.5% */
-		MAKE_RGB24(rgb, 19, 19, 19),	/* 7.5% */
-		MAKE_RGB24(rgb, 29, 29, 29),	/* 11.5% */
-		MAKE_RGB24(rgb, 19, 19, 19),	/* black */
-	};
-	unsigned int x;
-	unsigned int y;
-
-	for (y = 0; y < height * 6 / 9; ++y) {
-		for (x = 0; x < width; ++x)
-			((struct color_rgb32 *)mem)[x] =
-				colors_top[x * 7 / width];
-		mem += stride;
-	}
-
-	for (; y < height * 7 / 9; ++y) {
-		for (x = 0; x < width; ++x)
-			((struct color_rgb32 *)mem)[x] =
-				colors_middle[x * 7 / width];
-		mem += stride;
-	}
-
-	for (; y < height; ++y) {
-		for (x = 0; x < width * 5 / 7; ++x)
-			((struct color_rgb32 *)mem)[x] =
-				colors_bottom[x * 4 / (width * 5 / 7)];
-		for (; x < width * 6 / 7; ++x)
-			((struct color_rgb32 *)mem)[x] =
-				colors_bottom[(x - width * 5 / 7) * 3
-					      / (width / 7) + 4];
-		for (; x < width; ++x)
-			((struct color_rgb32 *)mem)[x] = colors_bottom[7];
-		mem += stride;
-	}
-}
@@ -6,7 +6,8 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
-#define BUFCOUNT 4
+#define BUFCOUNT 4		/* default buffers per stream */
+#define BUFCOUNT_MAX 8		/* upper bound for runtime sizing */
 
 struct drm_buffer_t {
 	uint32_t pitch, size;
@@ -17,8 +18,66 @@ struct drm_buffer_t {
 	uint32_t *buf;
 };
 
+/* plane properties an atomic commit sets, by name in drm.c */
+enum drm_plane_prop {
+	DRM_PLANE_FB_ID,
+	DRM_PLANE_CRTC_ID,
+	DRM_PLANE_SRC_X,
+	DRM_PLANE_SRC_Y,
+	DRM_PLANE_SRC_W,
+	DRM_PLANE_SRC_H,
+	DRM_PLANE_CRTC_X,
+	DRM_PLANE_CRTC_Y,
+	DRM_PLANE_CRTC_W,
+	DRM_PLANE_CRTC_H,
+	DRM_PLANE_ZPOS,
+	DRM_PLANE_ROTATION,
+	DRM_PLANE_COLOR_ENCODING,
+	DRM_PLANE_COLOR_RANGE,
+	DRM_PLANE_ALPHA,
+	DRM_PLANE_BLEND,
+	DRM_PLANE_PROPS
+};
+
+/* how a plane turns YCbCr into RGB, the COLOR_ENCODING and COLOR_RANGE values */
+enum drm_ycbcr_encoding {
+	DRM_YCBCR_BT601,
+	DRM_YCBCR_BT709,
+	DRM_YCBCR_BT2020,
+	DRM_YCBCR_ENCODINGS
+};
+
+enum drm_ycbcr_range {
+	DRM_YCBCR_LIMITED,
+	DRM_YCBCR_FULL,
+	DRM_YCBCR_RANGES
+};
+
+/* the "pixel blend mode" values */
+enum drm_blend_mode {
+	DRM_BLEND_NONE,
+	DRM_BLEND_PREMULTI,
+	DRM_BLEND_COVERAGE,
+	DRM_BLEND_MODES
+};
+
+struct drm_plane_props {
+	uint32_t plane_id;
+	uint32_t ids[DRM_PLANE_PROPS];	/* 0 when the plane doesn't have it */
+	uint64_t zpos, zpos_min, zpos_max;
+	int zpos_mutable;
+	uint32_t rotations;	/* DRM_MODE_ROTATE_* and REFLECT_* bits it takes */
+	/* property values for each encoding and range, listed ones have their bit set */
+	uint64_t encodings[DRM_YCBCR_ENCODINGS], ranges[DRM_YCBCR_RANGES];
+	unsigned int encoding_mask, range_mask;
+	uint64_t alpha_max;	/* opaque alpha */
+	uint64_t blends[DRM_BLEND_MODES];
+	unsigned int blend_mask;
+};
+
 struct drm_dev_t {
 	uint32_t conn_id, enc_id, crtc_id;
+	int crtc_index;		/* in the resources, vblank requests use it */
 	uint32_t width, height, pitch;
 	drmModeModeInfo mode;
 	drmModeCrtc *saved_crtc;
@@ -26,10 +85,33 @@ struct drm_dev_t {
 
 	int v4l2_fd[2];
 	int drm_fd;
+	int no_pause;	/* drm_setup_fb goes straight on, no keypress */
+	int takeover;	/* live CRTC adopted, left running on exit */
+	struct drm_buffer_t blank;	/* only when takeover had to modeset */
 
 	drmModePlaneRes *plane_res;
-	struct drm_buffer_t bufs[BUFCOUNT];
-	struct drm_buffer_t plane1bufs[BUFCOUNT];	
+	int atomic;	/* atomic commits allowed */
+	struct drm_plane_props plane_props[2];	/* the streams' planes */
+	/* CRTC colour management, 0 where the CRTC has none */
+	uint32_t ctm_prop, gamma_lut_prop, gamma_lut_size;
+	uint32_t ctm_blob, gamma_blob;	/* ours, 0 when none is set */
+	struct drm_buffer_t bufs[BUFCOUNT_MAX];
+	struct drm_buffer_t plane1bufs[BUFCOUNT_MAX];
+	/* buffers allocated per stream: [0] bufs, [1] plane1bufs */
+	int nbufs[2];
+	/* per stream frame layout, buffers and framebuffers follow it */
+	uint32_t fb_width[2], fb_height[2], fb_pitch[2], fb_format[2];
+	uint32_t stale[2];	/* buffers still in an older layout, by index */
+	/* RGB copies for planes that can't scan out the camera format */
+	struct drm_buffer_t cvtbufs[2][2];
+	uint32_t cvt_format[2];		/* 0 when the stream scans out directly */
+	int cvt_next[2];
+	/* downscaled copies for planes that can't scale */
+	struct drm_buffer_t sclbufs[2][2];
+	int scl_next[2];
+	/* turned copies for planes that can't rotate */
+	struct drm_buffer_t rotbufs[2][2];
+	int rot_next[2];
 };
 
 inline static void fatal(char *str)
@@ -46,6 +128,36 @@ inline static void error(char *str)
 
 int drm_open(const char *path, int need_dumb, int need_prime);
 struct drm_dev_t *drm_find_dev(int fd);
+struct drm_dev_t *drm_find_dev_probe(int fd, int probe);
 void drm_setup_dummy(int fd, struct drm_dev_t *dev, int map, int export);
 void drm_setup_fb(int fd, struct drm_dev_t *dev, int map, int export);
 void drm_destroy(int fd, struct drm_dev_t *dev_head);
+int drm_takeover(int fd, struct drm_dev_t *dev);
+int drm_add_buffers(int fd, struct drm_dev_t *dev, int stream, int count, int map, int export);
+void drm_remove_buffers(int fd, struct drm_dev_t *dev, int stream, int count);
+int drm_set_stream_format(int fd, struct drm_dev_t *dev, int stream, uint32_t width, uint32_t height,
+			  uint32_t pitch, uint32_t format, int map, int export, uint32_t busy);
+int drm_refit_buffer(int fd, struct drm_dev_t *dev, int stream, int index, int map, int export);
+int drm_plane_has_format(int fd, uint32_t plane_id, uint32_t format);
+uint32_t drm_find_spare_plane(int fd, struct drm_dev_t *dev, uint32_t format, uint32_t width, uint32_t height);
+void drm_setup_mapped_buffer(int fd, struct drm_dev_t *dev, uint32_t width, uint32_t height,
+			     uint32_t format, struct drm_buffer_t *buffer);
+void drm_free_buffer(int fd, struct drm_buffer_t *buffer);
+uint32_t drm_setup_convert(int fd, struct drm_dev_t *dev, int stream, uint32_t plane_id);
+void drm_free_convert(int fd, struct drm_dev_t *dev, int stream);
+int drm_get_plane_props(int fd, uint32_t plane_id, struct drm_plane_props *props);
+/* src_* in 16.16 fixed point */
+int drm_atomic_add_plane(drmModeAtomicReq *req, const struct drm_plane_props *props, uint32_t crtc_id,
+			 uint32_t fb_id, int32_t x, int32_t y, uint32_t width, uint32_t height,
+			 uint32_t src_x, uint32_t src_y, uint32_t src_width, uint32_t src_height);
+int drm_request_vblank(int fd, struct drm_dev_t *dev, void *data);
+const char *drm_blend_name(enum drm_blend_mode mode);
+int drm_plane_set_ycbcr(int fd, const struct drm_plane_props *props,
+			enum drm_ycbcr_encoding encoding, enum drm_ycbcr_range range);
+/* ctm row major, NULL for none; gamma 1.0 for none */
+int drm_set_crtc_color(int fd, struct drm_dev_t *dev, const double *ctm, double gamma);
+void drm_setup_scale(int fd, struct drm_dev_t *dev, int stream, uint32_t width, uint32_t height);
+void drm_free_scale(int fd, struct drm_dev_t *dev, int stream);
+void drm_setup_rotate(int fd, struct drm_dev_t *dev, int stream, uint32_t width, uint32_t height,
+		      uint32_t format);
+void drm_free_rotate(int fd, struct drm_dev_t *dev, int stream);
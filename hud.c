@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <drm_fourcc.h>
+
+#include "drm.h"
+#include "hud.h"
+
+/* 5x7 glyphs, drawn twice the size in a cell with a margin */
+#define GLYPH_W		5
+#define GLYPH_H		7
+#define GLYPH_SCALE	2
+#define CELL_W		(GLYPH_W * GLYPH_SCALE + 2)
+#define CELL_H		(GLYPH_H * GLYPH_SCALE + 4)
+
+/* premultiplied: white text on half transparent black */
+#define HUD_INK		0xffffffff
+#define HUD_PAPER	0x80000000
+
+static const char hud_chars[] = " 0123456789.:/-%?ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+/* a row a byte, the leftmost pixel in bit 4 */
+static const uint8_t hud_font[][GLYPH_H] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },	/* space */
+	{ 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e },	/* 0 */
+	{ 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e },
+	{ 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f },
+	{ 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e },
+	{ 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 },
+	{ 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e },
+	{ 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e },
+	{ 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },
+	{ 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e },
+	{ 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c },	/* 9 */
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c },	/* . */
+	{ 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 },	/* : */
+	{ 0x01, 0x01, 0x02, 0x04, 0x08, 0x10, 0x10 },	/* / */
+	{ 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 },	/* - */
+	{ 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 },	/* % */
+	{ 0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 },	/* ? */
+	{ 0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 },	/* A */
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e },
+	{ 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e },
+	{ 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c },
+	{ 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f },
+	{ 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 },
+	{ 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f },
+	{ 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 },
+	{ 0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e },
+	{ 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c },
+	{ 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 },
+	{ 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f },
+	{ 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 },
+	{ 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 },
+	{ 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e },
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 },
+	{ 0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d },
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 },
+	{ 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e },
+	{ 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e },
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04 },
+	{ 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a },
+	{ 0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11 },
+	{ 0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04 },
+	{ 0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f },	/* Z */
+};
+
+#define HUD_GLYPHS	(sizeof(hud_font) / sizeof(hud_font[0]))
+
+/* Every glyph as ARGB pixels, margins included, ready to be copied */
+static uint32_t *hud_rasterise(void)
+{
+	uint32_t *atlas, *cell;
+	unsigned int g, x, y;
+
+	atlas = malloc(HUD_GLYPHS * CELL_W * CELL_H * sizeof(*atlas));
+	if (!atlas)
+		return NULL;
+
+	for (g = 0; g < HUD_GLYPHS; g++) {
+		cell = atlas + g * CELL_W * CELL_H;
+		for (y = 0; y < CELL_H; y++)
+			for (x = 0; x < CELL_W; x++)
+				cell[y * CELL_W + x] = HUD_PAPER;
+		for (y = 0; y < GLYPH_H * GLYPH_SCALE; y++)
+			for (x = 0; x < GLYPH_W * GLYPH_SCALE; x++)
+				if (hud_font[g][y / GLYPH_SCALE] & 0x10 >> x / GLYPH_SCALE)
+					cell[(y + 2) * CELL_W + x + 1] = HUD_INK;
+	}
+	return atlas;
+}
+
+static unsigned int hud_glyph(char c)
+{
+	const char *p;
+
+	if (!c)
+		return 0;
+	p = strchr(hud_chars, toupper((unsigned char)c));
+	return p ? p - hud_chars : strchr(hud_chars, '?') - hud_chars;
+}
+
+static void hud_draw(struct hud_t *h, int row, int col, char c)
+{
+	const uint32_t *cell = h->atlas + hud_glyph(c) * CELL_W * CELL_H;
+	uint8_t *dst = (uint8_t *)h->buffer.buf + row * CELL_H * h->buffer.pitch + col * CELL_W * 4;
+	int y;
+
+	for (y = 0; y < CELL_H; y++, dst += h->buffer.pitch)
+		memcpy(dst, cell + y * CELL_W, CELL_W * 4);
+}
+
+struct hud_t *hud_open(int fd, struct drm_dev_t *dev, int rows, int32_t x, int32_t y)
+{
+	struct drm_plane_props props;
+	struct hud_t *h;
+	uint32_t plane_id, width = HUD_COLS * CELL_W, height;
+	uint32_t i;
+
+	if (rows < 1 || rows > HUD_ROWS)
+		return NULL;
+	height = rows * CELL_H;
+
+	plane_id = drm_find_spare_plane(fd, dev, DRM_FORMAT_ARGB8888, width, height);
+	if (!plane_id) {
+		fprintf(stderr, "hud: no spare plane takes %ux%u ARGB8888\n", width, height);
+		return NULL;
+	}
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return NULL;
+	h->atlas = hud_rasterise();
+	if (!h->atlas) {
+		free(h);
+		return NULL;
+	}
+	h->fd = fd;
+	h->plane_id = plane_id;
+	h->width = width;
+	h->height = height;
+	h->rows = rows;
+
+	/* blank, which is what all spaces look like */
+	drm_setup_mapped_buffer(fd, dev, width, height, DRM_FORMAT_ARGB8888, &h->buffer);
+	for (i = 0; i < (uint32_t)rows * HUD_COLS; i++)
+		hud_draw(h, i / HUD_COLS, i % HUD_COLS, ' ');
+	memset(h->text, ' ', sizeof(h->text));
+
+	/* above the streams */
+	if (drm_get_plane_props(fd, plane_id, &props) == 0 && props.ids[DRM_PLANE_ZPOS] && props.zpos_mutable)
+		drmModeObjectSetProperty(fd, plane_id, DRM_MODE_OBJECT_PLANE, props.ids[DRM_PLANE_ZPOS],
+					 props.zpos_max);
+	if (drmModeSetPlane(fd, plane_id, dev->crtc_id, h->buffer.fb_id, 0, x, y, width, height,
+			    0, 0, width << 16, height << 16)) {
+		fprintf(stderr, "hud: plane %d refused the overlay\n", plane_id);
+		hud_close(h);
+		return NULL;
+	}
+
+	printf("hud: %ux%u on plane %d\n", width, height, plane_id);
+	return h;
+}
+
+void hud_close(struct hud_t *h)
+{
+	drmModeSetPlane(h->fd, h->plane_id, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	drm_free_buffer(h->fd, &h->buffer);
+	free(h->atlas);
+	free(h);
+}
+
+/*
+ * The plane keeps scanning out the same buffer, changed cells are
+ * written into it in place. Drivers that only push damaged areas to
+ * the panel get told which.
+ */
+int hud_print(struct hud_t *h, int row, const char *text)
+{
+	drmModeClip clip;
+	int col, first = -1, last = -1, changed = 0, end = 0;
+	char c;
+
+	if (row < 0 || row >= h->rows)
+		return 0;
+
+	for (col = 0; col < HUD_COLS; col++) {
+		if (!end && !text[col])
+			end = 1;
+		c = end ? ' ' : text[col];
+		if (c == h->text[row][col])
+			continue;
+		hud_draw(h, row, col, c);
+		h->text[row][col] = c;
+		if (first < 0)
+			first = col;
+		last = col;
+		changed++;
+	}
+
+	if (changed) {
+		clip.x1 = first * CELL_W;
+		clip.y1 = row * CELL_H;
+		clip.x2 = (last + 1) * CELL_W;
+		clip.y2 = (row + 1) * CELL_H;
+		drmModeDirtyFB(h->fd, h->buffer.fb_id, &clip, 1);
+	}
+	return changed;
+}
@@ -0,0 +1,32 @@
+
+#include <stdint.h>
+
+/*
+ * On-screen diagnostics: a few lines of text on a spare plane above
+ * the video. The glyphs are rasterised once into an ARGB atlas; a
+ * print copies atlas cells into the mapped buffer the plane scans out,
+ * and only for the characters that changed, so a refresh of a few
+ * digits costs a few hundred bytes of writes and no plane update.
+ *
+ * Needs drm.h included first.
+ */
+
+#define HUD_ROWS	4
+/* a stream line at 999.9 fps, 9999.9 ms and 9 digits of drops */
+#define HUD_COLS	40
+
+struct hud_t {
+	int fd;
+	uint32_t plane_id;
+	struct drm_buffer_t buffer;
+	uint32_t width, height;
+	int rows;
+	uint32_t *atlas;	/* a cell per glyph, one after the other */
+	char text[HUD_ROWS][HUD_COLS];	/* what the buffer shows */
+};
+
+/* rows of text, its top left corner at x, y on the screen; NULL without a spare plane */
+struct hud_t *hud_open(int fd, struct drm_dev_t *dev, int rows, int32_t x, int32_t y);
+void hud_close(struct hud_t *h);
+/* returns how many characters had to be drawn */
+int hud_print(struct hud_t *h, int row, const char *text);
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "layout.h"
+
+static const char *const layout_names[] = {
+	[LAYOUT_GRID] = "grid",
+	[LAYOUT_PIP] = "pip",
+	[LAYOUT_FOCUS] = "focus",
+};
+
+static void layout_cell(struct layout_t *l, int stream, uint32_t x, uint32_t y,
+			uint32_t width, uint32_t height)
+{
+	struct layout_rect *r = &l->cells[stream];
+
+	r->x = x & ~1u;
+	r->y = y & ~1u;
+	r->width = width & ~1u;
+	r->height = height & ~1u;
+}
+
+static void layout_grid(struct layout_t *l)
+{
+	uint32_t cols, rows, w, h;
+	int i;
+
+	for (cols = 1; cols * cols < (uint32_t)l->nstreams; cols++)
+		;
+	rows = (l->nstreams + cols - 1) / cols;
+	w = l->width / cols;
+	h = l->height / rows;
+
+	for (i = 0; i < l->nstreams; i++) {
+		layout_cell(l, i, (i % cols) * w, (i / cols) * h, w, h);
+		l->zorder[i] = i;
+	}
+}
+
+/* the others in a column at the right edge, bottom up, the first on top of the stack */
+static void layout_column(struct layout_t *l, uint32_t w, uint32_t h, uint32_t y0, int up)
+{
+	int i, k = 0;
+
+	for (i = 0; i < l->nstreams; i++) {
+		if (i == l->main)
+			continue;
+		layout_cell(l, i, l->width - w, up ? l->height - (k + 1) * h : y0 + k * h, w, h);
+		l->zorder[i] = l->nstreams - 1 - k++;
+	}
+}
+
+static void layout_pip(struct layout_t *l)
+{
+	int insets = l->nstreams - 1;
+	uint32_t h = l->height / (insets > 2 ? insets : 2);
+	uint32_t w = (uint64_t)l->width * h / l->height;
+
+	layout_cell(l, l->main, 0, 0, l->width, l->height);
+	l->zorder[l->main] = 0;
+	layout_column(l, w, h, 0, 1);
+}
+
+static void layout_focus(struct layout_t *l)
+{
+	int thumbs = l->nstreams - 1;
+	uint32_t w = l->nstreams > 1 ? l->width / 4 : 0;
+	uint32_t h = l->height / (thumbs > 3 ? thumbs : 3);
+
+	layout_cell(l, l->main, 0, 0, l->width - w, l->height);
+	l->zorder[l->main] = 0;
+	layout_column(l, w, h, 0, 0);
+}
+
+int layout_compute(struct layout_t *l, enum layout_kind kind, int main, uint32_t width,
+		   uint32_t height, int nstreams)
+{
+	if (nstreams < 1 || nstreams > LAYOUT_MAX_STREAMS || main < 0 || main >= nstreams
+		|| !width || !height)
+		return -1;
+
+	memset(l, 0, sizeof(*l));
+	l->kind = kind;
+	l->main = main;
+	l->width = width;
+	l->height = height;
+	l->nstreams = nstreams;
+
+	switch (kind) {
+	case LAYOUT_GRID:
+		layout_grid(l);
+		break;
+	case LAYOUT_PIP:
+		layout_pip(l);
+		break;
+	case LAYOUT_FOCUS:
+		layout_focus(l);
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+struct layout_rect layout_fit(const struct layout_t *l, int stream, uint32_t src_width,
+			      uint32_t src_height)
+{
+	struct layout_rect cell = l->cells[stream], r = cell;
+
+	if (!src_width || !src_height)
+		return cell;
+
+	/* as wide as the cell, unless that makes it too tall */
+	r.height = (uint64_t)cell.width * src_height / src_width;
+	if (r.height > cell.height) {
+		r.height = cell.height;
+		r.width = (uint64_t)cell.height * src_width / src_height;
+	}
+	r.width &= ~1u;
+	r.height &= ~1u;
+	r.x = cell.x + ((cell.width - r.width) / 2 & ~1u);
+	r.y = cell.y + ((cell.height - r.height) / 2 & ~1u);
+	return r;
+}
+
+int layout_parse(const char *str, enum layout_kind *kind, int *main)
+{
+	size_t n;
+	char *end;
+	int k;
+
+	for (k = 0; k < (int)(sizeof(layout_names) / sizeof(layout_names[0])); k++) {
+		n = strlen(layout_names[k]);
+		if (strncmp(str, layout_names[k], n))
+			continue;
+
+		*kind = k;
+		*main = 0;
+		if (str[n] && str[n] != '\n') {
+			*main = strtol(str + n, &end, 10);
+			if (end == str + n || (*end && *end != '\n') || *main < 0)
+				return -1;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+const char *layout_name(enum layout_kind kind)
+{
+	return layout_names[kind];
+}
@@ -0,0 +1,44 @@
+
+#include <stdint.h>
+
+/*
+ * Where the streams go on screen. A layout cuts the display mode into
+ * one cell per stream and stacks them; a stream is then fitted into its
+ * cell with its own aspect ratio kept, centred. Everything is in whole
+ * even pixels so YUV planes and the scaler can take it as is.
+ *
+ *   grid   rows and columns, as square as N allows
+ *   pip    the main stream full screen, the others inset bottom right
+ *   focus  the main stream large on the left, thumbnails down the right
+ */
+
+#define LAYOUT_MAX_STREAMS	4
+
+enum layout_kind {
+	LAYOUT_GRID,
+	LAYOUT_PIP,
+	LAYOUT_FOCUS,
+};
+
+struct layout_rect {
+	int32_t x, y;
+	uint32_t width, height;
+};
+
+struct layout_t {
+	enum layout_kind kind;
+	int main;		/* pip and focus: the big stream */
+	uint32_t width, height;	/* display mode */
+	int nstreams;
+	struct layout_rect cells[LAYOUT_MAX_STREAMS];
+	int zorder[LAYOUT_MAX_STREAMS];	/* 0 at the bottom */
+};
+
+int layout_compute(struct layout_t *l, enum layout_kind kind, int main, uint32_t width,
+		   uint32_t height, int nstreams);
+/* the stream's rectangle in its cell, a source of unknown size fills the cell */
+struct layout_rect layout_fit(const struct layout_t *l, int stream, uint32_t src_width,
+			      uint32_t src_height);
+/* "grid", "pip" or "focus", optionally followed by the main stream: "pip1" */
+int layout_parse(const char *str, enum layout_kind *kind, int *main);
+const char *layout_name(enum layout_kind kind);
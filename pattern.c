@@ -0,0 +1,775 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include "videodev2.h"
+#include "pattern.h"
+#include "copy.h"
+#include "record.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+static struct pattern_t sources[PATTERN_MAX_SOURCES] = {
+	[0 ... PATTERN_MAX_SOURCES - 1] = { .fd = -1 },
+};
+
+static const struct {
+	const char *name;
+	uint32_t fourcc;
+} pattern_formats[] = {
+	{ "uyvy", V4L2_PIX_FMT_UYVY },
+	{ "yuyv", V4L2_PIX_FMT_YUYV },
+	{ "nv12", V4L2_PIX_FMT_NV12 },
+	{ "nv16", V4L2_PIX_FMT_NV16 },
+	/* B, G, R, X in memory, DRM_FORMAT_XRGB8888 */
+	{ "xrgb", V4L2_PIX_FMT_XBGR32 },
+};
+
+/* SMPTE colour bars, 75% */
+static const uint8_t bars_top[7][3] = {
+	{ 192, 192, 192 }, { 192, 192, 0 }, { 0, 192, 192 }, { 0, 192, 0 },
+	{ 192, 0, 192 }, { 192, 0, 0 }, { 0, 0, 192 },
+};
+static const uint8_t bars_middle[7][3] = {
+	{ 0, 0, 192 }, { 19, 19, 19 }, { 192, 0, 192 }, { 19, 19, 19 },
+	{ 0, 192, 192 }, { 19, 19, 19 }, { 192, 192, 192 },
+};
+static const uint8_t bars_bottom[8][3] = {
+	{ 0, 33, 76 }, { 255, 255, 255 }, { 50, 0, 106 }, { 19, 19, 19 },
+	{ 9, 9, 9 }, { 19, 19, 19 }, { 29, 29, 29 }, { 19, 19, 19 },
+};
+static const uint8_t white[3] = { 255, 255, 255 };
+
+static struct pattern_t *pattern_get(int fd)
+{
+	int i;
+
+	if (fd < 0)
+		return NULL;
+	for (i = 0; i < PATTERN_MAX_SOURCES; i++)
+		if (sources[i].fd == fd)
+			return &sources[i];
+	return NULL;
+}
+
+int pattern_is(int fd)
+{
+	return pattern_get(fd) != NULL;
+}
+
+static const uint8_t *pattern_bar(int band, uint32_t x, uint32_t width)
+{
+	switch (band) {
+	case 0:
+		return bars_top[x * 7 / width];
+	case 1:
+		return bars_middle[x * 7 / width];
+	}
+	if (x < width * 5 / 7)
+		return bars_bottom[x * 4 / (width * 5 / 7)];
+	if (x < width * 6 / 7)
+		return bars_bottom[(x - width * 5 / 7) * 3 / (width / 7) + 4];
+	return bars_bottom[7];
+}
+
+/* BT.709 limited range, which is what G_FMT reports for the YUV formats */
+static void pattern_ycbcr(const uint8_t *rgb, uint8_t *ycbcr)
+{
+	double y = 0.2126 * rgb[0] + 0.7152 * rgb[1] + 0.0722 * rgb[2];
+
+	ycbcr[0] = 16 + y * 219 / 255 + 0.5;
+	ycbcr[1] = 128 + (rgb[2] - y) / 1.8556 * 224 / 255 + 0.5;
+	ycbcr[2] = 128 + (rgb[0] - y) / 1.5748 * 224 / 255 + 0.5;
+}
+
+/*
+ * width pixels of whatever colour(x) says into a row per plane of
+ * the source's format. Chroma is the average of a pixel pair.
+ */
+static void pattern_fill_row(const struct pattern_t *p, uint8_t **row, uint32_t width,
+			     int band, uint32_t bar_width)
+{
+	uint8_t a[3], b[3];
+	const uint8_t *rgb;
+	uint32_t x;
+
+	for (x = 0; x < width; x += 2) {
+		if (p->fourcc == V4L2_PIX_FMT_XBGR32) {
+			rgb = band < 0 ? white : pattern_bar(band, x, bar_width);
+			row[0][x * 4] = rgb[2];
+			row[0][x * 4 + 1] = rgb[1];
+			row[0][x * 4 + 2] = rgb[0];
+			row[0][x * 4 + 3] = 0;
+			rgb = band < 0 ? white : pattern_bar(band, x + 1, bar_width);
+			row[0][x * 4 + 4] = rgb[2];
+			row[0][x * 4 + 5] = rgb[1];
+			row[0][x * 4 + 6] = rgb[0];
+			row[0][x * 4 + 7] = 0;
+			continue;
+		}
+
+		pattern_ycbcr(band < 0 ? white : pattern_bar(band, x, bar_width), a);
+		pattern_ycbcr(band < 0 ? white : pattern_bar(band, x + 1, bar_width), b);
+		a[1] = (a[1] + b[1] + 1) / 2;
+		a[2] = (a[2] + b[2] + 1) / 2;
+
+		switch (p->fourcc) {
+		case V4L2_PIX_FMT_UYVY:
+			row[0][x * 2] = a[1];
+			row[0][x * 2 + 1] = a[0];
+			row[0][x * 2 + 2] = a[2];
+			row[0][x * 2 + 3] = b[0];
+			break;
+		case V4L2_PIX_FMT_YUYV:
+			row[0][x * 2] = a[0];
+			row[0][x * 2 + 1] = a[1];
+			row[0][x * 2 + 2] = b[0];
+			row[0][x * 2 + 3] = a[2];
+			break;
+		default:
+			row[0][x] = a[0];
+			row[0][x + 1] = b[0];
+			row[1][x] = a[1];
+			row[1][x + 1] = a[2];
+			break;
+		}
+	}
+}
+
+static int pattern_semiplanar(const struct pattern_t *p)
+{
+	return p->fourcc == V4L2_PIX_FMT_NV12 || p->fourcc == V4L2_PIX_FMT_NV16;
+}
+
+/* first chroma row of luma row y */
+static uint32_t pattern_chroma_row(const struct pattern_t *p, uint32_t y)
+{
+	return p->fourcc == V4L2_PIX_FMT_NV12 ? (y + 1) / 2 : y;
+}
+
+static int pattern_templates(struct pattern_t *p)
+{
+	uint32_t rowbytes = p->width * p->bpp;
+	int i, planes = pattern_semiplanar(p) ? 2 : 1, j;
+
+	p->bands[0].y0 = 0;
+	p->bands[0].y1 = p->bands[1].y0 = p->height * 6 / 9;
+	p->bands[1].y1 = p->bands[2].y0 = p->height * 7 / 9;
+	p->bands[2].y1 = p->height;
+
+	for (i = 0; i < PATTERN_BANDS; i++) {
+		for (j = 0; j < planes; j++) {
+			p->bands[i].row[j] = malloc(rowbytes);
+			if (!p->bands[i].row[j])
+				return -1;
+		}
+		pattern_fill_row(p, p->bands[i].row, p->width, i, p->width);
+	}
+
+	/* an even sized block in the middle of the top band, across in two seconds */
+	p->marker_size = (p->height / 8) & ~1;
+	if (p->marker_size >= p->width)
+		p->marker_size = (p->width / 2) & ~1;
+	p->marker_y = (p->bands[0].y1 - p->marker_size) / 2 & ~1;
+	p->marker_step = (p->width / (2 * p->fps)) & ~1;
+	if (p->marker_step < 2)
+		p->marker_step = 2;
+	for (j = 0; j < planes; j++) {
+		p->marker[j] = malloc(p->marker_size * p->bpp);
+		if (!p->marker[j])
+			return -1;
+	}
+	pattern_fill_row(p, p->marker, p->marker_size, -1, 0);
+	return 0;
+}
+
+static void pattern_paint_bars(struct pattern_t *p, uint8_t *map)
+{
+	uint8_t *chroma = map + p->pitch * p->height;
+	uint32_t c0, c1;
+	int i;
+
+	for (i = 0; i < PATTERN_BANDS; i++) {
+		copy_frame(NULL, map + p->bands[i].y0 * p->pitch, p->pitch, p->bands[i].row[0], 0,
+			   p->width * p->bpp, p->bands[i].y1 - p->bands[i].y0);
+		if (!pattern_semiplanar(p))
+			continue;
+		c0 = pattern_chroma_row(p, p->bands[i].y0);
+		c1 = pattern_chroma_row(p, p->bands[i].y1);
+		copy_frame(NULL, chroma + c0 * p->pitch, p->pitch, p->bands[i].row[1], 0,
+			   p->width, c1 - c0);
+	}
+}
+
+/* the block's square at x, from the marker rows or put back from the top band */
+static void pattern_paint_block(struct pattern_t *p, uint8_t *map, uint32_t x, int marker)
+{
+	uint8_t *chroma = map + p->pitch * p->height;
+	uint32_t c0 = pattern_chroma_row(p, p->marker_y);
+	uint32_t c1 = pattern_chroma_row(p, p->marker_y + p->marker_size);
+	uint32_t offset = x * p->bpp, len = p->marker_size * p->bpp;
+
+	copy_frame(NULL, map + p->marker_y * p->pitch + offset, p->pitch,
+		   marker ? p->marker[0] : p->bands[0].row[0] + offset, 0, len, p->marker_size);
+	if (pattern_semiplanar(p))
+		copy_frame(NULL, chroma + c0 * p->pitch + x, p->pitch,
+			   marker ? p->marker[1] : p->bands[0].row[1] + x, 0, p->marker_size, c1 - c0);
+}
+
+static void pattern_paint(struct pattern_t *p, struct pattern_buffer *b)
+{
+	int32_t x = p->sequence * p->marker_step % (p->width - p->marker_size) & ~1;
+
+	if (!b->painted) {
+		pattern_paint_bars(p, b->map);
+		b->painted = 1;
+		b->marker_x = -1;
+	} else if (b->marker_x >= 0 && b->marker_x != x) {
+		pattern_paint_block(p, b->map, b->marker_x, 0);
+	}
+	if (b->marker_x != x)
+		pattern_paint_block(p, b->map, x, 1);
+	b->marker_x = x;
+}
+
+static void pattern_unmap(struct pattern_t *p, uint32_t index)
+{
+	struct pattern_buffer *b = &p->bufs[index];
+
+	if (b->map)
+		munmap(b->map, p->size);
+	b->map = NULL;
+	b->dmabuf_fd = -1;
+	b->painted = 0;
+}
+
+static void pattern_set_buffers(struct pattern_t *p, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = count; i < p->nbufs; i++)
+		pattern_unmap(p, i);
+	for (i = p->nbufs; i < count; i++) {
+		CLEAR(p->bufs[i]);
+		p->bufs[i].dmabuf_fd = -1;
+	}
+	p->nbufs = count;
+}
+
+static void pattern_format(const struct pattern_t *p, struct v4l2_format *fmt)
+{
+	struct v4l2_pix_format_mplane *pix = &fmt->fmt.pix_mp;
+
+	CLEAR(*pix);
+	pix->width = p->width;
+	pix->height = p->height;
+	pix->pixelformat = p->fourcc;
+	pix->field = V4L2_FIELD_NONE;
+	pix->num_planes = 1;
+	pix->plane_fmt[0].bytesperline = p->pitch;
+	pix->plane_fmt[0].sizeimage = p->size;
+	pix->colorspace = p->colorspace;
+	pix->ycbcr_enc = p->ycbcr_enc;
+	pix->quantization = p->quantization;
+	pix->xfer_func = p->xfer_func;
+}
+
+static uint64_t pattern_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* fire once at an absolute time, 1 is right away and 0 never */
+static void pattern_arm(struct pattern_t *p, uint64_t at)
+{
+	struct itimerspec timer;
+
+	CLEAR(timer);
+	timer.it_value.tv_sec = at / 1000000000;
+	timer.it_value.tv_nsec = at % 1000000000;
+	timerfd_settime(p->fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+static int pattern_queue(struct pattern_t *p, struct v4l2_buffer *buf)
+{
+	struct pattern_buffer *b;
+	int dmabuf_fd;
+
+	if (buf->index >= p->nbufs || buf->memory != V4L2_MEMORY_DMABUF || !buf->length)
+		return EINVAL;
+	b = &p->bufs[buf->index];
+	if (b->queued)
+		return EINVAL;
+
+	dmabuf_fd = buf->m.planes[0].m.fd;
+	if (dmabuf_fd != b->dmabuf_fd || !b->map) {
+		pattern_unmap(p, buf->index);
+		b->map = mmap(NULL, p->size, PROT_READ | PROT_WRITE, MAP_SHARED, dmabuf_fd, 0);
+		if (b->map == MAP_FAILED) {
+			b->map = NULL;
+			return errno;
+		}
+		b->dmabuf_fd = dmabuf_fd;
+	}
+
+	b->queued = 1;
+	p->fifo[(p->head + p->count++) % PATTERN_MAX_BUFFERS] = buf->index;
+	if (p->replay && p->fast && p->streaming && !p->ended)
+		pattern_arm(p, 1);
+	return 0;
+}
+
+/* the oldest queued buffer */
+static struct pattern_buffer *pattern_take(struct pattern_t *p, uint32_t *index)
+{
+	*index = p->fifo[p->head];
+	p->head = (p->head + 1) % PATTERN_MAX_BUFFERS;
+	p->count--;
+	p->bufs[*index].queued = 0;
+	return &p->bufs[*index];
+}
+
+static void pattern_deliver(struct pattern_t *p, struct pattern_buffer *b, uint32_t index,
+			    uint64_t captured, uint32_t sequence, struct v4l2_buffer *buf)
+{
+	buf->index = index;
+	buf->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+	buf->field = V4L2_FIELD_NONE;
+	buf->timestamp.tv_sec = captured / 1000000000;
+	buf->timestamp.tv_usec = captured % 1000000000 / 1000;
+	buf->sequence = sequence;
+	if (buf->length) {
+		buf->m.planes[0].bytesused = p->size;
+		buf->m.planes[0].length = p->size;
+		buf->m.planes[0].m.fd = b->dmabuf_fd;
+	}
+}
+
+/*
+ * A frame per timer tick into the oldest queued buffer. Ticks missed
+ * because the fd wasn't read in time, or that found no buffer queued,
+ * are frames lost, the sequence skips them as a driver's would.
+ */
+static int pattern_dequeue(struct pattern_t *p, struct v4l2_buffer *buf)
+{
+	struct pattern_buffer *b;
+	uint64_t ticks, captured;
+	uint32_t index;
+
+	if (read(p->fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+		return EAGAIN;
+	p->sequence += ticks - 1;
+	if (!p->count) {
+		p->sequence++;
+		return EAGAIN;
+	}
+
+	captured = pattern_now();
+	b = pattern_take(p, &index);
+	pattern_paint(p, b);
+	pattern_deliver(p, b, index, captured, p->sequence++, buf);
+	return 0;
+}
+
+/* when recorded frame i is due in this pass */
+static uint64_t pattern_due(const struct pattern_t *p, uint64_t i)
+{
+	const struct record_entry *index = p->replay->index;
+
+	return p->start + (index[i].timestamp - index[0].timestamp);
+}
+
+/* on to the next recorded frame, round again after the last one with loop */
+static void pattern_advance(struct pattern_t *p)
+{
+	const struct record_entry *index = p->replay->index;
+	uint64_t last = p->replay->frames - 1;
+
+	if (p->next < last) {
+		p->next++;
+	} else if (p->loop) {
+		/* the next pass an average frame interval after this one */
+		p->start = pattern_due(p, last)
+			+ (last ? (index[last].timestamp - index[0].timestamp) / last : 0);
+		p->loop_base += index[last].sequence - index[0].sequence + 1;
+		p->next = 0;
+	} else {
+		p->ended = 1;
+	}
+}
+
+static void pattern_rearm(struct pattern_t *p)
+{
+	if (p->ended)
+		pattern_arm(p, 1);	/* to be told it's over */
+	else if (!p->fast)
+		pattern_arm(p, pattern_due(p, p->next));
+	else if (p->count)
+		pattern_arm(p, 1);
+}
+
+/*
+ * Recorded frames go out as far apart as they were captured, or with
+ * fast as soon as a buffer is queued. A frame whose time passed while
+ * waiting for a buffer is lost. Neither is a frame waited for that
+ * readahead didn't get in yet: the timer fires again shortly, so the
+ * display loop never blocks on the disk, and a frame late by then is
+ * lost as well. Sequence numbers are the recorded ones, gaps in the
+ * recording show up again.
+ */
+static int pattern_replay(struct pattern_t *p, struct v4l2_buffer *buf)
+{
+	struct replay_t *r = p->replay;
+	const struct record_entry *e;
+	struct pattern_buffer *b;
+	uint64_t ticks, now;
+	uint32_t index;
+
+	if (p->ended)
+		return EPIPE;
+	if (read(p->fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+		return EAGAIN;
+
+	now = pattern_now();
+	if (!p->fast)
+		while (p->next + 1 < r->frames && pattern_due(p, p->next + 1) <= now)
+			p->next++;
+
+	e = &r->index[p->next];
+	/* the buffers are mapped at the first frame's size, a bigger one would overrun them */
+	if (e->fourcc != p->fourcc || e->width != p->width || e->height != p->height
+	    || e->pitch != p->pitch || e->bytes != p->size) {
+		fprintf(stderr, "replay: format changes at frame %llu, ending there\n",
+			(unsigned long long)p->next);
+		p->ended = 1;
+		return EPIPE;
+	}
+
+	if (!p->count) {
+		if (!p->fast)
+			pattern_advance(p);
+		pattern_rearm(p);
+		return EAGAIN;
+	}
+	if (!replay_resident(r, p->next)) {
+		replay_readahead(r, p->next);
+		pattern_arm(p, now + PATTERN_DISK_RETRY_NS);
+		return EAGAIN;
+	}
+
+	b = pattern_take(p, &index);
+	copy_frame(NULL, b->map, 0, replay_data(r, e), 0, e->bytes, 1);
+	b->painted = 0;
+	pattern_deliver(p, b, index, now, p->loop_base + e->sequence - r->index[0].sequence, buf);
+
+	pattern_advance(p);
+	replay_readahead(r, p->next);
+	pattern_rearm(p);
+	return 0;
+}
+
+static int pattern_stream(struct pattern_t *p, int on)
+{
+	struct itimerspec timer;
+	uint32_t i;
+
+	CLEAR(timer);
+	if (on) {
+		if (!p->nbufs)
+			return EINVAL;
+		/* a whole second at 1 fps, tv_nsec stays below one */
+		timer.it_interval.tv_sec = 1 / p->fps;
+		timer.it_interval.tv_nsec = 1000000000 / p->fps % 1000000000;
+		timer.it_value = timer.it_interval;
+		p->sequence = 0;
+	} else {
+		for (i = 0; i < p->nbufs; i++)
+			p->bufs[i].queued = 0;
+		p->count = 0;
+	}
+
+	if (p->replay) {
+		p->streaming = on;
+		p->next = 0;
+		p->ended = 0;
+		p->loop_base = 0;
+		p->start = pattern_now();
+		if (on)
+			replay_readahead(p->replay, 0);
+		pattern_arm(p, on ? 1 : 0);
+		return 0;
+	}
+
+	if (timerfd_settime(p->fd, 0, &timer, NULL) < 0)
+		return errno;
+	p->streaming = on;
+	return 0;
+}
+
+int pattern_ioctl(int fd, unsigned int request, void *arg)
+{
+	struct pattern_t *p = pattern_get(fd);
+	struct v4l2_capability *cap = arg;
+	struct v4l2_format *fmt = arg;
+	struct v4l2_requestbuffers *req = arg;
+	struct v4l2_create_buffers *create = arg;
+	struct v4l2_buffer *buf = arg;
+	enum v4l2_buf_type *type = arg;
+	int err = 0;
+
+	if (!p) {
+		errno = EBADF;
+		return -1;
+	}
+
+	switch (request) {
+	case VIDIOC_QUERYCAP:
+		CLEAR(*cap);
+		strcpy((char *)cap->driver, p->replay ? "replay" : "pattern");
+		snprintf((char *)cap->card, sizeof(cap->card), "%ux%u@%u %.4s",
+			 p->width, p->height, p->fps, (char *)&p->fourcc);
+		cap->device_caps = V4L2_CAP_VIDEO_CAPTURE_MPLANE | V4L2_CAP_STREAMING;
+		cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+		break;
+	case VIDIOC_G_FMT:
+	case VIDIOC_S_FMT:
+	case VIDIOC_TRY_FMT:
+		/* one format only, whatever was asked for */
+		if (fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+			err = EINVAL;
+		else if (request == VIDIOC_S_FMT && p->nbufs)
+			err = EBUSY;
+		else
+			pattern_format(p, fmt);
+		break;
+	case VIDIOC_REQBUFS:
+		if (req->memory != V4L2_MEMORY_DMABUF)
+			err = EINVAL;
+		else if (p->streaming)
+			err = EBUSY;
+		else {
+			if (req->count > PATTERN_MAX_BUFFERS)
+				req->count = PATTERN_MAX_BUFFERS;
+			pattern_set_buffers(p, 0);
+			pattern_set_buffers(p, req->count);
+		}
+		break;
+	case VIDIOC_CREATE_BUFS:
+		if (create->memory != V4L2_MEMORY_DMABUF
+		    || p->nbufs + create->count > PATTERN_MAX_BUFFERS)
+			err = EINVAL;
+		else {
+			create->index = p->nbufs;
+			pattern_set_buffers(p, p->nbufs + create->count);
+		}
+		break;
+	case VIDIOC_QUERYBUF:
+		if (buf->index >= p->nbufs)
+			err = EINVAL;
+		break;
+	case VIDIOC_QBUF:
+		err = pattern_queue(p, buf);
+		break;
+	case VIDIOC_DQBUF:
+		if (!p->streaming)
+			err = EINVAL;
+		else if (p->replay)
+			err = pattern_replay(p, buf);
+		else
+			err = pattern_dequeue(p, buf);
+		break;
+	case VIDIOC_STREAMON:
+	case VIDIOC_STREAMOFF:
+		if (*type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+			err = EINVAL;
+		else
+			err = pattern_stream(p, request == VIDIOC_STREAMON);
+		break;
+	case VIDIOC_SUBSCRIBE_EVENT:
+		/* the source never changes, nothing will ever come */
+		break;
+	case VIDIOC_DQEVENT:
+		err = ENOENT;
+		break;
+	default:
+		err = ENOTTY;
+		break;
+	}
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+void pattern_close(int fd)
+{
+	struct pattern_t *p = pattern_get(fd);
+	int i, j;
+
+	if (!p)
+		return;
+
+	pattern_set_buffers(p, 0);
+	if (p->replay)
+		replay_close(p->replay);
+	for (i = 0; i < PATTERN_BANDS; i++)
+		for (j = 0; j < 2; j++)
+			free(p->bands[i].row[j]);
+	free(p->marker[0]);
+	free(p->marker[1]);
+	close(p->fd);
+	CLEAR(*p);
+	p->fd = -1;
+}
+
+/* "replay:PATH[,fast][,loop]", the format is the first frame's */
+static int pattern_open_replay(struct pattern_t *p, const char *spec)
+{
+	char path[4096], *opt;
+	const struct record_entry *e;
+
+	snprintf(path, sizeof(path), "%s", spec + strlen(PATTERN_REPLAY_PREFIX));
+	while ((opt = strrchr(path, ',')) != NULL) {
+		if (!strcmp(opt, ",fast"))
+			p->fast = 1;
+		else if (!strcmp(opt, ",loop"))
+			p->loop = 1;
+		else
+			break;
+		*opt = 0;
+	}
+
+	p->replay = replay_open(path);
+	if (!p->replay)
+		return -1;
+
+	e = &p->replay->index[0];
+	p->width = e->width;
+	p->height = e->height;
+	p->fourcc = e->fourcc;
+	p->pitch = e->pitch;
+	p->size = e->bytes;
+	p->colorspace = e->colorspace;
+	p->ycbcr_enc = e->ycbcr_enc;
+	p->quantization = e->quantization;
+	p->xfer_func = e->xfer_func;
+	p->fps = 1;
+	return 0;
+}
+
+/* "pattern:1920x1080@60:nv12", fps and format may be left out */
+static int pattern_open_bars(struct pattern_t *p, const char *spec)
+{
+	const char *name;
+	unsigned int i;
+
+	p->fps = 60;
+	p->fourcc = V4L2_PIX_FMT_UYVY;
+	if (sscanf(spec + strlen(PATTERN_PREFIX), "%ux%u@%u", &p->width, &p->height, &p->fps) < 2
+	    || p->width < 16 || p->height < 16 || p->width % 2 || p->height % 2 || !p->fps) {
+		fprintf(stderr, "%s: expected %sWIDTHxHEIGHT[@FPS][:FORMAT], even sizes\n",
+			spec, PATTERN_PREFIX);
+		return -1;
+	}
+
+	name = strchr(spec + strlen(PATTERN_PREFIX), ':');
+	if (name) {
+		for (i = 0; i < sizeof(pattern_formats) / sizeof(pattern_formats[0]); i++)
+			if (!strcasecmp(name + 1, pattern_formats[i].name))
+				break;
+		if (i == sizeof(pattern_formats) / sizeof(pattern_formats[0])) {
+			fprintf(stderr, "%s: no format %s\n", spec, name + 1);
+			return -1;
+		}
+		p->fourcc = pattern_formats[i].fourcc;
+	}
+
+	switch (p->fourcc) {
+	case V4L2_PIX_FMT_XBGR32:
+		p->bpp = 4;
+		p->chroma_rows = 0;
+		break;
+	case V4L2_PIX_FMT_NV12:
+		p->bpp = 1;
+		p->chroma_rows = p->height / 2;
+		break;
+	case V4L2_PIX_FMT_NV16:
+		p->bpp = 1;
+		p->chroma_rows = p->height;
+		break;
+	default:
+		p->bpp = 2;
+		p->chroma_rows = 0;
+		break;
+	}
+	/* what scanout engines want of a pitch */
+	p->pitch = (p->width * p->bpp + 63) & ~63;
+	p->size = (size_t)p->pitch * (p->height + p->chroma_rows);
+
+	if (p->fourcc == V4L2_PIX_FMT_XBGR32) {
+		p->colorspace = V4L2_COLORSPACE_SRGB;
+		p->quantization = V4L2_QUANTIZATION_FULL_RANGE;
+	} else {
+		p->colorspace = V4L2_COLORSPACE_REC709;
+		p->ycbcr_enc = V4L2_YCBCR_ENC_709;
+		p->quantization = V4L2_QUANTIZATION_LIM_RANGE;
+	}
+
+	if (pattern_templates(p) < 0) {
+		fprintf(stderr, "%s: out of memory\n", spec);
+		return -1;
+	}
+	return 0;
+}
+
+int pattern_open(const char *spec)
+{
+	struct pattern_t *p = NULL;
+	unsigned int i;
+	int fd, ret;
+
+	for (i = 0; i < PATTERN_MAX_SOURCES && !p; i++)
+		if (sources[i].fd < 0)
+			p = &sources[i];
+	if (!p) {
+		fprintf(stderr, "%s: too many pattern sources\n", spec);
+		return -1;
+	}
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "%s: timerfd: %s\n", spec, strerror(errno));
+		return -1;
+	}
+	CLEAR(*p);
+	p->fd = fd;
+
+	if (!strncmp(spec, PATTERN_REPLAY_PREFIX, strlen(PATTERN_REPLAY_PREFIX)))
+		ret = pattern_open_replay(p, spec);
+	else
+		ret = pattern_open_bars(p, spec);
+	if (ret < 0) {
+		pattern_close(fd);
+		return -1;
+	}
+
+	if (p->replay)
+		printf("replay: %llu frames %ux%u %.4s, pitch %u%s%s\n",
+		       (unsigned long long)p->replay->frames, p->width, p->height,
+		       (char *)&p->fourcc, p->pitch, p->fast ? ", fast" : "", p->loop ? ", looping" : "");
+	else
+		printf("pattern: %ux%u@%u %.4s, pitch %u\n", p->width, p->height, p->fps,
+		       (char *)&p->fourcc, p->pitch);
+	return fd;
+}
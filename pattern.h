@@ -0,0 +1,80 @@
+
+#include <stdint.h>
+
+/*
+ * Synthetic capture source, to run the display and conversion paths
+ * without a camera. It opens in place of a video device as
+ * "pattern:WIDTHxHEIGHT@FPS:FORMAT" (format uyvy, yuyv, nv12, nv16 or
+ * xrgb) and answers the V4L2 ioctls on its fd instead of a driver:
+ * one DMABUF capture queue, a frame per tick of a timer the fd polls
+ * readable on.
+ *
+ * "replay:PATH[,fast][,loop]" plays a recording (record.h) through
+ * the same queue instead, the frames copied into the buffers straight
+ * from the mapped file, at the recorded cadence or as fast as buffers
+ * come back. DQBUF fails with EPIPE after the last frame.
+ *
+ * Frames are colour bars with a white block that moves a fixed step
+ * per frame, so a dropped frame shows as a jump. Every bar band is
+ * one row in the stream's format, precomputed, and rows go out as
+ * streaming stores. A buffer that already holds the bars only has the
+ * block it last showed put back and the new one drawn.
+ *
+ * Needs videodev2.h included first.
+ */
+
+#define PATTERN_PREFIX		"pattern:"
+#define PATTERN_REPLAY_PREFIX	"replay:"
+#define PATTERN_MAX_SOURCES	4
+#define PATTERN_MAX_BUFFERS	32
+#define PATTERN_BANDS		3
+/* a replayed frame still on the disk is looked at again after this */
+#define PATTERN_DISK_RETRY_NS	(2 * 1000000)
+
+struct replay_t;
+
+struct pattern_buffer {
+	int dmabuf_fd;
+	uint8_t *map;
+	int queued;
+	int painted;		/* holds the bars */
+	int32_t marker_x;	/* where it shows the block, -1 nowhere */
+};
+
+struct pattern_t {
+	int fd;			/* timerfd, -1 when the slot is free */
+	uint32_t width, height, fps;
+	uint32_t fourcc;	/* V4L2 */
+	uint32_t pitch, chroma_rows, bpp;	/* bytes per pixel in plane 0 */
+	size_t size;
+	uint32_t colorspace, ycbcr_enc, quantization, xfer_func;
+
+	/* rows [y0, y1) of plane 0 look like row[0], chroma rows like row[1] */
+	struct {
+		uint32_t y0, y1;
+		uint8_t *row[2];
+	} bands[PATTERN_BANDS];
+	uint8_t *marker[2];	/* one row of the block */
+	uint32_t marker_size, marker_y, marker_step;
+
+	int streaming;
+	uint32_t nbufs;
+	struct pattern_buffer bufs[PATTERN_MAX_BUFFERS];
+	uint32_t fifo[PATTERN_MAX_BUFFERS];	/* queued indices, oldest first */
+	uint32_t head, count;
+	uint32_t sequence;
+
+	/* replaying instead of drawing */
+	struct replay_t *replay;
+	int fast, loop, ended;
+	uint64_t next;		/* recorded frame to go out next */
+	uint64_t start;		/* ns, when this pass's first frame is due */
+	uint32_t loop_base;	/* added to the recorded sequence numbers */
+};
+
+/* fd to poll and issue ioctls on, -1 if the spec makes no sense */
+int pattern_open(const char *spec);
+int pattern_is(int fd);
+/* ioctl() semantics: -1 with errno set on failure */
+int pattern_ioctl(int fd, unsigned int request, void *arg);
+void pattern_close(int fd);
@@ -0,0 +1,62 @@
+
+/*
+ * USDT probes on the frame path, provider v4l2drm, for lining frames
+ * up with vb2 and drm kernel events in perf, bpftrace or ftrace:
+ *
+ *   dequeue (stream, index, sequence, captured)
+ *   queue   (stream, index, sequence, captured)	back to the driver
+ *   commit  (stream, index, sequence, captured)	on the plane
+ *   flip    (stream, index, sequence, captured, vblank)	on screen
+ *   drop    (stream, index, sequence, captured, lost)
+ *
+ * Times are ns of CLOCK_MONOTONIC, like bpftrace's nsecs; captured is
+ * the driver's timestamp, 0 when it isn't on that clock. A drop is
+ * lost frames the driver skipped before this one, or lost 0 for this
+ * frame never making it to the screen.
+ *
+ * With <sys/sdt.h> a probe is a nop in the code and a note in the
+ * binary, so they are always built in. Flip needs a vblank event per
+ * commit, which is only asked for while something is attached to it
+ * (PROBE_ENABLED, the probe's semaphore). Without the header, or
+ * with -DNO_PROBES, it all compiles to nothing.
+ *
+ * The semaphores are defined in v4l2.c, which includes this with
+ * PROBE_SEMAPHORES defined.
+ *
+ * Capture to screen per stream, in us:
+ *   bpftrace -e 'usdt:./test-dmabuf:v4l2drm:flip /arg3/ { @[arg0] = hist((arg4 - arg3) / 1000); }'
+ */
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PROBES
+#endif
+#endif
+
+#ifdef PROBES
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#ifdef PROBE_SEMAPHORES
+#define PROBE_SEMAPHORE(name)	unsigned short v4l2drm_##name##_semaphore __attribute__((section(".probes")))
+#else
+#define PROBE_SEMAPHORE(name)	extern unsigned short v4l2drm_##name##_semaphore
+#endif
+PROBE_SEMAPHORE(dequeue);
+PROBE_SEMAPHORE(queue);
+PROBE_SEMAPHORE(commit);
+PROBE_SEMAPHORE(flip);
+PROBE_SEMAPHORE(drop);
+
+#define PROBE4(name, a, b, c, d)	DTRACE_PROBE4(v4l2drm, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e)	DTRACE_PROBE5(v4l2drm, name, a, b, c, d, e)
+#define PROBE_ENABLED(name)	__builtin_expect(v4l2drm_##name##_semaphore != 0, 0)
+
+#else
+
+#define PROBE4(name, a, b, c, d)	do { } while (0)
+#define PROBE5(name, a, b, c, d, e)	do { } while (0)
+#define PROBE_ENABLED(name)	0
+
+#endif
@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "videodev2.h"
+#include "record.h"
+#include "copy.h"
+
+#define ALIGN(x, a)	(((x) + (a) - 1) / (a) * (a))
+
+/*
+ * Move the mapping on to fresh space at the end. The space just
+ * written starts going to disk, the chunk before it, which should be
+ * there by now, leaves the page cache so a long recording doesn't
+ * push everything else out.
+ */
+static int record_window(struct record_t *r, uint64_t len)
+{
+	if (r->window) {
+		munmap(r->window, r->window_len);
+		sync_file_range(r->fd, r->window_start, r->window_len, SYNC_FILE_RANGE_WRITE);
+		if (r->window_start > r->written)
+			posix_fadvise(r->fd, r->written, r->window_start - r->written, POSIX_FADV_DONTNEED);
+		r->written = r->window_start;
+		r->window = NULL;
+	}
+
+	r->window_start = r->end;
+	r->window_len = ALIGN(len, RECORD_CHUNK);
+	if (fallocate(r->fd, 0, r->window_start, r->window_len) < 0
+	    && ftruncate(r->fd, r->window_start + r->window_len) < 0) {
+		perror("record: cannot grow the file");
+		return -1;
+	}
+
+	r->window = mmap(NULL, r->window_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, r->window_start);
+	if (r->window == MAP_FAILED) {
+		perror("record: mmap");
+		r->window = NULL;
+		return -1;
+	}
+	/* have the pages in before the frames land, instead of faulting each one */
+	madvise(r->window, r->window_len, MADV_WILLNEED);
+	return 0;
+}
+
+struct record_t *record_open(const char *path)
+{
+	struct record_header hdr;
+	struct record_t *r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->page = sysconf(_SC_PAGESIZE);
+
+	r->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (r->fd < 0) {
+		fprintf(stderr, "record: cannot create %s: %s\n", path, strerror(errno));
+		free(r);
+		return NULL;
+	}
+
+	/* without an index until closed */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic));
+	hdr.version = RECORD_VERSION;
+	hdr.page = r->page;
+	if (pwrite(r->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		fprintf(stderr, "record: cannot write %s: %s\n", path, strerror(errno));
+		close(r->fd);
+		free(r);
+		return NULL;
+	}
+	r->end = r->page;
+	r->written = r->page;
+	return r;
+}
+
+int record_frame(struct record_t *r, const struct v4l2_pix_format_mplane *pix,
+		 const struct v4l2_buffer *buf, const void *data)
+{
+	struct record_entry *e;
+	uint64_t slot;
+
+	slot = r->page + ALIGN((uint64_t)pix->plane_fmt[0].sizeimage, r->page);
+	if (!r->window || r->end + slot > r->window_start + r->window_len)
+		if (record_window(r, slot) < 0)
+			return -1;
+
+	if (r->frames == r->capacity) {
+		uint64_t capacity = r->capacity ? r->capacity * 2 : 1024;
+		struct record_entry *index = realloc(r->index, capacity * sizeof(*index));
+
+		if (!index)
+			return -1;
+		r->index = index;
+		r->capacity = capacity;
+	}
+
+	e = &r->index[r->frames];
+	memset(e, 0, sizeof(*e));
+	e->magic = RECORD_ENTRY_MAGIC;
+	e->sequence = buf->sequence;
+	e->timestamp = buf->timestamp.tv_sec * 1000000000ULL + buf->timestamp.tv_usec * 1000ULL;
+	e->offset = r->end + r->page;
+	e->bytes = pix->plane_fmt[0].sizeimage;
+	e->fourcc = pix->pixelformat;
+	e->width = pix->width;
+	e->height = pix->height;
+	e->pitch = pix->plane_fmt[0].bytesperline;
+	e->colorspace = pix->colorspace;
+	e->ycbcr_enc = pix->ycbcr_enc;
+	e->quantization = pix->quantization;
+	e->xfer_func = pix->xfer_func;
+
+	/* streaming stores, the page cache copy is not read back */
+	copy_frame(NULL, r->window + (e->offset - r->window_start), 0, data, 0, e->bytes, 1);
+	memcpy(r->window + (r->end - r->window_start), e, sizeof(*e));
+
+	r->end += slot;
+	r->frames++;
+	return 0;
+}
+
+void record_close(struct record_t *r)
+{
+	struct record_header hdr;
+	size_t len = r->frames * sizeof(*r->index);
+
+	if (r->window)
+		munmap(r->window, r->window_len);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic));
+	hdr.version = RECORD_VERSION;
+	hdr.page = r->page;
+	hdr.frames = r->frames;
+	hdr.index_offset = r->end;
+	/* the index first, a header pointing at half an index is worse than none */
+	if (ftruncate(r->fd, r->end + len) < 0
+	    || pwrite(r->fd, r->index, len, r->end) != (ssize_t)len
+	    || fdatasync(r->fd) < 0
+	    || pwrite(r->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		perror("record: cannot write the index");
+	else
+		printf("record: %llu frames\n", (unsigned long long)r->frames);
+
+	close(r->fd);
+	free(r->index);
+	free(r);
+}
+
+/* A recording that was never closed: walk its slots for as long as they hold frames */
+static int replay_walk(struct replay_t *r)
+{
+	const struct record_entry *e;
+	uint64_t off = r->page, capacity = 0;
+	struct record_entry *built;
+
+	while (off + r->page <= r->size) {
+		e = (const struct record_entry *)(r->map + off);
+		if (e->magic != RECORD_ENTRY_MAGIC || e->offset != off + r->page
+		    || e->offset + e->bytes > r->size)
+			break;
+		if (r->frames == capacity) {
+			capacity = capacity ? capacity * 2 : 1024;
+			built = realloc(r->built, capacity * sizeof(*built));
+			if (!built)
+				return -1;
+			r->built = built;
+		}
+		r->built[r->frames++] = *e;
+		off = e->offset + ALIGN((uint64_t)e->bytes, r->page);
+	}
+	r->index = r->built;
+	return 0;
+}
+
+/*
+ * The index a closed recording ends with, trusted only if it fits the
+ * file and every frame it lists lies page aligned, in order, inside it
+ */
+static int replay_index_valid(const struct replay_t *r, const struct record_header *hdr)
+{
+	const struct record_entry *e;
+	uint64_t i, end = r->page;
+
+	if (!hdr->index_offset || hdr->index_offset % r->page || hdr->index_offset > r->size
+	    || hdr->frames > (r->size - hdr->index_offset) / sizeof(*e))
+		return 0;
+
+	e = (const struct record_entry *)(r->map + hdr->index_offset);
+	for (i = 0; i < hdr->frames; i++, e++) {
+		if (e->offset % r->page || e->offset < end || e->offset > r->size
+		    || e->bytes > r->size - e->offset)
+			return 0;
+		end = e->offset + e->bytes;
+	}
+	return 1;
+}
+
+struct replay_t *replay_open(const char *path)
+{
+	const struct record_header *hdr;
+	struct replay_t *r;
+	struct stat st;
+	uint64_t i, largest = 0;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (r->fd < 0 || fstat(r->fd, &st) < 0) {
+		fprintf(stderr, "replay: cannot open %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	r->size = st.st_size;
+	if (r->size < sizeof(*hdr)) {
+		fprintf(stderr, "replay: %s is no recording\n", path);
+		goto fail;
+	}
+
+	r->map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		fprintf(stderr, "replay: cannot map %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	madvise((void *)r->map, r->size, MADV_SEQUENTIAL);
+
+	hdr = (const struct record_header *)r->map;
+	if (memcmp(hdr->magic, RECORD_MAGIC, sizeof(hdr->magic)) || hdr->version != RECORD_VERSION
+	    || !hdr->page || hdr->page % sysconf(_SC_PAGESIZE)) {
+		fprintf(stderr, "replay: %s is no recording\n", path);
+		goto fail;
+	}
+	r->page = hdr->page;
+
+	if (replay_index_valid(r, hdr)) {
+		r->index = (const struct record_entry *)(r->map + hdr->index_offset);
+		r->frames = hdr->frames;
+	} else {
+		if (replay_walk(r) < 0)
+			goto fail;
+		fprintf(stderr, "replay: %s has %s index, found %llu frames\n", path,
+			hdr->index_offset ? "a damaged" : "no", (unsigned long long)r->frames);
+	}
+	if (!r->frames) {
+		fprintf(stderr, "replay: %s holds no frames\n", path);
+		goto fail;
+	}
+
+	for (i = 0; i < r->frames; i++)
+		if (r->index[i].bytes > largest)
+			largest = r->index[i].bytes;
+	r->resident = malloc(ALIGN(largest, r->page) / r->page + 1);
+	if (!r->resident)
+		goto fail;
+	return r;
+
+fail:
+	replay_close(r);
+	return NULL;
+}
+
+void replay_close(struct replay_t *r)
+{
+	if (r->map)
+		munmap((void *)r->map, r->size);
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r->built);
+	free(r->resident);
+	free(r);
+}
+
+const uint8_t *replay_data(const struct replay_t *r, const struct record_entry *e)
+{
+	return r->map + e->offset;
+}
+
+int replay_resident(struct replay_t *r, uint64_t i)
+{
+	const struct record_entry *e = &r->index[i];
+	size_t pages = ALIGN((uint64_t)e->bytes, r->page) / r->page, n;
+
+	/* offsets are page aligned, so is the mapping */
+	if (mincore((void *)(r->map + e->offset), pages * r->page, r->resident) < 0)
+		return 1;
+	for (n = 0; n < pages; n++)
+		if (!(r->resident[n] & 1))
+			return 0;
+	return 1;
+}
+
+void replay_readahead(struct replay_t *r, uint64_t i)
+{
+	uint64_t last = i + REPLAY_READAHEAD, start, end;
+
+	if (last >= r->frames)
+		last = r->frames - 1;
+	if (r->hinted > last || r->hinted <= i)
+		r->hinted = i + 1;
+	if (r->hinted > last)
+		return;
+
+	start = r->index[r->hinted].offset;
+	end = r->index[last].offset + r->index[last].bytes;
+	madvise((void *)(r->map + start), end - start, MADV_WILLNEED);
+	r->hinted = last + 1;
+}
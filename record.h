@@ -0,0 +1,83 @@
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Raw frame recordings. A file is a header page, then a slot per frame
+ * (a page with the frame's entry, its data from the next page on),
+ * then at the end an index of all entries, which the header points
+ * to. A recording that was never closed has no index; the slots are
+ * walked instead.
+ *
+ * The recorder writes through a shared mapping of space allocated
+ * ahead in chunks, and starts writeback on each chunk as it leaves
+ * it, so a frame costs a copy into the page cache. The reader maps
+ * the whole file and hints the kernel to read ahead of playback.
+ *
+ * Needs videodev2.h included first.
+ */
+
+#define RECORD_MAGIC		"V4L2REC1"
+#define RECORD_ENTRY_MAGIC	0x46524d45	/* "EMRF" */
+#define RECORD_VERSION		1
+/* space allocated and mapped at a time */
+#define RECORD_CHUNK		(64 << 20)
+/* frames the reader asks the kernel to read ahead */
+#define REPLAY_READAHEAD	8
+
+struct record_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t page;		/* slots are multiples of this */
+	uint64_t frames;	/* in the index, 0 without one */
+	uint64_t index_offset;
+};
+
+struct record_entry {
+	uint32_t magic;
+	uint32_t sequence;
+	uint64_t timestamp;	/* ns, CLOCK_MONOTONIC at capture */
+	uint64_t offset;	/* of the frame data */
+	uint32_t bytes;
+	uint32_t fourcc;	/* V4L2 */
+	uint32_t width, height, pitch;
+	uint8_t colorspace, ycbcr_enc, quantization, xfer_func;
+};
+
+struct record_t {
+	int fd;
+	uint32_t page;
+	uint64_t end;		/* where the next slot goes */
+	uint8_t *window;	/* mapped [window_start, window_start + window_len) */
+	uint64_t window_start, window_len;
+	uint64_t written;	/* everything before is on its way to disk */
+	struct record_entry *index;
+	uint64_t frames, capacity;
+};
+
+struct replay_t {
+	int fd;
+	const uint8_t *map;
+	size_t size;
+	uint32_t page;
+	const struct record_entry *index;
+	struct record_entry *built;	/* index walked from the slots */
+	uint64_t frames;
+	uint64_t hinted;	/* frames before this were handed to readahead */
+	unsigned char *resident;	/* mincore() vector, a frame's worth */
+};
+
+struct record_t *record_open(const char *path);
+/* data is the frame as captured, sized by the format */
+int record_frame(struct record_t *r, const struct v4l2_pix_format_mplane *pix,
+		 const struct v4l2_buffer *buf, const void *data);
+/* writes the index */
+void record_close(struct record_t *r);
+
+struct replay_t *replay_open(const char *path);
+void replay_close(struct replay_t *r);
+const uint8_t *replay_data(const struct replay_t *r, const struct record_entry *e);
+/* whether frame i can be read without waiting for the disk */
+int replay_resident(struct replay_t *r, uint64_t i);
+/* start reading the frames after i */
+void replay_readahead(struct replay_t *r, uint64_t i);
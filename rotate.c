@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ROTATE_SSE2
+typedef __m128i vec_t;
+#define vec_load(p)		_mm_loadu_si128((const __m128i *)(p))
+#define vec_store(p, v)		_mm_storeu_si128((__m128i *)(p), (v))
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define ROTATE_NEON
+typedef uint8x16_t vec_t;
+#define vec_load(p)		vld1q_u8((const uint8_t *)(p))
+#define vec_store(p, v)		vst1q_u8((uint8_t *)(p), (v))
+#endif
+
+#include "convert.h"
+#include "rotate.h"
+
+/* elements per block edge, a block of 4 byte pixels is 16KB each way */
+#define ROTATE_BLOCK	64
+
+/*
+ * Output pixel (x', y') for source (x, y), as a transpose followed by
+ * output flips. DRM reflects first, then turns counter clockwise:
+ * 90 takes (x, y) to (y, W-1-x), 270 to (H-1-y, x).
+ */
+struct rotate_op {
+	int transpose;
+	int flip_x, flip_y;
+};
+
+static struct rotate_op rotate_op(uint32_t rotation)
+{
+	int fx = !!(rotation & DRM_MODE_REFLECT_X), fy = !!(rotation & DRM_MODE_REFLECT_Y);
+	struct rotate_op op = { 0, fx, fy };
+
+	switch (rotation & DRM_MODE_ROTATE_MASK) {
+	case DRM_MODE_ROTATE_90:
+		op = (struct rotate_op){ 1, fy, !fx };
+		break;
+	case DRM_MODE_ROTATE_180:
+		op = (struct rotate_op){ 0, !fx, !fy };
+		break;
+	case DRM_MODE_ROTATE_270:
+		op = (struct rotate_op){ 1, !fy, fx };
+		break;
+	}
+	return op;
+}
+
+int rotate_transposes(uint32_t rotation)
+{
+	return rotate_op(rotation).transpose;
+}
+
+uint32_t rotate_format(uint32_t format, uint32_t rotation)
+{
+	int transpose = rotate_transposes(rotation);
+
+	switch (format) {
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_RGB565:
+	case DRM_FORMAT_NV12:
+		return format;
+	case DRM_FORMAT_NV16:
+		/* turned, 4:2:2 chroma would be subsampled vertically: every other row makes it 4:2:0 */
+		return transpose ? DRM_FORMAT_NV12 : format;
+	case DRM_FORMAT_UYVY:
+	case DRM_FORMAT_YUYV:
+		return transpose ? 0 : format;
+	}
+	return 0;
+}
+
+#if defined(ROTATE_SSE2) || defined(ROTATE_NEON)
+
+/*
+ * Interleaving register i with register i + n/2, n times over, transposes
+ * an n x n tile; lo/hi halves go to 2i and 2i + 1.
+ */
+#if defined(ROTATE_SSE2)
+static inline void vec_zip(vec_t *lo, vec_t *hi, vec_t a, vec_t b, int bpp)
+{
+	switch (bpp) {
+	case 1:
+		*lo = _mm_unpacklo_epi8(a, b);
+		*hi = _mm_unpackhi_epi8(a, b);
+		break;
+	case 2:
+		*lo = _mm_unpacklo_epi16(a, b);
+		*hi = _mm_unpackhi_epi16(a, b);
+		break;
+	default:
+		*lo = _mm_unpacklo_epi32(a, b);
+		*hi = _mm_unpackhi_epi32(a, b);
+		break;
+	}
+}
+
+/* element order reversed, elements of bpp bytes */
+static inline vec_t vec_reverse(vec_t v, int bpp)
+{
+	if (bpp == 4)
+		return _mm_shuffle_epi32(v, 0x1b);
+	v = _mm_shufflelo_epi16(v, 0x1b);
+	v = _mm_shufflehi_epi16(v, 0x1b);
+	v = _mm_shuffle_epi32(v, 0x4e);
+	if (bpp == 1)
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	return v;
+}
+
+/* swap the bytes under mask between the two halves of each 32 bits */
+static inline vec_t vec_swap16(vec_t v, uint32_t mask)
+{
+	vec_t m = _mm_set1_epi32(mask), k = _mm_and_si128(v, m);
+
+	k = _mm_or_si128(_mm_slli_epi32(k, 16), _mm_srli_epi32(k, 16));
+	return _mm_or_si128(_mm_andnot_si128(m, v), k);
+}
+#else
+static inline void vec_zip(vec_t *lo, vec_t *hi, vec_t a, vec_t b, int bpp)
+{
+	switch (bpp) {
+	case 1: {
+		uint8x16x2_t z = vzipq_u8(a, b);
+
+		*lo = z.val[0];
+		*hi = z.val[1];
+		break;
+	}
+	case 2: {
+		uint16x8x2_t z = vzipq_u16(vreinterpretq_u16_u8(a), vreinterpretq_u16_u8(b));
+
+		*lo = vreinterpretq_u8_u16(z.val[0]);
+		*hi = vreinterpretq_u8_u16(z.val[1]);
+		break;
+	}
+	default: {
+		uint32x4x2_t z = vzipq_u32(vreinterpretq_u32_u8(a), vreinterpretq_u32_u8(b));
+
+		*lo = vreinterpretq_u8_u32(z.val[0]);
+		*hi = vreinterpretq_u8_u32(z.val[1]);
+		break;
+	}
+	}
+}
+
+static inline vec_t vec_reverse(vec_t v, int bpp)
+{
+	if (bpp == 4)
+		v = vreinterpretq_u8_u32(vrev64q_u32(vreinterpretq_u32_u8(v)));
+	else if (bpp == 2)
+		v = vreinterpretq_u8_u16(vrev64q_u16(vreinterpretq_u16_u8(v)));
+	else
+		v = vrev64q_u8(v);
+	return vextq_u8(v, v, 8);
+}
+
+static inline vec_t vec_swap16(vec_t v, uint32_t mask)
+{
+	uint8x16_t m = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+	uint8x16_t k = vreinterpretq_u8_u16(vrev32q_u16(vreinterpretq_u16_u8(vandq_u8(v, m))));
+
+	return vorrq_u8(vbicq_u8(v, m), k);
+}
+#endif
+
+/* one tile of 16 bytes a row, n = 16 / bpp rows, n columns */
+static inline __attribute__((always_inline))
+void transpose_tile(uint8_t *dst, ptrdiff_t dst_pitch, const uint8_t *src,
+			   ptrdiff_t src_pitch, int bpp)
+{
+	int n = 16 / bpp, half = n / 2, i, pass;
+	vec_t r[16], t[16];
+
+	for (i = 0; i < n; i++)
+		r[i] = vec_load(src + i * src_pitch);
+	for (pass = n; pass > 1; pass /= 2) {
+		for (i = 0; i < half; i++)
+			vec_zip(&t[2 * i], &t[2 * i + 1], r[i], r[i + half], bpp);
+		for (i = 0; i < n; i++)
+			r[i] = t[i];
+	}
+	for (i = 0; i < n; i++)
+		vec_store(dst + i * dst_pitch, r[i]);
+}
+#endif
+
+static inline void copy_elem(uint8_t *dst, const uint8_t *src, int bpp)
+{
+	switch (bpp) {
+	case 1:
+		*dst = *src;
+		break;
+	case 2:
+		memcpy(dst, src, 2);
+		break;
+	default:
+		memcpy(dst, src, 4);
+		break;
+	}
+}
+
+/* dst(x, y) = src(y, x) for a width x height block of the source, in elements */
+static inline __attribute__((always_inline))
+void transpose_block_bpp(uint8_t *dst, ptrdiff_t dst_pitch, const uint8_t *src,
+			 ptrdiff_t src_pitch, uint32_t width, uint32_t height, const int bpp)
+{
+	uint32_t y = 0, i, j;
+
+#if defined(ROTATE_SSE2) || defined(ROTATE_NEON)
+	uint32_t n = 16 / bpp, x = 0;
+
+	for (y = 0; y + n <= height; y += n)
+		for (x = 0; x + n <= width; x += n)
+			transpose_tile(dst + (ptrdiff_t)x * dst_pitch + y * bpp, dst_pitch,
+				       src + (ptrdiff_t)y * src_pitch + x * bpp, src_pitch, bpp);
+	/* the ragged right and bottom edges */
+	for (j = 0; j < y; j++)
+		for (i = x; i < width; i++)
+			copy_elem(dst + (ptrdiff_t)i * dst_pitch + j * bpp,
+				  src + (ptrdiff_t)j * src_pitch + i * bpp, bpp);
+#endif
+	for (j = y; j < height; j++)
+		for (i = 0; i < width; i++)
+			copy_elem(dst + (ptrdiff_t)i * dst_pitch + j * bpp,
+				  src + (ptrdiff_t)j * src_pitch + i * bpp, bpp);
+}
+
+/* one copy per element size, so the tile loops unroll */
+static void transpose_block(uint8_t *dst, ptrdiff_t dst_pitch, const uint8_t *src,
+			    ptrdiff_t src_pitch, uint32_t width, uint32_t height, int bpp)
+{
+	switch (bpp) {
+	case 1:
+		transpose_block_bpp(dst, dst_pitch, src, src_pitch, width, height, 1);
+		break;
+	case 2:
+		transpose_block_bpp(dst, dst_pitch, src, src_pitch, width, height, 2);
+		break;
+	default:
+		transpose_block_bpp(dst, dst_pitch, src, src_pitch, width, height, 4);
+		break;
+	}
+}
+
+static void transpose_plane(uint8_t *dst, ptrdiff_t dst_pitch, const uint8_t *src,
+			    ptrdiff_t src_pitch, uint32_t width, uint32_t height, int bpp)
+{
+	uint32_t bx, by, bw, bh;
+
+	/* block by block, both the rows read and the rows written stay in cache */
+	for (by = 0; by < height; by += ROTATE_BLOCK) {
+		bh = height - by < ROTATE_BLOCK ? height - by : ROTATE_BLOCK;
+		for (bx = 0; bx < width; bx += ROTATE_BLOCK) {
+			bw = width - bx < ROTATE_BLOCK ? width - bx : ROTATE_BLOCK;
+			transpose_block(dst + (ptrdiff_t)bx * dst_pitch + by * bpp, dst_pitch,
+					src + (ptrdiff_t)by * src_pitch + bx * bpp, src_pitch, bw, bh, bpp);
+		}
+	}
+}
+
+/* a row back to front; luma_mask swaps the two lumas of packed 4:2:2 pixel pairs */
+static void reverse_row(uint8_t *dst, const uint8_t *src, uint32_t width, int bpp, uint32_t luma_mask)
+{
+	const uint8_t *end = src + width * bpp;
+	uint32_t i = 0, v, k;
+
+#if defined(ROTATE_SSE2) || defined(ROTATE_NEON)
+	uint32_t n = 16 / bpp;
+
+	for (; i + n <= width; i += n) {
+		vec_t r = vec_reverse(vec_load(end - (i + n) * bpp), bpp);
+
+		vec_store(dst + i * bpp, luma_mask ? vec_swap16(r, luma_mask) : r);
+	}
+#endif
+	for (; i < width; i++) {
+		copy_elem(dst + i * bpp, end - (i + 1) * bpp, bpp);
+		if (luma_mask) {
+			memcpy(&v, dst + i * bpp, 4);
+			k = v & luma_mask;
+			v = (v & ~luma_mask) | k << 16 | k >> 16;
+			memcpy(dst + i * bpp, &v, 4);
+		}
+	}
+}
+
+/* One plane of width x height elements, dst sized for the op */
+static void rotate_plane(uint8_t *dst, ptrdiff_t dst_pitch, const uint8_t *src, ptrdiff_t src_pitch,
+			 uint32_t width, uint32_t height, int bpp, uint32_t luma_mask, struct rotate_op op)
+{
+	uint32_t out_height = op.transpose ? width : height;
+	uint32_t y;
+
+	/* a flipped output is written bottom up */
+	if (op.flip_y) {
+		dst += (ptrdiff_t)(out_height - 1) * dst_pitch;
+		dst_pitch = -dst_pitch;
+	}
+
+	if (op.transpose) {
+		/* output columns are source rows, flipping them is reading the source bottom up */
+		if (op.flip_x) {
+			src += (ptrdiff_t)(height - 1) * src_pitch;
+			src_pitch = -src_pitch;
+		}
+		transpose_plane(dst, dst_pitch, src, src_pitch, width, height, bpp);
+		return;
+	}
+
+	for (y = 0; y < height; y++) {
+		if (op.flip_x)
+			reverse_row(dst + (ptrdiff_t)y * dst_pitch, src + (ptrdiff_t)y * src_pitch, width, bpp, luma_mask);
+		else
+			memcpy(dst + (ptrdiff_t)y * dst_pitch, src + (ptrdiff_t)y * src_pitch, width * bpp);
+	}
+}
+
+void rotate_frame(const struct convert_frame *src, const struct convert_frame *dst, uint32_t rotation)
+{
+	struct rotate_op op = rotate_op(rotation);
+	uint32_t w = src->width, h = src->height;
+
+	switch (src->format) {
+	case DRM_FORMAT_XRGB8888:
+		rotate_plane(dst->planes[0], dst->pitches[0], src->planes[0], src->pitches[0],
+			     w, h, 4, 0, op);
+		break;
+	case DRM_FORMAT_RGB565:
+		rotate_plane(dst->planes[0], dst->pitches[0], src->planes[0], src->pitches[0],
+			     w, h, 2, 0, op);
+		break;
+	case DRM_FORMAT_UYVY:
+	case DRM_FORMAT_YUYV:
+		/* pixel pairs, both lumas swap places when a row is reversed */
+		rotate_plane(dst->planes[0], dst->pitches[0], src->planes[0], src->pitches[0],
+			     w / 2, h, 4, src->format == DRM_FORMAT_UYVY ? 0xff00ff00 : 0x00ff00ff, op);
+		break;
+	case DRM_FORMAT_NV12:
+		rotate_plane(dst->planes[0], dst->pitches[0], src->planes[0], src->pitches[0],
+			     w, h, 1, 0, op);
+		rotate_plane(dst->planes[1], dst->pitches[1], src->planes[1], src->pitches[1],
+			     w / 2, h / 2, 2, 0, op);
+		break;
+	case DRM_FORMAT_NV16:
+		rotate_plane(dst->planes[0], dst->pitches[0], src->planes[0], src->pitches[0],
+			     w, h, 1, 0, op);
+		if (op.transpose)
+			rotate_plane(dst->planes[1], dst->pitches[1], src->planes[1], src->pitches[1] * 2,
+				     w / 2, h / 2, 2, 0, op);
+		else
+			rotate_plane(dst->planes[1], dst->pitches[1], src->planes[1], src->pitches[1],
+				     w / 2, h, 2, 0, op);
+		break;
+	}
+}
+
+int rotate_parse(const char *str, uint32_t *rotation)
+{
+	char *end;
+	long deg = strtol(str, &end, 10);
+
+	switch (deg) {
+	case 0:
+		*rotation = DRM_MODE_ROTATE_0;
+		break;
+	case 90:
+		*rotation = DRM_MODE_ROTATE_90;
+		break;
+	case 180:
+		*rotation = DRM_MODE_ROTATE_180;
+		break;
+	case 270:
+		*rotation = DRM_MODE_ROTATE_270;
+		break;
+	default:
+		return -1;
+	}
+	if (end == str)
+		return -1;
+	for (; *end && *end != '\n'; end++) {
+		if (*end == 'x')
+			*rotation |= DRM_MODE_REFLECT_X;
+		else if (*end == 'y')
+			*rotation |= DRM_MODE_REFLECT_Y;
+		else
+			return -1;
+	}
+	return 0;
+}
+
+void rotate_name(uint32_t rotation, char *buf, size_t len)
+{
+	static const int degrees[] = { 0, 90, 180, 270 };
+	int i;
+
+	for (i = 0; i < 3 && !(rotation & (DRM_MODE_ROTATE_0 << i)); i++)
+		;
+	snprintf(buf, len, "%d%s%s", degrees[i], rotation & DRM_MODE_REFLECT_X ? "x" : "",
+		 rotation & DRM_MODE_REFLECT_Y ? "y" : "");
+}
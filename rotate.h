@@ -0,0 +1,27 @@
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Software rotation and reflection, for planes without a rotation
+ * property that takes what a stream needs. The rotation value is the
+ * plane property's: one DRM_MODE_ROTATE_* optionally with
+ * DRM_MODE_REFLECT_X/Y, reflections applied first, rotations counter
+ * clockwise.
+ *
+ * Every combination comes down to an optional transpose plus flips.
+ * Flips of whole rows are just negative pitches; the transpose is done
+ * in cache sized blocks of SIMD register sized tiles, and flips within
+ * a row reverse SIMD registers.
+ *
+ * Needs convert.h included first.
+ */
+
+int rotate_transposes(uint32_t rotation);
+/* format the rotated frame is in, 0 if it can't be rotated that way */
+uint32_t rotate_format(uint32_t format, uint32_t rotation);
+/* dst is in rotate_format(), sized as the source turned */
+void rotate_frame(const struct convert_frame *src, const struct convert_frame *dst, uint32_t rotation);
+/* "90", "180x", "0y": degrees counter clockwise, then x and/or y to reflect */
+int rotate_parse(const char *str, uint32_t *rotation);
+void rotate_name(uint32_t rotation, char *buf, size_t len);
@@ -0,0 +1,439 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <drm_fourcc.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SCALE_SSE2
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define SCALE_NEON
+#endif
+
+#include "convert.h"
+#include "copy.h"
+#include "scale.h"
+
+/* where a component sits in a plane row */
+struct scale_chan {
+	uint8_t offset, stride;
+	uint8_t chroma;
+};
+
+static const struct scale_chan uyvy_chans[] = { { 1, 2, 0 }, { 0, 4, 1 }, { 2, 4, 1 } };
+static const struct scale_chan yuyv_chans[] = { { 0, 2, 0 }, { 1, 4, 1 }, { 3, 4, 1 } };
+static const struct scale_chan luma_chans[] = { { 0, 1, 0 } };
+static const struct scale_chan cbcr_chans[] = { { 0, 2, 1 }, { 1, 2, 1 } };
+
+int scale_supported(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_UYVY:
+	case DRM_FORMAT_YUYV:
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_NV16:
+		return 1;
+	}
+	return 0;
+}
+
+static int scale_axis_init(struct scale_axis *a, uint32_t src, uint32_t dst)
+{
+	uint32_t i;
+	int64_t pos;
+
+	memset(a, 0, sizeof(*a));
+	a->src = src;
+	a->dst = dst;
+	if (!dst || !src)
+		return -1;
+	if (src % dst == 0) {
+		a->box = src / dst;
+		return 0;
+	}
+
+	a->index = malloc(dst * sizeof(uint32_t));
+	a->frac = malloc(dst);
+	if (!a->index || !a->frac)
+		return -1;
+
+	for (i = 0; i < dst; i++) {
+		/* centre of output sample i in source samples, 8 fraction bits */
+		pos = ((2 * (int64_t)i + 1) * src * 256) / (2 * dst) - 128;
+		if (pos < 0)
+			pos = 0;
+		a->index[i] = pos >> 8;
+		a->frac[i] = pos & 255;
+		if (a->index[i] >= src - 1) {
+			a->index[i] = src - 1;
+			a->frac[i] = 0;
+		}
+	}
+	return 0;
+}
+
+static void scale_axis_free(struct scale_axis *a)
+{
+	free(a->index);
+	free(a->frac);
+}
+
+/* vertical kernels, bytes are bytes whatever the layout */
+
+static void avg_rows(uint8_t *dst, const uint8_t *a, const uint8_t *b, uint32_t len)
+{
+	uint32_t i = 0;
+
+#if defined(SCALE_SSE2)
+	for (; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i *)(dst + i),
+			_mm_avg_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+				     _mm_loadu_si128((const __m128i *)(b + i))));
+#elif defined(SCALE_NEON)
+	for (; i + 16 <= len; i += 16)
+		vst1q_u8(dst + i, vrhaddq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+#endif
+	for (; i < len; i++)
+		dst[i] = (a[i] + b[i] + 1) >> 1;
+}
+
+/* (a * (256 - f) + b * f + 128) >> 8, f in 1..255 */
+static void lerp_rows(uint8_t *dst, const uint8_t *a, const uint8_t *b, uint8_t f, uint32_t len)
+{
+	uint32_t i = 0;
+
+#if defined(SCALE_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i wa = _mm_set1_epi16(256 - f), wb = _mm_set1_epi16(f);
+	const __m128i half = _mm_set1_epi16(128);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i lo, hi;
+
+		/* at most 255 * 256 + 128, unsigned 16 bit lanes are enough */
+		lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+				   _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+		hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+				   _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, half), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, half), 8);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+#elif defined(SCALE_NEON)
+	const uint8x8_t wa = vdup_n_u8(256 - f), wb = vdup_n_u8(f);
+
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t va = vld1q_u8(a + i), vb = vld1q_u8(b + i);
+		uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(va), wa), vget_low_u8(vb), wb);
+		uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(va), wa), vget_high_u8(vb), wb);
+
+		vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+	}
+#endif
+	for (; i < len; i++)
+		dst[i] = (a[i] * (256 - f) + b[i] * f + 128) >> 8;
+}
+
+static void box_rows(uint8_t *dst, const uint8_t *src, uint32_t pitch, uint32_t n, uint32_t len)
+{
+	uint32_t i, k, sum;
+
+	for (i = 0; i < len; i++) {
+		for (sum = 0, k = 0; k < n; k++)
+			sum += src[k * pitch + i];
+		dst[i] = (sum + n / 2) / n;
+	}
+}
+
+/* Source row y of a plane after vertical filtering, tmp if it had to be blended */
+static const uint8_t *scale_vertical(const struct scale_axis *a, const uint8_t *plane, uint32_t pitch,
+				     uint32_t len, uint32_t y, uint8_t *tmp)
+{
+	const uint8_t *row;
+
+	if (a->box == 1)
+		return plane + y * pitch;
+
+	if (a->box) {
+		row = plane + y * a->box * pitch;
+		if (a->box == 2)
+			avg_rows(tmp, row, row + pitch, len);
+		else
+			box_rows(tmp, row, pitch, a->box, len);
+		return tmp;
+	}
+
+	row = plane + a->index[y] * pitch;
+	if (!a->frac[y])
+		return row;
+	lerp_rows(tmp, row, row + pitch, a->frac[y], len);
+	return tmp;
+}
+
+/*
+ * 2:1 horizontal box, the picture in picture case, per layout. Each
+ * returns how many output bytes it wrote, the rest is left to the
+ * generic path.
+ */
+
+static uint32_t halve_packed(uint8_t *dst, const uint8_t *src, uint32_t out_len, int yuyv)
+{
+	uint32_t i = 0;
+
+#if defined(SCALE_SSE2)
+	/* 32 bit groups U Y V Y (or Y U Y V): pair groups up, then average */
+	const __m128i cmask = _mm_set1_epi32(yuyv ? 0xff00ff00 : 0x00ff00ff);
+	const __m128i ymask = _mm_set1_epi32(yuyv ? 0x000000ff : 0x0000ff00);
+
+	for (; i + 16 <= out_len; i += 16) {
+		__m128i a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(src + i * 2)), 0xd8);
+		__m128i b = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(src + i * 2 + 16)), 0xd8);
+		__m128i even = _mm_unpacklo_epi64(a, b), odd = _mm_unpackhi_epi64(a, b);
+		__m128i c = _mm_and_si128(_mm_avg_epu8(even, odd), cmask);
+		/* the two lumas of one group */
+		__m128i ye = _mm_avg_epu8(even, _mm_srli_epi32(even, 16));
+		__m128i yo = _mm_avg_epu8(odd, _mm_srli_epi32(odd, 16));
+
+		ye = _mm_and_si128(ye, ymask);
+		yo = _mm_slli_epi32(_mm_and_si128(yo, ymask), 16);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(c, _mm_or_si128(ye, yo)));
+	}
+#elif defined(SCALE_NEON)
+	for (; i + 32 <= out_len; i += 32) {
+		uint8x16x4_t g = vld4q_u8(src + i * 2);
+		/* lanes 0 and 2 hold the lumas for UYVY, 1 and 3 for YUYV */
+		uint8x16_t y = yuyv ? vrhaddq_u8(g.val[0], g.val[2]) : vrhaddq_u8(g.val[1], g.val[3]);
+		uint8x16x2_t yy = vuzpq_u8(y, y);
+		uint8x8x4_t o;
+
+		if (yuyv) {
+			o.val[0] = vget_low_u8(yy.val[0]);
+			o.val[1] = vrshrn_n_u16(vpaddlq_u8(g.val[1]), 1);
+			o.val[2] = vget_low_u8(yy.val[1]);
+			o.val[3] = vrshrn_n_u16(vpaddlq_u8(g.val[3]), 1);
+		} else {
+			o.val[0] = vrshrn_n_u16(vpaddlq_u8(g.val[0]), 1);
+			o.val[1] = vget_low_u8(yy.val[0]);
+			o.val[2] = vrshrn_n_u16(vpaddlq_u8(g.val[2]), 1);
+			o.val[3] = vget_low_u8(yy.val[1]);
+		}
+		vst4_u8(dst + i, o);
+	}
+#endif
+	return i;
+}
+
+static uint32_t halve_luma(uint8_t *dst, const uint8_t *src, uint32_t out_len)
+{
+	uint32_t i = 0;
+
+#if defined(SCALE_SSE2)
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+
+	for (; i + 16 <= out_len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i * 2));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i * 2 + 16));
+		__m128i ra = _mm_avg_epu16(_mm_and_si128(a, lo), _mm_srli_epi16(a, 8));
+		__m128i rb = _mm_avg_epu16(_mm_and_si128(b, lo), _mm_srli_epi16(b, 8));
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(ra, rb));
+	}
+#elif defined(SCALE_NEON)
+	for (; i + 16 <= out_len; i += 16) {
+		uint8x16x2_t p = vld2q_u8(src + i * 2);
+
+		vst1q_u8(dst + i, vrhaddq_u8(p.val[0], p.val[1]));
+	}
+#endif
+	return i;
+}
+
+static uint32_t halve_cbcr(uint8_t *dst, const uint8_t *src, uint32_t out_len)
+{
+	uint32_t i = 0;
+
+#if defined(SCALE_SSE2)
+	for (; i + 16 <= out_len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i * 2));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i * 2 + 16));
+
+		/* CbCr pairs in the low half of each 32 bits, sign extended so packs keeps them */
+		a = _mm_avg_epu8(a, _mm_srli_epi32(a, 16));
+		b = _mm_avg_epu8(b, _mm_srli_epi32(b, 16));
+		a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+		b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+	}
+#elif defined(SCALE_NEON)
+	for (; i + 32 <= out_len; i += 32) {
+		uint8x16x4_t p = vld4q_u8(src + i * 2);
+		uint8x16x2_t o;
+
+		o.val[0] = vrhaddq_u8(p.val[0], p.val[2]);
+		o.val[1] = vrhaddq_u8(p.val[1], p.val[3]);
+		vst2q_u8(dst + i, o);
+	}
+#endif
+	return i;
+}
+
+static void scale_chan_row(const struct scale_axis *a, const struct scale_chan *c,
+			   uint8_t *dst, const uint8_t *src, uint32_t from)
+{
+	const uint8_t *p = src + c->offset;
+	uint8_t *q = dst + c->offset;
+	uint32_t i, k, sum, x;
+
+	for (i = from; i < a->dst; i++) {
+		if (a->box) {
+			for (sum = 0, k = 0; k < a->box; k++)
+				sum += p[(i * a->box + k) * c->stride];
+			q[i * c->stride] = (sum + a->box / 2) / a->box;
+		} else {
+			x = a->index[i] * c->stride;
+			q[i * c->stride] = a->frac[i] ?
+				(p[x] * (256 - a->frac[i]) + p[x + c->stride] * a->frac[i] + 128) >> 8 : p[x];
+		}
+	}
+}
+
+static void scale_horizontal(struct scale_t *s, const struct scale_chan *chans, int nchans,
+			     uint8_t *dst, const uint8_t *src, uint32_t src_len, uint32_t out_len,
+			     uint8_t *tmp)
+{
+	uint32_t done = 0;
+	int i;
+
+	if (s->luma.box == 1 && s->chroma.box == 1) {
+		memcpy(dst, src, src_len);
+		return;
+	}
+
+	if (s->luma.box == 2 && s->chroma.box == 2) {
+		if (chans == uyvy_chans || chans == yuyv_chans)
+			done = halve_packed(dst, src, out_len, chans == yuyv_chans);
+		else if (chans == luma_chans)
+			done = halve_luma(dst, src, out_len);
+		else
+			done = halve_cbcr(dst, src, out_len);
+		if (done == out_len)
+			return;
+	}
+
+	/* whatever is left goes through the output row, one strided component at a time */
+	for (i = 0; i < nchans; i++)
+		scale_chan_row(chans[i].chroma ? &s->chroma : &s->luma, &chans[i], tmp, src,
+			       done / chans[i].stride);
+	memcpy(dst + done, tmp + done, out_len - done);
+}
+
+static void scale_plane_rows(struct scale_t *s, int plane, const struct scale_chan *chans, int nchans,
+			     uint32_t y0, uint32_t y1, uint8_t *tmp, uint8_t *out)
+{
+	const struct convert_frame *src = s->src, *dst = s->dst;
+	/* bytes per pixel: 2 for packed 4:2:2, 1 for either NV plane */
+	uint32_t bpp = nchans == 3 ? 2 : 1;
+	uint32_t src_len = s->src_width * bpp, out_len = s->dst_width * bpp;
+	const uint8_t *row;
+	uint32_t y;
+
+	for (y = y0; y < y1; y++) {
+		row = scale_vertical(&s->rows[plane], src->planes[plane], src->pitches[plane],
+				     src_len, y, tmp);
+		scale_horizontal(s, chans, nchans, dst->planes[plane] + y * dst->pitches[plane],
+				 row, src_len, out_len, out);
+	}
+}
+
+static void scale_stripe(void *arg, int stripe, uint32_t y0, uint32_t y1)
+{
+	struct scale_t *s = arg;
+	uint8_t *tmp = s->scratch[stripe], *out = tmp + s->row_bytes;
+
+	switch (s->format) {
+	case DRM_FORMAT_UYVY:
+		scale_plane_rows(s, 0, uyvy_chans, 3, y0, y1, tmp, out);
+		break;
+	case DRM_FORMAT_YUYV:
+		scale_plane_rows(s, 0, yuyv_chans, 3, y0, y1, tmp, out);
+		break;
+	case DRM_FORMAT_NV12:
+		scale_plane_rows(s, 0, luma_chans, 1, y0, y1, tmp, out);
+		/* chroma rows of this stripe's luma rows, stripes stay disjoint */
+		scale_plane_rows(s, 1, cbcr_chans, 2, (y0 + 1) / 2, (y1 + 1) / 2, tmp, out);
+		break;
+	case DRM_FORMAT_NV16:
+		scale_plane_rows(s, 0, luma_chans, 1, y0, y1, tmp, out);
+		scale_plane_rows(s, 1, cbcr_chans, 2, y0, y1, tmp, out);
+		break;
+	}
+}
+
+struct scale_t *scale_create(uint32_t format, uint32_t src_width, uint32_t src_height,
+			     uint32_t dst_width, uint32_t dst_height, struct copy_pool_t *pool)
+{
+	struct scale_t *s;
+	uint32_t chroma_rows = format == DRM_FORMAT_NV12 ? 2 : 1;
+	int i;
+
+	if (!scale_supported(format) || (src_width | dst_width) & 1
+		|| (format == DRM_FORMAT_NV12 && (src_height | dst_height) & 1))
+		return NULL;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->format = format;
+	s->src_width = src_width;
+	s->src_height = src_height;
+	s->dst_width = dst_width;
+	s->dst_height = dst_height;
+	s->pool = pool;
+	/* packed rows are twice the width in bytes, NV12/NV16 rows the width */
+	s->row_bytes = (src_width > dst_width ? src_width : dst_width) * 2;
+
+	if (scale_axis_init(&s->rows[0], src_height, dst_height) < 0
+		|| scale_axis_init(&s->rows[1], src_height / chroma_rows, dst_height / chroma_rows) < 0
+		|| scale_axis_init(&s->luma, src_width, dst_width) < 0
+		|| scale_axis_init(&s->chroma, src_width / 2, dst_width / 2) < 0)
+		goto fail;
+
+	for (i = 0; i < COPY_MAX_THREADS; i++) {
+		s->scratch[i] = malloc(s->row_bytes * 2);
+		if (!s->scratch[i])
+			goto fail;
+	}
+
+	printf("scale: %.4s %dx%d -> %dx%d, %s vertical, %s horizontal\n",
+		(char *)&format, src_width, src_height, dst_width, dst_height,
+		s->rows[0].box ? "box" : "bilinear", s->luma.box ? "box" : "bilinear");
+	return s;
+
+fail:
+	scale_destroy(s);
+	return NULL;
+}
+
+void scale_destroy(struct scale_t *s)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		scale_axis_free(&s->rows[i]);
+	scale_axis_free(&s->luma);
+	scale_axis_free(&s->chroma);
+	for (i = 0; i < COPY_MAX_THREADS; i++)
+		free(s->scratch[i]);
+	free(s);
+}
+
+void scale_frame(struct scale_t *s, const struct convert_frame *src, const struct convert_frame *dst)
+{
+	s->src = src;
+	s->dst = dst;
+	copy_pool_run(s->pool, scale_stripe, s, s->dst_height);
+}
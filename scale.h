@@ -0,0 +1,42 @@
+
+#include <stdint.h>
+
+/*
+ * Software scaler for planes that can't scale. Works on the capture
+ * format itself, packed 4:2:2 (UYVY, YUYV) or NV12/NV16, so the result
+ * scans out like the original. Separable: a vertical pass blends source
+ * rows, a horizontal pass resamples each component. Integer ratios use
+ * a box filter, anything else bilinear. Output rows are striped over a
+ * copy pool.
+ *
+ * Needs convert.h and copy.h included first.
+ */
+
+struct scale_axis {
+	uint32_t src, dst;	/* samples */
+	uint32_t box;		/* integer ratio, 0 for bilinear */
+	uint32_t *index;	/* bilinear: first tap of each output sample */
+	uint8_t *frac;		/* bilinear: weight of the second tap, in 256ths */
+};
+
+struct scale_t {
+	uint32_t format;
+	uint32_t src_width, src_height, dst_width, dst_height;
+	struct scale_axis rows[2];	/* vertical, per plane */
+	struct scale_axis luma, chroma;	/* horizontal */
+
+	struct copy_pool_t *pool;
+	uint8_t *scratch[COPY_MAX_THREADS];	/* a blended row and an output row per stripe */
+	uint32_t row_bytes;
+
+	/* frame being scaled */
+	const struct convert_frame *src;
+	const struct convert_frame *dst;
+};
+
+int scale_supported(uint32_t format);
+struct scale_t *scale_create(uint32_t format, uint32_t src_width, uint32_t src_height,
+			     uint32_t dst_width, uint32_t dst_height, struct copy_pool_t *pool);
+void scale_destroy(struct scale_t *s);
+/* dst has the format and size the scaler was created for */
+void scale_frame(struct scale_t *s, const struct convert_frame *src, const struct convert_frame *dst);
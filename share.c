@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "share.h"
+
+static int share_addr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+struct share_t *share_open(const char *path, share_release_fn release, void *data)
+{
+	struct sockaddr_un addr;
+	struct share_t *sh;
+	int fd;
+
+	if (share_addr(path, &addr) < 0)
+		return NULL;
+
+	/* SEQPACKET keeps message boundaries and reports hangups */
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return NULL;
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+		|| listen(fd, SHARE_MAX_CLIENTS) < 0) {
+		perror("bind/listen");
+		close(fd);
+		return NULL;
+	}
+
+	sh = calloc(1, sizeof(*sh));
+	if (!sh) {
+		close(fd);
+		return NULL;
+	}
+	sh->listen_fd = fd;
+	sh->release = release;
+	sh->data = data;
+
+	printf("share: publishing frames on %s\n", path);
+	return sh;
+}
+
+static void share_unref(struct share_t *sh, int stream, int index)
+{
+	if (sh->refs[stream][index] == 0)
+		return;
+	if (--sh->refs[stream][index] == 0 && sh->release)
+		sh->release(stream, index, sh->data);
+}
+
+static void share_drop_client(struct share_t *sh, int n)
+{
+	struct share_client *c = &sh->clients[n];
+	int stream, index;
+
+	close(c->fd);
+
+	/* give back everything the client still held */
+	for (stream = 0; stream < SHARE_MAX_STREAMS; stream++)
+		for (index = 0; index < SHARE_MAX_BUFFERS; index++)
+			if (c->held[stream] & (1u << index))
+				share_unref(sh, stream, index);
+
+	sh->clients[n] = sh->clients[--sh->nclients];
+	printf("share: subscriber left, %d connected\n", sh->nclients);
+}
+
+static void share_accept(struct share_t *sh)
+{
+	int fd;
+
+	fd = accept4(sh->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN)
+			perror("accept");
+		return;
+	}
+
+	if (sh->nclients == SHARE_MAX_CLIENTS) {
+		fprintf(stderr, "share: too many subscribers\n");
+		close(fd);
+		return;
+	}
+
+	memset(&sh->clients[sh->nclients], 0, sizeof(struct share_client));
+	sh->clients[sh->nclients++].fd = fd;
+	printf("share: subscriber joined, %d connected\n", sh->nclients);
+}
+
+static int share_read_releases(struct share_t *sh, int n)
+{
+	struct share_client *c = &sh->clients[n];
+	struct share_release rel;
+	ssize_t len;
+
+	while ((len = recv(c->fd, &rel, sizeof(rel), MSG_DONTWAIT)) == sizeof(rel)) {
+		if (rel.stream >= SHARE_MAX_STREAMS || rel.index >= SHARE_MAX_BUFFERS
+			|| !(c->held[rel.stream] & (1u << rel.index)))
+			continue;
+
+		c->held[rel.stream] &= ~(1u << rel.index);
+		share_unref(sh, rel.stream, rel.index);
+	}
+
+	if (len == 0 || (len < 0 && errno != EAGAIN))
+		return -1;
+	return 0;
+}
+
+/* Listening socket first, then one entry per subscriber */
+int share_pollfds(struct share_t *sh, struct pollfd *fds)
+{
+	int i;
+
+	fds[0].fd = sh->listen_fd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+
+	for (i = 0; i < sh->nclients; i++) {
+		fds[i + 1].fd = sh->clients[i].fd;
+		fds[i + 1].events = POLLIN;
+		fds[i + 1].revents = 0;
+	}
+
+	return sh->nclients + 1;
+}
+
+void share_handle(struct share_t *sh, struct pollfd *fds, int nfds)
+{
+	int i;
+
+	/* walk backwards, dropping a client moves the last one into its slot */
+	for (i = nfds - 1; i > 0; i--) {
+		if (!fds[i].revents)
+			continue;
+		if (share_read_releases(sh, i - 1) < 0
+			|| (fds[i].revents & (POLLHUP | POLLERR)))
+			share_drop_client(sh, i - 1);
+	}
+
+	if (fds[0].revents & POLLIN)
+		share_accept(sh);
+}
+
+/*
+ * Send one frame to every subscriber. Returns the number of subscribers
+ * now holding the buffer; the release callback fires once they all let go.
+ * A subscriber whose socket is full misses the frame rather than stalling
+ * the display loop.
+ */
+int share_publish(struct share_t *sh, const struct share_frame *frame, int dmabuf_fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int i, sent = 0;
+
+	if (frame->stream >= SHARE_MAX_STREAMS || frame->index >= SHARE_MAX_BUFFERS)
+		return 0;
+
+	for (i = sh->nclients - 1; i >= 0; i--) {
+		struct share_client *c = &sh->clients[i];
+
+		/* a buffer is only ever handed out once at a time */
+		if (c->held[frame->stream] & (1u << frame->index))
+			continue;
+
+		iov.iov_base = (void *)frame;
+		iov.iov_len = sizeof(*frame);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &dmabuf_fd, sizeof(int));
+
+		if (sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+			if (errno != EAGAIN)
+				share_drop_client(sh, i);
+			continue;
+		}
+
+		c->held[frame->stream] |= 1u << frame->index;
+		sent++;
+	}
+
+	sh->refs[frame->stream][frame->index] += sent;
+	return sent;
+}
+
+int share_held(struct share_t *sh, int stream, int index)
+{
+	if (stream >= SHARE_MAX_STREAMS || index >= SHARE_MAX_BUFFERS)
+		return 0;
+	return sh->refs[stream][index] > 0;
+}
+
+void share_close(struct share_t *sh, const char *path)
+{
+	while (sh->nclients)
+		share_drop_client(sh, sh->nclients - 1);
+	close(sh->listen_fd);
+	unlink(path);
+	free(sh);
+}
+
+int share_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (share_addr(path, &addr) < 0)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Blocks for the next frame. Returns 1 on a frame, 0 on hangup, -1 on error */
+int share_recv(int fd, struct share_frame *frame, int *dmabuf_fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = frame, .iov_len = sizeof(*frame) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	do {
+		len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	} while (len < 0 && errno == EINTR);
+
+	if (len <= 0)
+		return len;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (len != sizeof(*frame) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "share: malformed frame message\n");
+		return -1;
+	}
+	memcpy(dmabuf_fd, CMSG_DATA(cmsg), sizeof(int));
+
+	return 1;
+}
+
+int share_release(int fd, const struct share_frame *frame)
+{
+	struct share_release rel = {
+		.stream = frame->stream,
+		.index = frame->index,
+		.sequence = frame->sequence,
+	};
+
+	if (send(fd, &rel, sizeof(rel), MSG_NOSIGNAL) != sizeof(rel))
+		return -1;
+	return 0;
+}
@@ -0,0 +1,66 @@
+
+#include <stdint.h>
+#include <poll.h>
+
+/*
+ * Zero-copy frame sharing over a unix socket.
+ *
+ * The publisher hands the dmabuf fd of every captured frame to each
+ * connected subscriber (SCM_RIGHTS), together with a share_frame header.
+ * A subscriber sends the header back as a share_release once it is done
+ * with the buffer; the buffer goes back to V4L2 when the last subscriber
+ * released it.  Subscribers must not hold frames for long: every held
+ * buffer is one less buffer the camera can capture into.
+ */
+
+#define SHARE_MAX_CLIENTS	8
+#define SHARE_MAX_STREAMS	2
+#define SHARE_MAX_BUFFERS	32
+
+struct share_frame {
+	uint32_t stream;	/* camera id */
+	uint32_t index;		/* V4L2 buffer index */
+	uint32_t sequence;
+	uint32_t fourcc;	/* V4L2 pixel format */
+	uint32_t width, height;
+	uint32_t pitch;
+	uint32_t size;
+	uint64_t timestamp;	/* capture time, ns CLOCK_MONOTONIC */
+};
+
+struct share_release {
+	uint32_t stream;
+	uint32_t index;
+	uint32_t sequence;
+};
+
+struct share_client {
+	int fd;
+	/* buffers this client still holds, one bit per index */
+	uint32_t held[SHARE_MAX_STREAMS];
+};
+
+typedef void (*share_release_fn)(int stream, int index, void *data);
+
+struct share_t {
+	int listen_fd;
+	int nclients;
+	struct share_client clients[SHARE_MAX_CLIENTS];
+	uint8_t refs[SHARE_MAX_STREAMS][SHARE_MAX_BUFFERS];
+
+	share_release_fn release;
+	void *data;
+};
+
+/* publisher side */
+struct share_t *share_open(const char *path, share_release_fn release, void *data);
+int share_pollfds(struct share_t *sh, struct pollfd *fds);
+void share_handle(struct share_t *sh, struct pollfd *fds, int nfds);
+int share_publish(struct share_t *sh, const struct share_frame *frame, int dmabuf_fd);
+int share_held(struct share_t *sh, int stream, int index);
+void share_close(struct share_t *sh, const char *path);
+
+/* subscriber side */
+int share_connect(const char *path);
+int share_recv(int fd, struct share_frame *frame, int *dmabuf_fd);
+int share_release(int fd, const struct share_frame *frame);
@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "videodev2.h"
+#include "record.h"
+#include "sink.h"
+#include "copy.h"
+
+#define ALIGN(x, a)	(((x) + (a) - 1) / (a) * (a))
+/* user_data of the fallocates, writes are their slot number */
+#define SINK_FALLOCATE	SINK_DEPTH
+
+static int sink_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sink_enter(int fd, unsigned int submit, unsigned int complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+/* the next free SQE, only the kernel's once sink_push() moved the tail past it */
+static struct io_uring_sqe *sink_sqe(struct sink_t *s)
+{
+	unsigned int tail = *s->sq_tail;
+	struct io_uring_sqe *sqe = &s->sqes[tail & *s->sq_mask];
+
+	memset(sqe, 0, sizeof(*sqe));
+	s->sq_array[tail & *s->sq_mask] = tail & *s->sq_mask;
+	return sqe;
+}
+
+static void sink_push(struct sink_t *s)
+{
+	__atomic_store_n(s->sq_tail, *s->sq_tail + 1, __ATOMIC_RELEASE);
+	s->sqes_pending++;
+}
+
+static int sink_submit(struct sink_t *s)
+{
+	int ret;
+
+	while (s->sqes_pending) {
+		ret = sink_enter(s->ring_fd, s->sqes_pending, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* out of completion space, reaping makes room */
+			if (errno == EAGAIN || errno == EBUSY)
+				return 0;
+			perror("sink: io_uring_enter");
+			return -1;
+		}
+		s->sqes_pending -= ret;
+	}
+	s->inflight += s->pending;
+	s->pending = 0;
+	return 0;
+}
+
+static void sink_prep_write(struct sink_t *s, int w)
+{
+	struct io_uring_sqe *sqe = sink_sqe(s);
+
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = s->fd;
+	sqe->off = s->writes[w].offset;
+	sqe->addr = (uintptr_t)s->writes[w].iov;
+	sqe->len = 2;
+	sqe->user_data = w;
+	sink_push(s);
+}
+
+/* a segment ahead of the writes, so they land in allocated space */
+static void sink_reserve(struct sink_t *s)
+{
+	struct io_uring_sqe *sqe;
+
+	if (s->end + SINK_SEGMENT / 2 < s->allocated)
+		return;
+
+	sqe = sink_sqe(s);
+	sqe->opcode = IORING_OP_FALLOCATE;
+	sqe->fd = s->fd;
+	sqe->off = s->allocated;
+	sqe->addr = SINK_SEGMENT;	/* length */
+	sqe->len = 0;			/* mode */
+	sqe->user_data = SINK_FALLOCATE;
+	sink_push(s);
+	s->allocated += SINK_SEGMENT;
+}
+
+static int sink_bounce(struct sink_t *s, size_t size)
+{
+	int b;
+
+	if (!s->free_bounces)
+		return -1;
+	b = ffs(s->free_bounces) - 1;
+	if (size > s->bounce_size) {
+		/* frames grew, all bounce buffers go */
+		if (s->free_bounces != (1u << SINK_BOUNCE) - 1)
+			return -1;
+		for (b = 0; b < SINK_BOUNCE; b++) {
+			free(s->bounces[b]);
+			s->bounces[b] = NULL;
+		}
+		s->bounce_size = size;
+		b = 0;
+	}
+	if (!s->bounces[b] && posix_memalign((void **)&s->bounces[b], s->page, s->bounce_size))
+		return -1;
+	s->free_bounces &= ~(1u << b);
+	return b;
+}
+
+static void sink_release(struct sink_t *s, struct sink_write *wr)
+{
+	if (wr->bounce >= 0) {
+		s->free_bounces |= 1u << wr->bounce;
+		wr->bounce = -1;
+	}
+	if (wr->index >= 0) {
+		s->held &= ~(1u << wr->index);
+		s->release(s->stream, wr->index, s->data);
+		wr->index = -1;
+	}
+}
+
+static void sink_complete(struct sink_t *s, int w, int res)
+{
+	struct sink_write *wr = &s->writes[w];
+	size_t len = wr->iov[0].iov_len + wr->iov[1].iov_len;
+	int b;
+
+	s->inflight--;
+
+	if (res == -EFAULT && wr->bounce < 0) {
+		if (!s->bouncing)
+			fprintf(stderr, "sink: stream %d buffers can't do direct I/O, copying them\n", s->stream);
+		s->bouncing = 1;
+
+		/* the buffer is still held, the frame goes again from a copy */
+		b = sink_bounce(s, wr->iov[1].iov_len);
+		if (b >= 0) {
+			copy_frame(NULL, s->bounces[b], 0, wr->iov[1].iov_base, 0, s->index[wr->frame].bytes, 1);
+			wr->iov[1].iov_base = s->bounces[b];
+			sink_release(s, wr);
+			wr->bounce = b;
+			sink_prep_write(s, w);
+			s->pending++;
+			sink_submit(s);
+			return;
+		}
+		s->index[wr->frame].magic = 0;
+		s->skipped++;
+	} else if (res < 0 || (size_t)res != len) {
+		fprintf(stderr, "sink: stream %d write failed: %s\n", s->stream,
+			res < 0 ? strerror(-res) : "short write");
+		s->failed = 1;
+	}
+
+	sink_release(s, wr);
+	s->free_writes |= 1u << w;
+}
+
+void sink_handle(struct sink_t *s)
+{
+	unsigned int head = *s->cq_head;
+	struct io_uring_cqe *cqe;
+
+	while (head != __atomic_load_n(s->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &s->cqes[head & *s->cq_mask];
+		/* a filesystem without fallocate still takes the writes */
+		if (cqe->user_data != SINK_FALLOCATE)
+			sink_complete(s, cqe->user_data, cqe->res);
+		head++;
+		__atomic_store_n(s->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+int sink_write(struct sink_t *s, int index, const struct v4l2_pix_format_mplane *pix,
+	       const struct v4l2_buffer *buf, const void *data, int spare)
+{
+	uint32_t bytes = pix->plane_fmt[0].sizeimage;
+	uint64_t len = ALIGN((uint64_t)bytes, s->page);
+	struct record_entry *e;
+	struct sink_write *wr;
+	uint8_t *page;
+	int w, b = -1;
+
+	if (s->failed)
+		return -1;
+
+	/* the disk can't keep up, the display shouldn't notice */
+	if (!s->free_writes) {
+		s->skipped++;
+		return 0;
+	}
+	if (s->bouncing) {
+		b = sink_bounce(s, len);
+		if (b < 0) {
+			s->skipped++;
+			return 0;
+		}
+		copy_frame(NULL, s->bounces[b], 0, data, 0, bytes, 1);
+	}
+
+	if (s->frames == s->capacity) {
+		uint64_t capacity = s->capacity ? s->capacity * 2 : 1024;
+		struct record_entry *grown = realloc(s->index, capacity * sizeof(*grown));
+
+		if (!grown)
+			return -1;
+		s->index = grown;
+		s->capacity = capacity;
+	}
+
+	e = &s->index[s->frames];
+	memset(e, 0, sizeof(*e));
+	e->magic = RECORD_ENTRY_MAGIC;
+	e->sequence = buf->sequence;
+	e->timestamp = buf->timestamp.tv_sec * 1000000000ULL + buf->timestamp.tv_usec * 1000ULL;
+	e->offset = s->end + s->page;
+	e->bytes = bytes;
+	e->fourcc = pix->pixelformat;
+	e->width = pix->width;
+	e->height = pix->height;
+	e->pitch = pix->plane_fmt[0].bytesperline;
+	e->colorspace = pix->colorspace;
+	e->ycbcr_enc = pix->ycbcr_enc;
+	e->quantization = pix->quantization;
+	e->xfer_func = pix->xfer_func;
+
+	w = ffs(s->free_writes) - 1;
+	s->free_writes &= ~(1u << w);
+	page = s->entries + (size_t)w * s->page;
+	memset(page, 0, s->page);
+	memcpy(page, e, sizeof(*e));
+
+	/* whole pages of the buffer, dumb buffers are allocated in pages */
+	wr = &s->writes[w];
+	wr->index = b < 0 ? index : -1;
+	wr->bounce = b;
+	wr->frame = s->frames;
+	wr->offset = s->end;
+	wr->iov[0].iov_base = page;
+	wr->iov[0].iov_len = s->page;
+	wr->iov[1].iov_base = b < 0 ? (void *)data : s->bounces[b];
+	wr->iov[1].iov_len = len;
+	if (b < 0)
+		s->held |= 1u << index;
+
+	sink_prep_write(s, w);
+	s->frames++;
+	s->end += s->page + len;
+	s->pending++;
+	sink_reserve(s);
+
+	if ((s->pending >= SINK_BATCH || __builtin_popcount(s->held) >= spare)
+	    && sink_submit(s) < 0)
+		s->failed = 1;
+	return b < 0;
+}
+
+int sink_held(struct sink_t *s, int index)
+{
+	return !!(s->held & (1u << index));
+}
+
+int sink_fd(struct sink_t *s)
+{
+	return s->ring_fd;
+}
+
+static int sink_map(struct sink_t *s, const struct io_uring_params *p)
+{
+	s->sq_map_len = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	s->cq_map_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	s->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	s->sq_map = mmap(NULL, s->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 s->ring_fd, IORING_OFF_SQ_RING);
+	s->cq_map = mmap(NULL, s->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 s->ring_fd, IORING_OFF_CQ_RING);
+	s->sqes = mmap(NULL, s->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       s->ring_fd, IORING_OFF_SQES);
+	if (s->sq_map == MAP_FAILED || s->cq_map == MAP_FAILED || s->sqes == MAP_FAILED)
+		return -1;
+
+	s->sq_head = (unsigned int *)((uint8_t *)s->sq_map + p->sq_off.head);
+	s->sq_tail = (unsigned int *)((uint8_t *)s->sq_map + p->sq_off.tail);
+	s->sq_mask = (unsigned int *)((uint8_t *)s->sq_map + p->sq_off.ring_mask);
+	s->sq_array = (unsigned int *)((uint8_t *)s->sq_map + p->sq_off.array);
+	s->cq_head = (unsigned int *)((uint8_t *)s->cq_map + p->cq_off.head);
+	s->cq_tail = (unsigned int *)((uint8_t *)s->cq_map + p->cq_off.tail);
+	s->cq_mask = (unsigned int *)((uint8_t *)s->cq_map + p->cq_off.ring_mask);
+	s->cqes = (struct io_uring_cqe *)((uint8_t *)s->cq_map + p->cq_off.cqes);
+	return 0;
+}
+
+static void sink_free(struct sink_t *s)
+{
+	int i;
+
+	if (s->sq_map && s->sq_map != MAP_FAILED)
+		munmap(s->sq_map, s->sq_map_len);
+	if (s->cq_map && s->cq_map != MAP_FAILED)
+		munmap(s->cq_map, s->cq_map_len);
+	if (s->sqes && s->sqes != MAP_FAILED)
+		munmap(s->sqes, s->sqes_len);
+	if (s->ring_fd >= 0)
+		close(s->ring_fd);
+	if (s->fd >= 0)
+		close(s->fd);
+	for (i = 0; i < SINK_BOUNCE; i++)
+		free(s->bounces[i]);
+	free(s->entries);
+	free(s->index);
+	free(s);
+}
+
+/* the header at the start of the file, through an aligned page as O_DIRECT wants */
+static int sink_header(struct sink_t *s, uint64_t frames, uint64_t index_offset)
+{
+	struct record_header *hdr = (struct record_header *)s->entries;
+
+	memset(s->entries, 0, s->page);
+	memcpy(hdr->magic, RECORD_MAGIC, sizeof(hdr->magic));
+	hdr->version = RECORD_VERSION;
+	hdr->page = s->page;
+	hdr->frames = frames;
+	hdr->index_offset = index_offset;
+	return pwrite(s->fd, s->entries, s->page, 0) == (ssize_t)s->page ? 0 : -1;
+}
+
+struct sink_t *sink_open(const char *path, int stream, sink_release_fn release, void *data)
+{
+	struct io_uring_params params;
+	struct sink_t *s;
+	int i;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->ring_fd = -1;
+	s->stream = stream;
+	s->release = release;
+	s->data = data;
+	s->page = sysconf(_SC_PAGESIZE);
+	s->free_writes = (1u << SINK_DEPTH) - 1;
+	s->free_bounces = (1u << SINK_BOUNCE) - 1;
+	for (i = 0; i < SINK_DEPTH; i++)
+		s->writes[i].index = s->writes[i].bounce = -1;
+
+	s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT | O_CLOEXEC, 0644);
+	if (s->fd < 0) {
+		fprintf(stderr, "sink: no direct I/O to %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	memset(&params, 0, sizeof(params));
+	s->ring_fd = sink_setup(SINK_DEPTH * 2, &params);
+	if (s->ring_fd < 0) {
+		fprintf(stderr, "sink: no io_uring: %s\n", strerror(errno));
+		goto fail;
+	}
+	if (sink_map(s, &params) < 0) {
+		perror("sink: mapping the rings");
+		goto fail;
+	}
+
+	if (posix_memalign((void **)&s->entries, s->page, (size_t)SINK_DEPTH * s->page)) {
+		s->entries = NULL;
+		goto fail;
+	}
+	/* without an index until closed, like record_open() */
+	if (sink_header(s, 0, 0) < 0) {
+		fprintf(stderr, "sink: cannot write %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	s->end = s->page;
+
+	/* the first segment now, the next ones ahead of the writes */
+	fallocate(s->fd, 0, 0, SINK_SEGMENT);
+	s->allocated = SINK_SEGMENT;
+	return s;
+
+fail:
+	sink_free(s);
+	return NULL;
+}
+
+void sink_close(struct sink_t *s)
+{
+	uint8_t *index = NULL;
+	size_t len = 0, aligned;
+	uint64_t i, frames = 0;
+
+	sink_submit(s);
+	while (s->inflight) {
+		if (sink_enter(s->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+			break;
+		sink_handle(s);
+	}
+
+	/* frames that never made it to the disk don't get an entry */
+	for (i = 0; i < s->frames; i++)
+		if (s->index[i].magic == RECORD_ENTRY_MAGIC)
+			s->index[frames++] = s->index[i];
+	len = frames * sizeof(*s->index);
+	aligned = ALIGN(len, s->page);
+
+	if (aligned && posix_memalign((void **)&index, s->page, aligned) == 0) {
+		memset(index + len, 0, aligned - len);
+		memcpy(index, s->index, len);
+	}
+	if ((aligned && (!index || pwrite(s->fd, index, aligned, s->end) != (ssize_t)aligned))
+	    || ftruncate(s->fd, s->end + len) < 0
+	    || fdatasync(s->fd) < 0
+	    || sink_header(s, frames, s->end) < 0)
+		perror("sink: cannot write the index");
+	else
+		printf("sink: stream %d, %llu frames recorded, %u left out\n", s->stream,
+		       (unsigned long long)frames, s->skipped);
+
+	free(index);
+	sink_free(s);
+}
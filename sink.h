@@ -0,0 +1,92 @@
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Recording sink that writes the captured buffers themselves: O_DIRECT
+ * writes through io_uring, straight from the buffer to the disk with
+ * no copy and no page cache. A buffer stays held until its write
+ * completes, then goes back through the release callback. The file
+ * layout is record.h's, replay plays it back the same way.
+ *
+ * Writes are batched, several frames to one io_uring_enter, but never
+ * so many held back that capture would run out of buffers. Space is
+ * allocated a segment ahead, with the fallocate riding along in the
+ * ring as well.
+ *
+ * Buffers that can't be the source of direct I/O (some drivers' mmaps
+ * are not backed by pages the block layer can pin) show up as EFAULT
+ * on the first write. From then on frames are copied into aligned
+ * bounce buffers and released right away; with none free a frame is
+ * left out of the recording rather than held up.
+ *
+ * Needs videodev2.h and record.h included first.
+ */
+
+#define SINK_DEPTH	16	/* writes in flight */
+#define SINK_BATCH	4	/* frames per submission */
+#define SINK_SEGMENT	(256ULL << 20)
+#define SINK_BOUNCE	4
+
+typedef void (*sink_release_fn)(int stream, int index, void *data);
+
+struct sink_write {
+	int index;		/* capture buffer, -1 for a bounce */
+	int bounce;		/* bounce buffer, -1 for none */
+	struct iovec iov[2];	/* the entry page, the frame */
+	uint64_t offset;
+	uint64_t frame;		/* its entry in the index */
+};
+
+struct sink_t {
+	int fd;			/* the recording, O_DIRECT */
+	int ring_fd;
+	int stream;
+	sink_release_fn release;
+	void *data;
+
+	/* rings as the kernel shares them */
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+
+	uint32_t page;
+	uint64_t end;		/* where the next slot goes */
+	uint64_t allocated;	/* fallocated, or asked to be */
+	struct record_entry *index;
+	uint64_t frames, capacity;
+
+	uint8_t *entries;	/* a page per write slot */
+	struct sink_write writes[SINK_DEPTH];
+	uint32_t free_writes;	/* bit per free slot */
+	unsigned int pending;	/* frames prepared, not submitted */
+	unsigned int sqes_pending;
+	unsigned int inflight;
+	int failed;
+	uint32_t held;		/* capture buffers in writes */
+
+	int bouncing;
+	uint8_t *bounces[SINK_BOUNCE];
+	size_t bounce_size;
+	uint32_t free_bounces;
+	unsigned int skipped;	/* frames left out, nothing to write them from */
+};
+
+/* NULL when the file or the kernel can't do direct I/O through io_uring */
+struct sink_t *sink_open(const char *path, int stream, sink_release_fn release, void *data);
+/*
+ * Returns 1 with the buffer held, 0 when it can be requeued right
+ * away, -1 when the recording failed. spare is how many of the
+ * stream's buffers capture can do without.
+ */
+int sink_write(struct sink_t *s, int index, const struct v4l2_pix_format_mplane *pix,
+	       const struct v4l2_buffer *buf, const void *data, int spare);
+int sink_held(struct sink_t *s, int index);
+/* readable when writes completed */
+int sink_fd(struct sink_t *s);
+void sink_handle(struct sink_t *s);
+/* waits for all writes, releases their buffers, writes the index */
+void sink_close(struct sink_t *s);
@@ -0,0 +1,271 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+/* a reader gives up on a publisher that never stops writing */
+#define STATS_READ_TRIES	1000
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Below STATS_SUB a bucket per value, above it STATS_SUB buckets per power of two */
+static unsigned int stats_bucket(uint64_t v)
+{
+	unsigned int shift;
+
+	if (v >= 1ULL << STATS_MAX_BITS)
+		v = (1ULL << STATS_MAX_BITS) - 1;
+	if (v < STATS_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - STATS_SUB_BITS;
+	return ((shift + 1) << STATS_SUB_BITS) + (v >> shift) - STATS_SUB;
+}
+
+uint64_t stats_bucket_value(unsigned int i)
+{
+	if (i < STATS_SUB)
+		return i;
+	return (uint64_t)((i & (STATS_SUB - 1)) + STATS_SUB) << ((i >> STATS_SUB_BITS) - 1);
+}
+
+void stats_add(struct stats_hist *h, uint64_t ns)
+{
+	if (!h->count || ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+	h->count++;
+	h->sum += ns;
+	h->buckets[stats_bucket(ns)]++;
+}
+
+/* The top of the bucket it falls in, kept within what was seen */
+uint64_t stats_quantile(const struct stats_hist *h, double q)
+{
+	uint64_t want, seen = 0, v;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+	want = q * h->count;
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= want)
+			break;
+	}
+	v = i + 1 < STATS_BUCKETS ? stats_bucket_value(i + 1) - 1 : h->max;
+	if (v > h->max)
+		v = h->max;
+	if (v < h->min)
+		v = h->min;
+	return v;
+}
+
+struct stats_t *stats_open(const char *name)
+{
+	struct stats_t *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	snprintf(s->name, sizeof(s->name), "%s", name);
+
+	s->fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (s->fd < 0) {
+		fprintf(stderr, "stats: cannot create %s: %s\n", name, strerror(errno));
+		free(s);
+		return NULL;
+	}
+	if (ftruncate(s->fd, sizeof(*s->shm)) < 0) {
+		fprintf(stderr, "stats: cannot size %s: %s\n", name, strerror(errno));
+		goto fail;
+	}
+	s->shm = mmap(NULL, sizeof(*s->shm), PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+	if (s->shm == MAP_FAILED) {
+		fprintf(stderr, "stats: cannot map %s: %s\n", name, strerror(errno));
+		goto fail;
+	}
+
+	/* the magic last, a reader checks it before anything else */
+	s->shm->version = STATS_VERSION;
+	s->shm->streams = STATS_STREAMS;
+	s->shm->spans = STATS_SPANS;
+	s->shm->buckets = STATS_BUCKETS;
+	s->shm->sub_bits = STATS_SUB_BITS;
+	s->shm->pid = getpid();
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(s->shm->magic, STATS_MAGIC, sizeof(s->shm->magic));
+
+	printf("stats: publishing frame timing in %s\n", name);
+	return s;
+
+fail:
+	close(s->fd);
+	shm_unlink(name);
+	free(s);
+	return NULL;
+}
+
+void stats_close(struct stats_t *s)
+{
+	munmap(s->shm, sizeof(*s->shm));
+	close(s->fd);
+	shm_unlink(s->name);
+	free(s);
+}
+
+void stats_dequeue(struct stats_t *s, int stream, int index, uint64_t captured, uint32_t sequence, uint64_t now)
+{
+	struct stats_frame *f = &s->frame[stream][index];
+
+	s->frames[stream]++;
+	if (s->sequenced[stream] && sequence - s->sequence[stream] > 1)
+		s->drops[stream] += sequence - s->sequence[stream] - 1;
+	s->sequence[stream] = sequence;
+	s->sequenced[stream] = 1;
+
+	f->captured = captured <= now ? captured : 0;
+	f->dequeued = now;
+	f->submitted = 0;
+	if (f->captured)
+		stats_add(&s->hist[stream][STATS_CAPTURE_DEQUEUE], now - f->captured);
+}
+
+void stats_submit(struct stats_t *s, int stream, int index, uint64_t now)
+{
+	struct stats_frame *f = &s->frame[stream][index];
+
+	if (!f->dequeued)
+		return;
+	f->submitted = now;
+	stats_add(&s->hist[stream][STATS_DEQUEUE_SUBMIT], now - f->dequeued);
+
+	/* a frame replaced before the vblank never showed, the later one counts */
+	s->flip[stream] = *f;
+	s->flip_pending[stream] = 1;
+}
+
+void stats_flip(struct stats_t *s, int stream, uint64_t when)
+{
+	struct stats_frame *f = &s->flip[stream];
+
+	if (!s->flip_pending[stream] || when < f->submitted)
+		return;
+	s->flip_pending[stream] = 0;
+	s->shown[stream]++;
+	stats_add(&s->hist[stream][STATS_SUBMIT_FLIP], when - f->submitted);
+	if (f->captured)
+		stats_add(&s->hist[stream][STATS_CAPTURE_FLIP], when - f->captured);
+}
+
+void stats_requeue(struct stats_t *s, int stream, int index, uint64_t now)
+{
+	struct stats_frame *f = &s->frame[stream][index];
+
+	if (!f->dequeued)
+		return;
+	stats_add(&s->hist[stream][STATS_DEQUEUE_REQUEUE], now - f->dequeued);
+	f->dequeued = 0;
+}
+
+void stats_buffers(struct stats_t *s, int stream, const uint32_t *counts)
+{
+	memcpy(s->buffers[stream], counts, sizeof(s->buffers[stream]));
+}
+
+void stats_calls(struct stats_t *s, const struct stats_call *calls)
+{
+	s->calls = calls;
+}
+
+/*
+ * The seqlock's write side: odd while the copy is going on, the next
+ * even number once it is done. There is only ever one writer.
+ */
+void stats_publish(struct stats_t *s, uint64_t now)
+{
+	struct stats_shm *shm = s->shm;
+	uint32_t seq;
+
+	seq = shm->seq;
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	shm->published = now;
+	memcpy(shm->frames, s->frames, sizeof(shm->frames));
+	memcpy(shm->drops, s->drops, sizeof(shm->drops));
+	memcpy(shm->shown, s->shown, sizeof(shm->shown));
+	memcpy(shm->buffers, s->buffers, sizeof(shm->buffers));
+	memcpy(shm->hist, s->hist, sizeof(shm->hist));
+	if (s->calls)
+		memcpy(shm->calls, s->calls, sizeof(shm->calls));
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+const struct stats_shm *stats_attach(const char *name)
+{
+	const struct stats_shm *shm;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "stats: cannot open %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		fprintf(stderr, "stats: cannot map %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+
+	if (memcmp(shm->magic, STATS_MAGIC, sizeof(shm->magic)) || shm->version != STATS_VERSION
+	    || shm->streams != STATS_STREAMS || shm->spans != STATS_SPANS
+	    || shm->buckets != STATS_BUCKETS || shm->sub_bits != STATS_SUB_BITS) {
+		fprintf(stderr, "stats: %s is not what this reader understands\n", name);
+		stats_detach(shm);
+		return NULL;
+	}
+	return shm;
+}
+
+void stats_detach(const struct stats_shm *shm)
+{
+	munmap((void *)shm, sizeof(*shm));
+}
+
+/* The read side: copy, and keep the copy only if no publish started or ran meanwhile */
+int stats_read(const struct stats_shm *shm, struct stats_shm *out)
+{
+	uint32_t seq;
+	int tries;
+
+	for (tries = 0; tries < STATS_READ_TRIES; tries++) {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(out, shm, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -1;
+}
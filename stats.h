@@ -0,0 +1,138 @@
+
+#include <stdint.h>
+
+/*
+ * Per-stage frame timing. Every frame is timestamped as it goes:
+ * captured (the driver's timestamp), dequeued, submitted to the plane,
+ * flipped (the vblank after the submit) and requeued. The spans between
+ * them go into histograms per stream, updated from the main loop with
+ * plain stores, nothing shared and nothing locked.
+ *
+ * The histograms are HDR style: fixed buckets, a power of two split
+ * into STATS_SUB sub-buckets, so anything from a nanosecond to a
+ * minute is kept to within 1/STATS_SUB of its value in a few KiB.
+ *
+ * Every STATS_PUBLISH_MS or so a snapshot is copied into a POSIX shared
+ * memory segment under a seqlock. A reader (stats_read()) retries
+ * while the sequence is odd or moved under it; the publisher never
+ * waits for anyone.
+ */
+
+#define STATS_MAGIC		"V4L2STA1"
+#define STATS_VERSION		1
+#define STATS_STREAMS		2
+#define STATS_MAX_BUFFERS	32
+#define STATS_SUB_BITS		4
+#define STATS_SUB		(1 << STATS_SUB_BITS)
+/* values up to 2^STATS_MAX_BITS ns, about 68 s; larger ones count as that */
+#define STATS_MAX_BITS		36
+#define STATS_BUCKETS		((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+#define STATS_PUBLISH_MS	100
+/* ioctl request codes timed, see trace.h */
+#define STATS_CALLS		32
+
+/*
+ * Who has a stream's buffers. The buffer on screen may be queued again
+ * while the plane still reads it; it then counts as DRIVER, SCANOUT is
+ * only for one kept out of the queue while it is shown.
+ */
+enum stats_owner {
+	STATS_OWNER_DRIVER,	/* queued, or being filled */
+	STATS_OWNER_SCANOUT,	/* on screen and not queued */
+	STATS_OWNER_SHARE,	/* with subscribers */
+	STATS_OWNER_SINK,	/* being written to disk */
+	STATS_OWNER_PARKED,	/* retired, not in rotation */
+	STATS_OWNERS
+};
+
+enum stats_span {
+	STATS_CAPTURE_DEQUEUE,	/* in the driver's queue */
+	STATS_DEQUEUE_SUBMIT,	/* converting, scaling, committing */
+	STATS_SUBMIT_FLIP,	/* waiting for the vblank */
+	STATS_CAPTURE_FLIP,	/* all of it, glass to glass but for the sensor */
+	STATS_DEQUEUE_REQUEUE,	/* the buffer away from the driver */
+	STATS_SPANS
+};
+
+struct stats_hist {
+	uint64_t count;
+	uint64_t sum;		/* ns */
+	uint64_t min, max;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+/* one ioctl request code */
+struct stats_call {
+	uint32_t code;		/* 0 for an unused slot */
+	char name[36];
+	struct stats_hist hist;
+};
+
+/* the shared memory segment */
+struct stats_shm {
+	char magic[8];
+	uint32_t version;
+	uint32_t seq;		/* odd while a snapshot is being written */
+	uint32_t streams, spans, buckets, sub_bits;
+	int32_t pid;		/* of the publisher */
+	uint32_t reserved;
+	uint64_t published;	/* ns, CLOCK_MONOTONIC */
+	uint64_t frames[STATS_STREAMS];	/* dequeued */
+	uint64_t drops[STATS_STREAMS];	/* skipped by the driver */
+	uint64_t shown[STATS_STREAMS];	/* made it to a vblank */
+	uint32_t buffers[STATS_STREAMS][STATS_OWNERS];
+	struct stats_hist hist[STATS_STREAMS][STATS_SPANS];
+	struct stats_call calls[STATS_CALLS];	/* all 0 without ioctl timing */
+};
+
+/* a frame on its way, times in ns */
+struct stats_frame {
+	uint64_t captured;	/* 0 when the driver's clock isn't ours */
+	uint64_t dequeued;
+	uint64_t submitted;
+};
+
+struct stats_t {
+	int fd;
+	char name[64];
+	struct stats_shm *shm;
+	/* what the hot path updates, copied out on publishing */
+	uint64_t frames[STATS_STREAMS];
+	uint64_t drops[STATS_STREAMS];
+	uint64_t shown[STATS_STREAMS];
+	uint32_t buffers[STATS_STREAMS][STATS_OWNERS];
+	uint32_t sequence[STATS_STREAMS];
+	int sequenced[STATS_STREAMS];
+	struct stats_hist hist[STATS_STREAMS][STATS_SPANS];
+	struct stats_frame frame[STATS_STREAMS][STATS_MAX_BUFFERS];
+	struct stats_frame flip[STATS_STREAMS];	/* submitted, waiting for the vblank */
+	int flip_pending[STATS_STREAMS];
+	const struct stats_call *calls;	/* STATS_CALLS of them, published as they are */
+};
+
+/* publisher side, name as for shm_open(): "/something" */
+struct stats_t *stats_open(const char *name);
+void stats_close(struct stats_t *s);
+uint64_t stats_now(void);
+void stats_add(struct stats_hist *h, uint64_t ns);
+/* the frame stages, now is stats_now(); captured 0 when not on our clock */
+void stats_dequeue(struct stats_t *s, int stream, int index, uint64_t captured, uint32_t sequence, uint64_t now);
+void stats_submit(struct stats_t *s, int stream, int index, uint64_t now);
+/* the vblank after the submits, in ns of the same clock */
+void stats_flip(struct stats_t *s, int stream, uint64_t when);
+void stats_requeue(struct stats_t *s, int stream, int index, uint64_t now);
+/* how many of the stream's buffers each owner has, counts[STATS_OWNERS] */
+void stats_buffers(struct stats_t *s, int stream, const uint32_t *counts);
+/* ioctl timing to publish along, NULL for none */
+void stats_calls(struct stats_t *s, const struct stats_call *calls);
+/* a snapshot of everything into the shared memory */
+void stats_publish(struct stats_t *s, uint64_t now);
+
+/* reader side */
+const struct stats_shm *stats_attach(const char *name);
+void stats_detach(const struct stats_shm *shm);
+/* a consistent copy, -1 if the publisher kept writing */
+int stats_read(const struct stats_shm *shm, struct stats_shm *out);
+/* the smallest value of bucket i, and the value below which a fraction q of the counts are */
+uint64_t stats_bucket_value(unsigned int i);
+uint64_t stats_quantile(const struct stats_hist *h, double q);
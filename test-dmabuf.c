@@ -3,15 +3,109 @@
 #include <poll.h>
 #include <stdio.h>
 #include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/prctl.h>
 
 #include "videodev2.h"
 #include "drm.h"
 #include "v4l2.h"
+#include "share.h"
+#include "convert.h"
+#include "copy.h"
+#include "compose.h"
+#include "scale.h"
+#include "layout.h"
+#include "view.h"
+#include "rotate.h"
+#include "hud.h"
+#include "record.h"
+#include "sink.h"
+#include "stats.h"
+#include "probe.h"
 #include <time.h>
+#include <drm_fourcc.h>
 
 static const char *dri_path = "/dev/dri/card0";
 static char v4l2_path[2][128];
-static int next_buffer_index = -1;
+static const char *share_path;
+static struct share_t *share;
+static struct v4l2_format v4l2_fmt[2];
+/* every captured frame appended to a file, for replay */
+static char record_path[2][512];
+static struct sink_t *sink[2];
+/* when the file can't take direct I/O */
+static struct record_t *recorder[2];
+/* buffers per stream, 0 sizes the stream automatically */
+static int bufcount[2] = { BUFCOUNT, BUFCOUNT };
+static struct v4l2_bufctl bufctl[2];
+static uint32_t parked[2];
+/* colorimetry for streams the plane takes as RGB only */
+static enum convert_matrix cvt_matrix[2];
+static enum convert_range cvt_range[2];
+/* all streams drawn into one plane, when there aren't enough planes */
+static struct compose_t *compose;
+static int compose_layer[2];
+/* software downscale for planes that can't scale, set up on first refusal */
+static struct scale_t *scaler[2];
+static struct copy_pool_t *scale_pool;
+
+/* where each stream goes on screen: its cell in the layout, aspect kept */
+static struct layout_t layout;
+static struct layout_rect stream_rect[2];
+/* last frame put on screen, shown again when only the layout changes */
+static int shown[2] = { -1, -1 };
+/* the part of each frame on screen, moved per vblank while animating */
+static struct view_t view[2];
+static int vblank_pending;
+/* orientation as plane rotation bits, turned in software when the plane can't */
+static uint32_t rotation[2] = { DRM_MODE_ROTATE_0, DRM_MODE_ROTATE_0 };
+static int rot_soft[2];
+/* cached RGB copy of the frame, when the software turn needs one */
+static struct convert_frame rot_rgb[2];
+/* vblanks a zoom or pan takes */
+#define VIEW_ANIMATE_STEPS	30
+/* correction on the CRTC, after the planes are blended */
+static double white_balance[3] = { 1.0, 1.0, 1.0 };
+static double display_gamma = 1.0;
+/* plane blending per stream: zpos -1 follows the layout, blend -1 leaves the plane's */
+static int64_t plane_zpos[2] = { -1, -1 };
+static double plane_alpha[2] = { 1.0, 1.0 };
+static int plane_blend[2] = { -1, -1 };
+static int plane_dirty[2];	/* to go with the next frame */
+
+/* on-screen diagnostics, redrawn this often at most */
+#define HUD_REFRESH_MS	250
+static struct hud_t *hud;
+static uint64_t hud_shown;	/* ms */
+/* counted since the HUD was last redrawn, but for drops */
+struct stream_stats {
+	unsigned int frames, timed;
+	uint64_t latency_us;	/* capture to plane update, summed over timed frames */
+	unsigned int drops;	/* sequence gaps, since start */
+	uint32_t sequence;
+	int sequenced;
+};
+static struct stream_stats stats[2];
+/* per-stage timing histograms, published in shared memory for a monitor */
+static const char *timing_name;
+static struct stats_t *timing;
+static uint64_t timing_published;	/* ms */
+/* the frame last committed per stream, until a vblank shows it: for the flip probe */
+static struct {
+	int pending;
+	uint32_t index, sequence;
+	uint64_t captured;
+} flipping[2];
+
+/* a stream without frames for this long is restarted */
+#define STREAM_STALL_MS	2000
+/* how often a lost camera is looked for again */
+#define STREAM_RETRY_MS	500
+
+static uint64_t last_frame[2];	/* ms, last dequeue or (re)start */
+static uint64_t retry_at[2];	/* ms, next reopen while the stream is down, never once it ended */
+static int next_buffer_index[2] = { -1, -1 };	/* last frame dequeued, per stream */
 static int curr_buffer_index = 0;
 
 static void page_flip_handler(int fd, unsigned int frame,
@@ -23,18 +117,1457 @@ static void page_flip_handler(int fd, unsigned int frame,
 	/* If we have a next buffer, then let's return the current one,
 	 * and grab the next one.
 	 */
-	if (next_buffer_index > 0) {
+	if (next_buffer_index[1] > 0) {
 //		v4l2_queue_buffer(dev->v4l2_fd, curr_buffer_index, dev->bufs[curr_buffer_index].dmabuf_fd);
 //		v4l2_queue_buffer(dev->v4l2_fd, curr_buffer_index, dev->plane1bufs[curr_buffer_index].dmabuf_fd);		
-		curr_buffer_index = next_buffer_index;
-		next_buffer_index = -1;
+		curr_buffer_index = next_buffer_index[1];
+		next_buffer_index[1] = -1;
+
+	}
+
+	TRACE_CALL(DRM_IOCTL_MODE_PAGE_FLIP,
+		   drmModePageFlip(fd, dev->crtc_id, dev->plane1bufs[curr_buffer_index].fb_id,
+				   DRM_MODE_PAGE_FLIP_EVENT, dev));
+}
+
+
+/*
+ * Buffers past bufctl.active are retired: they are parked as they come
+ * back instead of being queued. Once all of them are parked they are
+ * freed, if the kernel can remove buffers from a streaming queue;
+ * otherwise they stay parked for the next grow.
+ */
+static void stream_park(struct drm_dev_t *dev, int stream, int index)
+{
+	int active = bufctl[stream].active;
+	int count = dev->nbufs[stream];
+	uint32_t retired = ((1u << count) - 1) & ~((1u << active) - 1);
+
+	parked[stream] |= 1u << index;
+	if ((parked[stream] & retired) != retired)
+		return;
+
+	if (v4l2_remove_buffers(dev->v4l2_fd[stream], active, stream) == 0) {
+		drm_remove_buffers(dev->drm_fd, dev, stream, count - active);
+		parked[stream] &= ~retired;
+	}
+	printf("stream %d: shrunk to %d buffers (%d allocated)\n", stream, active, dev->nbufs[stream]);
+}
+
+static void stream_requeue(struct drm_dev_t *dev, int stream, int index)
+{
+	struct drm_buffer_t *bufs = stream ? dev->plane1bufs : dev->bufs;
+
+	/* a restarting stream queues its buffers when it comes back */
+	if (dev->v4l2_fd[stream] < 0 || index < 0 || index >= dev->nbufs[stream])
+		return;
+	/* held through a format change, it takes the new one now */
+	drm_refit_buffer(dev->drm_fd, dev, stream, index, 1, 1);
+	if (timing)
+		stats_requeue(timing, stream, index, stats_now());
+	if (index >= bufctl[stream].active) {
+		stream_park(dev, stream, index);
+		return;
+	}
+	v4l2_queue_buffer(dev->v4l2_fd[stream], index, bufs[index].dmabuf_fd, stream);
+}
+
+/* One more buffer in rotation: unpark a retired one or allocate a new one */
+static void stream_grow(struct drm_dev_t *dev, int stream)
+{
+	struct drm_buffer_t *bufs = stream ? dev->plane1bufs : dev->bufs;
+	int index = bufctl[stream].active - 1;
+
+	if (index < dev->nbufs[stream]) {
+		/* still in flight when not parked, it will be requeued normally */
+		if (parked[stream] & (1u << index)) {
+			parked[stream] &= ~(1u << index);
+			v4l2_queue_buffer(dev->v4l2_fd[stream], index, bufs[index].dmabuf_fd, stream);
+		}
+	} else if (drm_add_buffers(dev->drm_fd, dev, stream, 1, 1, 1) != index
+			|| v4l2_create_buffers(dev->v4l2_fd[stream], &bufs[index].dmabuf_fd, 1, stream) != index) {
+		if (dev->nbufs[stream] > index)
+			drm_remove_buffers(dev->drm_fd, dev, stream, 1);
+		/* can't grow any further, stay where we are */
+		bufctl[stream].active = bufctl[stream].max = index;
+		return;
+	} else {
+		v4l2_queue_buffer(dev->v4l2_fd[stream], index, bufs[index].dmabuf_fd, stream);
+	}
+	printf("stream %d: starved (%u frames lost), grown to %d buffers\n",
+		stream, bufctl[stream].starved, bufctl[stream].active);
+}
+
+static void stream_resize(struct drm_dev_t *dev, int stream, struct v4l2_buffer *buf)
+{
+	switch (v4l2_bufctl_update(&bufctl[stream], buf)) {
+	case 1:
+		stream_grow(dev, stream);
+		break;
+	case -1:
+		/* the retired buffer gets parked when it comes back */
+		printf("stream %d: quiet, retiring buffer %d\n", stream, bufctl[stream].active);
+		break;
+	}
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_ms(void)
+{
+	return now_us() / 1000;
+}
+
+/* startup phases, main thread, us since start */
+enum { T_DRM_PROBE, T_DRM_BUFFERS, T_CAMERAS, T_STREAMON, T_FIRST_FRAME, T_COUNT };
+static const char *t_names[T_COUNT] = {
+	"drm open/probe", "drm buffers", "wait for cameras", "stream on", "first frame",
+};
+static uint64_t t_start, t_mark[T_COUNT];
+
+/* camera open and negotiation runs in parallel with the DRM setup */
+struct stream_probe {
+	pthread_t thread;
+	int stream;
+	int fd;
+	struct v4l2_format fmt;
+	uint64_t begin, end;
+};
+static struct stream_probe probes[2];
+
+static void startup_mark(int phase)
+{
+	t_mark[phase] = now_us() - t_start;
+}
+
+static void startup_report(void)
+{
+	uint64_t prev = 0;
+	int i;
+
+	printf("startup timing:\n");
+	for (i = 0; i < T_COUNT; i++) {
+		printf("  %-18s %8.1f ms  (at %.1f ms)\n", t_names[i],
+			(t_mark[i] - prev) / 1000.0, t_mark[i] / 1000.0);
+		prev = t_mark[i];
+	}
+	for (i = 0; i < 2; i++)
+		printf("  camera %d %-9s %8.1f ms  (parallel, %s)\n", i, "negotiate",
+			(probes[i].end - probes[i].begin) / 1000.0,
+			probes[i].fd >= 0 ? "ok" : "failed");
+}
+
+static uint32_t drm_format(uint32_t v4l2_fourcc)
+{
+	switch (v4l2_fourcc) {
+	case V4L2_PIX_FMT_UYVY:
+		return DRM_FORMAT_UYVY;
+	case V4L2_PIX_FMT_YUYV:
+		return DRM_FORMAT_YUYV;
+	case V4L2_PIX_FMT_NV12:
+		return DRM_FORMAT_NV12;
+	case V4L2_PIX_FMT_NV16:
+		return DRM_FORMAT_NV16;
+	case V4L2_PIX_FMT_XBGR32:
+		return DRM_FORMAT_XRGB8888;
+	}
+	return 0;
+}
+
+/* YCbCr encoding and range as the driver reports them, V4L2 defaults otherwise */
+static void stream_ycbcr(const struct v4l2_pix_format_mplane *pix,
+			 enum drm_ycbcr_encoding *encoding, enum drm_ycbcr_range *range)
+{
+	unsigned int enc = pix->ycbcr_enc;
+	unsigned int quant = pix->quantization;
+
+	if (enc == V4L2_YCBCR_ENC_DEFAULT)
+		enc = V4L2_MAP_YCBCR_ENC_DEFAULT(pix->colorspace);
+	if (quant == V4L2_QUANTIZATION_DEFAULT)
+		quant = V4L2_MAP_QUANTIZATION_DEFAULT(0, pix->colorspace, enc);
+
+	switch (enc) {
+	case V4L2_YCBCR_ENC_709:
+	case V4L2_YCBCR_ENC_XV709:
+		*encoding = DRM_YCBCR_BT709;
+		break;
+	case V4L2_YCBCR_ENC_BT2020:
+	case V4L2_YCBCR_ENC_BT2020_CONST_LUM:
+		*encoding = DRM_YCBCR_BT2020;
+		break;
+	default:
+		*encoding = DRM_YCBCR_BT601;
+	}
+	*range = quant == V4L2_QUANTIZATION_FULL_RANGE ? DRM_YCBCR_FULL : DRM_YCBCR_LIMITED;
+}
+
+/* the same for the CPU converters, BT.2020 coming closest to BT.709 */
+static void stream_colorimetry(const struct v4l2_pix_format_mplane *pix,
+			       enum convert_matrix *matrix, enum convert_range *range)
+{
+	enum drm_ycbcr_encoding encoding;
+	enum drm_ycbcr_range ycbcr_range;
+
+	stream_ycbcr(pix, &encoding, &ycbcr_range);
+	*matrix = encoding == DRM_YCBCR_BT601 ? CONVERT_BT601 : CONVERT_BT709;
+	*range = ycbcr_range == DRM_YCBCR_FULL ? CONVERT_FULL : CONVERT_LIMITED;
+}
+
+/*
+ * Have the plane convert the stream's YCbCr as the camera encoded it,
+ * which costs no CPU. A plane that can't is left as it is, colours
+ * then come out somewhat off.
+ */
+static void stream_plane_ycbcr(struct drm_dev_t *dev, int stream, const struct v4l2_pix_format_mplane *pix)
+{
+	static const char *const encodings[DRM_YCBCR_ENCODINGS] = { "BT.601", "BT.709", "BT.2020" };
+	enum drm_ycbcr_encoding encoding;
+	enum drm_ycbcr_range range;
+
+	stream_ycbcr(pix, &encoding, &range);
+	if (drm_plane_set_ycbcr(dev->drm_fd, &dev->plane_props[stream], encoding, range) == 0)
+		printf("stream %d: plane converts %s %s range YCbCr\n", stream, encodings[encoding],
+		       range == DRM_YCBCR_FULL ? "full" : "limited");
+	else
+		fprintf(stderr, "stream %d: plane can't convert %s %s range YCbCr, colours will be off\n",
+			stream, encodings[encoding], range == DRM_YCBCR_FULL ? "full" : "limited");
+}
+
+/*
+ * Scan out the camera format if the stream's plane can, otherwise
+ * convert every frame into an RGB format it does take.
+ */
+static int stream_plane_format(struct drm_dev_t *dev, int stream, struct v4l2_pix_format_mplane *pix)
+{
+	uint32_t plane = dev->plane_res->planes[stream];
+	uint32_t format = dev->fb_format[stream];
+	uint32_t cvt;
+
+	if (drm_plane_has_format(dev->drm_fd, plane, format)) {
+		drm_free_convert(dev->drm_fd, dev, stream);
+		if (format != DRM_FORMAT_XRGB8888)
+			stream_plane_ycbcr(dev, stream, pix);
+		return 0;
+	}
+
+	if (!convert_supported(format, DRM_FORMAT_XRGB8888)
+		|| !(cvt = drm_setup_convert(dev->drm_fd, dev, stream, plane)))
+		return -1;
+
+	stream_colorimetry(pix, &cvt_matrix[stream], &cvt_range[stream]);
+	printf("stream %d: plane %d can't scan out %.4s, converting to %.4s (%s, %s %s range)\n",
+		stream, plane, (char *)&format, (char *)&cvt, convert_impl(),
+		cvt_matrix[stream] == CONVERT_BT709 ? "BT.709" : "BT.601",
+		cvt_range[stream] == CONVERT_FULL ? "full" : "limited");
+	return 0;
+}
+
+/* A captured frame as the converters see it */
+static void stream_frame(struct drm_dev_t *dev, int stream, int index, struct convert_frame *src)
+{
+	struct drm_buffer_t *bufs = stream ? dev->plane1bufs : dev->bufs;
+
+	src->format = dev->fb_format[stream];
+	src->width = dev->fb_width[stream];
+	src->height = dev->fb_height[stream];
+	src->planes[0] = (uint8_t *)bufs[index].buf;
+	src->pitches[0] = dev->fb_pitch[stream];
+	src->planes[1] = src->planes[0] + src->pitches[0] * src->height;
+	src->pitches[1] = src->pitches[0];
+}
+
+/* The frame scaled to its on screen size, into the buffer not on screen */
+static uint32_t stream_scaled_fb(struct drm_dev_t *dev, int stream, int index)
+{
+	struct drm_buffer_t *scl;
+	struct convert_frame src, dst;
+
+	if (index < 0 || index >= dev->nbufs[stream])
+		return dev->sclbufs[stream][dev->scl_next[stream] ^ 1].fb_id;
+
+	scl = &dev->sclbufs[stream][dev->scl_next[stream]];
+	dev->scl_next[stream] ^= 1;
+
+	stream_frame(dev, stream, index, &src);
+
+	dst.format = src.format;
+	dst.width = stream_rect[stream].width;
+	dst.height = stream_rect[stream].height;
+	dst.planes[0] = (uint8_t *)scl->buf;
+	dst.pitches[0] = scl->pitch;
+	dst.planes[1] = dst.planes[0] + dst.pitches[0] * dst.height;
+	dst.pitches[1] = dst.pitches[0];
+
+	scale_frame(scaler[stream], &src, &dst);
+	return scl->fb_id;
+}
+
+/* Frame size on screen, turned if the rotation turns it */
+static void stream_turned_size(struct drm_dev_t *dev, int stream, uint32_t *width, uint32_t *height)
+{
+	int turned = rotate_transposes(rotation[stream]);
+
+	*width = turned ? dev->fb_height[stream] : dev->fb_width[stream];
+	*height = turned ? dev->fb_width[stream] : dev->fb_height[stream];
+}
+
+/* Size of the buffer the plane scans out, views and source rectangles are in it */
+static void stream_scanned_size(struct drm_dev_t *dev, int stream, uint32_t *width, uint32_t *height)
+{
+	if (rot_soft[stream]) {
+		stream_turned_size(dev, stream, width, height);
+	} else {
+		*width = dev->fb_width[stream];
+		*height = dev->fb_height[stream];
+	}
+}
+
+/* The frame turned, through an RGB copy if need be, into the buffer not on screen */
+static uint32_t stream_rotated_fb(struct drm_dev_t *dev, int stream, int index)
+{
+	struct drm_buffer_t *rot;
+	struct convert_frame src, dst;
+
+	if (index < 0 || index >= dev->nbufs[stream])
+		return dev->rotbufs[stream][dev->rot_next[stream] ^ 1].fb_id;
+
+	rot = &dev->rotbufs[stream][dev->rot_next[stream]];
+	dev->rot_next[stream] ^= 1;
+
+	stream_frame(dev, stream, index, &src);
+	if (rot_rgb[stream].planes[0]) {
+		convert_frame(&src, &rot_rgb[stream], cvt_matrix[stream], cvt_range[stream]);
+		src = rot_rgb[stream];
+	}
+
+	dst.format = rotate_format(src.format, rotation[stream]);
+	stream_turned_size(dev, stream, &dst.width, &dst.height);
+	dst.planes[0] = (uint8_t *)rot->buf;
+	dst.pitches[0] = rot->pitch;
+	dst.planes[1] = dst.planes[0] + dst.pitches[0] * dst.height;
+	dst.pitches[1] = dst.pitches[0];
+
+	rotate_frame(&src, &dst, rotation[stream]);
+	return rot->fb_id;
+}
+
+static void stream_drop_rotation(struct drm_dev_t *dev, int stream)
+{
+	drm_free_rotate(dev->drm_fd, dev, stream);
+	free(rot_rgb[stream].planes[0]);
+	memset(&rot_rgb[stream], 0, sizeof(rot_rgb[stream]));
+	rot_soft[stream] = 0;
+}
+
+/*
+ * Turn frames in software into buffers of the turned size. Packed 4:2:2
+ * can't be turned by 90 degrees as it is, nor can a plane that needs RGB
+ * anyway take the camera format: those turn an RGB copy.
+ */
+static int stream_rotate_soft(struct drm_dev_t *dev, int stream)
+{
+	const struct drm_plane_props *p = &dev->plane_props[stream];
+	uint32_t plane = dev->plane_res->planes[stream];
+	uint32_t format = dev->cvt_format[stream] ? dev->cvt_format[stream] : dev->fb_format[stream];
+	struct convert_frame *rgb = &rot_rgb[stream];
+	uint32_t out, width, height;
+
+	if (!rotate_format(format, rotation[stream])) {
+		if (drm_plane_has_format(dev->drm_fd, plane, DRM_FORMAT_XRGB8888))
+			format = DRM_FORMAT_XRGB8888;
+		else if (drm_plane_has_format(dev->drm_fd, plane, DRM_FORMAT_RGB565))
+			format = DRM_FORMAT_RGB565;
+		if (!convert_supported(dev->fb_format[stream], format))
+			return -1;
+		stream_colorimetry(&v4l2_fmt[stream].fmt.pix_mp, &cvt_matrix[stream], &cvt_range[stream]);
+	}
+	out = rotate_format(format, rotation[stream]);
+	if (!out || !drm_plane_has_format(dev->drm_fd, plane, out))
+		return -1;
+
+	if (format != dev->fb_format[stream]) {
+		rgb->format = format;
+		rgb->width = dev->fb_width[stream];
+		rgb->height = dev->fb_height[stream];
+		rgb->pitches[0] = rgb->width * (format == DRM_FORMAT_RGB565 ? 2 : 4);
+		rgb->planes[0] = malloc(rgb->pitches[0] * rgb->height);
+		if (!rgb->planes[0])
+			return -1;
+	}
+
+	/* the plane shows the turned buffer as it is */
+	if (p->ids[DRM_PLANE_ROTATION])
+		drmModeObjectSetProperty(dev->drm_fd, p->plane_id, DRM_MODE_OBJECT_PLANE,
+					 p->ids[DRM_PLANE_ROTATION], DRM_MODE_ROTATE_0);
+	stream_turned_size(dev, stream, &width, &height);
+	drm_setup_rotate(dev->drm_fd, dev, stream, width, height, out);
+	rot_soft[stream] = 1;
+	return 0;
+}
+
+static void stream_drop_scaler(struct drm_dev_t *dev, int stream)
+{
+	if (!scaler[stream])
+		return;
+	scale_destroy(scaler[stream]);
+	scaler[stream] = NULL;
+	drm_free_scale(dev->drm_fd, dev, stream);
+}
+
+/*
+ * The plane refused to scale the stream into its rectangle, so scale
+ * in software from now on. Only the camera formats themselves, a
+ * stream that is also converted would have to go through the
+ * compositor.
+ */
+static int stream_setup_scaler(struct drm_dev_t *dev, int stream)
+{
+	uint32_t format = dev->fb_format[stream];
+
+	if (rotation[stream] != DRM_MODE_ROTATE_0) {
+		fprintf(stderr, "stream %d: plane can't scale a turned stream, try -c\n", stream);
+		return -1;
+	}
+	if (dev->cvt_format[stream] || !scale_supported(format)) {
+		fprintf(stderr, "stream %d: plane can't scale %.4s, try -c\n", stream, (char *)&format);
+		return -1;
+	}
+	if (!scale_pool)
+		scale_pool = copy_pool_create(-1);
+
+	scaler[stream] = scale_create(format, dev->fb_width[stream], dev->fb_height[stream],
+				      stream_rect[stream].width, stream_rect[stream].height, scale_pool);
+	if (!scaler[stream])
+		return -1;
+	drm_setup_scale(dev->drm_fd, dev, stream, stream_rect[stream].width, stream_rect[stream].height);
+	printf("stream %d: plane can't scale, scaling in software\n", stream);
+	return 0;
+}
+
+/*
+ * The fb to show for a frame: the capture buffer itself, or an RGB copy
+ * of it. The copy reads the capture buffer through its mapping, which
+ * is uncached on most drivers, so only streams that need it pay.
+ */
+static uint32_t stream_scanout_fb(struct drm_dev_t *dev, int stream, int index)
+{
+	struct drm_buffer_t *bufs = stream ? dev->plane1bufs : dev->bufs;
+	struct drm_buffer_t *cvt;
+	struct convert_frame src, dst;
+
+	if (scaler[stream])
+		return stream_scaled_fb(dev, stream, index);
+	if (rot_soft[stream])
+		return stream_rotated_fb(dev, stream, index);
+	if (!dev->cvt_format[stream])
+		return bufs[index >= 0 && index < dev->nbufs[stream] ? index : shown[stream]].fb_id;
+	/* nothing new captured, keep showing the last copy */
+	if (index < 0 || index >= dev->nbufs[stream])
+		return dev->cvtbufs[stream][dev->cvt_next[stream] ^ 1].fb_id;
+
+	cvt = &dev->cvtbufs[stream][dev->cvt_next[stream]];
+	dev->cvt_next[stream] ^= 1;
+
+	stream_frame(dev, stream, index, &src);
+
+	dst.format = dev->cvt_format[stream];
+	dst.width = src.width;
+	dst.height = src.height;
+	dst.planes[0] = (uint8_t *)cvt->buf;
+	dst.pitches[0] = cvt->pitch;
+
+	convert_frame(&src, &dst, cvt_matrix[stream], cvt_range[stream]);
+	return cvt->fb_id;
+}
+
+/* Narrow a frame to the view, on whole chroma samples */
+static void stream_crop(struct convert_frame *f, const struct view_t *v)
+{
+	uint32_t x = v->cur.x >> 16 & ~1u, y = v->cur.y >> 16 & ~1u;
+
+	if (!view_cropped(v))
+		return;
+	switch (f->format) {
+	case DRM_FORMAT_NV12:
+		f->planes[0] += y * f->pitches[0] + x;
+		f->planes[1] += y / 2 * f->pitches[1] + x;
+		break;
+	case DRM_FORMAT_NV16:
+		f->planes[0] += y * f->pitches[0] + x;
+		f->planes[1] += y * f->pitches[1] + x;
+		break;
+	case DRM_FORMAT_XRGB8888:
+		f->planes[0] += y * f->pitches[0] + x * 4;
+		break;
+	default:
+		/* packed 4:2:2 */
+		f->planes[0] += y * f->pitches[0] + x * 2;
+		break;
+	}
+	f->width = v->cur.width >> 16 & ~1u;
+	f->height = v->cur.height >> 16 & ~1u;
+}
+
+/* Fit a stream into its layout cell, by its current frame size */
+static void stream_place(struct drm_dev_t *dev, int stream)
+{
+	uint32_t width, height;
+
+	stream_turned_size(dev, stream, &width, &height);
+	stream_rect[stream] = layout_fit(&layout, stream, width, height);
+	if (compose)
+		compose_move_layer(compose, compose_layer[stream], stream_rect[stream].x,
+				   stream_rect[stream].y, stream_rect[stream].width,
+				   stream_rect[stream].height);
+}
+
+/*
+ * Turn a stream as asked: with the plane's rotation property if it takes
+ * the value, otherwise (or when soft is set, the plane having refused it
+ * after all) in software. Unturned if neither works.
+ */
+static void stream_orient(struct drm_dev_t *dev, int stream, int soft)
+{
+	const struct drm_plane_props *p = &dev->plane_props[stream];
+	uint32_t width, height;
+	char name[16];
+
+	stream_drop_rotation(dev, stream);
+	rotate_name(rotation[stream], name, sizeof(name));
+
+	if (compose) {
+		if (rotation[stream] != DRM_MODE_ROTATE_0)
+			fprintf(stderr, "stream %d: the compositor does not rotate\n", stream);
+		rotation[stream] = DRM_MODE_ROTATE_0;
+	} else if (!soft && p->ids[DRM_PLANE_ROTATION] && !(rotation[stream] & ~p->rotations)
+		   && drmModeObjectSetProperty(dev->drm_fd, p->plane_id, DRM_MODE_OBJECT_PLANE,
+					       p->ids[DRM_PLANE_ROTATION], rotation[stream]) == 0) {
+		if (rotation[stream] != DRM_MODE_ROTATE_0)
+			printf("stream %d: rotation %s by the plane\n", stream, name);
+	} else if (rotation[stream] == DRM_MODE_ROTATE_0) {
+		/* nothing to turn, and no property to set */
+	} else if (stream_rotate_soft(dev, stream) == 0) {
+		printf("stream %d: rotation %s in software, %s\n", stream, name,
+		       rot_rgb[stream].planes[0] ? "through RGB" : "in the camera format");
+	} else {
+		fprintf(stderr, "stream %d: can't rotate %s, showing it as it is\n", stream, name);
+		stream_drop_rotation(dev, stream);
+		rotation[stream] = DRM_MODE_ROTATE_0;
+	}
+
+	stream_scanned_size(dev, stream, &width, &height);
+	view_reset(&view[stream], width, height);
+	stream_place(dev, stream);
+}
+
+/* zpos a stream's plane gets: as set, or as the layout wants within what the plane allows */
+static uint64_t stream_zpos(struct drm_dev_t *dev, int stream)
+{
+	const struct drm_plane_props *p = &dev->plane_props[stream];
+	uint64_t base = dev->plane_props[0].zpos_min, z;
+
+	if (plane_zpos[stream] >= 0)
+		return plane_zpos[stream];
+	if (dev->plane_props[1].zpos_min > base)
+		base = dev->plane_props[1].zpos_min;
+	z = base + layout.zorder[stream];
+	return z > p->zpos_max ? p->zpos_max : z < p->zpos_min ? p->zpos_min : z;
+}
+
+static uint64_t stream_alpha(struct drm_dev_t *dev, int stream)
+{
+	return plane_alpha[stream] * dev->plane_props[stream].alpha_max + 0.5;
+}
+
+/*
+ * Drop the blending settings the stream's plane can't take, saying why,
+ * and have the next frame carry the rest.
+ */
+static void stream_check_blend(struct drm_dev_t *dev, int stream)
+{
+	const struct drm_plane_props *p = &dev->plane_props[stream];
+
+	if (plane_zpos[stream] >= 0 && !(p->ids[DRM_PLANE_ZPOS] && p->zpos_mutable)) {
+		fprintf(stderr, "stream %d: plane %d has no zpos to set\n", stream, p->plane_id);
+		plane_zpos[stream] = -1;
+	} else if (plane_zpos[stream] >= 0 && ((uint64_t)plane_zpos[stream] < p->zpos_min
+					       || (uint64_t)plane_zpos[stream] > p->zpos_max)) {
+		fprintf(stderr, "stream %d: zpos %lld is outside %llu..%llu\n", stream,
+			(long long)plane_zpos[stream], (unsigned long long)p->zpos_min,
+			(unsigned long long)p->zpos_max);
+		plane_zpos[stream] = -1;
+	}
+	if (plane_alpha[stream] != 1.0 && !(p->ids[DRM_PLANE_ALPHA] && p->alpha_max)) {
+		fprintf(stderr, "stream %d: plane %d has no alpha, it stays opaque\n", stream, p->plane_id);
+		plane_alpha[stream] = 1.0;
+	}
+	if (plane_blend[stream] >= 0 && !(p->ids[DRM_PLANE_BLEND] && p->blend_mask & 1u << plane_blend[stream])) {
+		fprintf(stderr, "stream %d: plane %d can't blend %s\n", stream, p->plane_id,
+			drm_blend_name(plane_blend[stream]));
+		plane_blend[stream] = -1;
+	}
+	plane_dirty[stream] = 1;
+}
+
+/* zpos, rotation, alpha and blend mode of a stream's plane, alongside its framebuffer */
+static int stream_add_blend(drmModeAtomicReq *req, struct drm_dev_t *dev, int stream)
+{
+	const struct drm_plane_props *p = &dev->plane_props[stream];
+	int ret = 0;
+
+	if (p->ids[DRM_PLANE_ZPOS] && p->zpos_mutable)
+		ret |= drmModeAtomicAddProperty(req, p->plane_id, p->ids[DRM_PLANE_ZPOS],
+						stream_zpos(dev, stream));
+	if (p->ids[DRM_PLANE_ROTATION])
+		ret |= drmModeAtomicAddProperty(req, p->plane_id, p->ids[DRM_PLANE_ROTATION],
+						rot_soft[stream] ? DRM_MODE_ROTATE_0 : rotation[stream]);
+	if (p->ids[DRM_PLANE_ALPHA] && p->alpha_max)
+		ret |= drmModeAtomicAddProperty(req, p->plane_id, p->ids[DRM_PLANE_ALPHA],
+						stream_alpha(dev, stream));
+	if (plane_blend[stream] >= 0)
+		ret |= drmModeAtomicAddProperty(req, p->plane_id, p->ids[DRM_PLANE_BLEND],
+						p->blends[plane_blend[stream]]);
+	return ret < 0 ? -1 : 0;
+}
+
+/* The same property by property, for drivers without atomic commits */
+static void stream_set_blend(struct drm_dev_t *dev, int stream)
+{
+	const struct drm_plane_props *p = &dev->plane_props[stream];
+
+	if (p->ids[DRM_PLANE_ZPOS] && p->zpos_mutable)
+		drmModeObjectSetProperty(dev->drm_fd, p->plane_id, DRM_MODE_OBJECT_PLANE,
+					 p->ids[DRM_PLANE_ZPOS], stream_zpos(dev, stream));
+	if (p->ids[DRM_PLANE_ALPHA] && p->alpha_max)
+		drmModeObjectSetProperty(dev->drm_fd, p->plane_id, DRM_MODE_OBJECT_PLANE,
+					 p->ids[DRM_PLANE_ALPHA], stream_alpha(dev, stream));
+	if (plane_blend[stream] >= 0)
+		drmModeObjectSetProperty(dev->drm_fd, p->plane_id, DRM_MODE_OBJECT_PLANE,
+					 p->ids[DRM_PLANE_BLEND], p->blends[plane_blend[stream]]);
+}
+
+/* Stack and blend the planes as set, where their properties can be set */
+static void stream_stack(struct drm_dev_t *dev)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		stream_set_blend(dev, i);
+}
+
+/* A frame and changed blending in one atomic commit, so neither shows without the other */
+static int stream_commit_blend(struct drm_dev_t *dev, int stream, uint32_t fb_id, const struct view_rect *crop)
+{
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+	ret = drm_atomic_add_plane(req, &dev->plane_props[stream], dev->crtc_id, fb_id,
+				   stream_rect[stream].x, stream_rect[stream].y,
+				   stream_rect[stream].width, stream_rect[stream].height,
+				   crop->x, crop->y, crop->width, crop->height);
+	if (ret == 0)
+		ret = stream_add_blend(req, dev, stream);
+	if (ret == 0)
+		ret = TRACE_CALL(DRM_IOCTL_MODE_ATOMIC, drmModeAtomicCommit(dev->drm_fd, req, 0, NULL));
+	drmModeAtomicFree(req);
+	return ret;
+}
+
+/* Put a frame on screen, on the stream's own plane or through the compositor */
+static int stream_show(struct drm_dev_t *dev, int stream, int index)
+{
+	struct convert_frame src;
+	struct view_rect crop;
+	uint32_t fb_id;
+	int ret = -1;
+
+	if (compose) {
+		if (index >= 0 && index < dev->nbufs[stream])
+			shown[stream] = index;
+		if (shown[stream] < 0)
+			return 0;
+		stream_frame(dev, stream, shown[stream], &src);
+		stream_crop(&src, &view[stream]);
+		compose_update(compose, compose_layer[stream], &src, cvt_matrix[stream], cvt_range[stream]);
+		return compose_commit(compose);
+	}
+
+	if (index >= 0 && index < dev->nbufs[stream])
+		shown[stream] = index;
+	if (shown[stream] < 0)
+		return 0;
+	/* a scaled copy is already the size of the rectangle, and never cropped */
+	if (scaler[stream]) {
+		crop = (struct view_rect){ 0, 0, stream_rect[stream].width << 16,
+					   stream_rect[stream].height << 16 };
+	} else {
+		crop = view[stream].cur;
+	}
+	fb_id = stream_scanout_fb(dev, stream, index);
+
+	/* blending changes ride on the next frame, which then goes by atomic commit */
+	if (plane_dirty[stream]) {
+		plane_dirty[stream] = 0;
+		if (dev->atomic)
+			ret = stream_commit_blend(dev, stream, fb_id, &crop);
+		if (ret < 0)
+			stream_set_blend(dev, stream);
+	}
+	if (ret < 0)
+		ret = TRACE_CALL(DRM_IOCTL_MODE_SETPLANE,
+				 drmModeSetPlane(dev->drm_fd, dev->plane_res->planes[stream], dev->crtc_id,
+						 fb_id, DRM_MODE_PAGE_FLIP_ASYNC,
+						 stream_rect[stream].x, stream_rect[stream].y,
+						 stream_rect[stream].width, stream_rect[stream].height,
+						 crop.x, crop.y, crop.width, crop.height));
+
+	/* rotating is what the plane may have refused */
+	if (ret < 0 && rotation[stream] != DRM_MODE_ROTATE_0 && !rot_soft[stream]) {
+		stream_orient(dev, stream, 1);
+		if (rot_soft[stream])
+			return stream_show(dev, stream, index);
+	}
+	if (ret < 0 && !scaler[stream] && !view_cropped(&view[stream])
+		&& (dev->fb_width[stream] != stream_rect[stream].width
+		|| dev->fb_height[stream] != stream_rect[stream].height)
+		&& stream_setup_scaler(dev, stream) == 0)
+		return stream_show(dev, stream, index);
+	return ret;
+}
+
+/* The legacy way, plane by plane: a frame or two may show half the change */
+static void stream_layout_legacy(struct drm_dev_t *dev)
+{
+	int i;
+
+	stream_stack(dev);
+	for (i = 0; i < 2; i++)
+		if (dev->v4l2_fd[i] >= 0)
+			stream_show(dev, i, -1);
+}
+
+static void vblank_handler(int fd, unsigned int frame, unsigned int sec,
+			   unsigned int usec, void *data)
+{
+	struct drm_dev_t *dev = data;
+	int i, more = 0;
+
+	vblank_pending = 0;
+	for (i = 0; i < 2; i++) {
+		if (timing)
+			stats_flip(timing, i, sec * 1000000000ULL + usec * 1000ULL);
+		if (flipping[i].pending)
+			PROBE5(flip, i, flipping[i].index, flipping[i].sequence, flipping[i].captured,
+			       sec * 1000000000ULL + usec * 1000ULL);
+		flipping[i].pending = 0;
+	}
+	for (i = 0; i < 2; i++) {
+		if (view_step(&view[i]))
+			stream_show(dev, i, -1);
+		more |= view_animating(&view[i]);
+	}
+	if (more && drm_request_vblank(dev->drm_fd, dev, dev) == 0)
+		vblank_pending = 1;
+}
+
+/* Start moving a stream's view, a step per vblank, or all at once without vblank events */
+static void stream_view_moved(struct drm_dev_t *dev, int stream)
+{
+	struct view_t *v = &view[stream];
+
+	if (view_animating(v) && !vblank_pending) {
+		if (drm_request_vblank(dev->drm_fd, dev, dev) == 0) {
+			vblank_pending = 1;
+			return;
+		}
+		view_crop(v, v->to, 0);
+	}
+	if (!view_animating(v))
+		stream_show(dev, stream, -1);
+}
+
+/*
+ * Zoom and pan from stdin, in source pixels:
+ *   zoom S factor [cx cy]   pan S dx dy   crop S x y w h   reset S
+ * and turning, see rotate_parse():   rotate S 90x
+ * Returns -1 if the line is none of these.
+ */
+static int stream_view_command(struct drm_dev_t *dev, const char *line)
+{
+	struct view_t *v;
+	struct view_rect r;
+	double zoom;
+	int stream, n, a, b, c, d;
+	char cmd[8], name[16];
+	uint32_t rot;
+
+	if (sscanf(line, "%7s %d%n", cmd, &stream, &n) < 2)
+		return -1;
+	if (stream < 0 || stream > 1)
+		return -1;
+	v = &view[stream];
+	line += n;
+
+	/* turning changes the buffer the view is in, it starts over */
+	if (!strcmp(cmd, "rotate")) {
+		if (sscanf(line, "%15s", name) != 1 || rotate_parse(name, &rot) < 0)
+			return -1;
+		rotation[stream] = rot;
+		if (dev->v4l2_fd[stream] >= 0) {
+			stream_drop_scaler(dev, stream);
+			stream_orient(dev, stream, 0);
+			stream_show(dev, stream, shown[stream]);
+		}
+		return 0;
+	}
+
+	if (!strcmp(cmd, "zoom") && sscanf(line, "%lf%n", &zoom, &n) == 1 && zoom >= 1.0) {
+		/* around the centre of where the view is going, unless told */
+		a = (v->to.x + v->to.width / 2) >> 16;
+		b = (v->to.y + v->to.height / 2) >> 16;
+		if (sscanf(line + n, "%d %d", &c, &d) == 2 && c >= 0 && d >= 0) {
+			a = c;
+			b = d;
+		}
+		view_zoom(v, zoom * VIEW_ONE, a, b, VIEW_ANIMATE_STEPS);
+	} else if (!strcmp(cmd, "pan") && sscanf(line, "%d %d", &a, &b) == 2) {
+		view_pan(v, a, b, VIEW_ANIMATE_STEPS);
+	} else if (!strcmp(cmd, "crop") && sscanf(line, "%d %d %d %d", &a, &b, &c, &d) == 4
+		   && a >= 0 && b >= 0 && c > 0 && d > 0) {
+		r = (struct view_rect){ a << 16, b << 16, c << 16, d << 16 };
+		view_crop(v, r, VIEW_ANIMATE_STEPS);
+	} else if (!strcmp(cmd, "reset")) {
+		r = (struct view_rect){ 0, 0, v->src_width << 16, v->src_height << 16 };
+		view_crop(v, r, VIEW_ANIMATE_STEPS);
+	} else {
+		return -1;
+	}
+
+	if (scaler[stream])
+		printf("stream %d: its plane can't scale, the view is not applied\n", stream);
+	stream_view_moved(dev, stream);
+	return 0;
+}
+
+static int blend_parse(const char *str)
+{
+	static const char *const names[DRM_BLEND_MODES] = { "none", "premulti", "coverage" };
+	int i;
+
+	for (i = 0; i < DRM_BLEND_MODES; i++)
+		if (!strcmp(str, names[i]))
+			return i;
+	return -1;
+}
+
+/* "auto" is -1, a zpos 0 and up; anything else -2 */
+static int64_t parse_zpos(const char *str)
+{
+	char *end;
+	long long z;
+
+	if (!strcmp(str, "auto"))
+		return -1;
+	errno = 0;
+	z = strtoll(str, &end, 10);
+	if (errno || end == str || *end || z < 0)
+		return -2;
+	return z;
+}
+
+/*
+ * Plane blending from stdin:
+ *   zpos S N|auto   alpha S 0..1   blend S none|premulti|coverage
+ * Returns -1 if the line is none of these.
+ */
+static int stream_blend_command(struct drm_dev_t *dev, const char *line)
+{
+	char cmd[8], arg[16];
+	int stream, mode;
+	int64_t z;
+	double alpha;
+
+	if (sscanf(line, "%7s %d %15s", cmd, &stream, arg) < 3 || stream < 0 || stream > 1)
+		return -1;
+
+	if (!strcmp(cmd, "zpos")) {
+		z = parse_zpos(arg);
+		if (z < -1) {
+			fprintf(stderr, "stream %d: zpos is auto or 0 and up\n", stream);
+			return 0;
+		}
+		if (z >= 0 && z == plane_zpos[!stream]) {
+			fprintf(stderr, "stream %d: zpos %lld is stream %d's\n", stream, (long long)z, !stream);
+			return 0;
+		}
+		plane_zpos[stream] = z;
+	} else if (!strcmp(cmd, "alpha") && sscanf(arg, "%lf", &alpha) == 1 && alpha >= 0 && alpha <= 1) {
+		plane_alpha[stream] = alpha;
+	} else if (!strcmp(cmd, "blend") && (mode = blend_parse(arg)) >= 0) {
+		plane_blend[stream] = mode;
+	} else {
+		return -1;
+	}
+
+	if (compose) {
+		printf("stream %d: the compositor draws streams opaque, in layout order\n", stream);
+		return 0;
+	}
+	stream_check_blend(dev, stream);
+	if (dev->v4l2_fd[stream] >= 0)
+		stream_show(dev, stream, shown[stream]);
+	return 0;
+}
+
+/* White balance as the diagonal of the CRTC colour matrix, then gamma */
+static void display_color(struct drm_dev_t *dev)
+{
+	const double *wb = white_balance;
+	const double ctm[9] = { wb[0], 0, 0, 0, wb[1], 0, 0, 0, wb[2] };
+	int balanced = wb[0] != 1.0 || wb[1] != 1.0 || wb[2] != 1.0;
+
+	if (drm_set_crtc_color(dev->drm_fd, dev, balanced ? ctm : NULL, display_gamma) < 0)
+		fprintf(stderr, "display: CRTC can't do white balance %.3f,%.3f,%.3f gamma %.2f\n",
+			wb[0], wb[1], wb[2], display_gamma);
+	else if (balanced || display_gamma != 1.0)
+		printf("display: white balance %.3f,%.3f,%.3f gamma %.2f on the CRTC\n",
+		       wb[0], wb[1], wb[2], display_gamma);
+}
+
+/*
+ * Display colour from stdin:   wb R G B   gamma G
+ * Returns -1 if the line is neither.
+ */
+static int display_color_command(struct drm_dev_t *dev, const char *line)
+{
+	double r, g, b;
+
+	if (sscanf(line, "wb %lf %lf %lf", &r, &g, &b) == 3 && r >= 0 && g >= 0 && b >= 0) {
+		white_balance[0] = r;
+		white_balance[1] = g;
+		white_balance[2] = b;
+	} else if (sscanf(line, "gamma %lf", &g) == 1 && g > 0) {
+		display_gamma = g;
+	} else {
+		return -1;
+	}
+	display_color(dev);
+	return 0;
+}
+
+/*
+ * Switch layout. The streams keep their buffers, only the planes'
+ * rectangles and stacking change, all in one atomic commit so the
+ * screen never shows a mix of the two layouts. Streams scaled in
+ * software first try the plane again at the new size.
+ */
+static void stream_relayout(struct drm_dev_t *dev, enum layout_kind kind, int main)
+{
+	const struct drm_plane_props *p;
+	drmModeAtomicReq *req;
+	int i, ret = -1;
+
+	if (layout_compute(&layout, kind, main, dev->mode.hdisplay, dev->mode.vdisplay, 2) < 0) {
+		fprintf(stderr, "layout: %s%d does not fit\n", layout_name(kind), main);
+		return;
+	}
+	for (i = 0; i < 2; i++) {
+		stream_drop_scaler(dev, i);
+		stream_place(dev, i);
+	}
+	printf("layout: %s, main stream %d\n", layout_name(kind), main);
+
+	if (compose) {
+		compose_stack(compose, layout.zorder);
+		return;
+	}
+
+	if (dev->atomic && (req = drmModeAtomicAlloc())) {
+		ret = 0;
+		for (i = 0; i < 2 && ret == 0; i++) {
+			p = &dev->plane_props[i];
+			if (dev->v4l2_fd[i] < 0 || shown[i] < 0)
+				continue;
+			ret = drm_atomic_add_plane(req, p, dev->crtc_id, stream_scanout_fb(dev, i, -1),
+						   stream_rect[i].x, stream_rect[i].y,
+						   stream_rect[i].width, stream_rect[i].height,
+						   view[i].cur.x, view[i].cur.y,
+						   view[i].cur.width, view[i].cur.height);
+			if (ret == 0)
+				ret = stream_add_blend(req, dev, i);
+		}
+		if (ret == 0)
+			ret = TRACE_CALL(DRM_IOCTL_MODE_ATOMIC, drmModeAtomicCommit(dev->drm_fd, req, 0, NULL));
+		drmModeAtomicFree(req);
+	}
+
+	/* the plane may need software scaling now, which only SetPlane finds out */
+	if (ret < 0)
+		stream_layout_legacy(dev);
+}
+
+/*
+ * Negotiate a camera and start it streaming. The stream's framebuffers
+ * follow the negotiated layout, dumb buffers are only reallocated when
+ * they became too small.
+ */
+static int stream_negotiate(int fd, struct v4l2_format *fmt)
+{
+	//因摄像头和显示器不一定能设置位相同的模式，后面三个参数保留
+	if (v4l2_try_init(fd, 0, 0, 0) < 0 || v4l2_get_format(fd, fmt) < 0)
+		return -1;
+	return 0;
+}
+
+/* Buffers a recording write or a subscriber still reads from */
+static uint32_t stream_busy(struct drm_dev_t *dev, int stream)
+{
+	uint32_t busy = 0;
+	int i;
 
+	for (i = 0; i < dev->nbufs[stream]; i++)
+		if ((share && share_held(share, stream, i)) || (sink[stream] && sink_held(sink[stream], i)))
+			busy |= 1u << i;
+	return busy;
+}
+
+/* Every buffer in rotation is with the sink or a subscriber, the driver has none */
+static int stream_drained(struct drm_dev_t *dev, int stream)
+{
+	uint32_t all = (1u << bufctl[stream].active) - 1;
+
+	return dev->v4l2_fd[stream] >= 0 && (stream_busy(dev, stream) & all) == all;
+}
+
+static int stream_setup(struct drm_dev_t *dev, int stream, int fd, struct v4l2_format *fmt)
+{
+	struct drm_buffer_t *bufs = stream ? dev->plane1bufs : dev->bufs;
+	struct v4l2_pix_format_mplane *pix = &fmt->fmt.pix_mp;
+	int dmabufs[BUFCOUNT_MAX];
+	uint32_t format, busy;
+	int i, keep;
+
+	format = drm_format(pix->pixelformat);
+	if (!format) {
+		fprintf(stderr, "stream %d: camera format not supported\n", stream);
+		return -1;
 	}
 
-	drmModePageFlip(fd, dev->crtc_id, dev->plane1bufs[curr_buffer_index].fb_id,
-			      DRM_MODE_PAGE_FLIP_EVENT, dev);
+	/*
+	 * Nothing is queued anymore, retired buffers can go, but not from
+	 * under a write or a subscriber: those stay retired and are parked
+	 * as they come back.
+	 */
+	busy = stream_busy(dev, stream);
+	keep = busy ? 32 - __builtin_clz(busy) : 0;
+	if (keep < bufctl[stream].active)
+		keep = bufctl[stream].active;
+	if (dev->nbufs[stream] > keep)
+		drm_remove_buffers(dev->drm_fd, dev, stream, dev->nbufs[stream] - keep);
+	parked[stream] = 0;
+
+	/* the frame size may have changed, the plane gets another chance to scale */
+	stream_drop_scaler(dev, stream);
+	drm_set_stream_format(dev->drm_fd, dev, stream, pix->width, pix->height,
+			      pix->plane_fmt[0].bytesperline, format, 1, 1, busy);
+	/* and those that came back while the stream was down catch up */
+	for (i = 0; i < dev->nbufs[stream]; i++)
+		if (!(busy & (1u << i)))
+			drm_refit_buffer(dev->drm_fd, dev, stream, i, 1, 1);
+	shown[stream] = -1;
+	v4l2_fmt[stream] = *fmt;
+
+	if (compose) {
+		/* the compositor converts everything to RGB anyway */
+		if (!convert_supported(format, DRM_FORMAT_XRGB8888)) {
+			fprintf(stderr, "stream %d: camera format cannot be composited\n", stream);
+			return -1;
+		}
+		stream_colorimetry(pix, &cvt_matrix[stream], &cvt_range[stream]);
+	} else if (stream_plane_format(dev, stream, pix) < 0) {
+		fprintf(stderr, "stream %d: camera format cannot be scanned out\n", stream);
+		return -1;
+	}
+	stream_orient(dev, stream, 0);
+
+	for (i = 0; i < dev->nbufs[stream]; i++)
+		dmabufs[i] = bufs[i].dmabuf_fd;
+	if (v4l2_try_init_dmabuf(fd, dmabufs, dev->nbufs[stream], stream) < 0)
+		return -1;
+
+	/* One buffer held by DRM, the rest queued unless a subscriber has it */
+	for (i = 1; i < dev->nbufs[stream]; i++)
+		if ((!share || !share_held(share, stream, i)) && (!sink[stream] || !sink_held(sink[stream], i)))
+			v4l2_queue_buffer(fd, i, bufs[i].dmabuf_fd, stream);
+
+	if (v4l2_streamon(fd) < 0) {
+		v4l2_release_buffers(fd, stream);
+		return -1;
+	}
+
+	dev->v4l2_fd[stream] = fd;
+	bufctl[stream].primed = 0;
+	last_frame[stream] = now_ms();
+	return 0;
+}
+
+static int stream_configure(struct drm_dev_t *dev, int stream, int fd)
+{
+	struct v4l2_format fmt;
+
+	if (stream_negotiate(fd, &fmt) < 0)
+		return -1;
+	return stream_setup(dev, stream, fd, &fmt);
 }
 
+static void *stream_probe_thread(void *arg)
+{
+	struct stream_probe *p = arg;
+
+	prctl(PR_SET_NAME, "probe");
+	p->begin = now_us();
+	p->fd = v4l2_try_open(v4l2_path[p->stream]);
+	if (p->fd >= 0) {
+		v4l2_subscribe_events(p->fd);
+		if (stream_negotiate(p->fd, &p->fmt) < 0) {
+			v4l2_close(p->fd);
+			p->fd = -1;
+		}
+	}
+	p->end = now_us();
+	return NULL;
+}
+
+static int stream_start(struct drm_dev_t *dev, int stream)
+{
+	int fd;
+
+	fd = v4l2_try_open(v4l2_path[stream]);
+	if (fd < 0)
+		return -1;
+
+	v4l2_subscribe_events(fd);
+	if (stream_configure(dev, stream, fd) < 0) {
+		v4l2_close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Close a stream's device. It is reopened by the watchdog, unless it
+ * ended: a replay that ran out, there is nothing to restart.
+ */
+static void stream_stop(struct drm_dev_t *dev, int stream, const char *why, int ended)
+{
+	int fd = dev->v4l2_fd[stream];
+
+	if (ended)
+		printf("stream %d: %s on %s\n", stream, why, v4l2_path[stream]);
+	else
+		fprintf(stderr, "stream %d: %s, restarting %s\n", stream, why, v4l2_path[stream]);
+
+	v4l2_stop_capturing(fd);
+	v4l2_release_buffers(fd, stream);
+	v4l2_close(fd);
+
+	dev->v4l2_fd[stream] = -1;
+	retry_at[stream] = ended ? UINT64_MAX : now_ms();
+}
+
+/* Restart stalled streams, and bring back lost ones when they reappear */
+static void stream_watchdog(struct drm_dev_t *dev)
+{
+	uint64_t now = now_ms();
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (dev->v4l2_fd[i] >= 0) {
+			if (now - last_frame[i] > STREAM_STALL_MS)
+				stream_stop(dev, i, "stalled", 0);
+		} else if (now >= retry_at[i]) {
+			if (stream_start(dev, i) == 0)
+				printf("stream %d: back on %s\n", i, v4l2_path[i]);
+			else
+				retry_at[i] = now + STREAM_RETRY_MS;
+		}
+	}
+}
+
+/*
+ * The source changed resolution: stop, latch the new timings and
+ * renegotiate on the same fd. Only buffers that became too small are
+ * reallocated, the plane picks up the new geometry on the next frame.
+ */
+static void stream_renegotiate(struct drm_dev_t *dev, int stream)
+{
+	int fd = dev->v4l2_fd[stream];
+
+	printf("stream %d: source changed, renegotiating\n", stream);
+
+	v4l2_stop_capturing(fd);
+	v4l2_release_buffers(fd, stream);
+	dev->v4l2_fd[stream] = -1;
+
+	v4l2_apply_dv_timings(fd);
+	if (stream_configure(dev, stream, fd) < 0) {
+		fprintf(stderr, "stream %d: renegotiation failed, restarting\n", stream);
+		v4l2_close(fd);
+		retry_at[stream] = now_ms();
+	}
+}
+
+static void stream_events(struct drm_dev_t *dev, int stream)
+{
+	struct v4l2_event ev;
+	int renegotiate = 0;
+
+	while (v4l2_dequeue_event(dev->v4l2_fd[stream], &ev)) {
+		switch (ev.type) {
+		case V4L2_EVENT_SOURCE_CHANGE:
+			if (ev.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION)
+				renegotiate = 1;
+			break;
+		case V4L2_EVENT_EOS:
+			stream_stop(dev, stream, "end of stream", 0);
+			return;
+		}
+	}
+
+	if (renegotiate)
+		stream_renegotiate(dev, stream);
+}
+
+/* A frame went to the plane: how late, and whether the driver skipped any before it */
+static void stream_account(int stream, const struct v4l2_buffer *buf)
+{
+	struct stream_stats *st = &stats[stream];
+	uint64_t captured = v4l2_buffer_time(buf);
+
+	st->frames++;
+	if (st->sequenced && buf->sequence - st->sequence > 1)
+		st->drops += buf->sequence - st->sequence - 1;
+	st->sequence = buf->sequence;
+	st->sequenced = 1;
+
+	/* only monotonic timestamps compare with our clock */
+	if (captured) {
+		st->latency_us += now_us() - captured / 1000;
+		st->timed++;
+	}
+}
+
+/*
+ * A frame went to the plane. The next vblank event tells when it
+ * showed, it is asked for when timing or someone tracing wants to know.
+ */
+static void stream_submitted(struct drm_dev_t *dev, int stream, const struct v4l2_buffer *buf)
+{
+	uint64_t captured = v4l2_buffer_time(buf);
+
+	PROBE4(commit, stream, buf->index, buf->sequence, captured);
+	flipping[stream].pending = 1;
+	flipping[stream].index = buf->index;
+	flipping[stream].sequence = buf->sequence;
+	flipping[stream].captured = captured;
+
+	if (timing)
+		stats_submit(timing, stream, buf->index, stats_now());
+	else if (!PROBE_ENABLED(flip))
+		return;
+	if (!vblank_pending && drm_request_vblank(dev->drm_fd, dev, dev) == 0)
+		vblank_pending = 1;
+}
+
+/* Who has each stream's buffers, then a snapshot for the monitor */
+static void stream_timing_publish(struct drm_dev_t *dev)
+{
+	uint32_t counts[STATS_OWNERS];
+	uint64_t now = now_ms();
+	int stream, i;
+
+	if (now - timing_published < STATS_PUBLISH_MS)
+		return;
+	timing_published = now;
+
+	for (stream = 0; stream < 2; stream++) {
+		memset(counts, 0, sizeof(counts));
+		/* the buffer on screen is the driver's too, frame_done queued it again */
+		for (i = 0; i < dev->nbufs[stream]; i++) {
+			if (parked[stream] & (1u << i))
+				counts[STATS_OWNER_PARKED]++;
+			else if (sink[stream] && sink_held(sink[stream], i))
+				counts[STATS_OWNER_SINK]++;
+			else if (share && share_held(share, stream, i))
+				counts[STATS_OWNER_SHARE]++;
+			else
+				counts[STATS_OWNER_DRIVER]++;
+		}
+		stats_buffers(timing, stream, counts);
+	}
+	stats_publish(timing, stats_now());
+}
+
+/* A line per stream, only the characters that changed get drawn */
+static void hud_refresh(struct drm_dev_t *dev)
+{
+	struct stream_stats *st;
+	uint64_t now = now_ms(), elapsed = now - hud_shown;
+	char line[HUD_COLS + 1];
+	int i;
+
+	if (elapsed < HUD_REFRESH_MS)
+		return;
+	hud_shown = now;
+
+	for (i = 0; i < 2; i++) {
+		st = &stats[i];
+		if (dev->v4l2_fd[i] < 0)
+			snprintf(line, sizeof(line), "S%d NO SIGNAL  DROP %u", i, st->drops);
+		else if (st->timed)
+			snprintf(line, sizeof(line), "S%d FPS %5.1f LAT %6.1fMS DROP %u", i,
+				 st->frames * 1000.0 / elapsed, st->latency_us / 1000.0 / st->timed, st->drops);
+		else
+			snprintf(line, sizeof(line), "S%d FPS %5.1f LAT      -   DROP %u", i,
+				 st->frames * 1000.0 / elapsed, st->drops);
+		hud_print(hud, i, line);
+		st->frames = st->timed = 0;
+		st->latency_us = 0;
+	}
+}
+
+static void share_release_handler(int stream, int index, void *data)
+{
+	/* the sink requeues it once the write is done */
+	if (sink[stream] && sink_held(sink[stream], index))
+		return;
+	stream_requeue(data, stream, index);
+}
+
+static void sink_release_handler(int stream, int index, void *data)
+{
+	if (share && share_held(share, stream, index))
+		return;
+	stream_requeue(data, stream, index);
+}
+
+/*
+ * A captured frame into the stream's recording. The sink holds the
+ * buffer until the disk has it, the buffered recorder copies it out
+ * of the mapped buffer. Returns whether the buffer is held.
+ */
+static int stream_record(struct drm_dev_t *dev, int stream, const struct v4l2_buffer *buf)
+{
+	struct drm_buffer_t *bufs = stream ? dev->plane1bufs : dev->bufs;
+	struct v4l2_pix_format_mplane *pix = &v4l2_fmt[stream].fmt.pix_mp;
+	int held = 0;
+
+	if (sink[stream]) {
+		held = sink_write(sink[stream], buf->index, pix, buf, bufs[buf->index].buf,
+				  bufctl[stream].active - 2);
+		if (held >= 0)
+			return held;
+		fprintf(stderr, "stream %d: recording failed, stopped\n", stream);
+		sink_close(sink[stream]);
+		sink[stream] = NULL;
+		return 0;
+	}
+
+	if (record_frame(recorder[stream], pix, buf, bufs[buf->index].buf) < 0) {
+		fprintf(stderr, "stream %d: recording failed, stopped\n", stream);
+		record_close(recorder[stream]);
+		recorder[stream] = NULL;
+	}
+	return 0;
+}
+
+/* Direct I/O where the file and the kernel take it, buffered otherwise */
+static void stream_record_open(struct drm_dev_t *dev)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (!record_path[i][0])
+			continue;
+		sink[i] = sink_open(record_path[i], i, sink_release_handler, dev);
+		if (sink[i])
+			continue;
+		recorder[i] = record_open(record_path[i]);
+		if (!recorder[i])
+			fatal("cannot record");
+		fprintf(stderr, "stream %d: recording through the page cache\n", i);
+	}
+}
+
+/* Hand a displayed frame to the recording and the subscribers, or straight back to V4L2 */
+static void frame_done(struct drm_dev_t *dev, int camera_id, struct v4l2_buffer *buf)
+{
+	struct drm_buffer_t *bufs = camera_id ? dev->plane1bufs : dev->bufs;
+	int index = buf->index, held = 0;
+
+	if (sink[camera_id] || recorder[camera_id])
+		held = stream_record(dev, camera_id, buf);
+
+	if (share) {
+		struct v4l2_pix_format_mplane *pix = &v4l2_fmt[camera_id].fmt.pix_mp;
+		struct share_frame frame = {
+			.stream = camera_id,
+			.index = index,
+			.sequence = buf->sequence,
+			.fourcc = pix->pixelformat,
+			.width = pix->width,
+			.height = pix->height,
+			.pitch = pix->plane_fmt[0].bytesperline,
+			.size = pix->plane_fmt[0].sizeimage,
+			.timestamp = buf->timestamp.tv_sec * 1000000000ULL + buf->timestamp.tv_usec * 1000ULL,
+		};
+
+		/* requeued from share_release_handler once everyone let go */
+		if (share_publish(share, &frame, bufs[index].dmabuf_fd) > 0)
+			held = 1;
+	}
+
+	if (!held)
+		stream_requeue(dev, camera_id, index);
+}
+
+/* A dequeued frame: onto its plane, then to the sink and subscribers or back to the driver */
+static void stream_captured(struct drm_dev_t *dev, int camera_id, struct v4l2_buffer *buf)
+{
+	int ret;
+
+	next_buffer_index[camera_id] = buf->index;
+	last_frame[camera_id] = now_ms();
+	if (timing)
+		stats_dequeue(timing, camera_id, buf->index, v4l2_buffer_time(buf),
+			      buf->sequence, stats_now());
+
+	ret = stream_show(dev, camera_id, buf->index);
+	if (ret < 0)
+		printf("drmModeSetPlane%d err %d\n", camera_id + 1, ret);
+	else if (!t_mark[T_FIRST_FRAME]) {
+		startup_mark(T_FIRST_FRAME);
+		startup_report();
+	}
+	if (ret >= 0) {
+		stream_account(camera_id, buf);
+		stream_submitted(dev, camera_id, buf);
+	} else {
+		PROBE5(drop, camera_id, buf->index, buf->sequence, v4l2_buffer_time(buf), 0);
+	}
+
+	frame_done(dev, camera_id, buf);
+	stream_resize(dev, camera_id, buf);
+}
 
 static void mainloop(int v4l2_fd[2], int drm_fd, struct drm_dev_t *dev)
 {
@@ -45,18 +1578,35 @@ static void mainloop(int v4l2_fd[2], int drm_fd, struct drm_dev_t *dev)
 
         memset(&ev, 0, sizeof ev);
         ev.version = DRM_EVENT_CONTEXT_VERSION;
-        ev.vblank_handler = NULL;
+        ev.vblank_handler = vblank_handler;
         ev.page_flip_handler = page_flip_handler;
 
-	struct pollfd fds[] = {
+	struct pollfd fds[6 + 1 + SHARE_MAX_CLIENTS] = {
 		{ .fd = STDIN_FILENO, .events = POLLIN },
-		{ .fd = v4l2_fd[0], .events = POLLIN },
-		{ .fd = v4l2_fd[1], .events = POLLIN },		
+		{ .fd = v4l2_fd[0], .events = POLLIN | POLLPRI },
+		{ .fd = v4l2_fd[1], .events = POLLIN | POLLPRI },
 		{ .fd = drm_fd, .events = POLLIN },
+		{ .fd = sink[0] ? sink_fd(sink[0]) : -1, .events = POLLIN },
+		{ .fd = sink[1] ? sink_fd(sink[1]) : -1, .events = POLLIN },
 	};
+	int nfds;
 
 	while (1) {
-		r = poll(fds, 4, 3000);
+		/*
+		 * A stream being restarted has fd -1, which poll skips. So has
+		 * one whose buffers are all held: there is nothing to dequeue,
+		 * and vb2 reports POLLERR on an empty queue until one is back.
+		 */
+		fds[1].fd = stream_drained(dev, 0) ? -1 : v4l2_fd[0];
+		fds[2].fd = stream_drained(dev, 1) ? -1 : v4l2_fd[1];
+		/* a sink that failed is gone */
+		fds[4].fd = sink[0] ? sink_fd(sink[0]) : -1;
+		fds[5].fd = sink[1] ? sink_fd(sink[1]) : -1;
+		nfds = 6;
+		if (share)
+			nfds += share_pollfds(share, &fds[6]);
+
+		r = poll(fds, nfds, STREAM_RETRY_MS);
 		if (-1 == r) {
 			if (EINTR == errno)
 				continue;
@@ -64,105 +1614,274 @@ static void mainloop(int v4l2_fd[2], int drm_fd, struct drm_dev_t *dev)
 			return;
 		}
 
-		if (0 == r) {
-			fprintf(stderr, "timeout\n");
-			return;
-		}
+		/* a lost camera is restarted on its own, the display stays up */
+		stream_watchdog(dev);
+		if (hud)
+			hud_refresh(dev);
+		if (timing)
+			stream_timing_publish(dev);
+		if (0 == r)
+			continue;
 
+		/* a layout name, view, colour or blend command takes effect, anything else quits */
 		if (fds[0].revents & POLLIN) {
+			char line[64];
+			enum layout_kind kind;
+			int main;
+
+			if (!fgets(line, sizeof(line), stdin))
+				line[0] = 0;
+			if (layout_parse(line, &kind, &main) == 0) {
+				stream_relayout(dev, kind, main);
+				continue;
+			}
+			if (stream_view_command(dev, line) == 0)
+				continue;
+			if (display_color_command(dev, line) == 0)
+				continue;
+			if (stream_blend_command(dev, line) == 0)
+				continue;
 			fprintf(stdout, "User requested exit\n");
 			return;
 		}
-		if (fds[1].revents & POLLIN) {
+		/* before the cameras, publishing may reshuffle the subscribers */
+		if (share)
+			share_handle(share, &fds[6], nfds - 6);
+
+		/* finished writes give their buffers back before new frames come */
+		if (sink[0] && (fds[4].revents & POLLIN))
+			sink_handle(sink[0]);
+		if (sink[1] && (fds[5].revents & POLLIN))
+			sink_handle(sink[1]);
+
+		/* V4L2 events, handled before any frame of the old format */
+		if ((fds[1].revents & POLLPRI) && v4l2_fd[0] >= 0)
+			stream_events(dev, 0);
+		if ((fds[2].revents & POLLPRI) && v4l2_fd[1] >= 0)
+			stream_events(dev, 1);
+
+		/* POLLERR with buffers queued: the queue errored or stopped streaming */
+		if ((fds[1].revents & POLLERR) && v4l2_fd[0] >= 0 && fds[1].fd == v4l2_fd[0])
+			stream_stop(dev, 0, "capture error", 0);
+		if ((fds[2].revents & POLLERR) && v4l2_fd[1] >= 0 && fds[2].fd == v4l2_fd[1])
+			stream_stop(dev, 1, "capture error", 0);
+
+		if ((fds[1].revents & POLLIN) && v4l2_fd[0] >= 0) {
 			camera_id = 0;
 			/* Video buffer captured, dequeue it
 			 * and store it for scanout.
 			 */
 			int dequeued = v4l2_dequeue_buffer(v4l2_fd[camera_id], &buf, camera_id);
-			if (dequeued) {
-				next_buffer_index = buf.index;
+			/*
+			 * Only a replay ends for good. A device returns EPIPE after
+			 * a buffer flagged LAST, around EOS or a source change,
+			 * and comes back when restarted.
+			 */
+			if (dequeued == V4L2_END_OF_STREAM) {
+				stream_stop(dev, camera_id, "end of stream", pattern_is(v4l2_fd[camera_id]));
+				continue;
 			}
-
-			static int aaa = 1;
-			if(aaa) {
-				// struct timespec time1, time2;
-				// clock_gettime(CLOCK_MONOTONIC, &time1);
-
-				int ret = drmModeSetPlane(drm_fd, dev->plane_res->planes[0], dev->crtc_id, dev->bufs[next_buffer_index].fb_id, DRM_MODE_PAGE_FLIP_ASYNC,
-						0, 0, 1920, 1080,
-						0, 0, 1920 << 16, (1080) << 16);		
-				if(ret < 0)
-					printf("drmModeSetPlane1 err %d\n",ret);
-
-				// int ret = drmModeSetCrtc(drm_fd, dev->crtc_id, dev->bufs[next_buffer_index].fb_id, 0, 0, &dev->conn_id, 1, &dev->mode);
-				// if (ret < 0) {
-				// 	printf("drmModeSetCrtc() failed, ret=%d\n", ret);
-				// }
-
-				// clock_gettime(CLOCK_MONOTONIC, &time2);
-				// printf("ProcessTime1:%ld \n", time2.tv_nsec-time1.tv_nsec);
-
-				aaa = 1;
-			} 
-			
-			v4l2_queue_buffer(v4l2_fd[camera_id], next_buffer_index, dev->bufs[next_buffer_index].dmabuf_fd, camera_id);		
-		
+			if (dequeued < 0) {
+				stream_stop(dev, camera_id, "capture error", 0);
+				continue;
+			}
+			/* 0 when nothing was ready after all: no frame, nothing to give back */
+			if (dequeued)
+				stream_captured(dev, camera_id, &buf);
 		}
-		if (fds[2].revents & POLLIN) {
+		if ((fds[2].revents & POLLIN) && v4l2_fd[1] >= 0) {
 			camera_id = 1;
 			/* Video buffer captured, dequeue it
 			 * and store it for scanout.
 			 */
 			int dequeued = v4l2_dequeue_buffer(v4l2_fd[camera_id], &buf, camera_id);
-			if (dequeued) {
-				next_buffer_index = buf.index;
+			/*
+			 * Only a replay ends for good. A device returns EPIPE after
+			 * a buffer flagged LAST, around EOS or a source change,
+			 * and comes back when restarted.
+			 */
+			if (dequeued == V4L2_END_OF_STREAM) {
+				stream_stop(dev, camera_id, "end of stream", pattern_is(v4l2_fd[camera_id]));
+				continue;
+			}
+			if (dequeued < 0) {
+				stream_stop(dev, camera_id, "capture error", 0);
+				continue;
 			}
+			/* 0 when nothing was ready after all: no frame, nothing to give back */
+			if (dequeued)
+				stream_captured(dev, camera_id, &buf);
+		}
+
+		if (fds[3].revents & POLLIN) {
+			drmHandleEvent(drm_fd, &ev);
+		}
+	}
+}
 
-			static int bbb = 1;
-			if(bbb) {
-				// struct timespec time1, time2;
-				// clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time1);
+/* "-r 180" or per stream "-r 90,0x" */
+static void parse_rotation(const char *arg)
+{
+	char spec[32], *tok, *save;
+	int stream = 0;
 
-				int ret = drmModeSetPlane(drm_fd, dev->plane_res->planes[1], dev->crtc_id, dev->plane1bufs[next_buffer_index].fb_id, DRM_MODE_PAGE_FLIP_ASYNC,
-						480*2, 270*2, 480*2, 270*2,
-						0, 0, 1920 << 16, (1080) << 16);
-				if(ret < 0)
-					printf("drmModeSetPlane2 err %d\n",ret);
+	snprintf(spec, sizeof(spec), "%s", arg);
+	for (tok = strtok_r(spec, ",", &save); tok && stream < 2;
+	     tok = strtok_r(NULL, ",", &save), stream++) {
+		if (rotate_parse(tok, &rotation[stream]) < 0)
+			fatal("rotation is 0, 90, 180 or 270, then optionally x and/or y to reflect");
+	}
+	if (stream == 1)
+		rotation[1] = rotation[0];
+}
 
-				// clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time2);
-				// printf("ProcessTime2:%ld \n", time2.tv_nsec-time1.tv_nsec);					
-				bbb = 1;	
-			}	
-			
-			v4l2_queue_buffer(v4l2_fd[camera_id], next_buffer_index, dev->plane1bufs[next_buffer_index].dmabuf_fd, camera_id);
+/*
+ * "-z 3", "-a 0.5" or "-m premulti", or one per stream: "-z 2,3". A
+ * single zpos puts the second stream right above the first, planes
+ * can't share one.
+ */
+static void parse_blend(int opt, const char *arg)
+{
+	char spec[32], *tok, *save;
+	int stream = 0;
 
+	snprintf(spec, sizeof(spec), "%s", arg);
+	for (tok = strtok_r(spec, ",", &save); tok && stream < 2;
+	     tok = strtok_r(NULL, ",", &save), stream++) {
+		if (opt == 'z') {
+			if ((plane_zpos[stream] = parse_zpos(tok)) < -1)
+				fatal("zpos is auto or 0 and up");
+		} else if (opt == 'a') {
+			plane_alpha[stream] = atof(tok);
+			if (plane_alpha[stream] < 0 || plane_alpha[stream] > 1)
+				fatal("alpha goes from 0, transparent, to 1, opaque");
+		} else if ((plane_blend[stream] = blend_parse(tok)) < 0) {
+			fatal("blend mode is none, premulti or coverage");
 		}
+	}
+	if (stream == 1) {
+		plane_zpos[1] = plane_zpos[0] >= 0 ? plane_zpos[0] + 1 : -1;
+		plane_alpha[1] = plane_alpha[0];
+		plane_blend[1] = plane_blend[0];
+	}
+	if (opt == 'z' && plane_zpos[0] >= 0 && plane_zpos[0] == plane_zpos[1])
+		fatal("the two streams need different zpos");
+}
 
-		if (fds[3].revents & POLLIN) {
-			drmHandleEvent(drm_fd, &ev);
-		}
+/* "-o cam0.rec" records the first stream, "-o cam0.rec,cam1.rec" both, "-o ,cam1.rec" the second */
+static void parse_record(const char *arg)
+{
+	char spec[512], *paths[2];
+	int stream;
+
+	snprintf(spec, sizeof(spec), "%s", arg);
+	paths[0] = spec;
+	paths[1] = strchr(spec, ',');
+	if (paths[1])
+		*paths[1]++ = 0;
+
+	for (stream = 0; stream < 2; stream++)
+		if (paths[stream])
+			snprintf(record_path[stream], sizeof(record_path[stream]), "%s", paths[stream]);
+}
+
+/* "-b 4", "-b auto" or per stream "-b 3,auto" */
+static void parse_bufcount(const char *arg)
+{
+	char spec[32], *tok, *save;
+	int stream = 0;
+
+	snprintf(spec, sizeof(spec), "%s", arg);
+	for (tok = strtok_r(spec, ",", &save); tok && stream < 2;
+	     tok = strtok_r(NULL, ",", &save), stream++) {
+		bufcount[stream] = strcmp(tok, "auto") ? atoi(tok) : 0;
+		if (bufcount[stream] && (bufcount[stream] < 2 || bufcount[stream] > BUFCOUNT_MAX))
+			fatal("buffer count out of range");
 	}
+	if (stream == 1)
+		bufcount[1] = bufcount[0];
 }
 
 int main(int argc, char *argv[])
 {
 	struct drm_dev_t *dev_head, *dev;
-	int v4l2_fd, drm_fd;
-	int dmabufs[2][BUFCOUNT];
+	int drm_fd;
 	int i = 0;
-	int camera_id = 0;
+	int opt;
+	int fast = 0;
+	int takeover = 0;
+	int compose_all = 0;
+	int diagnostics = 0;
+	enum layout_kind layout_kind = LAYOUT_PIP;
+	int layout_main = 0;
 
-	drm_fd = drm_open(dri_path, 1, 1);
-	dev_head = drm_find_dev(drm_fd);
+	t_start = now_us();
 
-	if (dev_head == NULL) {
-		fprintf(stderr, "available drm_dev not found\n");
-		return EXIT_FAILURE;
+	while ((opt = getopt(argc, argv, "a:b:cdfg:k:l:m:o:p:r:s:tw:z:")) != -1) {
+		switch (opt) {
+		case 'a':
+		case 'm':
+		case 'z':
+			parse_blend(opt, optarg);
+			break;
+		case 'b':
+			parse_bufcount(optarg);
+			break;
+		case 'c':
+			compose_all = 1;
+			break;
+		case 'd':
+			diagnostics = 1;
+			break;
+		case 'f':
+			fast = 1;
+			break;
+		case 'g':
+			display_gamma = atof(optarg);
+			if (display_gamma <= 0)
+				fatal("gamma must be above 0");
+			break;
+		case 'k':
+			dri_path = optarg;
+			break;
+		case 'l':
+			if (layout_parse(optarg, &layout_kind, &layout_main) < 0)
+				fatal("layout is grid, pip or focus, then optionally the main stream");
+			break;
+		case 'o':
+			parse_record(optarg);
+			break;
+		case 'p':
+			timing_name = optarg;
+			break;
+		case 'r':
+			parse_rotation(optarg);
+			break;
+		case 's':
+			share_path = optarg;
+			break;
+		case 't':
+			takeover = 1;
+			break;
+		case 'w':
+			if (sscanf(optarg, "%lf,%lf,%lf", &white_balance[0], &white_balance[1],
+				   &white_balance[2]) != 3)
+				fatal("white balance is three gains, r,g,b");
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-a alpha[,alpha]] [-b count|auto[,count|auto]] [-c] [-d] [-f] [-g gamma] [-k card] "
+				"[-l layout] [-m blend[,blend]] [-o file[,file]] [-p shm] [-r rotation[,rotation]] [-s socket] [-t] "
+				"[-w r,g,b] [-z zpos[,zpos]] [video0 video1]\n"
+				"a video may also be %sWIDTHxHEIGHT[@FPS][:uyvy|yuyv|nv12|nv16|xrgb]\n"
+				"or %sfile[,fast][,loop] to play back what -o recorded\n",
+				argv[0], PATTERN_PREFIX, PATTERN_REPLAY_PREFIX);
+			return EXIT_FAILURE;
+		}
 	}
 
-	if(argc >= 3) {
-		strcpy(v4l2_path[0], argv[1]);
-		strcpy(v4l2_path[1], argv[2]);		
+	if(argc - optind >= 2) {
+		strcpy(v4l2_path[0], argv[optind]);
+		strcpy(v4l2_path[1], argv[optind + 1]);
 	} else {
 		strcpy(v4l2_path[0], "/dev/video22");
 		strcpy(v4l2_path[1], "/dev/video31");		
@@ -170,6 +1889,23 @@ int main(int argc, char *argv[])
 
 	printf("v4l2_path[0]=%s, v4l2_path[1]=%s\n", v4l2_path[0], v4l2_path[1]);
 
+	/* sensors can take a while to power up, don't make the display wait */
+	for (i = 0; i < 2; i++) {
+		probes[i].stream = i;
+		if (pthread_create(&probes[i].thread, NULL, stream_probe_thread, &probes[i]))
+			fatal("pthread_create failed");
+	}
+
+	drm_fd = drm_open(dri_path, 1, 1);
+	/* fast start: no connector detect cycle, no keypress */
+	dev_head = drm_find_dev_probe(drm_fd, !fast);
+
+	if (dev_head == NULL) {
+		fprintf(stderr, "available drm_dev not found\n");
+		return EXIT_FAILURE;
+	}
+	startup_mark(T_DRM_PROBE);
+
 	/*****
 	connector id:208
 			encoder id:207 crtc id:119
@@ -189,27 +1925,104 @@ int main(int argc, char *argv[])
 			break;
 		}
 	}
+	/* anywhere else, the first connected one */
+	if (!dev)
+		dev = dev_head;
+
+	/* auto starts minimal: one on screen, one filling, one spare */
+	for (i = 0; i < 2; i++) {
+		if (bufcount[i])
+			v4l2_bufctl_init(&bufctl[i], bufcount[i], bufcount[i]);
+		else
+			v4l2_bufctl_init(&bufctl[i], 3, BUFCOUNT_MAX);
+		dev->nbufs[i] = bufctl[i].active;
+	}
 
+	dev->drm_fd = drm_fd;
+	dev->no_pause = fast;
+	/* restarts cost a plane update, not a modeset */
+	if (takeover)
+		drm_takeover(drm_fd, dev);
 	drm_setup_fb(drm_fd, dev, 1, 1);
+	display_color(dev);
 
-	for(i = 0; i < BUFCOUNT; i++) {
-		dmabufs[0][i] = dev->bufs[i].dmabuf_fd;		
-		dmabufs[1][i] = dev->plane1bufs[i].dmabuf_fd;
+	if (!dev->plane_res || !dev->plane_res->count_planes)
+		fatal("no planes");
+	if (layout_compute(&layout, layout_kind, layout_main, dev->mode.hdisplay, dev->mode.vdisplay, 2) < 0)
+		fatal("layout does not fit");
+	for (i = 0; i < 2; i++) {
+		stream_rect[i] = layout_fit(&layout, i, dev->fb_width[i], dev->fb_height[i]);
+		view_reset(&view[i], dev->fb_width[i], dev->fb_height[i]);
+	}
+	/* a plane per camera if there are enough, otherwise draw them into one */
+	if (compose_all || dev->plane_res->count_planes < 2) {
+		compose = compose_open(drm_fd, dev, dev->plane_res->planes[0]);
+		if (!compose)
+			fatal("cannot composite the streams");
+		for (i = 0; i < 2; i++)
+			compose_layer[i] = compose_add_layer(compose, stream_rect[i].x, stream_rect[i].y,
+							     stream_rect[i].width, stream_rect[i].height);
+		compose_stack(compose, layout.zorder);
+	} else {
+		for (i = 0; i < 2; i++)
+			stream_check_blend(dev, i);
+		stream_stack(dev);
 	}
+	/* on a spare plane, the streams' planes stay as they are */
+	if (diagnostics)
+		hud = hud_open(drm_fd, dev, 2, 8, 8);
+	startup_mark(T_DRM_BUFFERS);
+
+	for (i = 0; i < 2; i++)
+		pthread_join(probes[i].thread, NULL);
+	startup_mark(T_CAMERAS);
 
 	for(i = 0; i < 2; i++){
-		camera_id = i;
-		v4l2_fd = v4l2_open(v4l2_path[i]);
-		//因摄像头和显示器不一定能设置位相同的模式，后面三个参数保留
-		v4l2_init(v4l2_fd, dev->width, dev->height, dev->pitch);
-		v4l2_init_dmabuf(v4l2_fd, dmabufs[camera_id], BUFCOUNT, camera_id);
-		v4l2_start_capturing_dmabuf(v4l2_fd, camera_id);
-		dev->v4l2_fd[camera_id] = v4l2_fd;
+		dev->v4l2_fd[i] = -1;
+		if (probes[i].fd < 0 || stream_setup(dev, i, probes[i].fd, &probes[i].fmt) < 0) {
+			if (probes[i].fd >= 0)
+				v4l2_close(probes[i].fd);
+			fprintf(stderr, "stream %d: %s not ready, will keep trying\n", i, v4l2_path[i]);
+		}
+	}
+	startup_mark(T_STREAMON);
+
+	if (share_path) {
+		share = share_open(share_path, share_release_handler, dev);
+		if (!share)
+			fatal("cannot publish frames");
+	}
+	stream_record_open(dev);
+	if (timing_name) {
+		timing = stats_open(timing_name);
+		if (!timing)
+			fatal("cannot publish timing");
+		stats_calls(timing, TRACE_TABLE());
 	}
 
-	dev->drm_fd = drm_fd;
 	mainloop(dev->v4l2_fd, drm_fd, dev);
 
+	if (share)
+		share_close(share, share_path);
+	for (i = 0; i < 2; i++) {
+		if (sink[i])
+			sink_close(sink[i]);
+		if (recorder[i])
+			record_close(recorder[i]);
+	}
+	if (timing)
+		stats_close(timing);
+	if (hud)
+		hud_close(hud);
+	if (compose)
+		compose_close(compose);
+	for (i = 0; i < 2; i++)
+		if (scaler[i])
+			scale_destroy(scaler[i]);
+	if (scale_pool)
+		copy_pool_destroy(scale_pool);
+	for (i = 0; i < 2; i++)
+		free(rot_rgb[i].planes[0]);
 	drm_destroy(drm_fd, dev_head);
 	return 0;
 }
@@ -0,0 +1,526 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <drm_fourcc.h>
+
+#include "videodev2.h"
+#include "drm.h"
+#include "v4l2.h"
+
+/*
+ * Glass to glass latency of the dmabuf pipeline, with no camera and no
+ * GPU: frames carrying a counter go into the vivid video output, which
+ * vivid loops back to its HDMI capture. The capture is scanned out from
+ * dmabufs on a vkms plane as test-dmabuf does it, and a vkms writeback
+ * connector copies every composed frame back, where the counter is read.
+ *
+ * Latency runs from queueing a frame on the vivid output to the
+ * writeback fence signalling, i.e. the frame having been scanned out.
+ */
+
+/* frames measured after the warmup, 10 s at 60 Hz */
+#define LATENCY_FRAMES	600
+#define LATENCY_WARMUP	30
+#define CAPTURE_BUFS	4
+#define SOURCE_BUFS	2
+/* sent time per counter value, far more than can be in flight */
+#define SENT_RING	256
+
+/* the counter as 32 blocks across the top: its bits, then its complement below */
+#define CODE_BITS	32
+#define CODE_ROWS	16
+
+struct source {
+	int fd;
+	uint32_t width, height, pitch;
+	void *mem[SOURCE_BUFS];
+	size_t length[SOURCE_BUFS];
+	pthread_t thread;
+	uint64_t sent[SENT_RING];	/* us, by counter */
+};
+
+struct writeback {
+	uint32_t conn_id;
+	uint32_t crtc_prop, fb_prop, fence_prop;
+	struct drm_buffer_t bufs[2];
+	int next;
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* The first /dev/dri/card* that vkms drives */
+static int find_vkms(char *path, size_t len)
+{
+	drmVersion *ver;
+	int i, fd, found;
+
+	for (i = 0; i < 16; i++) {
+		snprintf(path, len, "/dev/dri/card%d", i);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		ver = drmGetVersion(fd);
+		found = ver && !strcmp(ver->name, "vkms");
+		if (ver)
+			drmFreeVersion(ver);
+		close(fd);
+		if (found)
+			return 0;
+	}
+	return -1;
+}
+
+/* The first vivid node with a capability, open */
+static int find_vivid(uint32_t caps)
+{
+	struct v4l2_capability cap;
+	char path[32];
+	int i, fd;
+
+	for (i = 0; i < 64; i++) {
+		snprintf(path, sizeof(path), "/dev/video%d", i);
+		fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == 0 && !strcmp((char *)cap.driver, "vivid")
+			&& (cap.device_caps & caps)) {
+			printf("vivid: %s\n", path);
+			return fd;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+/* HDMI in or out, in the DV timings of a width x height mode, in XBGR32 */
+static int vivid_setup(int fd, int output, uint32_t width, uint32_t height, struct v4l2_format *fmt)
+{
+	struct v4l2_input in;
+	struct v4l2_output out;
+	struct v4l2_enum_dv_timings et;
+	unsigned int i;
+	int found = 0;
+
+	for (i = 0; !found; i++) {
+		memset(&in, 0, sizeof(in));
+		memset(&out, 0, sizeof(out));
+		in.index = out.index = i;
+		if (xioctl(fd, output ? VIDIOC_ENUMOUTPUT : VIDIOC_ENUMINPUT, output ? (void *)&out : (void *)&in))
+			break;
+		if (!strncmp((char *)(output ? out.name : in.name), "HDMI", 4))
+			found = xioctl(fd, output ? VIDIOC_S_OUTPUT : VIDIOC_S_INPUT, &i) == 0;
+	}
+	if (!found) {
+		fprintf(stderr, "vivid: no HDMI %s\n", output ? "output" : "input");
+		return -1;
+	}
+
+	for (i = 0, found = 0; !found; i++) {
+		memset(&et, 0, sizeof(et));
+		et.index = i;
+		if (xioctl(fd, VIDIOC_ENUM_DV_TIMINGS, &et))
+			break;
+		if (et.timings.bt.width == width && et.timings.bt.height == height && !et.timings.bt.interlaced)
+			found = xioctl(fd, VIDIOC_S_DV_TIMINGS, &et.timings) == 0;
+	}
+	if (!found) {
+		fprintf(stderr, "vivid: no DV timings for %ux%u\n", width, height);
+		return -1;
+	}
+
+	memset(fmt, 0, sizeof(*fmt));
+	fmt->type = output ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	fmt->fmt.pix_mp.width = width;
+	fmt->fmt.pix_mp.height = height;
+	fmt->fmt.pix_mp.pixelformat = V4L2_PIX_FMT_XBGR32;
+	fmt->fmt.pix_mp.field = V4L2_FIELD_NONE;
+	fmt->fmt.pix_mp.num_planes = 1;
+	if (xioctl(fd, VIDIOC_S_FMT, fmt) || fmt->fmt.pix_mp.pixelformat != V4L2_PIX_FMT_XBGR32
+		|| fmt->fmt.pix_mp.width != width || fmt->fmt.pix_mp.height != height) {
+		fprintf(stderr, "vivid: can't do %ux%u XBGR32\n", width, height);
+		return -1;
+	}
+	return 0;
+}
+
+/* Have vivid copy what is output into what is captured */
+static int vivid_loop(int fd)
+{
+	struct v4l2_queryctrl qc;
+	struct v4l2_control ctrl;
+
+	memset(&qc, 0, sizeof(qc));
+	qc.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+	while (xioctl(fd, VIDIOC_QUERYCTRL, &qc) == 0) {
+		if (!strcmp((char *)qc.name, "Loop Video")) {
+			ctrl.id = qc.id;
+			ctrl.value = 1;
+			return xioctl(fd, VIDIOC_S_CTRL, &ctrl);
+		}
+		qc.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+	}
+	fprintf(stderr, "vivid: no Loop Video control\n");
+	return -1;
+}
+
+static void code_write(uint8_t *mem, uint32_t pitch, uint32_t width, uint32_t counter)
+{
+	uint32_t block = width / CODE_BITS, y, b, bits;
+	uint32_t *row;
+
+	for (y = 0; y < 2 * CODE_ROWS; y++) {
+		row = (uint32_t *)(mem + y * pitch);
+		bits = y < CODE_ROWS ? counter : ~counter;
+		for (b = 0; b < CODE_BITS; b++)
+			memset(row + b * block, bits >> (CODE_BITS - 1 - b) & 1 ? 0xff : 0x00, block * 4);
+	}
+}
+
+/* The counter, or -1 if the two rows disagree: a torn or garbled frame */
+static int code_read(const uint8_t *mem, uint32_t pitch, uint32_t width, uint32_t *counter)
+{
+	uint32_t block = width / CODE_BITS, b, bits[2] = { 0, 0 }, px;
+	int r;
+
+	for (r = 0; r < 2; r++) {
+		const uint32_t *row = (const uint32_t *)(mem + (r * CODE_ROWS + CODE_ROWS / 2) * pitch);
+
+		for (b = 0; b < CODE_BITS; b++) {
+			px = row[b * block + block / 2];
+			bits[r] = bits[r] << 1 | ((px >> 8 & 0xff) > 0x80);
+		}
+	}
+	if (bits[0] != ~bits[1])
+		return -1;
+	*counter = bits[0];
+	return 0;
+}
+
+static int source_init(struct source *src, const struct v4l2_format *fmt)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
+	unsigned int i;
+
+	src->width = fmt->fmt.pix_mp.width;
+	src->height = fmt->fmt.pix_mp.height;
+	src->pitch = fmt->fmt.pix_mp.plane_fmt[0].bytesperline;
+
+	memset(&req, 0, sizeof(req));
+	req.count = SOURCE_BUFS;
+	req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(src->fd, VIDIOC_REQBUFS, &req) || req.count != SOURCE_BUFS) {
+		errno_print("vivid output VIDIOC_REQBUFS");
+		return -1;
+	}
+
+	for (i = 0; i < SOURCE_BUFS; i++) {
+		memset(&buf, 0, sizeof(buf));
+		memset(&plane, 0, sizeof(plane));
+		buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		buf.length = 1;
+		buf.m.planes = &plane;
+		if (xioctl(src->fd, VIDIOC_QUERYBUF, &buf))
+			return -1;
+		src->length[i] = plane.length;
+		src->mem[i] = mmap(NULL, plane.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+				   src->fd, plane.m.mem_offset);
+		if (src->mem[i] == MAP_FAILED)
+			return -1;
+		/* grey under the code */
+		memset(src->mem[i], 0x60, plane.length);
+	}
+	return 0;
+}
+
+static void source_queue(struct source *src, unsigned int index, uint32_t counter)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
+
+	code_write(src->mem[index], src->pitch, src->width, counter);
+
+	memset(&buf, 0, sizeof(buf));
+	memset(&plane, 0, sizeof(plane));
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+	buf.length = 1;
+	buf.m.planes = &plane;
+	plane.bytesused = src->length[index];
+
+	__atomic_store_n(&src->sent[counter % SENT_RING], now_us(), __ATOMIC_RELEASE);
+	if (xioctl(src->fd, VIDIOC_QBUF, &buf))
+		errno_print("vivid output VIDIOC_QBUF");
+}
+
+/* A new counter into every output buffer vivid hands back */
+static void *source_thread(void *arg)
+{
+	struct source *src = arg;
+	struct pollfd pfd = { .fd = src->fd, .events = POLLOUT };
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
+	uint32_t counter = SOURCE_BUFS;
+
+	while (poll(&pfd, 1, -1) >= 0) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.length = 1;
+		buf.m.planes = &plane;
+		if (xioctl(src->fd, VIDIOC_DQBUF, &buf))
+			continue;
+		source_queue(src, buf.index, counter++);
+	}
+	return NULL;
+}
+
+static int source_start(struct source *src)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	unsigned int i;
+
+	for (i = 0; i < SOURCE_BUFS; i++)
+		source_queue(src, i, i);
+	if (xioctl(src->fd, VIDIOC_STREAMON, &type)) {
+		errno_print("vivid output VIDIOC_STREAMON");
+		return -1;
+	}
+	return pthread_create(&src->thread, NULL, source_thread, src) ? -1 : 0;
+}
+
+/* A writeback connector on our CRTC, and two buffers for it to fill */
+static int writeback_init(int fd, struct drm_dev_t *dev, struct writeback *wb)
+{
+	drmModeRes *res;
+	drmModeConnector *conn;
+	drmModeEncoder *enc;
+	drmModePropertyRes *p;
+	int i, k;
+
+	if (drmSetClientCap(fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1)) {
+		fprintf(stderr, "DRM: no writeback connectors\n");
+		return -1;
+	}
+	res = drmModeGetResources(fd);
+	if (!res)
+		return -1;
+
+	for (i = 0; i < res->count_connectors && !wb->conn_id; i++) {
+		conn = drmModeGetConnector(fd, res->connectors[i]);
+		if (!conn)
+			continue;
+		if (conn->connector_type == DRM_MODE_CONNECTOR_WRITEBACK && conn->count_encoders) {
+			enc = drmModeGetEncoder(fd, conn->encoders[0]);
+			if (enc && (enc->possible_crtcs & 1u << dev->crtc_index))
+				wb->conn_id = conn->connector_id;
+			if (enc)
+				drmModeFreeEncoder(enc);
+		}
+		for (k = 0; wb->conn_id && k < conn->count_props; k++) {
+			p = drmModeGetProperty(fd, conn->props[k]);
+			if (!p)
+				continue;
+			if (!strcmp(p->name, "CRTC_ID"))
+				wb->crtc_prop = p->prop_id;
+			else if (!strcmp(p->name, "WRITEBACK_FB_ID"))
+				wb->fb_prop = p->prop_id;
+			else if (!strcmp(p->name, "WRITEBACK_OUT_FENCE_PTR"))
+				wb->fence_prop = p->prop_id;
+			drmModeFreeProperty(p);
+		}
+		drmModeFreeConnector(conn);
+	}
+	drmModeFreeResources(res);
+
+	if (!wb->conn_id || !wb->crtc_prop || !wb->fb_prop || !wb->fence_prop) {
+		fprintf(stderr, "DRM: no writeback connector for crtc %d\n", dev->crtc_id);
+		return -1;
+	}
+	for (i = 0; i < 2; i++)
+		drm_setup_mapped_buffer(fd, dev, dev->width, dev->height, DRM_FORMAT_XRGB8888, &wb->bufs[i]);
+	printf("DRM: writeback connector %d\n", wb->conn_id);
+	return 0;
+}
+
+/* The captured frame on the plane and the writeback of the result, in one commit */
+static int commit_frame(int fd, struct drm_dev_t *dev, struct writeback *wb, uint32_t fb_id,
+			int *fence, uint32_t flags)
+{
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+	*fence = -1;
+	ret = drm_atomic_add_plane(req, &dev->plane_props[0], dev->crtc_id, fb_id,
+				   0, 0, dev->fb_width[0], dev->fb_height[0],
+				   0, 0, dev->fb_width[0] << 16, dev->fb_height[0] << 16);
+	if (ret == 0)
+		ret = drmModeAtomicAddProperty(req, wb->conn_id, wb->crtc_prop, dev->crtc_id) < 0
+			|| drmModeAtomicAddProperty(req, wb->conn_id, wb->fb_prop, wb->bufs[wb->next].fb_id) < 0
+			|| drmModeAtomicAddProperty(req, wb->conn_id, wb->fence_prop, (uint64_t)(uintptr_t)fence) < 0
+			? -1 : 0;
+	if (ret == 0)
+		ret = drmModeAtomicCommit(fd, req, flags, NULL);
+	drmModeAtomicFree(req);
+	return ret;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(uint64_t *latency, int n, unsigned int dropped, unsigned int duplicated,
+		   unsigned int unreadable)
+{
+	if (!n) {
+		printf("latency: no frame made it through\n");
+		return;
+	}
+	qsort(latency, n, sizeof(*latency), cmp_u64);
+	printf("latency over %d frames: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", n,
+	       latency[n / 2] / 1000.0, latency[(n * 99) / 100] / 1000.0, latency[n - 1] / 1000.0);
+	printf("frames dropped %u, duplicated %u, unreadable %u\n", dropped, duplicated, unreadable);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct source src;
+	struct writeback wb = { 0 };
+	struct drm_dev_t *dev;
+	struct v4l2_format fmt;
+	struct v4l2_buffer buf;
+	struct pollfd pfd, fpfd;
+	struct drm_buffer_t *out;
+	uint64_t *latency, sent, done;
+	uint32_t counter, last = 0;
+	unsigned int dropped = 0, duplicated = 0, unreadable = 0;
+	int dmabufs[CAPTURE_BUFS];
+	int drm_fd, cap_fd, fence, frames = LATENCY_FRAMES, n = 0, seen = 0, shown = -1, counted = 0, i;
+	char dri_path[32];
+
+	if (argc > 1)
+		frames = atoi(argv[1]);
+	if (frames < 1)
+		fatal("usage: test-latency [frames]");
+	latency = calloc(frames, sizeof(*latency));
+	if (!latency)
+		fatal("out of memory");
+
+	if (find_vkms(dri_path, sizeof(dri_path)) < 0)
+		fatal("no vkms card, modprobe vkms enable_writeback=1");
+	cap_fd = find_vivid(V4L2_CAP_VIDEO_CAPTURE_MPLANE);
+	src.fd = find_vivid(V4L2_CAP_VIDEO_OUTPUT_MPLANE);
+	if (cap_fd < 0 || src.fd < 0)
+		fatal("no multiplanar vivid capture and output, see the bench target in the Makefile");
+
+	drm_fd = drm_open(dri_path, 1, 1);
+	dev = drm_find_dev_probe(drm_fd, 1);
+	if (!dev)
+		fatal("vkms has no connected connector");
+	dev->drm_fd = drm_fd;
+	dev->no_pause = 1;
+	/* vkms planes take no YUV, start both streams out in XRGB8888 */
+	for (i = 0; i < 2; i++) {
+		dev->fb_width[i] = dev->width;
+		dev->fb_height[i] = dev->height;
+		dev->fb_pitch[i] = dev->width * 4;
+		dev->fb_format[i] = DRM_FORMAT_XRGB8888;
+	}
+	dev->nbufs[0] = CAPTURE_BUFS;
+	dev->nbufs[1] = 2;
+	drm_takeover(drm_fd, dev);
+	drm_setup_fb(drm_fd, dev, 0, 1);
+	if (!dev->atomic || writeback_init(drm_fd, dev, &wb) < 0)
+		fatal("vkms needs atomic commits and enable_writeback=1");
+
+	/* the frame covers the whole mode, as a vkms primary plane has to */
+	if (vivid_setup(src.fd, 1, dev->width, dev->height, &fmt) < 0 || source_init(&src, &fmt) < 0)
+		fatal("vivid output setup failed");
+	if (vivid_setup(cap_fd, 0, dev->width, dev->height, &fmt) < 0 || vivid_loop(cap_fd) < 0)
+		fatal("vivid capture setup failed");
+	drm_set_stream_format(drm_fd, dev, 0, dev->width, dev->height, fmt.fmt.pix_mp.plane_fmt[0].bytesperline,
+			      DRM_FORMAT_XRGB8888, 0, 1, 0);
+	for (i = 0; i < CAPTURE_BUFS; i++)
+		dmabufs[i] = dev->bufs[i].dmabuf_fd;
+	if (v4l2_try_init_dmabuf(cap_fd, dmabufs, CAPTURE_BUFS, 0) < 0)
+		fatal("vivid capture can't import the dumb buffers");
+
+	if (source_start(&src) < 0)
+		fatal("vivid output won't start");
+	v4l2_start_capturing_dmabuf(cap_fd, 0);
+	/* nothing is on the plane yet, the buffer kept back for it goes in too */
+	v4l2_queue_buffer(cap_fd, 0, dev->bufs[0].dmabuf_fd, 0);
+
+	pfd.fd = cap_fd;
+	pfd.events = POLLIN;
+	while (n < frames) {
+		if (poll(&pfd, 1, 1000) <= 0)
+			fatal("no frames captured, is vivid looping its HDMI output to the input?");
+		if (v4l2_dequeue_buffer(cap_fd, &buf, 0) <= 0)
+			continue;
+
+		/* the first commit also connects the writeback connector */
+		if (commit_frame(drm_fd, dev, &wb, dev->bufs[buf.index].fb_id, &fence,
+				 seen ? 0 : DRM_MODE_ATOMIC_ALLOW_MODESET) < 0)
+			fatal("atomic commit with writeback failed");
+		/* the frame that was on the plane before is free again */
+		if (shown >= 0)
+			v4l2_queue_buffer(cap_fd, shown, dev->bufs[shown].dmabuf_fd, 0);
+		shown = buf.index;
+
+		fpfd.fd = fence;
+		fpfd.events = POLLIN;
+		if (fence < 0 || poll(&fpfd, 1, 1000) <= 0)
+			fatal("writeback did not complete");
+		done = now_us();
+		close(fence);
+
+		out = &wb.bufs[wb.next];
+		wb.next ^= 1;
+		if (++seen <= LATENCY_WARMUP)
+			continue;
+		if (code_read((uint8_t *)out->buf, out->pitch, dev->width, &counter) < 0) {
+			unreadable++;
+			continue;
+		}
+		if (counted && counter == last) {
+			duplicated++;
+			continue;
+		}
+		if (counted && counter > last + 1)
+			dropped += counter - last - 1;
+		last = counter;
+		counted = 1;
+
+		sent = __atomic_load_n(&src.sent[counter % SENT_RING], __ATOMIC_ACQUIRE);
+		latency[n++] = done - sent;
+	}
+
+	report(latency, n, dropped, duplicated, unreadable);
+	free(latency);
+	drm_destroy(drm_fd, dev);
+	return 0;
+}
@@ -7,9 +7,24 @@
 #include "videodev2.h"
 #include "drm.h"
 #include "v4l2.h"
+#include "copy.h"
 
 static const char *dri_path = "/dev/dri/card0";
 static const char *v4l2_path = "/dev/video0";
+static struct copy_pool_t *copier;
+static struct v4l2_format v4l2_fmt;
+
+/* The camera frame into a scanout buffer, each side with its own pitch */
+static void copy_to_scanout(struct drm_dev_t *dev, struct drm_buffer_t *scanout, int index)
+{
+	struct v4l2_pix_format_mplane *pix = &v4l2_fmt.fmt.pix_mp;
+	uint32_t width = pix->width < dev->fb_width[0] ? pix->width : dev->fb_width[0];
+	uint32_t rows = pix->height < dev->fb_height[0] ? pix->height : dev->fb_height[0];
+
+	copy_frame(copier, scanout->buf, dev->fb_pitch[0],
+		   buffers[0][index].start, pix->plane_fmt[0].bytesperline, width * 2, rows);
+}
+
 static int next_buffer_index = -1;
 static int curr_buffer_index = 0;
 
@@ -23,7 +38,7 @@ static void page_flip_handler(int fd, unsigned int frame,
 	 * and grab the next one.
 	 */
 	if (next_buffer_index > 0) {
-		v4l2_queue_buffer(dev->v4l2_fd, curr_buffer_index, -1);
+		v4l2_queue_buffer(dev->v4l2_fd[0], curr_buffer_index, -1, 0);
 		curr_buffer_index = next_buffer_index;
 		next_buffer_index = -1;
 	}
@@ -70,10 +85,10 @@ static void mainloop(int v4l2_fd, int drm_fd, struct drm_dev_t *dev)
 			/* Video buffer captured, dequeue it
 			 * and store it for scanout.
 			 */
-			int dequeued = v4l2_dequeue_buffer(v4l2_fd, &buf);
-			if (dequeued) {
+			int dequeued = v4l2_dequeue_buffer(v4l2_fd, &buf, 0);
+			if (dequeued > 0 && (int)buf.index < dev->nbufs[0]) {
 				/* Copy to scanout buffer */
-				memcpy(dev->bufs[buf.index].buf, buffers[buf.index].start, buf.bytesused);
+				copy_to_scanout(dev, &dev->bufs[buf.index], buf.index);
 				/* Set next buffer */
 				next_buffer_index = buf.index;
 			}
@@ -102,14 +117,21 @@ int main()
 
 	v4l2_fd = v4l2_open(v4l2_path);
 	v4l2_init(v4l2_fd, dev->width, dev->height, dev->pitch);
-	v4l2_init_mmap(v4l2_fd, BUFCOUNT);
+	if (v4l2_get_format(v4l2_fd, &v4l2_fmt) < 0)
+		fatal("cannot read back the camera format");
+	v4l2_init_mmap(v4l2_fd, BUFCOUNT, 0);
 	v4l2_start_capturing_mmap(v4l2_fd);
 
-	dev->v4l2_fd = v4l2_fd;
+	dev->v4l2_fd[0] = v4l2_fd;
 	dev->drm_fd = drm_fd;
 
+	copier = copy_pool_create(-1);
+	if (!copier)
+		fatal("cannot start copy threads");
+
 	mainloop(v4l2_fd, drm_fd, dev);
 
+	copy_pool_destroy(copier);
 	drm_destroy(drm_fd, dev_head);
 	return 0;
 }
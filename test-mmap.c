@@ -7,9 +7,23 @@
 #include "videodev2.h"
 #include "drm.h"
 #include "v4l2.h"
+#include "copy.h"
 
 static const char *dri_path = "/dev/dri/card0";
 static const char *v4l2_path = "/dev/video0";
+static struct copy_pool_t *copier;
+static struct v4l2_format v4l2_fmt;
+
+/* The camera frame into a scanout buffer, each side with its own pitch */
+static void copy_to_scanout(struct drm_dev_t *dev, struct drm_buffer_t *scanout, int index)
+{
+	struct v4l2_pix_format_mplane *pix = &v4l2_fmt.fmt.pix_mp;
+	uint32_t width = pix->width < dev->fb_width[0] ? pix->width : dev->fb_width[0];
+	uint32_t rows = pix->height < dev->fb_height[0] ? pix->height : dev->fb_height[0];
+
+	copy_frame(copier, scanout->buf, dev->fb_pitch[0],
+		   buffers[0][index].start, pix->plane_fmt[0].bytesperline, width * 2, rows);
+}
 
 static void mainloop(int v4l2_fd, int drm_fd, struct drm_dev_t *dev)
 {
@@ -43,9 +57,10 @@ static void mainloop(int v4l2_fd, int drm_fd, struct drm_dev_t *dev)
 			 * act as the implicit synchronization
 			 * mechanism here.
 			 */
-			v4l2_dequeue_buffer(v4l2_fd, &buf);
-			memcpy(dev->bufs[0].buf, buffers[buf.index].start, buf.bytesused);
-			v4l2_queue_buffer(v4l2_fd, buf.index, -1);
+			if (v4l2_dequeue_buffer(v4l2_fd, &buf, 0) <= 0)
+				continue;
+			copy_to_scanout(dev, &dev->bufs[0], buf.index);
+			v4l2_queue_buffer(v4l2_fd, buf.index, -1, 0);
 	
 			drmModePageFlip(drm_fd, dev->crtc_id, dev->bufs[0].fb_id,
 				      DRM_MODE_PAGE_FLIP_EVENT, dev);
@@ -71,14 +86,21 @@ int main()
 
 	v4l2_fd = v4l2_open(v4l2_path);
 	v4l2_init(v4l2_fd, dev->width, dev->height, dev->pitch);
-	v4l2_init_mmap(v4l2_fd, BUFCOUNT);
+	if (v4l2_get_format(v4l2_fd, &v4l2_fmt) < 0)
+		fatal("cannot read back the camera format");
+	v4l2_init_mmap(v4l2_fd, BUFCOUNT, 0);
 	v4l2_start_capturing_mmap(v4l2_fd);
 
-	dev->v4l2_fd = v4l2_fd;
+	dev->v4l2_fd[0] = v4l2_fd;
 	dev->drm_fd = drm_fd;
 
+	copier = copy_pool_create(-1);
+	if (!copier)
+		fatal("cannot start copy threads");
+
 	mainloop(v4l2_fd, drm_fd, dev);
 
+	copy_pool_destroy(copier);
 	drm_destroy(drm_fd, dev_head);
 	return 0;
 }
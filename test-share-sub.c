@@ -0,0 +1,66 @@
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "share.h"
+
+static const char *share_path = "/tmp/v4l2-drm.sock";
+
+/*
+ * Minimal subscriber: maps every frame it gets, touches the first line
+ * (a byte per cache line, folded into a checksum) and gives it back. Prints the frame rate per stream once a second.
+ */
+int main(int argc, char *argv[])
+{
+	struct share_frame frame;
+	struct timespec now, last;
+	unsigned int frames[SHARE_MAX_STREAMS] = { 0 };
+	uint8_t sum = 0;
+	int fd, dmabuf_fd, i, r;
+
+	if (argc >= 2)
+		share_path = argv[1];
+
+	fd = share_connect(share_path);
+	if (fd < 0)
+		return EXIT_FAILURE;
+
+	clock_gettime(CLOCK_MONOTONIC, &last);
+
+	while ((r = share_recv(fd, &frame, &dmabuf_fd)) > 0) {
+		uint8_t *p;
+
+		p = mmap(NULL, frame.size, PROT_READ, MAP_SHARED, dmabuf_fd, 0);
+		if (p != MAP_FAILED) {
+			for (i = 0; i < (int)frame.pitch; i += 64)
+				sum ^= p[i];
+			munmap(p, frame.size);
+		}
+		close(dmabuf_fd);
+
+		if (share_release(fd, &frame) < 0)
+			break;
+		if (frame.stream < SHARE_MAX_STREAMS)
+			frames[frame.stream]++;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec != last.tv_sec) {
+			for (i = 0; i < SHARE_MAX_STREAMS; i++)
+				printf("stream %d: %u fps  ", i, frames[i]);
+			printf("(last seq %u, %ux%u pitch %u, sum %02x)\n", frame.sequence,
+				frame.width, frame.height, frame.pitch, sum);
+			memset(frames, 0, sizeof(frames));
+			last = now;
+		}
+	}
+
+	if (r < 0)
+		perror("share_recv");
+	close(fd);
+	return 0;
+}
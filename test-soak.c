@@ -0,0 +1,636 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "videodev2.h"
+#include "drm.h"
+#include "v4l2.h"
+#include "stats.h"
+
+/*
+ * Soak test of test-dmabuf on virtual devices, for hours: two vivid
+ * HDMI captures scanned out on vkms while the streams go through what
+ * real cameras put them through. A cycle is one of
+ *
+ *   a resolution change: vivid switches DV timings, test-dmabuf
+ *   renegotiates the stream;
+ *   a fatal streaming error: vivid errors the queue, test-dmabuf stops
+ *   the stream and starts it again;
+ *
+ * on each stream in turn, and every SOAK_RESTART_CYCLES the pipeline
+ * itself is stopped and started.
+ *
+ * Once a cycle has settled the pipeline is sampled: open fds, GEM
+ * handles on its DRM fd, dmabuf fds, RSS, and the frame rate from its
+ * stats segment (-p). The first SOAK_WARMUP_CYCLES of each run set what
+ * it may hold; more than that for SOAK_GROWTH_SAMPLES samples in a row
+ * is a leak. A stream running slower than it did in the first run for
+ * as long is a regression. Either fails the soak, and so do dmabufs
+ * still alive system wide after the pipeline exited (when debugfs shows
+ * them), and the pipeline exiting on its own.
+ */
+
+#define SOAK_SECS		(4 * 3600)
+#define SOAK_CYCLE_SECS		15
+/* a stream restarts within STREAM_STALL_MS + STREAM_RETRY_MS of test-dmabuf */
+#define SOAK_SETTLE_SECS	4
+#define SOAK_START_SECS		20
+#define SOAK_RESTART_CYCLES	20
+/* every action on every stream, in both timings */
+#define SOAK_WARMUP_CYCLES	8
+#define SOAK_GROWTH_SAMPLES	3
+#define SOAK_RSS_SLACK_KB	4096
+#define SOAK_FPS_TOLERANCE	10	/* % */
+/* handles are allocated lowest first, this many free in a row ends the count */
+#define SOAK_HANDLE_GAP		256
+
+#define SOAK_PIPELINE		"./test-dmabuf"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open		434
+#endif
+#ifndef SYS_pidfd_getfd
+#define SYS_pidfd_getfd		438
+#endif
+
+enum soak_resource {
+	SOAK_FDS,
+	SOAK_GEM,
+	SOAK_DMABUFS,
+	SOAK_RSS,
+	SOAK_RESOURCES
+};
+
+static const char *resource_names[SOAK_RESOURCES] = { "fds", "GEM handles", "dmabufs", "RSS KiB" };
+
+/* vivid's names for the DV timings it cycles between */
+static const char *soak_timings[2] = { "1280x720p60", "1920x1080p60" };
+
+struct soak_stream {
+	char path[32];
+	int fd;			/* ours, for the controls */
+	uint32_t timings_ctrl;
+	uint32_t error_ctrl;
+	int timings_menu[2];
+	int timing;
+};
+
+struct soak_pipeline {
+	pid_t pid;
+	int in;			/* its stdin, a line that isn't a command ends it */
+	int pidfd;
+	char shm_name[32];
+	const struct stats_shm *shm;
+};
+
+struct soak_sample {
+	long value[SOAK_RESOURCES];	/* -1 when it can't be counted */
+	double fps[STATS_STREAMS];
+};
+
+static volatile sig_atomic_t interrupted;
+
+static void on_signal(int sig)
+{
+	interrupted = 1;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-t seconds] [-c seconds] [-r cycles] [-m KiB] [-f percent] [-o log] "
+		"[video0 video1]\n"
+		"runs %s on vivid and vkms, see the soak target in the Makefile\n", argv0, SOAK_PIPELINE);
+	exit(EXIT_FAILURE);
+}
+
+/* The first /dev/dri/card* that vkms drives */
+static int find_vkms(char *path, size_t len)
+{
+	drmVersion *ver;
+	int i, fd, found;
+
+	for (i = 0; i < 16; i++) {
+		snprintf(path, len, "/dev/dri/card%d", i);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		ver = drmGetVersion(fd);
+		found = ver && !strcmp(ver->name, "vkms");
+		if (ver)
+			drmFreeVersion(ver);
+		close(fd);
+		if (found)
+			return 0;
+	}
+	return -1;
+}
+
+/* The first two multiplanar vivid captures */
+static int find_vivid(struct soak_stream *streams)
+{
+	struct v4l2_capability cap;
+	char path[32];
+	int i, fd, n = 0;
+
+	for (i = 0; i < 64 && n < 2; i++) {
+		snprintf(path, sizeof(path), "/dev/video%d", i);
+		fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == 0 && !strcmp((char *)cap.driver, "vivid")
+			&& (cap.device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE))
+			snprintf(streams[n++].path, sizeof(streams[0].path), "%s", path);
+		close(fd);
+	}
+	return n == 2 ? 0 : -1;
+}
+
+static uint32_t ctrl_find(int fd, const char *name, struct v4l2_queryctrl *qc)
+{
+	memset(qc, 0, sizeof(*qc));
+	qc->id = V4L2_CTRL_FLAG_NEXT_CTRL;
+	while (xioctl(fd, VIDIOC_QUERYCTRL, qc) == 0) {
+		if (!strcmp((char *)qc->name, name))
+			return qc->id;
+		qc->id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+	}
+	fprintf(stderr, "vivid: no %s control\n", name);
+	return 0;
+}
+
+static int menu_find(int fd, const struct v4l2_queryctrl *qc, const char *name)
+{
+	struct v4l2_querymenu qm;
+	int i;
+
+	for (i = qc->minimum; i <= qc->maximum; i++) {
+		memset(&qm, 0, sizeof(qm));
+		qm.id = qc->id;
+		qm.index = i;
+		if (xioctl(fd, VIDIOC_QUERYMENU, &qm) == 0 && !strcmp((char *)qm.name, name))
+			return i;
+	}
+	fprintf(stderr, "vivid: no %s in %s\n", name, qc->name);
+	return -1;
+}
+
+static int ctrl_set(int fd, uint32_t id, int value)
+{
+	struct v4l2_control ctrl = { .id = id, .value = value };
+
+	if (xioctl(fd, VIDIOC_S_CTRL, &ctrl)) {
+		errno_print("vivid VIDIOC_S_CTRL");
+		return -1;
+	}
+	return 0;
+}
+
+/* HDMI in, in timings picked by a control so that changing it is a source change */
+static int stream_init(struct soak_stream *st)
+{
+	struct v4l2_queryctrl qc;
+	struct v4l2_input in;
+	uint32_t mode;
+	int i, selected = -1;
+
+	st->fd = open(st->path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (st->fd < 0) {
+		fprintf(stderr, "cannot open %s: %s\n", st->path, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; selected < 0; i++) {
+		memset(&in, 0, sizeof(in));
+		in.index = i;
+		if (xioctl(st->fd, VIDIOC_ENUMINPUT, &in))
+			break;
+		if (!strncmp((char *)in.name, "HDMI", 4) && xioctl(st->fd, VIDIOC_S_INPUT, &i) == 0)
+			selected = i;
+	}
+	if (selected < 0) {
+		fprintf(stderr, "%s: no HDMI input\n", st->path);
+		return -1;
+	}
+
+	mode = ctrl_find(st->fd, "DV Timings Signal Mode", &qc);
+	if (!mode || (i = menu_find(st->fd, &qc, "Selected DV Timings")) < 0 || ctrl_set(st->fd, mode, i))
+		return -1;
+	st->timings_ctrl = ctrl_find(st->fd, "DV Timings", &qc);
+	if (!st->timings_ctrl)
+		return -1;
+	for (i = 0; i < 2; i++)
+		if ((st->timings_menu[i] = menu_find(st->fd, &qc, soak_timings[i])) < 0)
+			return -1;
+	st->error_ctrl = ctrl_find(st->fd, "Inject Fatal Streaming Error", &qc);
+	if (!st->error_ctrl)
+		return -1;
+	return 0;
+}
+
+/* Back to the first timings, latched before anyone streams */
+static int stream_reset(struct soak_stream *st)
+{
+	st->timing = 0;
+	if (ctrl_set(st->fd, st->timings_ctrl, st->timings_menu[0]))
+		return -1;
+	v4l2_apply_dv_timings(st->fd);
+	return 0;
+}
+
+static long status_kb(int pid, const char *key)
+{
+	char path[64], line[128];
+	size_t len = strlen(key);
+	long kb = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, key, len) && line[len] == ':')
+			kb = atol(line + len + 1);
+	fclose(f);
+	return kb;
+}
+
+/* Handles alive on a DRM fd: only a GEM object that isn't there is ENOENT */
+static long gem_count(int fd)
+{
+	struct drm_mode_map_dumb map;
+	uint32_t handle;
+	long n = 0;
+	int miss = 0;
+
+	for (handle = 1; miss < SOAK_HANDLE_GAP; handle++) {
+		memset(&map, 0, sizeof(map));
+		map.handle = handle;
+		if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map) == 0 || errno != ENOENT) {
+			n++;
+			miss = 0;
+		} else {
+			miss++;
+		}
+	}
+	return n;
+}
+
+/* fds, dmabufs and RSS from /proc; GEM handles through a copy of its DRM fd */
+static void sample_resources(const struct soak_pipeline *p, struct soak_sample *s)
+{
+	char path[300], link[256];
+	struct dirent *de;
+	DIR *dir;
+	ssize_t len;
+	int drm_fd = -1, fd;
+
+	s->value[SOAK_FDS] = s->value[SOAK_DMABUFS] = s->value[SOAK_GEM] = -1;
+	s->value[SOAK_RSS] = status_kb(p->pid, "VmRSS");
+
+	snprintf(path, sizeof(path), "/proc/%d/fd", p->pid);
+	dir = opendir(path);
+	if (!dir)
+		return;
+	s->value[SOAK_FDS] = s->value[SOAK_DMABUFS] = 0;
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		s->value[SOAK_FDS]++;
+		snprintf(path, sizeof(path), "/proc/%d/fd/%s", p->pid, de->d_name);
+		len = readlink(path, link, sizeof(link) - 1);
+		if (len < 0)
+			continue;
+		link[len] = 0;
+		/* "anon_inode:dmabuf" or "/dmabuf:" by kernel version */
+		if (strstr(link, "dmabuf"))
+			s->value[SOAK_DMABUFS]++;
+		else if (!strncmp(link, "/dev/dri/card", 13) && drm_fd < 0)
+			drm_fd = atoi(de->d_name);
+	}
+	closedir(dir);
+
+	if (p->pidfd < 0 || drm_fd < 0)
+		return;
+	fd = syscall(SYS_pidfd_getfd, p->pidfd, drm_fd, 0);
+	if (fd < 0)
+		return;
+	s->value[SOAK_GEM] = gem_count(fd);
+	close(fd);
+}
+
+/* dmabufs alive in the whole system, -1 without debugfs */
+static long dmabuf_total(void)
+{
+	char line[256];
+	long n = -1;
+	FILE *f;
+
+	f = fopen("/sys/kernel/debug/dma_buf/bufinfo", "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Total %ld objects", &n) == 1)
+			break;
+	fclose(f);
+	return n;
+}
+
+/* 1 once the pipeline has exited, with why in the log */
+static int pipeline_exited(struct soak_pipeline *p, int options)
+{
+	int status;
+
+	if (waitpid(p->pid, &status, options) != p->pid)
+		return 0;
+	if (WIFEXITED(status))
+		fprintf(stderr, "soak: pipeline exited with %d\n", WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+		fprintf(stderr, "soak: pipeline killed by signal %d\n", WTERMSIG(status));
+	p->pid = 0;
+	return !WIFEXITED(status) || WEXITSTATUS(status) ? -1 : 1;
+}
+
+/* Sleep, unless the pipeline dies or we are interrupted */
+static int soak_wait(struct soak_pipeline *p, double secs)
+{
+	struct timespec step = { 0, 100 * 1000000 };
+	uint64_t until = stats_now() + secs * 1e9;
+
+	while (stats_now() < until) {
+		if (interrupted)
+			return -1;
+		if (pipeline_exited(p, WNOHANG)) {
+			fprintf(stderr, "soak: the pipeline went away\n");
+			return -1;
+		}
+		nanosleep(&step, NULL);
+	}
+	return 0;
+}
+
+static int pipeline_start(struct soak_pipeline *p, const char *card, struct soak_stream *streams,
+			  int log_fd)
+{
+	int in[2], fd, i;
+
+	snprintf(p->shm_name, sizeof(p->shm_name), "/soak-%d", getpid());
+	if (pipe2(in, O_CLOEXEC) < 0)
+		return -1;
+
+	p->pid = fork();
+	if (p->pid < 0)
+		return -1;
+	if (p->pid == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(log_fd, STDOUT_FILENO);
+		dup2(log_fd, STDERR_FILENO);
+		/* fixed buffer counts, so that what is held is the same every cycle */
+		execl(SOAK_PIPELINE, SOAK_PIPELINE, "-f", "-b", "4", "-k", card, "-p", p->shm_name,
+		      streams[0].path, streams[1].path, (char *)NULL);
+		_exit(127);
+	}
+	close(in[0]);
+	p->in = in[1];
+	p->pidfd = syscall(SYS_pidfd_open, p->pid, 0);
+
+	/* up once it publishes, which it does after the streams are on */
+	for (i = 0; i < SOAK_START_SECS * 10; i++) {
+		fd = shm_open(p->shm_name, O_RDONLY, 0);
+		if (fd >= 0) {
+			close(fd);
+			p->shm = stats_attach(p->shm_name);
+			if (p->shm)
+				return 0;
+		}
+		if (soak_wait(p, 0.1) < 0)
+			return -1;
+	}
+	fprintf(stderr, "soak: pipeline not up after %d s\n", SOAK_START_SECS);
+	return -1;
+}
+
+static int pipeline_stop(struct soak_pipeline *p)
+{
+	int i, ret = -1;
+
+	if (p->shm)
+		stats_detach(p->shm);
+	p->shm = NULL;
+	if (p->pid > 0) {
+		if (write(p->in, "quit\n", 5) < 0)
+			fprintf(stderr, "soak: cannot ask the pipeline to quit: %s\n", strerror(errno));
+		for (i = 0; i < 100 && !(ret = pipeline_exited(p, WNOHANG)); i++)
+			usleep(100000);
+		if (!ret) {
+			fprintf(stderr, "soak: pipeline did not quit, killing it\n");
+			kill(p->pid, SIGKILL);
+			pipeline_exited(p, 0);
+			ret = -1;
+		}
+	}
+	close(p->in);
+	if (p->pidfd >= 0)
+		close(p->pidfd);
+	p->pidfd = -1;
+	/* left behind by a pipeline that didn't get to close it */
+	shm_unlink(p->shm_name);
+	return ret > 0 ? 0 : -1;
+}
+
+static const char *cycle_action(struct soak_stream *streams, int cycle, int *stream)
+{
+	struct soak_stream *st;
+
+	*stream = cycle & 1;
+	st = &streams[*stream];
+	if ((cycle & 2) == 0) {
+		st->timing ^= 1;
+		if (ctrl_set(st->fd, st->timings_ctrl, st->timings_menu[st->timing]))
+			return NULL;
+		return soak_timings[st->timing];
+	}
+	if (ctrl_set(st->fd, st->error_ctrl, 1))
+		return NULL;
+	return "streaming error";
+}
+
+int main(int argc, char *argv[])
+{
+	static struct soak_stream streams[2];
+	static struct stats_shm before, after;
+	struct soak_pipeline pipeline = { .pidfd = -1, .in = -1 };
+	struct soak_sample sample, peak;
+	struct sigaction sa;
+	const char *log_path = "test-soak.log", *action, *failed = NULL;
+	double duration = SOAK_SECS, cycle_secs = SOAK_CYCLE_SECS, secs;
+	double baseline[STATS_STREAMS] = { 0 };
+	long rss_slack = SOAK_RSS_SLACK_KB, system_dmabufs, left;
+	int restart_cycles = SOAK_RESTART_CYCLES, tolerance = SOAK_FPS_TOLERANCE;
+	int over[SOAK_RESOURCES] = { 0 }, slow[STATS_STREAMS] = { 0 };
+	int cycle, run = 0, run_cycle = 0, stream, log_fd, opt, i, s;
+	uint64_t start;
+	char card[32];
+
+	while ((opt = getopt(argc, argv, "c:f:m:o:r:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			cycle_secs = atof(optarg);
+			break;
+		case 'f':
+			tolerance = atoi(optarg);
+			break;
+		case 'm':
+			rss_slack = atol(optarg);
+			break;
+		case 'o':
+			log_path = optarg;
+			break;
+		case 'r':
+			restart_cycles = atoi(optarg);
+			break;
+		case 't':
+			duration = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (cycle_secs <= SOAK_SETTLE_SECS || restart_cycles <= SOAK_WARMUP_CYCLES)
+		fatal("a cycle must outlast the settling, a run the warmup");
+
+	if (find_vkms(card, sizeof(card)) < 0)
+		fatal("no vkms card, modprobe vkms");
+	if (argc - optind >= 2) {
+		snprintf(streams[0].path, sizeof(streams[0].path), "%s", argv[optind]);
+		snprintf(streams[1].path, sizeof(streams[1].path), "%s", argv[optind + 1]);
+	} else if (find_vivid(streams) < 0) {
+		fatal("no two multiplanar vivid captures, see the soak target in the Makefile");
+	}
+	for (i = 0; i < 2; i++)
+		if (stream_init(&streams[i]) < 0)
+			fatal("vivid cannot be driven through its controls");
+
+	log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (log_fd < 0)
+		fatal("cannot open the log");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	/* a dead pipeline's stdin is an error to report, not a signal */
+	signal(SIGPIPE, SIG_IGN);
+
+	system_dmabufs = dmabuf_total();
+	printf("soak: %s on %s, %s and %s for %.0f s, pipeline output in %s\n", SOAK_PIPELINE, card,
+	       streams[0].path, streams[1].path, duration, log_path);
+	if (system_dmabufs < 0)
+		printf("soak: no /sys/kernel/debug/dma_buf, dmabufs are only counted in the pipeline\n");
+
+	start = stats_now();
+	for (cycle = 0; !failed && !interrupted && stats_now() - start < duration * 1e9; cycle++) {
+		if (run_cycle == restart_cycles) {
+			if (pipeline_stop(&pipeline) < 0) {
+				failed = "the pipeline did not stop cleanly";
+				break;
+			}
+			left = dmabuf_total();
+			if (system_dmabufs >= 0 && left > system_dmabufs) {
+				fprintf(stderr, "soak: %ld dmabufs outlived the pipeline\n", left - system_dmabufs);
+				failed = "dmabufs leaked in the kernel";
+				break;
+			}
+			run++;
+			run_cycle = 0;
+		}
+		if (run_cycle == 0) {
+			for (i = 0; i < 2; i++)
+				stream_reset(&streams[i]);
+			if (pipeline_start(&pipeline, card, streams, log_fd) < 0) {
+				failed = "the pipeline did not start";
+				break;
+			}
+			memset(over, 0, sizeof(over));
+			for (i = 0; i < SOAK_RESOURCES; i++)
+				peak.value[i] = -1;
+		}
+
+		action = cycle_action(streams, run_cycle, &stream);
+		if (!action) {
+			failed = "vivid stopped taking controls";
+			break;
+		}
+		if (soak_wait(&pipeline, SOAK_SETTLE_SECS) < 0 || stats_read(pipeline.shm, &before) < 0
+		    || soak_wait(&pipeline, cycle_secs - SOAK_SETTLE_SECS) < 0 || stats_read(pipeline.shm, &after) < 0) {
+			if (!interrupted)
+				failed = "the pipeline went away";
+			break;
+		}
+
+		sample_resources(&pipeline, &sample);
+		secs = (after.published - before.published) / 1e9;
+		for (s = 0; s < STATS_STREAMS; s++)
+			sample.fps[s] = secs > 0 ? (after.frames[s] - before.frames[s]) / secs : 0;
+
+		printf("cycle %d, run %d: stream %d %-16s fps %5.1f %5.1f  fds %ld gem %ld dmabufs %ld rss %ld KiB\n",
+		       cycle, run, stream, action, sample.fps[0], sample.fps[1], sample.value[SOAK_FDS],
+		       sample.value[SOAK_GEM], sample.value[SOAK_DMABUFS], sample.value[SOAK_RSS]);
+		fflush(stdout);
+
+		/* what the first cycles held is what every later one may */
+		if (run_cycle < SOAK_WARMUP_CYCLES) {
+			for (i = 0; i < SOAK_RESOURCES; i++)
+				if (sample.value[i] > peak.value[i])
+					peak.value[i] = sample.value[i];
+			if (run == 0)
+				for (s = 0; s < STATS_STREAMS; s++)
+					baseline[s] += sample.fps[s] / SOAK_WARMUP_CYCLES;
+			run_cycle++;
+			continue;
+		}
+		run_cycle++;
+
+		for (i = 0; i < SOAK_RESOURCES && !failed; i++) {
+			if (sample.value[i] < 0 || peak.value[i] < 0)
+				continue;
+			if (sample.value[i] > peak.value[i] + (i == SOAK_RSS ? rss_slack : 0))
+				over[i]++;
+			else
+				over[i] = 0;
+			if (over[i] >= SOAK_GROWTH_SAMPLES) {
+				fprintf(stderr, "soak: %s at %ld, the run started with %ld\n", resource_names[i],
+					sample.value[i], peak.value[i]);
+				failed = "resources grow";
+			}
+		}
+		for (s = 0; s < STATS_STREAMS && !failed; s++) {
+			if (sample.fps[s] < baseline[s] * (100 - tolerance) / 100)
+				slow[s]++;
+			else
+				slow[s] = 0;
+			if (slow[s] >= SOAK_GROWTH_SAMPLES) {
+				fprintf(stderr, "soak: stream %d at %.1f fps, it started at %.1f\n", s,
+					sample.fps[s], baseline[s]);
+				failed = "throughput regressed";
+			}
+		}
+	}
+
+	if (pipeline.pid > 0 && pipeline_stop(&pipeline) < 0 && !failed)
+		failed = "the pipeline did not stop cleanly";
+	printf("soak: %d cycles, %d restarts in %.0f s: %s\n", cycle, run, (stats_now() - start) / 1e9,
+	       failed ? failed : "pass");
+	return failed ? EXIT_FAILURE : 0;
+}
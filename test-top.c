@@ -0,0 +1,288 @@
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/*
+ * top for a running test-dmabuf -p NAME: per stream frame rate,
+ * capture to scanout latency, drops, who holds the buffers and the
+ * V4L2/DRM call rates, per ioctl timing when the pipeline was built
+ * with IOCTL_TRACE, then CPU time per thread of the pipeline.
+ *
+ * Everything comes from the stats segment, mapped read only, and from
+ * /proc; the pipeline does nothing for it it wouldn't do anyway.
+ * Figures are over the last interval, not since start.
+ */
+
+#define TOP_MAX_THREADS	64
+
+struct top_thread {
+	int tid;
+	char comm[16];
+	uint64_t ticks;		/* utime + stime */
+};
+
+static const char *owner_names[STATS_OWNERS] = { "driver", "scanout", "share", "sink", "parked" };
+static const char *span_names[STATS_SPANS] = {
+	"capture>dequeue", "dequeue>submit", "submit>flip", "capture>flip", "dequeue>requeue",
+};
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-d seconds] [-n count] /name\n"
+		"attaches to test-dmabuf -p /name\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+/* What came in since the last snapshot; min and max as the buckets put them */
+static void hist_delta(const struct stats_hist *cur, const struct stats_hist *prev, struct stats_hist *d)
+{
+	int i, first = -1, last = -1;
+
+	memset(d, 0, sizeof(*d));
+	d->count = cur->count - prev->count;
+	d->sum = cur->sum - prev->sum;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		d->buckets[i] = cur->buckets[i] - prev->buckets[i];
+		if (!d->buckets[i])
+			continue;
+		if (first < 0)
+			first = i;
+		last = i;
+	}
+	if (first < 0)
+		return;
+	d->min = stats_bucket_value(first);
+	d->max = last + 1 < STATS_BUCKETS ? stats_bucket_value(last + 1) - 1 : cur->max;
+	if (d->max > cur->max)
+		d->max = cur->max;
+}
+
+static double ms(uint64_t ns)
+{
+	return ns / 1e6;
+}
+
+/* The threads of pid with their CPU ticks so far */
+static int read_threads(int pid, struct top_thread *t, int max)
+{
+	char path[300], line[512], *p, *end;
+	unsigned long long utime, stime;
+	struct dirent *de;
+	FILE *f;
+	DIR *dir;
+	int n = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((de = readdir(dir)) && n < max) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/task/%s/stat", pid, de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		p = fgets(line, sizeof(line), f);
+		fclose(f);
+		if (!p)
+			continue;
+
+		/* "tid (comm) state ..." and comm may hold anything, even ')' */
+		p = strchr(line, '(');
+		end = strrchr(line, ')');
+		if (!p || !end)
+			continue;
+		/* fields 14 and 15, the 12th and 13th after the state */
+		if (sscanf(end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+			   &utime, &stime) != 2)
+			continue;
+		t[n].tid = atoi(line);
+		snprintf(t[n].comm, sizeof(t[n].comm), "%.*s", (int)(end - p - 1), p + 1);
+		t[n].ticks = utime + stime;
+		n++;
+	}
+	closedir(dir);
+	return n;
+}
+
+static void show_streams(const struct stats_shm *cur, const struct stats_shm *prev, double secs)
+{
+	struct stats_hist d[STATS_SPANS];
+	uint64_t frames, shown, drops;
+	int64_t lost;
+	int s, i;
+
+	printf("STREAM    FPS  SHOWN/S  DROP DRV  DROP DISP   LATENCY ms  p50    p90    p99    max\n");
+	for (s = 0; s < STATS_STREAMS; s++) {
+		for (i = 0; i < STATS_SPANS; i++)
+			hist_delta(&cur->hist[s][i], &prev->hist[s][i], &d[i]);
+		frames = cur->frames[s] - prev->frames[s];
+		shown = cur->shown[s] - prev->shown[s];
+		drops = cur->drops[s] - prev->drops[s];
+		/* the frame waiting for its vblank at either end makes this off by one */
+		lost = frames - shown;
+		if (lost < 0)
+			lost = 0;
+
+		printf("S%-6d %6.1f  %7.1f  %8llu  %9lld", s, frames / secs, shown / secs,
+		       (unsigned long long)drops, (long long)lost);
+		if (d[STATS_CAPTURE_FLIP].count)
+			printf("               %6.2f %6.2f %6.2f %6.2f\n",
+			       ms(stats_quantile(&d[STATS_CAPTURE_FLIP], 0.5)),
+			       ms(stats_quantile(&d[STATS_CAPTURE_FLIP], 0.9)),
+			       ms(stats_quantile(&d[STATS_CAPTURE_FLIP], 0.99)),
+			       ms(d[STATS_CAPTURE_FLIP].max));
+		else
+			printf("                    -\n");
+	}
+
+	printf("\nSTREAM  BUFFERS");
+	for (i = 0; i < STATS_OWNERS; i++)
+		printf(" %8s", owner_names[i]);
+	printf("      DQBUF/S  QBUF/S  COMMIT/S\n");
+	for (s = 0; s < STATS_STREAMS; s++) {
+		printf("S%-14d", s);
+		for (i = 0; i < STATS_OWNERS; i++)
+			printf(" %8u", cur->buffers[s][i]);
+		/* a dequeue, a requeue and a submit are an ioctl each */
+		printf("      %7.1f %7.1f %9.1f\n",
+		       (cur->frames[s] - prev->frames[s]) / secs,
+		       (cur->hist[s][STATS_DEQUEUE_REQUEUE].count - prev->hist[s][STATS_DEQUEUE_REQUEUE].count) / secs,
+		       (cur->hist[s][STATS_DEQUEUE_SUBMIT].count - prev->hist[s][STATS_DEQUEUE_SUBMIT].count) / secs);
+	}
+
+	printf("\nSTAGE ms (p50/p99)");
+	for (s = 0; s < STATS_STREAMS; s++)
+		printf("        S%d      ", s);
+	printf("\n");
+	for (i = 0; i < STATS_SPANS; i++) {
+		printf("%-18s", span_names[i]);
+		for (s = 0; s < STATS_STREAMS; s++) {
+			hist_delta(&cur->hist[s][i], &prev->hist[s][i], &d[0]);
+			if (d[0].count)
+				printf("   %6.2f/%-7.2f", ms(stats_quantile(&d[0], 0.5)), ms(stats_quantile(&d[0], 0.99)));
+			else
+				printf("   %6s %-7s", "-", "");
+		}
+		printf("\n");
+	}
+}
+
+/* Only with IOCTL_TRACE, slots are only ever added so they line up */
+static void show_calls(const struct stats_shm *cur, const struct stats_shm *prev, double secs)
+{
+	static const struct stats_hist none;
+	struct stats_hist d;
+	int i;
+
+	if (!cur->calls[0].code)
+		return;
+	printf("\n%-32s %9s %8s %8s %8s  (ms)\n", "IOCTL", "CALLS/S", "p50", "p99", "max");
+	for (i = 0; i < STATS_CALLS && cur->calls[i].code; i++) {
+		hist_delta(&cur->calls[i].hist, prev->calls[i].code ? &prev->calls[i].hist : &none, &d);
+		if (!d.count)
+			continue;
+		printf("%-32s %9.1f %8.3f %8.3f %8.3f\n", cur->calls[i].name, d.count / secs,
+		       ms(stats_quantile(&d, 0.5)), ms(stats_quantile(&d, 0.99)), ms(d.max));
+	}
+}
+
+static void show_threads(const struct top_thread *cur, int n, const struct top_thread *prev, int nprev,
+			 double secs)
+{
+	long hz = sysconf(_SC_CLK_TCK);
+	uint64_t before;
+	int i, j;
+
+	printf("\n%8s  %-16s %6s\n", "TID", "THREAD", "CPU%");
+	for (i = 0; i < n; i++) {
+		/* a thread that is new since the last look counts from 0 */
+		before = 0;
+		for (j = 0; j < nprev; j++)
+			if (prev[j].tid == cur[i].tid)
+				before = prev[j].ticks;
+		printf("%8d  %-16s %6.1f\n", cur[i].tid, cur[i].comm,
+		       (cur[i].ticks - before) * 100.0 / hz / secs);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static struct stats_shm cur, prev;
+	struct top_thread threads[2][TOP_MAX_THREADS];
+	const struct stats_shm *shm;
+	uint64_t looked[2];	/* ns, when the threads were read */
+	int nthreads[2], n = 0, which = 0;
+	double interval = 1.0, secs;
+	long count = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:n:")) != -1) {
+		switch (opt) {
+		case 'd':
+			interval = atof(optarg);
+			if (interval < STATS_PUBLISH_MS / 1000.0)
+				interval = STATS_PUBLISH_MS / 1000.0;
+			break;
+		case 'n':
+			count = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+
+	shm = stats_attach(argv[optind]);
+	if (!shm)
+		return EXIT_FAILURE;
+	if (stats_read(shm, &prev) < 0) {
+		fprintf(stderr, "stats: no consistent snapshot\n");
+		return EXIT_FAILURE;
+	}
+	nthreads[which] = read_threads(prev.pid, threads[which], TOP_MAX_THREADS);
+	looked[which] = stats_now();
+
+	while (count < 0 || n++ < count) {
+		usleep(interval * 1000000);
+		if (stats_read(shm, &cur) < 0)
+			continue;
+		if (kill(cur.pid, 0) < 0 && errno == ESRCH) {
+			fprintf(stderr, "pid %d is gone\n", cur.pid);
+			break;
+		}
+		/* publishing stalls with the main loop, say so rather than show zeros */
+		if (cur.published == prev.published) {
+			printf("\033[H\033[2J%s: pid %d, no snapshot for %.1f s\n",
+			       argv[optind], cur.pid, (stats_now() - cur.published) / 1e9);
+			fflush(stdout);
+			continue;
+		}
+
+		which ^= 1;
+		nthreads[which] = read_threads(cur.pid, threads[which], TOP_MAX_THREADS);
+		looked[which] = stats_now();
+		secs = (cur.published - prev.published) / 1e9;
+
+		printf("\033[H\033[2J%s: pid %d, over %.2f s\n\n", argv[optind], cur.pid, secs);
+		show_streams(&cur, &prev, secs);
+		show_calls(&cur, &prev, secs);
+		if (nthreads[which] > 0)
+			show_threads(threads[which], nthreads[which], threads[which ^ 1],
+				     nthreads[which ^ 1] > 0 ? nthreads[which ^ 1] : 0,
+				     (looked[which] - looked[which ^ 1]) / 1e9);
+		fflush(stdout);
+		prev = cur;
+	}
+
+	stats_detach(shm);
+	return 0;
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <xf86drm.h>
+
+#include "videodev2.h"
+#include "stats.h"
+#include "trace.h"
+
+#define TRACE_NAME(code)	{ code, #code }
+
+static const struct {
+	unsigned long code;
+	const char *name;
+} trace_names[] = {
+	TRACE_NAME(VIDIOC_QUERYCAP),
+	TRACE_NAME(VIDIOC_G_FMT),
+	TRACE_NAME(VIDIOC_S_FMT),
+	TRACE_NAME(VIDIOC_REQBUFS),
+	TRACE_NAME(VIDIOC_CREATE_BUFS),
+	TRACE_NAME(VIDIOC_QUERYBUF),
+	TRACE_NAME(VIDIOC_QBUF),
+	TRACE_NAME(VIDIOC_DQBUF),
+	TRACE_NAME(VIDIOC_STREAMON),
+	TRACE_NAME(VIDIOC_STREAMOFF),
+	TRACE_NAME(VIDIOC_QUERYCTRL),
+	TRACE_NAME(VIDIOC_S_CTRL),
+	TRACE_NAME(VIDIOC_SUBSCRIBE_EVENT),
+	TRACE_NAME(VIDIOC_DQEVENT),
+	TRACE_NAME(VIDIOC_ENUM_DV_TIMINGS),
+	TRACE_NAME(VIDIOC_QUERY_DV_TIMINGS),
+	TRACE_NAME(VIDIOC_S_DV_TIMINGS),
+	TRACE_NAME(DRM_IOCTL_MODE_CREATE_DUMB),
+	TRACE_NAME(DRM_IOCTL_MODE_MAP_DUMB),
+	TRACE_NAME(DRM_IOCTL_MODE_DESTROY_DUMB),
+	TRACE_NAME(DRM_IOCTL_MODE_ADDFB),
+	TRACE_NAME(DRM_IOCTL_MODE_ADDFB2),
+	TRACE_NAME(DRM_IOCTL_MODE_RMFB),
+	TRACE_NAME(DRM_IOCTL_MODE_SETCRTC),
+	TRACE_NAME(DRM_IOCTL_MODE_SETPLANE),
+	TRACE_NAME(DRM_IOCTL_MODE_PAGE_FLIP),
+	TRACE_NAME(DRM_IOCTL_MODE_ATOMIC),
+	TRACE_NAME(DRM_IOCTL_MODE_OBJ_SETPROPERTY),
+	TRACE_NAME(DRM_IOCTL_WAIT_VBLANK),
+};
+
+static struct stats_call calls[STATS_CALLS];
+static int ncalls;
+static pthread_mutex_t calls_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the frame last dequeued, outliers are blamed on it */
+static int frame_stream = -1;
+static uint32_t frame_sequence;
+
+static void trace_report(void)
+{
+	const struct stats_hist *h;
+	int i;
+
+	fprintf(stderr, "ioctl timing, ms:\n  %-32s %9s %8s %8s %8s %8s\n",
+		"", "calls", "mean", "p50", "p99", "max");
+	for (i = 0; i < ncalls; i++) {
+		h = &calls[i].hist;
+		fprintf(stderr, "  %-32s %9llu %8.3f %8.3f %8.3f %8.3f\n", calls[i].name,
+			(unsigned long long)h->count, h->sum / 1e6 / h->count,
+			stats_quantile(h, 0.5) / 1e6, stats_quantile(h, 0.99) / 1e6, h->max / 1e6);
+	}
+}
+
+/* A code's slot, found without the lock: slots are filled before ncalls counts them */
+static struct stats_call *trace_slot(unsigned long code)
+{
+	struct stats_call *c = NULL;
+	int i, n = __atomic_load_n(&ncalls, __ATOMIC_ACQUIRE);
+	size_t k;
+
+	for (i = 0; i < n; i++)
+		if (calls[i].code == (uint32_t)code)
+			return &calls[i];
+
+	pthread_mutex_lock(&calls_lock);
+	for (i = 0; i < ncalls; i++)
+		if (calls[i].code == (uint32_t)code)
+			c = &calls[i];
+	if (!c && ncalls < STATS_CALLS) {
+		c = &calls[ncalls];
+		c->code = code;
+		snprintf(c->name, sizeof(c->name), "ioctl %#lx", code);
+		for (k = 0; k < sizeof(trace_names) / sizeof(trace_names[0]); k++)
+			if (trace_names[k].code == code)
+				snprintf(c->name, sizeof(c->name), "%s", trace_names[k].name);
+		if (!ncalls)
+			atexit(trace_report);
+		__atomic_store_n(&ncalls, ncalls + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&calls_lock);
+	return c;
+}
+
+uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_end(unsigned long code, uint64_t start, long long sequence)
+{
+	uint64_t ns = trace_now() - start;
+	struct stats_call *c = trace_slot(code);
+
+	if (!c)
+		return;
+	stats_add(&c->hist, ns);
+	if (ns < TRACE_OUTLIER_NS)
+		return;
+
+	if (sequence != TRACE_CONTEXT)
+		fprintf(stderr, "trace: %s took %.2f ms, frame %lld\n", c->name, ns / 1e6, sequence);
+	else if (frame_stream >= 0)
+		fprintf(stderr, "trace: %s took %.2f ms, after stream %d frame %u\n", c->name, ns / 1e6,
+			frame_stream, frame_sequence);
+	else
+		fprintf(stderr, "trace: %s took %.2f ms, before the first frame\n", c->name, ns / 1e6);
+}
+
+void trace_frame(int stream, uint32_t sequence)
+{
+	frame_stream = stream;
+	frame_sequence = sequence;
+}
+
+const struct stats_call *trace_table(void)
+{
+	return calls;
+}
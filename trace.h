@@ -0,0 +1,52 @@
+
+#include <stdint.h>
+
+/*
+ * Ioctl timing, built in with make IOCTL_TRACE=1 and gone without: the
+ * macros below then expand to the bare call and to nothing.
+ *
+ * Every V4L2 ioctl (through xioctl) and the DRM calls on the frame path
+ * are timed into a histogram per request code, the HDR histograms of
+ * stats.h. A call slower than TRACE_OUTLIER_NS is logged with the
+ * frame it happened for: the one it dequeued, or the last one dequeued.
+ * test-dmabuf -p publishes the table for test-top; every program prints
+ * it to stderr on exit.
+ *
+ * Calls made from the camera probe threads at startup may race with
+ * the main thread's in the counts; only slot allocation is locked.
+ */
+
+#ifndef TRACE_OUTLIER_NS
+#define TRACE_OUTLIER_NS	(4 * 1000000)
+#endif
+/* sequence of the frame being handled, as left by TRACE_FRAME() */
+#define TRACE_CONTEXT		(-1LL)
+
+struct stats_call;
+
+#ifdef IOCTL_TRACE
+
+uint64_t trace_now(void);
+void trace_end(unsigned long code, uint64_t start, long long sequence);
+void trace_frame(int stream, uint32_t sequence);
+const struct stats_call *trace_table(void);
+
+#define TRACE_BEGIN()		uint64_t trace_start = trace_now()
+#define TRACE_END(code, seq)	trace_end((code), trace_start, (seq))
+#define TRACE_CALL(code, call) ({				\
+	uint64_t trace_t0 = trace_now();			\
+	__typeof__(call) trace_ret = (call);			\
+	trace_end((code), trace_t0, TRACE_CONTEXT);		\
+	trace_ret; })
+#define TRACE_FRAME(stream, seq)	trace_frame((stream), (seq))
+#define TRACE_TABLE()		trace_table()
+
+#else
+
+#define TRACE_BEGIN()		do { } while (0)
+#define TRACE_END(code, seq)	do { } while (0)
+#define TRACE_CALL(code, call)	(call)
+#define TRACE_FRAME(stream, seq)	do { } while (0)
+#define TRACE_TABLE()		((const struct stats_call *)0)
+
+#endif
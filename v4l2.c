@@ -15,14 +15,43 @@
 
 #include "videodev2.h"
 #include "v4l2.h"
+#define PROBE_SEMAPHORES
+#include "probe.h"
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 #define PCLEAR(x) memset(x, 0, sizeof(*x))
 
+#ifndef VIDIOC_REMOVE_BUFS
+/* Linux 6.10+, newer than our copy of videodev2.h */
+struct v4l2_remove_buffers {
+	__u32 index;
+	__u32 count;
+	__u32 type;
+	__u32 reserved[13];
+};
+#define VIDIOC_REMOVE_BUFS	_IOWR('V', 104, struct v4l2_remove_buffers)
+#endif
+
+/* automatic sizing: wait between grows, and how long to stay quiet before shrinking */
+#define BUFCTL_GROW_HOLDOFF_NS	(500 * 1000000ULL)
+#define BUFCTL_QUIET_NS		(10 * 1000000000ULL)
+
 // 支持两个摄像头的缓存
 struct buffer *buffers[2];
 static unsigned int n_buffers[2];
 static enum v4l2_memory memory_type[2];
+/* the frame each buffer last held and the last sequence seen, for the probes */
+static uint32_t buffer_sequence[2][VIDEO_MAX_FRAME];
+static uint64_t buffer_captured[2][VIDEO_MAX_FRAME];
+static uint32_t last_sequence[2];
+static int sequenced[2];
+
+uint64_t v4l2_buffer_time(const struct v4l2_buffer *buf)
+{
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		return 0;
+	return buf->timestamp.tv_sec * 1000000000ULL + buf->timestamp.tv_usec * 1000ULL;
+}
 
 void v4l2_queue_buffer(int fd, int index, int dmabuf_fd, int camera_id)
 {
@@ -36,12 +65,11 @@ void v4l2_queue_buffer(int fd, int index, int dmabuf_fd, int camera_id)
 	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 	buf.memory = memory_type[camera_id];
 	buf.index = index;
-	if (memory_type[camera_id] == V4L2_MEMORY_DMABUF) {
-		// buf.m.fd = dmabuf_fd;
-		buf.length = 1;
-		buf.m.planes = &plane;
-	}
+	/* MPLANE wants the plane array for mmap buffers too */
+	buf.length = 1;
+	buf.m.planes = &plane;
 
+	PROBE4(queue, camera_id, index, buffer_sequence[camera_id][index], buffer_captured[camera_id][index]);
 	if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
 		errno_print("VIDIOC_QBUF");
 }
@@ -63,15 +91,30 @@ int v4l2_dequeue_buffer(int fd, struct v4l2_buffer *buf, int camera_id)
 		switch (errno) {
 		case EAGAIN:
 			return 0;
+		case EPIPE:
+			/* the last buffer was dequeued, end of stream */
+			return V4L2_END_OF_STREAM;
 		case EIO:
 			/* Could ignore EIO, see spec. */
 			/* fall through */
 		default:
 			errno_print("VIDIOC_DQBUF");
+			return -1;
 		}
 	}
 
 	assert(buf->index < n_buffers[camera_id]);
+	TRACE_FRAME(camera_id, buf->sequence);
+
+	buffer_sequence[camera_id][buf->index] = buf->sequence;
+	buffer_captured[camera_id][buf->index] = v4l2_buffer_time(buf);
+	PROBE4(dequeue, camera_id, buf->index, buf->sequence, buffer_captured[camera_id][buf->index]);
+	/* a restart starts over from 0, that is no gap */
+	if (sequenced[camera_id] && buf->sequence > last_sequence[camera_id] + 1)
+		PROBE5(drop, camera_id, buf->index, buf->sequence, buffer_captured[camera_id][buf->index],
+		       buf->sequence - last_sequence[camera_id] - 1);
+	last_sequence[camera_id] = buf->sequence;
+	sequenced[camera_id] = 1;
 	return 1;
 }
 
@@ -86,55 +129,90 @@ void v4l2_stop_capturing(int fd)
 
 void v4l2_start_capturing_dmabuf(int fd, int camera_id)
 {
-	enum v4l2_buf_type type;
 	unsigned int i;
 
 	/* One buffer held by DRM, the rest queued to video4linux */
 	for (i = 1; i < n_buffers[camera_id]; ++i)
 		v4l2_queue_buffer(fd, i, buffers[camera_id][i].dmabuf_fd, camera_id);
 
+	v4l2_streamon(fd);
+}
+
+int v4l2_streamon(int fd)
+{
+	enum v4l2_buf_type type;
+
 	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
+	if (-1 == xioctl(fd, VIDIOC_STREAMON, &type)) {
 		errno_print("VIDIOC_STREAMON");
+		return -1;
+	}
+	return 0;
 }
 
 void v4l2_start_capturing_mmap(int fd)
 {
-	enum v4l2_buf_type type;
 	unsigned int i;
 
-	for (i = 0; i < n_buffers[0]; ++i) {
-		struct v4l2_buffer buf;
+	for (i = 0; i < n_buffers[0]; ++i)
+		v4l2_queue_buffer(fd, i, -1, 0);
 
-		CLEAR(buf);
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = i;
+	v4l2_streamon(fd);
+}
 
-		if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-			errno_print("VIDIOC_QBUF");
-	}
+/* Only MMAP buffers were mapped, DMABUF ones belong to whoever exported them */
+static void v4l2_unmap_buffers(int camera_id)
+{
+	unsigned int i;
 
-	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
-		errno_print("VIDIOC_STREAMON");
+	if (memory_type[camera_id] != V4L2_MEMORY_MMAP)
+		return;
+	for (i = 0; i < n_buffers[camera_id]; ++i)
+		if (buffers[camera_id][i].start && buffers[camera_id][i].start != MAP_FAILED
+		    && -1 == munmap(buffers[camera_id][i].start, buffers[camera_id][i].length))
+			errno_print("munmap");
 }
 
 void v4l2_uninit_device(void)
 {
-	unsigned int i;
-	unsigned int camera_id;	
+	unsigned int camera_id;
 
-	for(camera_id = 0; camera_id < 2; camera_id++){
-		for (i = 0; i < n_buffers[camera_id]; ++i)
-			if (-1 == munmap(buffers[camera_id][i].start, buffers[camera_id][i].length))
-				errno_print("munmap");
+	for (camera_id = 0; camera_id < 2; camera_id++) {
+		v4l2_unmap_buffers(camera_id);
 		free(buffers[camera_id]);
+		buffers[camera_id] = NULL;
+		n_buffers[camera_id] = 0;
 	}
+}
+
+/* Free the queue of one camera, capture must be stopped */
+void v4l2_release_buffers(int fd, int camera_id)
+{
+	struct v4l2_requestbuffers req;
+
+	/* a mapping keeps its buffer, and the queue, busy */
+	v4l2_unmap_buffers(camera_id);
+
+	CLEAR(req);
+	req.count = 0;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	req.memory = memory_type[camera_id];
+
+	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req) && ENODEV != errno)
+		errno_print("VIDIOC_REQBUFS");
 
+	free(buffers[camera_id]);
+	buffers[camera_id] = NULL;
+	n_buffers[camera_id] = 0;
 }
 
 void v4l2_init_dmabuf(int fd, int *dmabufs, int count, int camera_id)
+{
+	if (v4l2_try_init_dmabuf(fd, dmabufs, count, camera_id) < 0)
+		exit(EXIT_FAILURE);
+}
+
+int v4l2_try_init_dmabuf(int fd, int *dmabufs, int count, int camera_id)
 {
 	struct v4l2_requestbuffers req;
 
@@ -146,24 +224,25 @@ void v4l2_init_dmabuf(int fd, int *dmabufs, int count, int camera_id)
 	memory_type[camera_id] = req.memory;
 
 	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
-		if (EINVAL == errno) {
+		if (EINVAL == errno)
 			fprintf(stderr, "does not support dmabuf\n");
-			exit(EXIT_FAILURE);
-		} else {
+		else
 			errno_print("VIDIOC_REQBUFS");
-		}
+		return -1;
 	}
 
 	if (req.count < 2) {
 		fprintf(stderr, "Insufficient buffer memory\n");
-		exit(EXIT_FAILURE);
+		v4l2_release_buffers(fd, camera_id);
+		return -1;
 	}
 
 	buffers[camera_id] = calloc(req.count, sizeof(*buffers[camera_id]));
 
 	if (!buffers[camera_id]) {
 		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+		v4l2_release_buffers(fd, camera_id);
+		return -1;
 	}
 
 	for (n_buffers[camera_id] = 0; n_buffers[camera_id] < req.count; ++n_buffers[camera_id]) {
@@ -184,8 +263,125 @@ void v4l2_init_dmabuf(int fd, int *dmabufs, int count, int camera_id)
 		if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
 			errno_print("VIDIOC_QUERYBUF");
 		buffers[camera_id][n_buffers[camera_id]].index = buf.index;
-		buffers[camera_id][n_buffers[camera_id]].dmabuf_fd = dmabufs[n_buffers[camera_id]];
+		/* the driver may have raised the count, those stay unbacked */
+		buffers[camera_id][n_buffers[camera_id]].dmabuf_fd =
+			n_buffers[camera_id] < (unsigned int)count ? dmabufs[n_buffers[camera_id]] : -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Add count DMABUF buffers to a streaming queue. Returns the index of the
+ * first new buffer, or -1 on failure.
+ */
+int v4l2_create_buffers(int fd, int *dmabufs, int count, int camera_id)
+{
+	struct v4l2_create_buffers create;
+	struct buffer *bufs;
+	unsigned int i;
+
+	CLEAR(create);
+	create.count = count;
+	create.memory = V4L2_MEMORY_DMABUF;
+	create.format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+	if (-1 == xioctl(fd, VIDIOC_G_FMT, &create.format)) {
+		errno_print("VIDIOC_G_FMT");
+		return -1;
+	}
+
+	if (-1 == xioctl(fd, VIDIOC_CREATE_BUFS, &create)) {
+		errno_print("VIDIOC_CREATE_BUFS");
+		return -1;
+	}
+
+	if (create.count != (unsigned int)count) {
+		fprintf(stderr, "VIDIOC_CREATE_BUFS: got %d of %d buffers\n", create.count, count);
+		return -1;
+	}
+
+	bufs = realloc(buffers[camera_id], (create.index + create.count) * sizeof(*bufs));
+	if (!bufs) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	buffers[camera_id] = bufs;
+
+	for (i = 0; i < create.count; i++) {
+		CLEAR(bufs[create.index + i]);
+		bufs[create.index + i].index = create.index + i;
+		bufs[create.index + i].dmabuf_fd = dmabufs[i];
+	}
+	n_buffers[camera_id] = create.index + create.count;
+
+	return create.index;
+}
+
+/*
+ * Drop the buffers from index on, they must all be dequeued.
+ * Returns -1 when the kernel cannot remove buffers from a live queue.
+ */
+int v4l2_remove_buffers(int fd, int index, int camera_id)
+{
+	struct v4l2_remove_buffers remove;
+
+	CLEAR(remove);
+	remove.index = index;
+	remove.count = n_buffers[camera_id] - index;
+	remove.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+	if (-1 == xioctl(fd, VIDIOC_REMOVE_BUFS, &remove)) {
+		if (ENOTTY != errno)
+			errno_print("VIDIOC_REMOVE_BUFS");
+		return -1;
+	}
+
+	n_buffers[camera_id] = index;
+	return 0;
+}
+
+void v4l2_bufctl_init(struct v4l2_bufctl *ctl, int min, int max)
+{
+	PCLEAR(ctl);
+	ctl->min = min;
+	ctl->max = max;
+	ctl->active = min;
+}
+
+/*
+ * Feed every dequeued buffer. A sequence gap means the driver had nothing
+ * to capture into; answer it with one more buffer, at most every
+ * BUFCTL_GROW_HOLDOFF_NS. Give one back after BUFCTL_QUIET_NS without gaps.
+ * Returns the change in active buffers the caller has to apply.
+ */
+int v4l2_bufctl_update(struct v4l2_bufctl *ctl, const struct v4l2_buffer *buf)
+{
+	uint64_t now = buf->timestamp.tv_sec * 1000000000ULL + buf->timestamp.tv_usec * 1000ULL;
+	int lost = ctl->primed ? (int)(buf->sequence - ctl->last_sequence) - 1 : 0;
+
+	if (!ctl->primed) {
+		ctl->primed = 1;
+		ctl->last_change = ctl->last_gap = now;
+	}
+	ctl->last_sequence = buf->sequence;
+
+	if (lost > 0) {
+		ctl->starved += lost;
+		ctl->last_gap = now;
+		if (ctl->active < ctl->max && now - ctl->last_change > BUFCTL_GROW_HOLDOFF_NS) {
+			ctl->active++;
+			ctl->last_change = now;
+			return 1;
+		}
+	} else if (ctl->active > ctl->min && now - ctl->last_gap > BUFCTL_QUIET_NS
+			&& now - ctl->last_change > BUFCTL_QUIET_NS) {
+		ctl->active--;
+		ctl->last_change = now;
+		return -1;
 	}
+
+	return 0;
 }
 
 void v4l2_init_mmap(int fd, int count, int camera_id)
@@ -195,7 +391,7 @@ void v4l2_init_mmap(int fd, int count, int camera_id)
 	CLEAR(req);
 
 	req.count = count;
-	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 	req.memory = V4L2_MEMORY_MMAP;
 	memory_type[camera_id] = req.memory;
 
@@ -222,51 +418,128 @@ void v4l2_init_mmap(int fd, int count, int camera_id)
 
 	for (n_buffers[camera_id] = 0; n_buffers[camera_id] < req.count; ++n_buffers[camera_id]) {
 		struct v4l2_buffer buf;
+		struct v4l2_plane plane;
 
 		CLEAR(buf);
+		CLEAR(plane);
 
-		buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 		buf.memory      = V4L2_MEMORY_MMAP;
 		buf.index       = n_buffers[camera_id];
+		buf.length      = 1;
+		buf.m.planes    = &plane;
 
 		if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
 			errno_print("VIDIOC_QUERYBUF");
 
-		buffers[camera_id][n_buffers[camera_id]].length = buf.length;
+		buffers[camera_id][n_buffers[camera_id]].length = plane.length;
 		buffers[camera_id][n_buffers[camera_id]].start =
 			mmap(NULL /* start anywhere */,
-					buf.length,
+					plane.length,
 					PROT_READ | PROT_WRITE /* required */,
 					MAP_SHARED /* recommended */,
-					fd, buf.m.offset);
+					fd, plane.m.mem_offset);
 
 		if (MAP_FAILED == buffers[camera_id][n_buffers[camera_id]].start)
 			errno_print("mmap");
 	}
 }
 
+/*
+ * Source changes and end of stream arrive as POLLPRI on the device.
+ * Not every driver has them, so failing to subscribe is not fatal.
+ */
+int v4l2_subscribe_events(int fd)
+{
+	struct v4l2_event_subscription sub;
+	int ret = 0;
+
+	CLEAR(sub);
+	sub.type = V4L2_EVENT_SOURCE_CHANGE;
+	if (-1 == xioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &sub)) {
+		fprintf(stderr, "no source change events\n");
+		ret = -1;
+	}
+
+	CLEAR(sub);
+	sub.type = V4L2_EVENT_EOS;
+	if (-1 == xioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &sub)) {
+		fprintf(stderr, "no end of stream events\n");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/* Returns 1 with an event, 0 when there are no more pending */
+int v4l2_dequeue_event(int fd, struct v4l2_event *ev)
+{
+	PCLEAR(ev);
+	if (-1 == xioctl(fd, VIDIOC_DQEVENT, ev)) {
+		if (ENOENT != errno)
+			errno_print("VIDIOC_DQEVENT");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * After a source change, latch the new input timings on devices that
+ * have them (HDMI bridges); S_FMT then follows the new resolution.
+ */
+void v4l2_apply_dv_timings(int fd)
+{
+	struct v4l2_dv_timings timings;
+
+	CLEAR(timings);
+	if (-1 == xioctl(fd, VIDIOC_QUERY_DV_TIMINGS, &timings))
+		return;
+
+	if (-1 == xioctl(fd, VIDIOC_S_DV_TIMINGS, &timings))
+		errno_print("VIDIOC_S_DV_TIMINGS");
+	else
+		printf("v4l2 input timings: %dx%d\n", timings.bt.width, timings.bt.height);
+}
+
+int v4l2_get_format(int fd, struct v4l2_format *fmt)
+{
+	PCLEAR(fmt);
+	fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+	if (-1 == xioctl(fd, VIDIOC_G_FMT, fmt)) {
+		errno_print("VIDIOC_G_FMT");
+		return -1;
+	}
+	return 0;
+}
+
 void v4l2_init(int fd, int width, int height, int pitch)
+{
+	if (v4l2_try_init(fd, width, height, pitch) < 0)
+		exit(EXIT_FAILURE);
+}
+
+int v4l2_try_init(int fd, int width, int height, int pitch)
 {
 	struct v4l2_capability cap;
 	struct v4l2_format fmt;
 
 	if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
-		if (EINVAL == errno) {
+		if (EINVAL == errno)
 			fprintf(stderr, "not a V4L2 device\n");
-			exit(EXIT_FAILURE);
-		} else {
+		else
 			errno_print("VIDIOC_QUERYCAP");
-		}
+		return -1;
 	}
 
 	if (!(cap.capabilities & (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE))) {
 		fprintf(stderr, "not a video capture device\n");
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
 		fprintf(stderr, "does not support streaming i/o\n");
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
@@ -281,7 +554,11 @@ void v4l2_init(int fd, int width, int height, int pitch)
 
 	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_UYVY;
 	fmt.fmt.pix_mp.field       = V4L2_FIELD_NONE;
-	fmt.fmt.pix_mp.colorspace  = V4L2_COLORSPACE_RAW;
+	/* colorimetry is the capture driver's to report, the display follows it */
+	fmt.fmt.pix_mp.colorspace  = V4L2_COLORSPACE_DEFAULT;
+	fmt.fmt.pix_mp.ycbcr_enc   = V4L2_YCBCR_ENC_DEFAULT;
+	fmt.fmt.pix_mp.quantization = V4L2_QUANTIZATION_DEFAULT;
+	fmt.fmt.pix_mp.xfer_func   = V4L2_XFER_FUNC_DEFAULT;
 
 
 	if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
@@ -295,34 +572,59 @@ void v4l2_init(int fd, int width, int height, int pitch)
 
 	printf("v4l2 negotiated format: ");
 	printf("size = %dx%d, ", fmt.fmt.pix_mp.width, fmt.fmt.pix_mp.height);
-	printf("pitch = %d bytes\n", fmt.fmt.pix_mp.plane_fmt[0].bytesperline);
+	printf("pitch = %d bytes, ", fmt.fmt.pix_mp.plane_fmt[0].bytesperline);
+	printf("colorspace %d, ycbcr_enc %d, quantization %d\n", fmt.fmt.pix_mp.colorspace,
+	       fmt.fmt.pix_mp.ycbcr_enc, fmt.fmt.pix_mp.quantization);
 
 	/* Note VIDIOC_S_FMT may change width and height. */
 
+	return 0;
 }
 
 int v4l2_open(const char *dev_name)
+{
+	int fd;
+
+	fd = v4l2_try_open(dev_name);
+	if (-1 == fd)
+		exit(EXIT_FAILURE);
+	return fd;
+}
+
+int v4l2_try_open(const char *dev_name)
 {
 	struct stat st;
 	int fd;
 
+	if (!strncmp(dev_name, PATTERN_PREFIX, strlen(PATTERN_PREFIX))
+	    || !strncmp(dev_name, PATTERN_REPLAY_PREFIX, strlen(PATTERN_REPLAY_PREFIX)))
+		return pattern_open(dev_name);
+
 	if (-1 == stat(dev_name, &st)) {
 		fprintf(stderr, "Cannot identify '%s': %d, %s\n",
 				dev_name, errno, strerror(errno));
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	if (!S_ISCHR(st.st_mode)) {
 		fprintf(stderr, "%s is no device\n", dev_name);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
-	fd = open(dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
+	fd = open(dev_name, O_RDWR /* required */ | O_NONBLOCK | O_CLOEXEC, 0);
 
 	if (-1 == fd) {
 		fprintf(stderr, "Cannot open '%s': %d, %s\n",
 				dev_name, errno, strerror(errno));
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 	return fd;
 }
+
+void v4l2_close(int fd)
+{
+	if (pattern_is(fd))
+		pattern_close(fd);
+	else
+		close(fd);
+}
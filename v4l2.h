@@ -5,6 +5,8 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include "videodev2.h"
+#include "pattern.h"
+#include "trace.h"
 
 struct buffer {
 	void   *start;
@@ -16,6 +18,17 @@ struct buffer {
 
 extern struct buffer *buffers[2];
 
+/* Runtime buffer count of one stream, min == max keeps it fixed */
+struct v4l2_bufctl {
+	int min, max;
+	int active;		/* buffers in rotation, indices 0..active-1 */
+	int primed;
+	unsigned int starved;	/* frames the driver dropped for lack of buffers */
+	uint32_t last_sequence;
+	uint64_t last_change;	/* ns */
+	uint64_t last_gap;	/* ns */
+};
+
 inline static void errno_print(const char *s)
 {
 	fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
@@ -25,21 +38,48 @@ inline static int xioctl(int fh, int request, void *arg)
 {
 	int r;
 
+	/* synthetic sources answer in place of a driver */
+	if (pattern_is(fh))
+		return pattern_ioctl(fh, request, arg);
+
+	TRACE_BEGIN();
 	do {
 		r = ioctl(fh, request, arg);
 	} while (-1 == r && EINTR == errno);
+	/* a dequeue is timed for the frame it brought */
+	TRACE_END((unsigned int)request, request == (int)VIDIOC_DQBUF && r == 0 ?
+		  ((struct v4l2_buffer *)arg)->sequence : TRACE_CONTEXT);
 
 	return r;
 }
 
+/* The v4l2_try_* variants report failure instead of exiting */
 int v4l2_open(const char *dev_name);
+int v4l2_try_open(const char *dev_name);
+void v4l2_close(int fd);
 void v4l2_init(int fd, int width, int height, int pitch);
+int v4l2_try_init(int fd, int width, int height, int pitch);
+int v4l2_get_format(int fd, struct v4l2_format *fmt);
+int v4l2_subscribe_events(int fd);
+int v4l2_dequeue_event(int fd, struct v4l2_event *ev);
+void v4l2_apply_dv_timings(int fd);
 void v4l2_init_dmabuf(int fd, int *dmabufs, int count, int camera_id);
+int v4l2_try_init_dmabuf(int fd, int *dmabufs, int count, int camera_id);
+void v4l2_release_buffers(int fd, int camera_id);
 void v4l2_init_mmap(int fd, int count, int camera_id);
+int v4l2_create_buffers(int fd, int *dmabufs, int count, int camera_id);
+int v4l2_remove_buffers(int fd, int index, int camera_id);
+void v4l2_bufctl_init(struct v4l2_bufctl *ctl, int min, int max);
+int v4l2_bufctl_update(struct v4l2_bufctl *ctl, const struct v4l2_buffer *buf);
 void v4l2_uninit_device(void);
 void v4l2_start_capturing_mmap(int fd);
 void v4l2_start_capturing_dmabuf(int fd, int camera_id);
+int v4l2_streamon(int fd);
 void v4l2_stop_capturing(int fd);
 
+/* 1 with a buffer, 0 with none ready, V4L2_END_OF_STREAM after the last one, -1 on errors */
+#define V4L2_END_OF_STREAM	(-2)
 int v4l2_dequeue_buffer(int fd, struct v4l2_buffer *buf, int camera_id);
+/* capture time in ns of CLOCK_MONOTONIC, 0 when the driver uses another clock */
+uint64_t v4l2_buffer_time(const struct v4l2_buffer *buf);
 void v4l2_queue_buffer(int fd, int index, int dmabuf_fd, int camera_id);
@@ -0,0 +1,108 @@
+#include <string.h>
+
+#include "view.h"
+
+void view_reset(struct view_t *v, uint32_t src_width, uint32_t src_height)
+{
+	memset(v, 0, sizeof(*v));
+	v->src_width = src_width;
+	v->src_height = src_height;
+	v->cur.width = src_width << 16;
+	v->cur.height = src_height << 16;
+	v->to = v->cur;
+}
+
+/* inside the frame: shrink to fit first, then slide back in */
+static struct view_rect view_clamp(const struct view_t *v, struct view_rect r)
+{
+	uint32_t w = v->src_width << 16, h = v->src_height << 16;
+	uint32_t min = VIEW_MIN_SIZE << 16;
+
+	if (r.width > w)
+		r.width = w;
+	if (r.height > h)
+		r.height = h;
+	if (r.width < min)
+		r.width = min < w ? min : w;
+	if (r.height < min)
+		r.height = min < h ? min : h;
+	if (r.x > w - r.width)
+		r.x = w - r.width;
+	if (r.y > h - r.height)
+		r.y = h - r.height;
+	return r;
+}
+
+void view_crop(struct view_t *v, struct view_rect r, int steps)
+{
+	v->to = view_clamp(v, r);
+	v->from = v->cur;
+	v->step = 0;
+	v->steps = steps > 0 ? steps : 0;
+	if (!v->steps)
+		v->cur = v->to;
+}
+
+void view_zoom(struct view_t *v, uint32_t zoom, uint32_t cx, uint32_t cy, int steps)
+{
+	struct view_rect r;
+
+	if (zoom < VIEW_ONE)
+		zoom = VIEW_ONE;
+	r.width = ((uint64_t)v->src_width << 32) / zoom;
+	r.height = ((uint64_t)v->src_height << 32) / zoom;
+	/* the centre may be near an edge, clamping slides the rectangle back in */
+	r.x = (cx << 16) > r.width / 2 ? (cx << 16) - r.width / 2 : 0;
+	r.y = (cy << 16) > r.height / 2 ? (cy << 16) - r.height / 2 : 0;
+	view_crop(v, r, steps);
+}
+
+void view_pan(struct view_t *v, int32_t dx, int32_t dy, int steps)
+{
+	struct view_rect r = v->to;
+	int64_t x = (int64_t)r.x + ((int64_t)dx << 16), y = (int64_t)r.y + ((int64_t)dy << 16);
+
+	r.x = x < 0 ? 0 : x > UINT32_MAX ? UINT32_MAX : x;
+	r.y = y < 0 ? 0 : y > UINT32_MAX ? UINT32_MAX : y;
+	view_crop(v, r, steps);
+}
+
+static uint32_t view_lerp(uint32_t a, uint32_t b, int64_t e)
+{
+	return a + (((int64_t)b - a) * e >> 16);
+}
+
+int view_step(struct view_t *v)
+{
+	int64_t t, e;
+
+	if (!v->steps)
+		return 0;
+
+	v->step++;
+	if (v->step >= v->steps) {
+		v->cur = v->to;
+		v->steps = 0;
+		return 1;
+	}
+
+	/* smoothstep, 3t^2 - 2t^3: no jerk at either end of a pan */
+	t = ((int64_t)v->step << 16) / v->steps;
+	e = (3 * t * t * VIEW_ONE - 2 * t * t * t) >> 32;
+	v->cur.x = view_lerp(v->from.x, v->to.x, e);
+	v->cur.y = view_lerp(v->from.y, v->to.y, e);
+	v->cur.width = view_lerp(v->from.width, v->to.width, e);
+	v->cur.height = view_lerp(v->from.height, v->to.height, e);
+	return 1;
+}
+
+int view_animating(const struct view_t *v)
+{
+	return v->steps != 0;
+}
+
+int view_cropped(const struct view_t *v)
+{
+	return v->cur.x || v->cur.y || v->cur.width != v->src_width << 16
+		|| v->cur.height != v->src_height << 16;
+}
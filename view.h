@@ -0,0 +1,38 @@
+
+#include <stdint.h>
+
+/*
+ * The part of a stream's frame that is shown: a crop of the source in
+ * 16.16 fixed point, as the plane SRC_* properties take it. Zooming and
+ * panning only move this rectangle, the plane scales it into place, so
+ * no pixel is copied. Changes can be animated: each vblank moves the
+ * rectangle one step along an ease in/out curve towards the target.
+ */
+
+#define VIEW_ONE	(1 << 16)
+/* never crop below this many pixels a side */
+#define VIEW_MIN_SIZE	16
+
+struct view_rect {
+	uint32_t x, y, width, height;	/* 16.16 */
+};
+
+struct view_t {
+	uint32_t src_width, src_height;	/* whole frame, pixels */
+	struct view_rect cur;		/* what the plane shows */
+	struct view_rect from, to;	/* animation ends */
+	int step, steps;		/* vblanks done and total, 0 when still */
+};
+
+void view_reset(struct view_t *v, uint32_t src_width, uint32_t src_height);
+/* crop to r, kept inside the frame, over steps vblanks (0 at once) */
+void view_crop(struct view_t *v, struct view_rect r, int steps);
+/* zoom by a 16.16 factor of the whole frame, centred on a point in pixels */
+void view_zoom(struct view_t *v, uint32_t zoom, uint32_t cx, uint32_t cy, int steps);
+/* move the target by whole pixels */
+void view_pan(struct view_t *v, int32_t dx, int32_t dy, int steps);
+/* advance an animation one vblank, returns 1 if the rectangle moved */
+int view_step(struct view_t *v);
+int view_animating(const struct view_t *v);
+/* whether anything but the whole frame is shown */
+int view_cropped(const struct view_t *v);